@@ -0,0 +1,121 @@
+/**
+ * pugihtml parser - version 0.1
+ * --------------------------------------------------------
+ * Copyright (c) 2012 Adgooroo, LLC (kgantchev [AT] adgooroo [DOT] com)
+ *
+ * This library is distributed under the MIT License. See notice in license.txt
+ */
+
+// Benchmark of XPath substring search on long text nodes.
+//
+// Build with the contains_bench target (scripts/CMakeLists.txt, -DPUGIHTML_BUILD_BENCHMARKS=ON) and run:
+//
+//     contains_bench [paragraphs [words]]
+//
+// Every paragraph holds the given number of words of generated text; in the first document the text of a paragraph is one
+// text node, in the second one it is split by inline elements. Each line gives the milliseconds per operation and the result.
+
+#include "../src/pugihtml.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+using namespace pugihtml;
+
+namespace
+{
+	const char* const queries[] =
+	{
+		"count(//P[contains(., 'needlework')])",
+		"count(//P[contains(., 'e')])",
+		"count(//P[contains(., 'zzz')])",
+		"count(//P[contains(., 'consectetur adipiscing elit sed')])",
+		"count(//P[contains(., 'tempor do tempor do tempor do tempor do tempor do tempor do tempor do tempor do tempor')])",
+		"count(//P[contains(text(), 'needlework')])",
+		"count(//P[contains(., concat('needle', 'work'))])",
+		"string-length(substring-before(/HTML/BODY, 'needlework'))",
+	};
+
+	const char* const words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do", "eiusmod", "tempor"};
+
+	std::string generate(int paragraphs, int length, bool split)
+	{
+		std::string result = "<html><body>";
+		unsigned int seed = 1;
+
+		for (int i = 0; i < paragraphs; ++i)
+		{
+			result += "<p>";
+
+			for (int j = 0; j < length; ++j)
+			{
+				seed = seed * 1103515245 + 12345;
+
+				result += words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+				result += (split && j % 40 == 39) ? "<b>x</b> " : " ";
+			}
+
+			if (i % 50 == 0) result += "needlework";
+
+			result += "</p>";
+		}
+
+		result += "</body></html>";
+
+		return result;
+	}
+
+	void run(const html_document& doc, const char* text)
+	{
+		xpath_query query(text);
+
+		int iterations = 0;
+		double result = 0;
+
+		clock_t start = clock();
+
+		// repeat for about half a second
+		do
+		{
+			result = query.evaluate_number(doc);
+			++iterations;
+		}
+		while (clock() - start < CLOCKS_PER_SEC / 2);
+
+		printf("%-64s %10.3f ms (%.0f)\n", text, 1000.0 * static_cast<double>(clock() - start) / CLOCKS_PER_SEC / iterations, result);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int paragraphs = argc > 1 ? atoi(argv[1]) : 400;
+	int length = argc > 2 ? atoi(argv[2]) : 300;
+
+	if (paragraphs <= 0 || length <= 0)
+	{
+		fprintf(stderr, "usage: %s [paragraphs [words]]\n", argv[0]);
+		return 2;
+	}
+
+	for (int split = 0; split < 2; ++split)
+	{
+		std::string text = generate(paragraphs, length, split != 0);
+
+		html_document doc;
+
+		if (!doc.load(text.c_str()))
+		{
+			fprintf(stderr, "failed to load the generated document\n");
+			return 1;
+		}
+
+		printf("%d paragraphs of %d words, %s:\n", paragraphs, length, split ? "split by inline elements" : "one text node each");
+
+		for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); ++i) run(doc, queries[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * pugihtml parser - version 0.1
+ * --------------------------------------------------------
+ * Copyright (c) 2012 Adgooroo, LLC (kgantchev [AT] adgooroo [DOT] com)
+ *
+ * This library is distributed under the MIT License. See notice in license.txt
+ */
+
+// Benchmark of css_selector against the equivalent XPath queries.
+//
+// Build with the css_selector_bench target (scripts/CMakeLists.txt, -DPUGIHTML_BUILD_BENCHMARKS=ON) and run:
+//
+//     css_selector_bench [rows [iterations]]
+//
+// The document is a table of generated rows; every selector is run on it with and without the document index.
+// Each line gives the milliseconds per operation and the number of selected nodes, which has to be the same for both.
+
+#include "../src/pugihtml.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+using namespace pugihtml;
+
+namespace
+{
+	struct benchmark_case
+	{
+		const char* css;
+		const char* xpath;
+	};
+
+	const benchmark_case cases[] =
+	{
+		{"td.price", "//TD[contains(concat(' ', normalize-space(@CLASS), ' '), ' price ')]"},
+		{"div.row td.sale", "//DIV[contains(concat(' ', normalize-space(@CLASS), ' '), ' row ')]//TD[contains(concat(' ', normalize-space(@CLASS), ' '), ' sale ')]"},
+		{"#row500 td", "//*[@ID = 'row500']//TD"},
+		{"tr > td:nth-child(2)", "//TR/TD[2]"},
+		{"td:not(.name)", "//TD[not(contains(concat(' ', normalize-space(@CLASS), ' '), ' name '))]"},
+		{"td[data-k^='7']", "//TD[starts-with(@DATA-K, '7')]"},
+		{"td.name + td", "//TD[contains(concat(' ', normalize-space(@CLASS), ' '), ' name ')]/following-sibling::*[1][self::TD]"},
+		{"tr td:last-child", "//TR//TD[not(following-sibling::*)]"},
+	};
+
+	std::string generate(int rows)
+	{
+		std::string result = "<html><body>";
+		char buffer[256];
+
+		for (int i = 0; i < rows; ++i)
+		{
+			sprintf(buffer, "<div class='row' id='row%d'><table><tr><td class='name' data-k='%d'>n</td><td class='%s'>%d</td><td>x</td></tr></table></div>",
+				i, i % 97, i % 50 == 0 ? "price sale" : "price", i);
+
+			result += buffer;
+		}
+
+		result += "</body></html>";
+
+		return result;
+	}
+
+	double milliseconds(clock_t start, int iterations)
+	{
+		return 1000.0 * static_cast<double>(clock() - start) / CLOCKS_PER_SEC / iterations;
+	}
+
+	bool run(const html_document& doc, const benchmark_case& c, int iterations)
+	{
+		css_selector selector(c.css);
+		xpath_query query(c.xpath);
+
+		size_t css_count = 0, xpath_count = 0;
+		bool css_first = false, xpath_first = false;
+
+		clock_t start = clock();
+		for (int i = 0; i < iterations; ++i) css_count = selector.select_all(doc).size();
+		double css_all = milliseconds(start, iterations);
+
+		start = clock();
+		for (int i = 0; i < iterations; ++i) xpath_count = query.evaluate_node_set(doc).size();
+		double xpath_all = milliseconds(start, iterations);
+
+		start = clock();
+		for (int i = 0; i < iterations; ++i) css_first = selector.select_first(doc);
+		double css_one = milliseconds(start, iterations);
+
+		start = clock();
+		for (int i = 0; i < iterations; ++i) xpath_first = query.evaluate_node(doc);
+		double xpath_one = milliseconds(start, iterations);
+
+		printf("%-24s all: css %8.3f xpath %8.3f ms (%lu)   first: css %8.3f xpath %8.3f ms\n",
+			c.css, css_all, xpath_all, static_cast<unsigned long>(css_count), css_one, xpath_one);
+
+		if (css_count != xpath_count || css_first != xpath_first)
+		{
+			printf("  mismatch: xpath selected %lu nodes\n", static_cast<unsigned long>(xpath_count));
+			return false;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int rows = argc > 1 ? atoi(argv[1]) : 20000;
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+	if (rows <= 0 || iterations <= 0)
+	{
+		fprintf(stderr, "usage: %s [rows [iterations]]\n", argv[0]);
+		return 2;
+	}
+
+	std::string text = generate(rows);
+
+	html_document doc;
+
+	if (!doc.load(text.c_str()))
+	{
+		fprintf(stderr, "failed to load the generated document\n");
+		return 1;
+	}
+
+	printf("%d rows, %d iterations\n", rows, iterations);
+
+	bool ok = true;
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) ok &= run(doc, cases[i], iterations);
+
+	doc.index_attribute(PUGIHTML_TEXT("ID"));
+	doc.build_index();
+
+	printf("with document index:\n");
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) ok &= run(doc, cases[i], iterations);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+/**
+ * pugihtml parser - version 0.1
+ * --------------------------------------------------------
+ * Copyright (c) 2012 Adgooroo, LLC (kgantchev [AT] adgooroo [DOT] com)
+ *
+ * This library is distributed under the MIT License. See notice in license.txt
+ */
+
+// Benchmark of XPath predicate and scalar query evaluation.
+//
+// The same driver is built twice (scripts/CMakeLists.txt, -DPUGIHTML_BUILD_BENCHMARKS=ON): xpath_bytecode_bench uses the
+// bytecode compiler, xpath_interpreter_bench is linked with a library built with PUGIHTML_NO_XPATH_BYTECODE and only
+// uses the tree interpreter. Run both with the same arguments and compare the timings:
+//
+//     xpath_bytecode_bench [elements [iterations]]
+//     xpath_interpreter_bench [elements [iterations]]
+//
+// Each line gives the milliseconds per operation and the result, which has to be the same for both builds.
+
+#include "../src/pugihtml.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+
+using namespace pugihtml;
+
+namespace
+{
+	// node set queries, evaluated from the document
+	const char* const node_set_queries[] =
+	{
+		"//DIV[@N > 100 and @N < 200]",
+		"//DIV[@N mod 7 = 3]",
+		"//SPAN[@CLASS = 'c3' or @CLASS = 'c5']",
+		"//A[starts-with(@HREF, '/p/1')]",
+		"//DIV[contains(@CLASS, 'c4')]",
+		"//B[string-length(.) = 4]",
+		"//DIV[not(@CLASS = 'x') and @N * 2 > 5000]",
+		"//*[@N = 1500]",
+	};
+
+	// scalar queries, evaluated once for every DIV element
+	const char* const scalar_queries[] =
+	{
+		"@N * 2 + 1 > 10 and @CLASS != ''",
+		"string-length(@ID) + @N",
+		"concat(@ID, '/', @N)",
+	};
+
+	std::string generate(int elements)
+	{
+		std::string result = "<html><body>";
+		char buffer[256];
+
+		for (int i = 0; i < elements; ++i)
+		{
+			sprintf(buffer, "<div id='d%d' n='%d' class='item c%d'><p><b>t%d</b><span class='c%d'>s</span><a href='/p/%d'>l</a></p></div>",
+				i, i, i % 7, i, i % 7, i);
+
+			result += buffer;
+		}
+
+		result += "</body></html>";
+
+		return result;
+	}
+
+	double milliseconds(clock_t start, int iterations)
+	{
+		return 1000.0 * static_cast<double>(clock() - start) / CLOCKS_PER_SEC / iterations;
+	}
+
+	void run_node_set(const html_document& doc, const char* text, int iterations)
+	{
+		xpath_query query(text);
+
+		size_t count = 0;
+
+		clock_t start = clock();
+		for (int i = 0; i < iterations; ++i) count = query.evaluate_node_set(doc).size();
+
+		printf("%-48s %8.3f ms (%lu)\n", text, milliseconds(start, iterations), static_cast<unsigned long>(count));
+	}
+
+	void run_scalar(const xpath_node_set& context, const char* text, int iterations)
+	{
+		xpath_query query(text);
+
+		// the sum of numbers or string lengths over the context nodes identifies the result
+		double sum = 0;
+
+		clock_t start = clock();
+
+		for (int i = 0; i < iterations; ++i)
+		{
+			sum = 0;
+
+			for (size_t j = 0; j < context.size(); ++j)
+			{
+				switch (query.return_type())
+				{
+				case xpath_type_boolean:
+					sum += query.evaluate_boolean(context[j]);
+					break;
+
+				case xpath_type_number:
+					sum += query.evaluate_number(context[j]);
+					break;
+
+				default:
+					sum += static_cast<double>(query.evaluate_string(0, 0, context[j]));
+				}
+			}
+		}
+
+		printf("%-48s %8.3f ms (%.0f)\n", text, milliseconds(start, iterations), sum);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int elements = argc > 1 ? atoi(argv[1]) : 3000;
+	int iterations = argc > 2 ? atoi(argv[2]) : 100;
+
+	if (elements <= 0 || iterations <= 0)
+	{
+		fprintf(stderr, "usage: %s [elements [iterations]]\n", argv[0]);
+		return 2;
+	}
+
+	std::string text = generate(elements);
+
+	html_document doc;
+
+	if (!doc.load(text.c_str()))
+	{
+		fprintf(stderr, "failed to load the generated document\n");
+		return 1;
+	}
+
+#ifdef PUGIHTML_NO_XPATH_BYTECODE
+	printf("tree interpreter, %d elements, %d iterations\n", elements, iterations);
+#else
+	printf("bytecode, %d elements, %d iterations\n", elements, iterations);
+#endif
+
+	for (size_t i = 0; i < sizeof(node_set_queries) / sizeof(node_set_queries[0]); ++i) run_node_set(doc, node_set_queries[i], iterations);
+
+	xpath_node_set divs = doc.select_nodes(PUGIHTML_TEXT("//DIV"));
+
+	printf("scalar queries on %lu DIV elements:\n", static_cast<unsigned long>(divs.size()));
+
+	for (size_t i = 0; i < sizeof(scalar_queries) / sizeof(scalar_queries[0]); ++i) run_scalar(divs, scalar_queries[i], iterations / 10 + 1);
+
+	return 0;
+}
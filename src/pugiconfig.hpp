@@ -19,6 +19,12 @@
 // Uncomment this to disable XPath
 // #define PUGIHTML_NO_XPATH
 
+// Uncomment this to evaluate XPath expressions with the tree interpreter only (by default predicates and scalar queries are compiled to bytecode)
+// #define PUGIHTML_NO_XPATH_BYTECODE
+
+// Uncomment this to let xpath_query::evaluate_node_set_parallel use several threads (requires pthreads or Windows threads)
+// #define PUGIHTML_XPATH_THREADS
+
 // Uncomment this to disable STL
 // Note: you can't use XPath with PUGIHTML_NO_STL
 // #define PUGIHTML_NO_STL
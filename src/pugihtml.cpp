@@ -32,6 +32,20 @@
 #   include <algorithm>
 #endif
 
+// Threads are only used for XPath evaluation
+#if defined(PUGIHTML_NO_XPATH) && defined(PUGIHTML_XPATH_THREADS)
+#	undef PUGIHTML_XPATH_THREADS
+#endif
+
+#ifdef PUGIHTML_XPATH_THREADS
+#	ifdef _WIN32
+#		include <windows.h>
+#		include <process.h>
+#	else
+#		include <pthread.h>
+#	endif
+#endif
+
 // For placement new
 #include <new>
 
@@ -69,6 +83,7 @@ typedef size_t uintptr_t;
 typedef unsigned __int8 uint8_t;
 typedef unsigned __int16 uint16_t;
 typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
 typedef __int32 int32_t;
 #endif
 
@@ -139,15 +154,6 @@ namespace
 #else
 #define find_first_of std::find_first_of
 #endif
-	
-#ifdef PUGIHTML_WCHAR_MODE
-	// Convert string to wide string, assuming all symbols are ASCII
-	void widen_ascii(wchar_t* dest, const char* source)
-	{
-		for (const char* i = source; *i; ++i) *dest++ = *i;
-		*dest = 0;
-	}
-#endif
 }
 
 #if !defined(PUGIHTML_NO_STL) || !defined(PUGIHTML_NO_XPATH)
@@ -202,7 +208,7 @@ namespace pugihtml
 	{
 		/// Default ctor
 		/// \param type - node type
-		html_node_struct(html_memory_page* page, html_node_type type): header(reinterpret_cast<uintptr_t>(page) | (type - 1)), parent(0), name(0), value(0), first_child(0), prev_sibling_c(0), next_sibling(0), first_attribute(0)
+		html_node_struct(html_memory_page* page, html_node_type type): header(reinterpret_cast<uintptr_t>(page) | (type - 1)), parent(0), name(0), value(0), first_child(0), prev_sibling_c(0), next_sibling(0), first_attribute(0), pre(0), post(0)
 		{
 		}
 
@@ -219,20 +225,187 @@ namespace pugihtml
 		html_node_struct*		next_sibling;			///< Right brother
 		
 		html_attribute_struct*	first_attribute;		///< First attribute
+
+		unsigned int			pre;					///< Pre-order number (valid if document order is current)
+		unsigned int			post;					///< Post-order number (valid if document order is current)
+	};
+
+	/// Parser callbacks for nodes added to the tree (see html_document::load_buffer_stream).
+	struct html_parse_listener
+	{
+		virtual ~html_parse_listener() {}
+
+		/// Called when the start tag of the element is parsed
+		virtual void open(html_node_struct* node) = 0;
+
+		/// Called when the node is closed; returns true if the node should be removed from the tree
+		virtual bool close(html_node_struct* node) = 0;
 	};
 }
 
 namespace
 {
+	struct html_attribute_index;
+	struct html_text_index;
+
+#ifdef PUGIHTML_XPATH_THREADS
+	// Every order_checkpoint_step-th node in pre-order, so that a thread can start in the middle of a subtree
+	struct html_order_checkpoints
+	{
+		size_t count;				// 0 if the nodes could not be recorded
+		size_t capacity;
+		html_node_struct* nodes[1];
+	};
+#endif
+
 	struct html_document_struct: public html_node_struct, public html_allocator
 	{
-		html_document_struct(html_memory_page* page): html_node_struct(page, node_document), html_allocator(page), buffer(0)
+		html_document_struct(html_memory_page* page): html_node_struct(page, node_document), html_allocator(page), buffer(0), version(0), order_version(0), index(0), text_index(0), names(0)
 		{
+		#ifdef PUGIHTML_XPATH_THREADS
+			order_checkpoints = 0;
+		#endif
 		}
 
 		const char_t* buffer;
+
+		// Modification counter; lazily maintained data is rebuilt when it does not match
+		size_t version;
+
+		// Version at which node pre/post numbers were assigned
+		size_t order_version;
+
+		// Attribute index (see html_document::build_index)
+		html_attribute_index* index;
+
+		// Full-text index (see html_document::build_text_index)
+		html_text_index* text_index;
+
+		// Case of element and attribute names: parse_names_lower, parse_names_preserve or 0 for upper case
+		unsigned int names;
+
+	#ifdef PUGIHTML_XPATH_THREADS
+		// Nodes recorded with the pre/post numbers to split subtrees between threads (see order_document)
+		html_order_checkpoints* order_checkpoints;
+	#endif
 	};
 
+	static inline html_document_struct& get_document(uintptr_t header)
+	{
+		html_allocator* alloc = reinterpret_cast<html_memory_page*>(header & html_memory_page_pointer_mask)->allocator;
+		assert(alloc);
+
+		return *static_cast<html_document_struct*>(alloc);
+	}
+
+	// Notify the document that the tree was modified
+	static inline void touch_document(uintptr_t header)
+	{
+		++get_document(header).version;
+	}
+
+#ifdef PUGIHTML_XPATH_THREADS
+	const unsigned int order_checkpoint_step = 256;
+
+	static bool order_checkpoint(html_document_struct& doc, html_node_struct* node)
+	{
+		html_order_checkpoints* checkpoints = doc.order_checkpoints;
+
+		if (!checkpoints || checkpoints->count == checkpoints->capacity)
+		{
+			size_t capacity = checkpoints ? checkpoints->capacity * 2 : 64;
+
+			html_order_checkpoints* result = static_cast<html_order_checkpoints*>(global_allocate(sizeof(html_order_checkpoints) + (capacity - 1) * sizeof(html_node_struct*)));
+			if (!result) return false;
+
+			result->count = checkpoints ? checkpoints->count : 0;
+			result->capacity = capacity;
+
+			if (checkpoints)
+			{
+				memcpy(result->nodes, checkpoints->nodes, checkpoints->count * sizeof(html_node_struct*));
+				global_deallocate(checkpoints);
+			}
+
+			doc.order_checkpoints = checkpoints = result;
+		}
+
+		checkpoints->nodes[checkpoints->count++] = node;
+
+		return true;
+	}
+#endif
+
+	// Assign pre-order and post-order numbers to all document nodes
+	static void order_document(html_document_struct& doc)
+	{
+		unsigned int pre = 0, post = 0;
+
+		html_node_struct* cur = &doc;
+
+	#ifdef PUGIHTML_XPATH_THREADS
+		bool checkpoints = true;
+		if (doc.order_checkpoints) doc.order_checkpoints->count = 0;
+	#endif
+
+		for (;;)
+		{
+		#ifdef PUGIHTML_XPATH_THREADS
+			if (pre % order_checkpoint_step == 0 && checkpoints && !order_checkpoint(doc, cur))
+			{
+				checkpoints = false;
+				if (doc.order_checkpoints) doc.order_checkpoints->count = 0;
+			}
+		#endif
+
+			cur->pre = pre++;
+
+			if (cur->first_child)
+			{
+				cur = cur->first_child;
+				continue;
+			}
+
+			// leave the node and all ancestors that have no more children to visit
+			for (;;)
+			{
+				cur->post = post++;
+
+				if (cur == &doc)
+				{
+					doc.order_version = doc.version;
+					return;
+				}
+
+				if (cur->next_sibling)
+				{
+					cur = cur->next_sibling;
+					break;
+				}
+
+				cur = cur->parent;
+			}
+		}
+	}
+
+	// Renumber the document of the node if it was modified since the last numbering
+	static inline void update_document_order(const html_node_struct* node)
+	{
+		if (!node) return;
+
+		html_document_struct& doc = get_document(node->header);
+
+		if (doc.order_version != doc.version) order_document(doc);
+	}
+
+	// Check if pre/post numbers can be used to compare the nodes
+	static inline bool document_order_current(const html_node_struct* lhs, const html_node_struct* rhs)
+	{
+		const html_document_struct& doc = get_document(lhs->header);
+
+		return &doc == &get_document(rhs->header) && doc.order_version == doc.version;
+	}
+
 	static inline html_allocator& get_allocator(const html_node_struct* node)
 	{
 		assert(node);
@@ -1140,6 +1313,8 @@ namespace
 
 	bool strcpy_insitu(char_t*& dest, uintptr_t& header, uintptr_t header_mask, const char_t* source)
 	{
+		touch_document(header);
+
 		size_t source_length = strlength(source);
 
 		if (source_length == 0)
@@ -1654,26 +1829,60 @@ namespace
 
 		return result;
 	}
+
+	// Convert element or attribute name to the case selected by the parse options
+	inline void fold_name(char_t* name, unsigned int optmsk)
+	{
+		if (optmsk & parse_names_preserve) return;
+
+		if (optmsk & parse_names_lower) to_lower(name);
+		else to_upper(name);
+	}
     
 	struct html_parser
 	{
 		html_allocator alloc;
 		char_t* error_offset;
 		jmp_buf error_handler;
+		html_parse_listener* listener;
 		
 		// Parser utilities.
 		#define SKIPWS()			{ while (IS_CHARTYPE(*s, ct_space)) ++s; }
 		#define OPTSET(OPT)			( optmsk & OPT )
 		#define PUSHNODE(TYPE)		{ cursor = append_node(cursor, alloc, TYPE); if (!cursor) THROW_ERROR(status_out_of_memory, s); }
-		#define POPNODE()			{ cursor = cursor->parent; }
+		#define POPNODE()			{ cursor = listener ? pop_node(cursor) : cursor->parent; }
+		#define OPENNODE()			{ if (listener) listener->open(cursor); }
 		#define SCANFOR(X)			{ while (*s != 0 && !(X)) ++s; }
 		#define SCANWHILE(X)		{ while ((X)) ++s; }
 		#define ENDSEG()			{ ch = *s; *s = 0; ++s; }
 		#define THROW_ERROR(err, m)	error_offset = m, longjmp(error_handler, err)
 		#define CHECK_ERROR(err, m)	{ if (*s == 0) THROW_ERROR(err, m); }
 		
-		html_parser(const html_allocator& alloc): alloc(alloc), error_offset(0)
+		html_parser(const html_allocator& alloc, html_parse_listener* listener): alloc(alloc), error_offset(0), listener(listener)
+		{
+		}
+
+		// Close the node and remove it from the tree if the listener does not need it anymore; returns the parent
+		html_node_struct* pop_node(html_node_struct* node)
 		{
+			html_node_struct* parent = node->parent;
+
+			if (listener->close(node))
+			{
+				// the node is the last child of its parent
+				html_node_struct* first = parent->first_child;
+
+				if (first == node) parent->first_child = 0;
+				else
+				{
+					node->prev_sibling_c->next_sibling = 0;
+					first->prev_sibling_c = node->prev_sibling_c;
+				}
+
+				destroy_node(node, alloc);
+			}
+
+			return parent;
 		}
 
 		// DOCTYPE consists of nested sections of the following possible types:
@@ -2048,12 +2257,13 @@ namespace
                         // Save char in 'ch', terminate & step over.
                         ENDSEG();
 
-                        // Capitalize the tag name
-                        to_upper(cursor->name);
+                        // Convert the tag name to the case of the document
+                        fold_name(cursor->name, optmsk);
 
 						if (ch == '>')
 						{
 							// end of tag
+							OPENNODE();
 						}
 						else if (IS_CHARTYPE(ch, ct_space))
 						{
@@ -2074,8 +2284,8 @@ namespace
 
 									ENDSEG(); // Save char in 'ch', terminate & step over.
                                     
-                                    // Capitalize the attribute name
-                                    to_upper(a->name);
+                                    // Convert the attribute name to the case of the document
+                                    fold_name(a->name, optmsk);
                                     
                                     //$ redundant, left for performance
 									CHECK_ERROR(status_bad_attribute, s); 
@@ -2133,6 +2343,8 @@ namespace
 									
 									if (*s == '>')
 									{
+										OPENNODE();
+
 										if(cursor->parent)
                                         {
 						                    POPNODE(); // Pop.
@@ -2148,6 +2360,8 @@ namespace
 									}
 									else if (*s == 0 && endch == '>')
 									{
+										OPENNODE();
+
 										if(cursor->parent)
                                         {
 						                    POPNODE(); // Pop.
@@ -2166,10 +2380,12 @@ namespace
 								{
 									++s;
 
+									OPENNODE();
 									break;
 								}
 								else if (*s == 0 && endch == '>')
 								{
+									OPENNODE();
 									break;
 								}
 								else THROW_ERROR(status_bad_start_element, s);
@@ -2181,6 +2397,8 @@ namespace
 						{
 							if (!ENDSWITH(*s, '>')) THROW_ERROR(status_bad_start_element, s);
 
+							OPENNODE();
+
                             if(cursor->parent)
                             {
 							    POPNODE(); // Pop.
@@ -2200,6 +2418,8 @@ namespace
 							--s;
 							
 							if (endch != '>') THROW_ERROR(status_bad_start_element, s);
+
+							OPENNODE();
 						}
 						else THROW_ERROR(status_bad_start_element, s);
 					}
@@ -2220,10 +2440,16 @@ namespace
                             // Read the name while the character is a symbol
 						    while (IS_CHARTYPE(*s, ct_symbol))
 						    {
-                                // Check if we're closing the correct tag name:
-                                // if the cursor tag does not match the current
-                                // closing tag then throw an exception.
-							    if (*s++ != *name++)
+                                // Check if we're closing the correct tag name
+                                // (names match regardless of case): if the
+                                // cursor tag does not match the current closing
+                                // tag then throw an exception.
+                                char_t closing = *s++, opening = *name++;
+
+                                TOUPPER(closing);
+                                TOUPPER(opening);
+
+							    if (closing != opening)
                                 {
                                     // TODO POPNODE or ignore exception
                                     //THROW_ERROR(status_end_element_mismatch, s);
@@ -2350,6 +2576,12 @@ namespace
 				}
 			}
 
+			// Close the nodes that are still open so that the listener sees all end tags
+			if (listener)
+			{
+				while (cursor != htmldoc) POPNODE();
+			}
+
 			// Check that last tag is closed
 			if (cursor != htmldoc)
             {
@@ -2359,18 +2591,24 @@ namespace
             }
 		}
 
-		static html_parse_result parse(char_t* buffer, size_t length, html_node_struct* root, unsigned int optmsk)
+		static html_parse_result parse(char_t* buffer, size_t length, html_node_struct* root, unsigned int optmsk, html_parse_listener* listener = 0)
 		{
 			html_document_struct* htmldoc = static_cast<html_document_struct*>(root);
 
 			// store buffer for offset_debug
 			htmldoc->buffer = buffer;
 
+			// queries and lookups of the class attribute depend on the case of names
+			htmldoc->names = optmsk & (parse_names_lower | parse_names_preserve);
+
 			// early-out for empty documents
 			if (length == 0) return make_parse_result(status_ok);
 
+			// node numbers are not assigned until the document is parsed
+			if (listener) touch_document(htmldoc->header);
+
 			// create parser on stack
-			html_parser parser(*htmldoc);
+			html_parser parser(*htmldoc, listener);
 
 			// save last character and make buffer zero-terminated (speeds up parsing)
 			char_t endch = buffer[length - 1];
@@ -3176,6154 +3414,15512 @@ namespace
 #endif
 }
 
-namespace pugihtml
+// Document attribute index
+namespace
 {
-	html_writer_file::html_writer_file(void* file): file(file)
+	// Index key: whitespace-separated token of a CLASS attribute or a complete value of a declared attribute
+	struct html_index_entry
 	{
-	}
+		unsigned int hash;
+		size_t attribute;			// 0 for class tokens, declared attribute number + 1 otherwise
 
-	void html_writer_file::write(const void* data, size_t size)
-	{
-		fwrite(data, size, 1, static_cast<FILE*>(file));
-	}
+		const char_t* key;			// points into attribute value
+		size_t length;
 
-#ifndef PUGIHTML_NO_STL
-	html_writer_stream::html_writer_stream(std::basic_ostream<char, std::char_traits<char> >& stream): narrow_stream(&stream), wide_stream(0)
-	{
-	}
+		size_t offset;				// first element in html_attribute_index::postings
+		size_t count;				// element count
 
-	html_writer_stream::html_writer_stream(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream): narrow_stream(0), wide_stream(&stream)
-	{
-	}
+		html_node_struct* last;		// last element added, used to skip duplicate tokens
+	};
 
-	void html_writer_stream::write(const void* data, size_t size)
+	struct html_attribute_index
 	{
-		if (narrow_stream)
-		{
-			assert(!wide_stream);
-			narrow_stream->write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
-		}
-		else
-		{
-			assert(wide_stream);
-			assert(size % sizeof(wchar_t) == 0);
+		size_t version;				// document version the index was built for
 
-			wide_stream->write(reinterpret_cast<const wchar_t*>(data), static_cast<std::streamsize>(size / sizeof(wchar_t)));
-		}
-	}
-#endif
+		char_t** names;				// declared attribute names
+		size_t name_count;
+		size_t name_capacity;
 
-	html_tree_walker::html_tree_walker(): _depth(0)
-	{
-	}
-	
-	html_tree_walker::~html_tree_walker()
-	{
-	}
+		html_index_entry* entries;
+		size_t entry_count;
+		size_t entry_capacity;
 
-	int html_tree_walker::depth() const
-	{
-		return _depth;
-	}
+		size_t* slots;				// open addressing hash table, entry number + 1
+		size_t slot_count;
 
-	bool html_tree_walker::begin(html_node&)
-	{
-		return true;
-	}
+		html_node_struct** postings; // elements in document order for each entry
 
-	bool html_tree_walker::end(html_node&)
-	{
-		return true;
-	}
+		const char_t* class_name;	// class attribute name of the document the index was built for
+		bool class_nocase;			// class attribute name is compared ignoring case (see document_class_nocase)
+	};
 
-	html_attribute::html_attribute(): _attr(0)
+	// The class attribute name as produced by the parser with default options, and with parse_names_lower or parse_names_preserve
+	static const char_t index_class_name[] = {'C', 'L', 'A', 'S', 'S', 0};
+	static const char_t index_class_name_lower[] = {'c', 'l', 'a', 's', 's', 0};
+
+	inline const char_t* document_class_name(const html_document_struct& doc)
 	{
+		return doc.names ? index_class_name_lower : index_class_name;
 	}
 
-	html_attribute::html_attribute(html_attribute_struct* attr): _attr(attr)
+	// parse_names_preserve keeps attribute names as written, so the class attribute can be spelled in any case
+	inline bool document_class_nocase(const html_document_struct& doc)
 	{
+		return (doc.names & parse_names_preserve) != 0;
 	}
 
-	html_attribute::operator html_attribute::unspecified_bool_type() const
+	// Check if the attribute name is the class attribute name; class_name is in the case produced by the parser
+	inline bool is_class_name(const char_t* name, const char_t* class_name, bool nocase)
 	{
-      	return _attr ? &html_attribute::_attr : 0;
-   	}
+		if (!nocase) return strequal(name, class_name);
 
-   	bool html_attribute::operator!() const
-   	{
-   		return !_attr;
-   	}
+		for (; *class_name; ++name, ++class_name)
+		{
+			char_t ch = *name;
+			TOLOWER(ch);
 
-	bool html_attribute::operator==(const html_attribute& r) const
-	{
-		return (_attr == r._attr);
-	}
-	
-	bool html_attribute::operator!=(const html_attribute& r) const
-	{
-		return (_attr != r._attr);
+			if (ch != *class_name) return false;
+		}
+
+		return *name == 0;
 	}
 
-	bool html_attribute::operator<(const html_attribute& r) const
+	inline bool index_is_current(const html_attribute_index* index, const html_document_struct& doc)
 	{
-		return (_attr < r._attr);
+		return index && index->version == doc.version;
 	}
-	
-	bool html_attribute::operator>(const html_attribute& r) const
+
+	inline unsigned int index_hash(size_t attribute, const char_t* key, size_t length)
 	{
-		return (_attr > r._attr);
-	}
+		// Jenkins one-at-a-time hash (http://en.wikipedia.org/wiki/Jenkins_hash_function#one-at-a-time)
+		unsigned int result = static_cast<unsigned int>(attribute);
+
+		for (size_t i = 0; i < length; ++i)
+		{
+			result += static_cast<unsigned int>(key[i]);
+			result += result << 10;
+			result ^= result >> 6;
+		}
 	
-	bool html_attribute::operator<=(const html_attribute& r) const
-	{
-		return (_attr <= r._attr);
-	}
+		result += result << 3;
+		result ^= result >> 11;
+		result += result << 15;
 	
-	bool html_attribute::operator>=(const html_attribute& r) const
-	{
-		return (_attr >= r._attr);
+		return result;
 	}
 
-   	html_attribute html_attribute::next_attribute() const
-   	{
-    	return _attr ? html_attribute(_attr->next_attribute) : html_attribute();
-   	}
+	html_attribute_index* index_create()
+	{
+		void* memory = global_allocate(sizeof(html_attribute_index));
+		if (!memory) return 0;
 
-    html_attribute html_attribute::previous_attribute() const
-    {
-    	return _attr && _attr->prev_attribute_c->next_attribute ? html_attribute(_attr->prev_attribute_c) : html_attribute();
-    }
+		html_attribute_index* index = static_cast<html_attribute_index*>(memory);
+		memset(index, 0, sizeof(html_attribute_index));
 
-	int html_attribute::as_int() const
-	{
-		if (!_attr || !_attr->value) return 0;
+		// never matches document version until the index is built
+		index->version = static_cast<size_t>(-1);
+		index->class_name = index_class_name;
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		return (int)wcstol(_attr->value, 0, 10);
-	#else
-		return (int)strtol(_attr->value, 0, 10);
-	#endif
+		return index;
 	}
 
-	unsigned int html_attribute::as_uint() const
+	void index_clear(html_attribute_index* index)
 	{
-		if (!_attr || !_attr->value) return 0;
+		if (index->entries) global_deallocate(index->entries);
+		if (index->slots) global_deallocate(index->slots);
+		if (index->postings) global_deallocate(index->postings);
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		return (unsigned int)wcstoul(_attr->value, 0, 10);
-	#else
-		return (unsigned int)strtoul(_attr->value, 0, 10);
-	#endif
+		index->entries = 0;
+		index->entry_count = index->entry_capacity = 0;
+		index->slots = 0;
+		index->slot_count = 0;
+		index->postings = 0;
+
+		index->version = static_cast<size_t>(-1);
 	}
 
-	double html_attribute::as_double() const
+	void index_destroy(html_attribute_index* index)
 	{
-		if (!_attr || !_attr->value) return 0;
+		index_clear(index);
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		return wcstod(_attr->value, 0);
-	#else
-		return strtod(_attr->value, 0);
-	#endif
+		for (size_t i = 0; i < index->name_count; ++i) global_deallocate(index->names[i]);
+		if (index->names) global_deallocate(index->names);
+
+		global_deallocate(index);
 	}
 
-	float html_attribute::as_float() const
+	// Get attribute number for the index or -1 if the attribute is not indexed
+	size_t index_attribute_id(const html_attribute_index* index, const char_t* name)
 	{
-		if (!_attr || !_attr->value) return 0;
+		if (is_class_name(name, index->class_name, index->class_nocase)) return 0;
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		return (float)wcstod(_attr->value, 0);
-	#else
-		return (float)strtod(_attr->value, 0);
-	#endif
+		for (size_t i = 0; i < index->name_count; ++i)
+			if (strequal(name, index->names[i])) return i + 1;
+
+		return static_cast<size_t>(-1);
 	}
 
-	bool html_attribute::as_bool() const
+	bool index_declare(html_attribute_index* index, const char_t* name)
 	{
-		if (!_attr || !_attr->value) return false;
+		if (index_attribute_id(index, name) != static_cast<size_t>(-1)) return true;
 
-		// only look at first char
-		char_t first = *_attr->value;
+		if (index->name_count == index->name_capacity)
+		{
+			size_t capacity = index->name_capacity ? index->name_capacity * 2 : 4;
 
-		// 1*, t* (true), T* (True), y* (yes), Y* (YES)
-		return (first == '1' || first == 't' || first == 'T' || first == 'y' || first == 'Y');
+			char_t** names = static_cast<char_t**>(global_allocate(capacity * sizeof(char_t*)));
+			if (!names) return false;
+
+			if (index->names)
+			{
+				memcpy(names, index->names, index->name_count * sizeof(char_t*));
+				global_deallocate(index->names);
+			}
+
+			index->names = names;
+			index->name_capacity = capacity;
+		}
+
+		size_t size = (strlength(name) + 1) * sizeof(char_t);
+
+		char_t* copy = static_cast<char_t*>(global_allocate(size));
+		if (!copy) return false;
+
+		memcpy(copy, name, size);
+		index->names[index->name_count++] = copy;
+
+		// new attribute invalidates the index contents
+		index->version = static_cast<size_t>(-1);
+
+		return true;
 	}
 
-	bool html_attribute::empty() const
+	html_index_entry* index_find(const html_attribute_index* index, size_t attribute, const char_t* key, size_t length)
 	{
-		return !_attr;
+		if (index->slot_count == 0) return 0;
+
+		unsigned int hash = index_hash(attribute, key, length);
+
+		for (size_t slot = hash & (index->slot_count - 1); index->slots[slot]; slot = (slot + 1) & (index->slot_count - 1))
+		{
+			html_index_entry* entry = index->entries + index->slots[slot] - 1;
+
+			if (entry->hash == hash && entry->attribute == attribute && entry->length == length && memcmp(entry->key, key, length * sizeof(char_t)) == 0)
+				return entry;
+		}
+
+		return 0;
 	}
 
-	const char_t* html_attribute::name() const
+	bool index_rehash(html_attribute_index* index, size_t slot_count)
 	{
-		return (_attr && _attr->name) ? _attr->name : PUGIHTML_TEXT("");
+		size_t* slots = static_cast<size_t*>(global_allocate(slot_count * sizeof(size_t)));
+		if (!slots) return false;
+
+		memset(slots, 0, slot_count * sizeof(size_t));
+
+		for (size_t i = 0; i < index->entry_count; ++i)
+		{
+			size_t slot = index->entries[i].hash & (slot_count - 1);
+
+			while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+
+			slots[slot] = i + 1;
+		}
+
+		if (index->slots) global_deallocate(index->slots);
+
+		index->slots = slots;
+		index->slot_count = slot_count;
+
+		return true;
 	}
 
-	const char_t* html_attribute::value() const
+	// First pass: register key and count the element
+	bool index_count(html_attribute_index* index, size_t attribute, const char_t* key, size_t length, html_node_struct* node)
 	{
-		return (_attr && _attr->value) ? _attr->value : PUGIHTML_TEXT("");
-	}
+		html_index_entry* entry = index_find(index, attribute, key, length);
 
-    size_t html_attribute::hash_value() const
-    {
-        return static_cast<size_t>(reinterpret_cast<uintptr_t>(_attr) / sizeof(html_attribute_struct));
-    }
+		if (!entry)
+		{
+			// keep load factor below 1/2
+			if ((index->entry_count + 1) * 2 > index->slot_count && !index_rehash(index, index->slot_count ? index->slot_count * 2 : 64))
+				return false;
 
-	html_attribute_struct* html_attribute::internal_object() const
-	{
-        return _attr;
+			if (index->entry_count == index->entry_capacity)
+			{
+				size_t capacity = index->entry_capacity ? index->entry_capacity * 2 : 32;
+
+				html_index_entry* entries = static_cast<html_index_entry*>(global_allocate(capacity * sizeof(html_index_entry)));
+				if (!entries) return false;
+
+				if (index->entries)
+				{
+					memcpy(entries, index->entries, index->entry_count * sizeof(html_index_entry));
+					global_deallocate(index->entries);
+				}
+
+				index->entries = entries;
+				index->entry_capacity = capacity;
+			}
+
+			entry = index->entries + index->entry_count++;
+
+			entry->hash = index_hash(attribute, key, length);
+			entry->attribute = attribute;
+			entry->key = key;
+			entry->length = length;
+			entry->offset = 0;
+			entry->count = 0;
+			entry->last = 0;
+
+			size_t slot = entry->hash & (index->slot_count - 1);
+
+			while (index->slots[slot]) slot = (slot + 1) & (index->slot_count - 1);
+
+			index->slots[slot] = index->entry_count;
+		}
+
+		if (entry->last != node)
+		{
+			entry->last = node;
+			entry->count++;
+		}
+
+		return true;
 	}
 
-	html_attribute& html_attribute::operator=(const char_t* rhs)
+	// Second pass: add the element to the posting list
+	void index_fill(html_attribute_index* index, size_t attribute, const char_t* key, size_t length, html_node_struct* node)
 	{
-		set_value(rhs);
-		return *this;
+		html_index_entry* entry = index_find(index, attribute, key, length);
+		assert(entry);
+
+		if (entry->last != node)
+		{
+			entry->last = node;
+			index->postings[entry->offset + entry->count++] = node;
+		}
 	}
-	
-	html_attribute& html_attribute::operator=(int rhs)
+
+	template <typename F> bool index_element(html_attribute_index* index, html_node_struct* node, const F& process)
 	{
-		set_value(rhs);
-		return *this;
+		for (html_attribute_struct* a = node->first_attribute; a; a = a->next_attribute)
+		{
+			if (!a->name || !a->value) continue;
+
+			size_t attribute = index_attribute_id(index, a->name);
+
+			if (attribute == 0)
+			{
+				for (const char_t* s = a->value; *s; )
+				{
+					while (IS_CHARTYPE(*s, ct_space)) ++s;
+
+					const char_t* token = s;
+
+					while (*s && !IS_CHARTYPE(*s, ct_space)) ++s;
+
+					if (s != token && !process(index, 0, token, static_cast<size_t>(s - token), node)) return false;
+				}
+			}
+			else if (attribute != static_cast<size_t>(-1))
+			{
+				if (!process(index, attribute, a->value, strlength(a->value), node)) return false;
+			}
+		}
+
+		return true;
 	}
 
-	html_attribute& html_attribute::operator=(unsigned int rhs)
+	struct index_count_op
 	{
-		set_value(rhs);
-		return *this;
-	}
+		bool operator()(html_attribute_index* index, size_t attribute, const char_t* key, size_t length, html_node_struct* node) const
+		{
+			return index_count(index, attribute, key, length, node);
+		}
+	};
 
-	html_attribute& html_attribute::operator=(double rhs)
+	struct index_fill_op
 	{
-		set_value(rhs);
-		return *this;
-	}
-	
-	html_attribute& html_attribute::operator=(bool rhs)
+		bool operator()(html_attribute_index* index, size_t attribute, const char_t* key, size_t length, html_node_struct* node) const
+		{
+			index_fill(index, attribute, key, length, node);
+			return true;
+		}
+	};
+
+	template <typename F> bool index_traverse(html_attribute_index* index, html_node_struct* root, const F& process)
 	{
-		set_value(rhs);
-		return *this;
+		html_node_struct* cur = root->first_child;
+
+		while (cur)
+		{
+			if (static_cast<html_node_type>((cur->header & html_memory_page_type_mask) + 1) == node_element && !index_element(index, cur, process)) return false;
+
+			if (cur->first_child)
+				cur = cur->first_child;
+			else
+			{
+				while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+				cur = (cur == root) ? 0 : cur->next_sibling;
+			}
+		}
+
+		return true;
 	}
 
-	bool html_attribute::set_name(const char_t* rhs)
+	bool index_build(html_attribute_index* index, html_document_struct& doc)
 	{
-		if (!_attr) return false;
-		
-		return strcpy_insitu(_attr->name, _attr->header, html_memory_page_name_allocated_mask, rhs);
+		index_clear(index);
+
+		index->class_name = document_class_name(doc);
+		index->class_nocase = document_class_nocase(doc);
+
+		// count keys and elements
+		if (!index_traverse(index, &doc, index_count_op())) 
+		{
+			index_clear(index);
+			return false;
+		}
+
+		size_t total = 0;
+
+		for (size_t i = 0; i < index->entry_count; ++i)
+		{
+			html_index_entry& entry = index->entries[i];
+
+			entry.offset = total;
+			total += entry.count;
+
+			entry.count = 0;
+			entry.last = 0;
+		}
+
+		index->postings = static_cast<html_node_struct**>(global_allocate((total ? total : 1) * sizeof(html_node_struct*)));
+
+		if (!index->postings)
+		{
+			index_clear(index);
+			return false;
+		}
+
+		// fill posting lists in document order
+		index_traverse(index, &doc, index_fill_op());
+
+		index->version = doc.version;
+
+		return true;
 	}
-		
-	bool html_attribute::set_value(const char_t* rhs)
+
+	// Get current index for the document, building it if necessary; returns 0 on allocation failure
+	html_attribute_index* index_get(html_document_struct& doc)
 	{
-		if (!_attr) return false;
+		if (!doc.index && (doc.index = index_create()) == 0) return 0;
 
-		return strcpy_insitu(_attr->value, _attr->header, html_memory_page_value_allocated_mask, rhs);
+		if (doc.index->version != doc.version && !index_build(doc.index, doc)) return 0;
+
+		return doc.index;
 	}
+}
 
-	bool html_attribute::set_value(int rhs)
+// Full-text index
+namespace
+{
+	// Occurrence of a token in document text; a token can continue over several text nodes, as in the string value of their ancestors
+	struct html_text_span
 	{
-		char buf[128];
-		sprintf(buf, "%d", rhs);
-	
-	#ifdef PUGIHTML_WCHAR_MODE
-		char_t wbuf[128];
-		widen_ascii(wbuf, buf);
+		html_node_struct* first;	// text nodes with the first and the last character of the token
+		html_node_struct* last;
+	};
 
-		return set_value(wbuf);
-	#else
-		return set_value(buf);
-	#endif
+	inline bool operator==(const html_text_span& lhs, const html_text_span& rhs)
+	{
+		return lhs.first == rhs.first && lhs.last == rhs.last;
 	}
 
-	bool html_attribute::set_value(unsigned int rhs)
+	struct html_text_token
 	{
-		char buf[128];
-		sprintf(buf, "%u", rhs);
+		unsigned int hash;
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		char_t wbuf[128];
-		widen_ascii(wbuf, buf);
+		size_t key;					// offset of the folded token in html_text_index::chars
+		size_t length;
 
-		return set_value(wbuf);
-	#else
-		return set_value(buf);
-	#endif
-	}
+		size_t offset;				// first occurrence in html_text_index::spans
+		size_t count;				// occurrence count
 
-	bool html_attribute::set_value(double rhs)
+		html_text_span last;		// last occurrence added, used to skip repeated tokens
+	};
+
+	struct html_text_index
 	{
-		char buf[128];
-		sprintf(buf, "%g", rhs);
+		size_t version;				// document version the index was built for
 
-	#ifdef PUGIHTML_WCHAR_MODE
-		char_t wbuf[128];
-		widen_ascii(wbuf, buf);
+		html_text_token* tokens;
+		size_t token_count;
+		size_t token_capacity;
 
-		return set_value(wbuf);
-	#else
-		return set_value(buf);
-	#endif
-	}
-	
-	bool html_attribute::set_value(bool rhs)
-	{
-		return set_value(rhs ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
-	}
+		size_t* slots;				// open addressing hash table, token number + 1
+		size_t slot_count;
 
-#ifdef __BORLANDC__
-	bool operator&&(const html_attribute& lhs, bool rhs)
+		char_t* chars;				// token characters
+		size_t char_count;
+		size_t char_capacity;
+
+		html_text_span* spans;		// occurrences in document order for each token
+		size_t span_count;
+	};
+
+	// Tokens are runs of ASCII letters and digits and non-ASCII characters; ASCII letters are indexed in lower case
+	inline bool text_is_word(char_t ch)
 	{
-		return (bool)lhs && rhs;
+		unsigned int c = static_cast<unsigned int>(ch);
+
+		return c >= 128 || c - '0' < 10 || (c | ' ') - 'a' < 26;
 	}
 
-	bool operator||(const html_attribute& lhs, bool rhs)
+	inline char_t text_fold(char_t ch)
 	{
-		return (bool)lhs || rhs;
+		TOLOWER(ch);
+		return ch;
 	}
-#endif
 
-	html_node::html_node(): _root(0)
+	inline bool text_is_node(const html_node_struct* node)
 	{
+		html_node_type type = static_cast<html_node_type>((node->header & html_memory_page_type_mask) + 1);
+
+		return type == node_pcdata || type == node_cdata;
 	}
 
-	html_node::html_node(html_node_struct* p): _root(p)
+	inline bool text_index_is_current(const html_text_index* index, const html_document_struct& doc)
 	{
+		return index && index->version == doc.version;
 	}
-	
-	html_node::operator html_node::unspecified_bool_type() const
+
+	unsigned int text_hash(const char_t* key, size_t length)
 	{
-      	return _root ? &html_node::_root : 0;
-   	}
+		// Jenkins one-at-a-time hash of the folded characters, see index_hash
+		unsigned int result = 0;
 
-   	bool html_node::operator!() const
-   	{
-   		return !_root;
-   	}
+		for (size_t i = 0; i < length; ++i)
+		{
+			result += static_cast<unsigned int>(text_fold(key[i]));
+			result += result << 10;
+			result ^= result >> 6;
+		}
+	
+		result += result << 3;
+		result ^= result >> 11;
+		result += result << 15;
+	
+		return result;
+	}
 
-	html_node::iterator html_node::begin() const
+	// Check if the folded token key is equal to the text, ignoring the case of ASCII letters
+	inline bool text_key_equal(const char_t* key, const char_t* text, size_t length)
 	{
-		return iterator(_root ? _root->first_child : 0, _root);
+		for (size_t i = 0; i < length; ++i)
+			if (key[i] != text_fold(text[i])) return false;
+
+		return true;
 	}
 
-	html_node::iterator html_node::end() const
+	html_text_index* text_index_create()
 	{
-		return iterator(0, _root);
+		void* memory = global_allocate(sizeof(html_text_index));
+		if (!memory) return 0;
+
+		html_text_index* index = static_cast<html_text_index*>(memory);
+		memset(index, 0, sizeof(html_text_index));
+
+		// never matches document version until the index is built
+		index->version = static_cast<size_t>(-1);
+
+		return index;
 	}
-	
-	html_node::attribute_iterator html_node::attributes_begin() const
+
+	void text_index_clear(html_text_index* index)
 	{
-		return attribute_iterator(_root ? _root->first_attribute : 0, _root);
+		if (index->tokens) global_deallocate(index->tokens);
+		if (index->slots) global_deallocate(index->slots);
+		if (index->chars) global_deallocate(index->chars);
+		if (index->spans) global_deallocate(index->spans);
+
+		memset(index, 0, sizeof(html_text_index));
+
+		index->version = static_cast<size_t>(-1);
 	}
 
-	html_node::attribute_iterator html_node::attributes_end() const
+	void text_index_destroy(html_text_index* index)
 	{
-		return attribute_iterator(0, _root);
+		text_index_clear(index);
+
+		global_deallocate(index);
 	}
 
-	bool html_node::operator==(const html_node& r) const
+	html_text_token* text_index_find(const html_text_index* index, const char_t* key, size_t length)
 	{
-		return (_root == r._root);
+		if (index->slot_count == 0) return 0;
+
+		unsigned int hash = text_hash(key, length);
+
+		for (size_t slot = hash & (index->slot_count - 1); index->slots[slot]; slot = (slot + 1) & (index->slot_count - 1))
+		{
+			html_text_token* token = index->tokens + index->slots[slot] - 1;
+
+			if (token->hash == hash && token->length == length && text_key_equal(index->chars + token->key, key, length))
+				return token;
+		}
+
+		return 0;
 	}
 
-	bool html_node::operator!=(const html_node& r) const
+	bool text_index_rehash(html_text_index* index, size_t slot_count)
 	{
-		return (_root != r._root);
+		size_t* slots = static_cast<size_t*>(global_allocate(slot_count * sizeof(size_t)));
+		if (!slots) return false;
+
+		memset(slots, 0, slot_count * sizeof(size_t));
+
+		for (size_t i = 0; i < index->token_count; ++i)
+		{
+			size_t slot = index->tokens[i].hash & (slot_count - 1);
+
+			while (slots[slot]) slot = (slot + 1) & (slot_count - 1);
+
+			slots[slot] = i + 1;
+		}
+
+		if (index->slots) global_deallocate(index->slots);
+
+		index->slots = slots;
+		index->slot_count = slot_count;
+
+		return true;
 	}
 
-	bool html_node::operator<(const html_node& r) const
+	template <typename T> bool text_index_grow(T*& data, size_t count, size_t& capacity, size_t required, size_t initial)
 	{
-		return (_root < r._root);
-	}
-	
-	bool html_node::operator>(const html_node& r) const
-	{
-		return (_root > r._root);
+		if (required <= capacity) return true;
+
+		size_t result = capacity ? capacity : initial;
+		while (result < required) result *= 2;
+
+		T* copy = static_cast<T*>(global_allocate(result * sizeof(T)));
+		if (!copy) return false;
+
+		if (data)
+		{
+			memcpy(copy, data, count * sizeof(T));
+			global_deallocate(data);
+		}
+
+		data = copy;
+		capacity = result;
+
+		return true;
 	}
-	
-	bool html_node::operator<=(const html_node& r) const
+
+	// First pass: register the token and count the occurrence
+	bool text_index_count(html_text_index* index, const char_t* key, size_t length, const html_text_span& span)
 	{
-		return (_root <= r._root);
+		html_text_token* token = text_index_find(index, key, length);
+
+		if (!token)
+		{
+			// keep load factor below 1/2
+			if ((index->token_count + 1) * 2 > index->slot_count && !text_index_rehash(index, index->slot_count ? index->slot_count * 2 : 256))
+				return false;
+
+			if (!text_index_grow(index->tokens, index->token_count, index->token_capacity, index->token_count + 1, 64) ||
+				!text_index_grow(index->chars, index->char_count, index->char_capacity, index->char_count + length, 1024))
+				return false;
+
+			token = index->tokens + index->token_count;
+
+			token->hash = text_hash(key, length);
+			token->key = index->char_count;
+			token->length = length;
+			token->offset = 0;
+			token->count = 0;
+			token->last.first = token->last.last = 0;
+
+			// the key is already folded by the tokenizer
+			memcpy(index->chars + index->char_count, key, length * sizeof(char_t));
+			index->char_count += length;
+
+			size_t slot = token->hash & (index->slot_count - 1);
+
+			while (index->slots[slot]) slot = (slot + 1) & (index->slot_count - 1);
+
+			index->slots[slot] = ++index->token_count;
+		}
+
+		if (!(token->last == span))
+		{
+			token->last = span;
+			token->count++;
+		}
+
+		return true;
 	}
-	
-	bool html_node::operator>=(const html_node& r) const
+
+	// Second pass: add the occurrence to the posting list
+	void text_index_fill(html_text_index* index, const char_t* key, size_t length, const html_text_span& span)
 	{
-		return (_root >= r._root);
+		html_text_token* token = text_index_find(index, key, length);
+		assert(token);
+
+		if (!(token->last == span))
+		{
+			token->last = span;
+			index->spans[token->offset + token->count++] = span;
+		}
 	}
 
-	bool html_node::empty() const
+	struct text_index_count_op
 	{
-		return !_root;
-	}
-	
-	const char_t* html_node::name() const
+		bool operator()(html_text_index* index, const char_t* key, size_t length, const html_text_span& span) const
+		{
+			return text_index_count(index, key, length, span);
+		}
+	};
+
+	struct text_index_fill_op
 	{
-		return (_root && _root->name) ? _root->name : PUGIHTML_TEXT("");
-	}
+		bool operator()(html_text_index* index, const char_t* key, size_t length, const html_text_span& span) const
+		{
+			text_index_fill(index, key, length, span);
+			return true;
+		}
+	};
 
-	html_node_type html_node::type() const
+	// Split the text of the document into tokens; the text nodes are concatenated as in the string value of the document
+	template <typename F> bool text_index_traverse(html_text_index* index, html_node_struct* root, const F& process)
 	{
-		return _root ? static_cast<html_node_type>((_root->header & html_memory_page_type_mask) + 1) : node_null;
+		char_t* buffer = 0;
+		size_t size = 0;
+		size_t capacity = 0;
+
+		html_text_span span = {0, 0};
+		bool result = true;
+
+		for (html_node_struct* cur = root->first_child; cur && result; )
+		{
+			if (text_is_node(cur) && cur->value)
+			{
+				for (const char_t* s = cur->value; *s && result; ++s)
+				{
+					if (text_is_word(*s))
+					{
+						if (size == capacity && !text_index_grow(buffer, size, capacity, size + 1, 64))
+						{
+							result = false;
+							break;
+						}
+
+						if (size == 0) span.first = cur;
+						span.last = cur;
+
+						buffer[size++] = text_fold(*s);
+					}
+					else if (size)
+					{
+						result = process(index, buffer, size, span);
+						size = 0;
+					}
+				}
+			}
+
+			if (cur->first_child)
+				cur = cur->first_child;
+			else
+			{
+				while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+				cur = (cur == root) ? 0 : cur->next_sibling;
+			}
+		}
+
+		if (result && size) result = process(index, buffer, size, span);
+
+		if (buffer) global_deallocate(buffer);
+
+		return result;
 	}
-	
-	const char_t* html_node::value() const
+
+	bool text_index_build(html_text_index* index, html_document_struct& doc)
 	{
-		return (_root && _root->value) ? _root->value : PUGIHTML_TEXT("");
+		text_index_clear(index);
+
+		// postings are ordered and compared by pre-order numbers
+		if (doc.order_version != doc.version) order_document(doc);
+
+		// count tokens and occurrences
+		if (!text_index_traverse(index, &doc, text_index_count_op()))
+		{
+			text_index_clear(index);
+			return false;
+		}
+
+		size_t total = 0;
+
+		for (size_t i = 0; i < index->token_count; ++i)
+		{
+			html_text_token& token = index->tokens[i];
+
+			token.offset = total;
+			total += token.count;
+
+			token.count = 0;
+			token.last.first = token.last.last = 0;
+		}
+
+		index->spans = static_cast<html_text_span*>(global_allocate((total ? total : 1) * sizeof(html_text_span)));
+
+		if (!index->spans)
+		{
+			text_index_clear(index);
+			return false;
+		}
+
+		// fill posting lists in document order
+		if (!text_index_traverse(index, &doc, text_index_fill_op()))
+		{
+			text_index_clear(index);
+			return false;
+		}
+
+		index->span_count = total;
+		index->version = doc.version;
+
+		return true;
 	}
-	
-	html_node html_node::child(const char_t* name) const
+
+	// Get current full-text index for the document, building it if necessary; returns 0 on allocation failure
+	html_text_index* text_index_get(html_document_struct& doc)
 	{
-		if (!_root) return html_node();
+		if (!doc.text_index && (doc.text_index = text_index_create()) == 0) return 0;
 
-		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
-			if (i->name && strequal(name, i->name)) return html_node(i);
+		if (doc.text_index->version != doc.version && !text_index_build(doc.text_index, doc)) return 0;
 
-		return html_node();
+		return doc.text_index;
 	}
+}
 
-	html_attribute html_node::attribute(const char_t* name) const
+// Locale-independent number conversion
+namespace
+{
+	// Longest number in string form: sign, "0.", 323 zeros and 17 digits of the smallest denormal
+	const size_t number_chars_size = 512;
+
+	// Binary floating point number with 64-bit significand; value is f * 2^e
+	struct number_fp
 	{
-		if (!_root) return html_attribute();
+		uint64_t f;
+		int e;
+	};
 
-		for (html_attribute_struct* i = _root->first_attribute; i; i = i->next_attribute)
-			if (i->name && strequal(name, i->name))
-				return html_attribute(i);
-		
-		return html_attribute();
-	}
-	
-	html_node html_node::next_sibling(const char_t* name) const
+	struct number_cached_power
 	{
-		if (!_root) return html_node();
-		
-		for (html_node_struct* i = _root->next_sibling; i; i = i->next_sibling)
-			if (i->name && strequal(name, i->name)) return html_node(i);
+		uint32_t high;
+		uint32_t low;
+		int e;
+	};
 
-		return html_node();
-	}
+	// 10^k for k = -348, -340, ..., 340, normalized and rounded to 64 bits
+	const number_cached_power number_cached_powers[] =
+	{
+		{0xfa8fd5a0, 0x081c0288, -1220}, {0xbaaee17f, 0xa23ebf76, -1193}, {0x8b16fb20, 0x3055ac76, -1166},
+		{0xcf42894a, 0x5dce35ea, -1140}, {0x9a6bb0aa, 0x55653b2d, -1113}, {0xe61acf03, 0x3d1a45df, -1087},
+		{0xab70fe17, 0xc79ac6ca, -1060}, {0xff77b1fc, 0xbebcdc4f, -1034}, {0xbe5691ef, 0x416bd60c, -1007},
+		{0x8dd01fad, 0x907ffc3c, -980}, {0xd3515c28, 0x31559a83, -954}, {0x9d71ac8f, 0xada6c9b5, -927},
+		{0xea9c2277, 0x23ee8bcb, -901}, {0xaecc4991, 0x4078536d, -874}, {0x823c1279, 0x5db6ce57, -847},
+		{0xc2109436, 0x4dfb5637, -821}, {0x9096ea6f, 0x3848984f, -794}, {0xd77485cb, 0x25823ac7, -768},
+		{0xa086cfcd, 0x97bf97f4, -741}, {0xef340a98, 0x172aace5, -715}, {0xb23867fb, 0x2a35b28e, -688},
+		{0x84c8d4df, 0xd2c63f3b, -661}, {0xc5dd4427, 0x1ad3cdba, -635}, {0x936b9fce, 0xbb25c996, -608},
+		{0xdbac6c24, 0x7d62a584, -582}, {0xa3ab6658, 0x0d5fdaf6, -555}, {0xf3e2f893, 0xdec3f126, -529},
+		{0xb5b5ada8, 0xaaff80b8, -502}, {0x87625f05, 0x6c7c4a8b, -475}, {0xc9bcff60, 0x34c13053, -449},
+		{0x964e858c, 0x91ba2655, -422}, {0xdff97724, 0x70297ebd, -396}, {0xa6dfbd9f, 0xb8e5b88f, -369},
+		{0xf8a95fcf, 0x88747d94, -343}, {0xb9447093, 0x8fa89bcf, -316}, {0x8a08f0f8, 0xbf0f156b, -289},
+		{0xcdb02555, 0x653131b6, -263}, {0x993fe2c6, 0xd07b7fac, -236}, {0xe45c10c4, 0x2a2b3b06, -210},
+		{0xaa242499, 0x697392d3, -183}, {0xfd87b5f2, 0x8300ca0e, -157}, {0xbce50864, 0x92111aeb, -130},
+		{0x8cbccc09, 0x6f5088cc, -103}, {0xd1b71758, 0xe219652c, -77}, {0x9c400000, 0x00000000, -50},
+		{0xe8d4a510, 0x00000000, -24}, {0xad78ebc5, 0xac620000, 3}, {0x813f3978, 0xf8940984, 30},
+		{0xc097ce7b, 0xc90715b3, 56}, {0x8f7e32ce, 0x7bea5c70, 83}, {0xd5d238a4, 0xabe98068, 109},
+		{0x9f4f2726, 0x179a2245, 136}, {0xed63a231, 0xd4c4fb27, 162}, {0xb0de6538, 0x8cc8ada8, 189},
+		{0x83c7088e, 0x1aab65db, 216}, {0xc45d1df9, 0x42711d9a, 242}, {0x924d692c, 0xa61be758, 269},
+		{0xda01ee64, 0x1a708dea, 295}, {0xa26da399, 0x9aef774a, 322}, {0xf209787b, 0xb47d6b85, 348},
+		{0xb454e4a1, 0x79dd1877, 375}, {0x865b8692, 0x5b9bc5c2, 402}, {0xc83553c5, 0xc8965d3d, 428},
+		{0x952ab45c, 0xfa97a0b3, 455}, {0xde469fbd, 0x99a05fe3, 481}, {0xa59bc234, 0xdb398c25, 508},
+		{0xf6c69a72, 0xa3989f5c, 534}, {0xb7dcbf53, 0x54e9bece, 561}, {0x88fcf317, 0xf22241e2, 588},
+		{0xcc20ce9b, 0xd35c78a5, 614}, {0x98165af3, 0x7b2153df, 641}, {0xe2a0b5dc, 0x971f303a, 667},
+		{0xa8d9d153, 0x5ce3b396, 694}, {0xfb9b7cd9, 0xa4a7443c, 720}, {0xbb764c4c, 0xa7a44410, 747},
+		{0x8bab8eef, 0xb6409c1a, 774}, {0xd01fef10, 0xa657842c, 800}, {0x9b10a4e5, 0xe9913129, 827},
+		{0xe7109bfb, 0xa19c0c9d, 853}, {0xac2820d9, 0x623bf429, 880}, {0x80444b5e, 0x7aa7cf85, 907},
+		{0xbf21e440, 0x03acdd2d, 933}, {0x8e679c2f, 0x5e44ff8f, 960}, {0xd433179d, 0x9c8cb841, 986},
+		{0x9e19db92, 0xb4e31ba9, 1013}, {0xeb96bf6e, 0xbadf77d9, 1039}, {0xaf87023b, 0x9bf0ee6b, 1066},
+	};
 
-	html_node html_node::next_sibling() const
+	const uint32_t number_powers_of_ten_32[] =
 	{
-		if (!_root) return html_node();
-		
-		if (_root->next_sibling) return html_node(_root->next_sibling);
-		else return html_node();
-	}
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+	};
 
-	html_node html_node::previous_sibling(const char_t* name) const
+	// Powers of ten that are exact in double
+	const double number_powers_of_ten[] =
 	{
-		if (!_root) return html_node();
-		
-		for (html_node_struct* i = _root->prev_sibling_c; i->next_sibling; i = i->prev_sibling_c)
-			if (i->name && strequal(name, i->name)) return html_node(i);
-
-		return html_node();
-	}
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
 
-	html_node html_node::previous_sibling() const
+	uint64_t number_bits(double value)
 	{
-		if (!_root) return html_node();
-		
-		if (_root->prev_sibling_c->next_sibling) return html_node(_root->prev_sibling_c);
-		else return html_node();
+		uint64_t result;
+		memcpy(&result, &value, sizeof(result));
+
+		return result;
 	}
 
-	html_node html_node::parent() const
+	number_fp number_make(uint64_t f, int e)
 	{
-		return _root ? html_node(_root->parent) : html_node();
+		number_fp result = {f, e};
+		return result;
 	}
 
-	html_node html_node::root() const
+	// High 64 bits of the product, rounded
+	number_fp number_multiply(const number_fp& lhs, const number_fp& rhs)
 	{
-		if (!_root) return html_node();
+		const uint64_t mask = 0xffffffffu;
 
-		html_memory_page* page = reinterpret_cast<html_memory_page*>(_root->header & html_memory_page_pointer_mask);
+		uint64_t hh = (lhs.f >> 32) * (rhs.f >> 32);
+		uint64_t hl = (lhs.f >> 32) * (rhs.f & mask);
+		uint64_t lh = (lhs.f & mask) * (rhs.f >> 32);
+		uint64_t ll = (lhs.f & mask) * (rhs.f & mask);
 
-		return html_node(static_cast<html_document_struct*>(page->allocator));
+		uint64_t middle = (ll >> 32) + (hl & mask) + (lh & mask) + (static_cast<uint64_t>(1) << 31);
+
+		return number_make(hh + (hl >> 32) + (lh >> 32) + (middle >> 32), lhs.e + rhs.e + 64);
 	}
 
-	const char_t* html_node::child_value() const
+	number_fp number_normalize(number_fp value)
 	{
-		if (!_root) return PUGIHTML_TEXT("");
-		
-		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+		while (!(value.f >> 63))
 		{
-			html_node_type type = static_cast<html_node_type>((i->header & html_memory_page_type_mask) + 1);
-
-			if (i->value && (type == node_pcdata || type == node_cdata))
-				return i->value;
+			value.f <<= 1;
+			value.e--;
 		}
 
-		return PUGIHTML_TEXT("");
+		return value;
 	}
 
-	const char_t* html_node::child_value(const char_t* name) const
+	// Move the last digit towards the exact value while it stays inside the rounding interval
+	void number_round_digits(char* digits, size_t length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t distance)
 	{
-		return child(name).child_value();
+		while (rest < distance && delta - rest >= ten_kappa && (rest + ten_kappa < distance || distance - rest > rest + ten_kappa - distance))
+		{
+			digits[length - 1]--;
+			rest += ten_kappa;
+		}
 	}
 
-	html_attribute html_node::first_attribute() const
+	// Get digits that round-trip to the value (positive, finite, nonzero) with Grisu2, so that value = digits * 10^exponent; the
+	// result is the shortest one for all but a small fraction of values
+	size_t convert_number_to_digits(double value, char* digits, int* out_exponent)
 	{
-		return _root ? html_attribute(_root->first_attribute) : html_attribute();
-	}
+		const uint64_t hidden = static_cast<uint64_t>(1) << 52;
 
-	html_attribute html_node::last_attribute() const
-	{
-		return _root && _root->first_attribute ? html_attribute(_root->first_attribute->prev_attribute_c) : html_attribute();
-	}
+		uint64_t bits = number_bits(value);
+		int biased = static_cast<int>(bits >> 52) & 0x7ff;
+		uint64_t significand = bits & (hidden - 1);
 
-	html_node html_node::first_child() const
-	{
-		return _root ? html_node(_root->first_child) : html_node();
-	}
+		number_fp v = biased ? number_make(significand + hidden, biased - 1075) : number_make(significand, -1074);
 
-	html_node html_node::last_child() const
-	{
-		return _root && _root->first_child ? html_node(_root->first_child->prev_sibling_c) : html_node();
-	}
+		// boundaries of the rounding interval, with the exponent of the normalized upper one
+		number_fp plus = number_normalize(number_make((v.f << 1) + 1, v.e - 1));
+		number_fp minus = (v.f == hidden) ? number_make((v.f << 2) - 1, v.e - 2) : number_make((v.f << 1) - 1, v.e - 1);
 
-	bool html_node::set_name(const char_t* rhs)
-	{
-		switch (type())
+		minus.f <<= minus.e - plus.e;
+		minus.e = plus.e;
+
+		// cached power that brings the binary exponent of the upper boundary to [-60, -32]
+		double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+		int k = static_cast<int>(dk);
+		if (dk - k > 0.0) k++;
+
+		size_t index = static_cast<size_t>((k >> 3) + 1);
+		int exponent = 348 - static_cast<int>(index) * 8;
+
+		const number_cached_power& power = number_cached_powers[index];
+		number_fp cached = number_make((static_cast<uint64_t>(power.high) << 32) | power.low, power.e);
+
+		number_fp w = number_multiply(number_normalize(v), cached);
+		number_fp upper = number_multiply(plus, cached);
+		number_fp lower = number_multiply(minus, cached);
+
+		upper.f--;
+		lower.f++;
+
+		// generate digits of the upper boundary until the rest fits in the interval
+		number_fp one = number_make(static_cast<uint64_t>(1) << -upper.e, upper.e);
+
+		uint64_t delta = upper.f - lower.f;
+		uint64_t distance = upper.f - w.f;
+
+		uint32_t integral = static_cast<uint32_t>(upper.f >> -one.e);
+		uint64_t fractional = upper.f & (one.f - 1);
+
+		int kappa = 1;
+		while (kappa < 10 && integral >= number_powers_of_ten_32[kappa]) kappa++;
+
+		size_t length = 0;
+
+		while (kappa > 0)
 		{
-		case node_pi:
-		case node_declaration:
-		case node_element:
-			return strcpy_insitu(_root->name, _root->header, html_memory_page_name_allocated_mask, rhs);
+			uint32_t ten_kappa = number_powers_of_ten_32[kappa - 1];
+			uint32_t digit = integral / ten_kappa;
+			integral %= ten_kappa;
 
-		default:
-			return false;
+			if (digit || length) digits[length++] = static_cast<char>('0' + digit);
+
+			kappa--;
+
+			uint64_t rest = (static_cast<uint64_t>(integral) << -one.e) + fractional;
+
+			if (rest <= delta)
+			{
+				number_round_digits(digits, length, delta, rest, static_cast<uint64_t>(number_powers_of_ten_32[kappa]) << -one.e, distance);
+
+				*out_exponent = exponent + kappa;
+				return length;
+			}
 		}
-	}
-		
-	bool html_node::set_value(const char_t* rhs)
-	{
-		switch (type())
+
+		for (;;)
 		{
-		case node_pi:
-		case node_cdata:
-		case node_pcdata:
-		case node_comment:
-        case node_doctype:
-			return strcpy_insitu(_root->value, _root->header, html_memory_page_value_allocated_mask, rhs);
+			fractional *= 10;
+			delta *= 10;
 
-		default:
-			return false;
+			unsigned int digit = static_cast<unsigned int>(fractional >> -one.e);
+
+			if (digit || length) digits[length++] = static_cast<char>('0' + digit);
+
+			fractional &= one.f - 1;
+			kappa--;
+
+			if (fractional < delta)
+			{
+				// distance in units of the last digit
+				uint64_t scale = -kappa < 20 ? 1 : 0;
+				for (int i = 0; i < -kappa && scale; ++i) scale *= 10;
+
+				number_round_digits(digits, length, delta, fractional, one.f, distance * scale);
+
+				*out_exponent = exponent + kappa;
+				return length;
+			}
 		}
 	}
 
-	html_attribute html_node::append_attribute(const char_t* name)
+	char_t* write_ascii(char_t* result, const char* value)
 	{
-		if (type() != node_element && type() != node_declaration) return html_attribute();
-		
-		html_attribute a(append_attribute_ll(_root, get_allocator(_root)));
-		a.set_name(name);
-		
-		return a;
+		while (*value) *result++ = *value++;
+
+		*result = 0;
+		return result;
 	}
 
-	html_attribute html_node::prepend_attribute(const char_t* name)
+#ifndef PUGIHTML_NO_XPATH
+	// Write number without exponent using the shortest digits that round-trip, NaN and Infinity for special values; the
+	// buffer has to hold number_chars_size characters; returns the end of the output
+	char_t* convert_number_to_chars(double value, char_t* result)
 	{
-		if (type() != node_element && type() != node_declaration) return html_attribute();
-		
-		html_attribute a(allocate_attribute(get_allocator(_root)));
-		if (!a) return html_attribute();
+		uint64_t bits = number_bits(value);
+		bool negative = (bits >> 63) != 0;
 
-		a.set_name(name);
-		
-        html_attribute_struct* head = _root->first_attribute;
+		if ((static_cast<int>(bits >> 52) & 0x7ff) == 0x7ff)
+		{
+			if (bits & ((static_cast<uint64_t>(1) << 52) - 1)) return write_ascii(result, "NaN");
 
-		if (head)
-        {
-            a._attr->prev_attribute_c = head->prev_attribute_c;
-            head->prev_attribute_c = a._attr;
-        }
-        else
-            a._attr->prev_attribute_c = a._attr;
-		
-		a._attr->next_attribute = head;
-        _root->first_attribute = a._attr;
-				
-		return a;
-	}
+			return write_ascii(result, negative ? "-Infinity" : "Infinity");
+		}
 
-	html_attribute html_node::insert_attribute_before(const char_t* name, const html_attribute& attr)
-	{
-		if ((type() != node_element && type() != node_declaration) || attr.empty()) return html_attribute();
-		
-		// check that attribute belongs to *this
-		html_attribute_struct* cur = attr._attr;
+		if (!(bits << 1)) return write_ascii(result, "0");
 
-		while (cur->prev_attribute_c->next_attribute) cur = cur->prev_attribute_c;
+		char digits[32];
+		int exponent;
+		size_t length = convert_number_to_digits(negative ? -value : value, digits, &exponent);
 
-		if (cur != _root->first_attribute) return html_attribute();
+		while (length > 1 && digits[length - 1] == '0')
+		{
+			length--;
+			exponent++;
+		}
 
-		html_attribute a(allocate_attribute(get_allocator(_root)));
-		if (!a) return html_attribute();
+		// value is 0.digits * 10^point
+		int point = static_cast<int>(length) + exponent;
 
-		a.set_name(name);
+		const char* mantissa = digits;
+		const char* mantissa_end = digits + length;
 
-		if (attr._attr->prev_attribute_c->next_attribute)
-			attr._attr->prev_attribute_c->next_attribute = a._attr;
-		else
-			_root->first_attribute = a._attr;
-		
-		a._attr->prev_attribute_c = attr._attr->prev_attribute_c;
-		a._attr->next_attribute = attr._attr;
-		attr._attr->prev_attribute_c = a._attr;
-				
-		return a;
-	}
+		char_t* s = result;
 
-	html_attribute html_node::insert_attribute_after(const char_t* name, const html_attribute& attr)
-	{
-		if ((type() != node_element && type() != node_declaration) || attr.empty()) return html_attribute();
-		
-		// check that attribute belongs to *this
-		html_attribute_struct* cur = attr._attr;
+		if (negative) *s++ = '-';
 
-		while (cur->prev_attribute_c->next_attribute) cur = cur->prev_attribute_c;
+		// integer part
+		if (point <= 0)
+		{
+			*s++ = '0';
+		}
+		else
+		{
+			for (; point > 0; --point) *s++ = mantissa < mantissa_end ? *mantissa++ : '0';
+		}
 
-		if (cur != _root->first_attribute) return html_attribute();
+		// fractional part
+		if (mantissa < mantissa_end)
+		{
+			*s++ = '.';
 
-		html_attribute a(allocate_attribute(get_allocator(_root)));
-		if (!a) return html_attribute();
+			for (; point < 0; ++point) *s++ = '0';
 
-		a.set_name(name);
+			while (mantissa < mantissa_end) *s++ = *mantissa++;
+		}
 
-		if (attr._attr->next_attribute)
-			attr._attr->next_attribute->prev_attribute_c = a._attr;
-		else
-			_root->first_attribute->prev_attribute_c = a._attr;
-		
-		a._attr->next_attribute = attr._attr->next_attribute;
-		a._attr->prev_attribute_c = attr._attr;
-		attr._attr->next_attribute = a._attr;
+		assert(s < result + number_chars_size);
+		*s = 0;
 
-		return a;
+		return s;
 	}
+#endif
 
-	html_attribute html_node::append_copy(const html_attribute& proto)
+	// Longest number in exponent form: sign, 17 digits, point and a three-digit exponent
+	const size_t number_exponent_chars_size = 32;
+
+	// Write number like printf %g with enough precision for the shortest digits that round-trip (at least 6), so the output switches to
+	// exponent form for large and small magnitudes; keeps the sign of negative zero and writes inf and nan for special values
+	char_t* convert_number_to_chars_exponent(double value, char_t* result)
 	{
-		if (!proto) return html_attribute();
+		uint64_t bits = number_bits(value);
+		bool negative = (bits >> 63) != 0;
 
-		html_attribute result = append_attribute(proto.name());
-		result.set_value(proto.value());
+		if ((static_cast<int>(bits >> 52) & 0x7ff) == 0x7ff)
+		{
+			if (bits & ((static_cast<uint64_t>(1) << 52) - 1)) return write_ascii(result, "nan");
 
-		return result;
-	}
+			return write_ascii(result, negative ? "-inf" : "inf");
+		}
 
-	html_attribute html_node::prepend_copy(const html_attribute& proto)
-	{
-		if (!proto) return html_attribute();
+		if (!(bits << 1)) return write_ascii(result, negative ? "-0" : "0");
 
-		html_attribute result = prepend_attribute(proto.name());
-		result.set_value(proto.value());
+		char digits[32];
+		int exponent;
+		size_t length = convert_number_to_digits(negative ? -value : value, digits, &exponent);
 
-		return result;
-	}
+		while (length > 1 && digits[length - 1] == '0')
+		{
+			length--;
+			exponent++;
+		}
 
-	html_attribute html_node::insert_copy_after(const html_attribute& proto, const html_attribute& attr)
-	{
-		if (!proto) return html_attribute();
+		// value is d.ddd * 10^scientific
+		int scientific = static_cast<int>(length) + exponent - 1;
+		int precision = length > 6 ? static_cast<int>(length) : 6;
 
-		html_attribute result = insert_attribute_after(proto.name(), attr);
-		result.set_value(proto.value());
+		char_t* s = result;
 
-		return result;
-	}
+		if (negative) *s++ = '-';
 
-	html_attribute html_node::insert_copy_before(const html_attribute& proto, const html_attribute& attr)
-	{
-		if (!proto) return html_attribute();
+		if (scientific < -4 || scientific >= precision)
+		{
+			*s++ = digits[0];
 
-		html_attribute result = insert_attribute_before(proto.name(), attr);
-		result.set_value(proto.value());
+			if (length > 1)
+			{
+				*s++ = '.';
 
-		return result;
-	}
+				for (size_t i = 1; i < length; ++i) *s++ = digits[i];
+			}
 
-	html_node html_node::append_child(html_node_type type)
-	{
-		if (!allow_insert_child(this->type(), type)) return html_node();
-		
-		html_node n(append_node(_root, get_allocator(_root), type));
+			*s++ = 'e';
+			*s++ = scientific < 0 ? '-' : '+';
 
-		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+			unsigned int magnitude = static_cast<unsigned int>(scientific < 0 ? -scientific : scientific);
 
-		return n;
-	}
+			if (magnitude >= 100) *s++ = static_cast<char_t>('0' + magnitude / 100);
+			*s++ = static_cast<char_t>('0' + magnitude / 10 % 10);
+			*s++ = static_cast<char_t>('0' + magnitude % 10);
+		}
+		else if (scientific < 0)
+		{
+			*s++ = '0';
+			*s++ = '.';
 
-	html_node html_node::prepend_child(html_node_type type)
-	{
-		if (!allow_insert_child(this->type(), type)) return html_node();
-		
-		html_node n(allocate_node(get_allocator(_root), type));
-		if (!n) return html_node();
+			for (int i = -1; i > scientific; --i) *s++ = '0';
+			for (size_t i = 0; i < length; ++i) *s++ = digits[i];
+		}
+		else
+		{
+			// integer part, padded with zeros; fraction if any digits remain
+			for (int i = 0; i <= scientific; ++i) *s++ = static_cast<size_t>(i) < length ? digits[i] : '0';
 
-        n._root->parent = _root;
+			if (length > static_cast<size_t>(scientific) + 1)
+			{
+				*s++ = '.';
 
-        html_node_struct* head = _root->first_child;
+				for (size_t i = static_cast<size_t>(scientific) + 1; i < length; ++i) *s++ = digits[i];
+			}
+		}
 
-		if (head)
-        {
-            n._root->prev_sibling_c = head->prev_sibling_c;
-            head->prev_sibling_c = n._root;
-        }
-        else
-            n._root->prev_sibling_c = n._root;
-		
-		n._root->next_sibling = head;
-        _root->first_child = n._root;
-				
-		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+		assert(s < result + number_exponent_chars_size);
+		*s = 0;
 
-		return n;
+		return s;
 	}
 
-	html_node html_node::insert_child_before(html_node_type type, const html_node& node)
+	char_t* convert_integer_to_chars(unsigned int magnitude, bool negative, char_t* result)
 	{
-		if (!allow_insert_child(this->type(), type)) return html_node();
-		if (!node._root || node._root->parent != _root) return html_node();
-	
-		html_node n(allocate_node(get_allocator(_root), type));
-		if (!n) return html_node();
+		char_t buffer[16];
+		char_t* end = buffer + sizeof(buffer) / sizeof(buffer[0]);
+		char_t* begin = end;
 
-		n._root->parent = _root;
-		
-		if (node._root->prev_sibling_c->next_sibling)
-			node._root->prev_sibling_c->next_sibling = n._root;
-		else
-			_root->first_child = n._root;
-		
-		n._root->prev_sibling_c = node._root->prev_sibling_c;
-		n._root->next_sibling = node._root;
-		node._root->prev_sibling_c = n._root;
+		do
+		{
+			*--begin = static_cast<char_t>('0' + magnitude % 10);
+			magnitude /= 10;
+		}
+		while (magnitude);
 
-		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+		if (negative) *result++ = '-';
 
-		return n;
+		while (begin != end) *result++ = *begin++;
+
+		*result = 0;
+		return result;
 	}
 
-	html_node html_node::insert_child_after(html_node_type type, const html_node& node)
+	bool is_decimal_digit(char_t ch)
 	{
-		if (!allow_insert_child(this->type(), type)) return html_node();
-		if (!node._root || node._root->parent != _root) return html_node();
-	
-		html_node n(allocate_node(get_allocator(_root), type));
-		if (!n) return html_node();
+		return static_cast<unsigned int>(ch - '0') < 10;
+	}
 
-		n._root->parent = _root;
-	
-		if (node._root->next_sibling)
-			node._root->next_sibling->prev_sibling_c = n._root;
-		else
-			_root->first_child->prev_sibling_c = n._root;
-		
-		n._root->next_sibling = node._root->next_sibling;
-		n._root->prev_sibling_c = node._root;
-		node._root->next_sibling = n._root;
+	// Parse decimal number with optional sign, fraction and exponent; succeeds only when the mantissa has at most 53 bits and the
+	// power of ten is exact, so a single correctly rounded operation gives the result. Returns the end of the number, or 0 if the
+	// string has to go to strtod (long mantissas, large exponents, hexadecimal numbers, infinities)
+	const char_t* convert_chars_to_number(const char_t* s, double* out_result)
+	{
+		while (IS_CHARTYPE(*s, ct_space)) ++s;
 
-		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+		bool negative = (*s == '-');
+		if (*s == '-' || *s == '+') ++s;
 
-		return n;
-	}
+		uint64_t mantissa = 0;
+		int digits = 0;
+		int exponent = 0;
+		bool empty = true;
 
-    html_node html_node::append_child(const char_t* name)
-    {
-        html_node result = append_child(node_element);
+		for (; is_decimal_digit(*s); ++s)
+		{
+			if (mantissa || *s != '0')
+			{
+				if (++digits > 19) return 0;
+				mantissa = mantissa * 10 + static_cast<unsigned int>(*s - '0');
+			}
 
-        result.set_name(name);
+			empty = false;
+		}
 
-        return result;
-    }
+		if (*s == '.')
+		{
+			for (++s; is_decimal_digit(*s); ++s)
+			{
+				if (mantissa || *s != '0')
+				{
+					if (++digits > 19) return 0;
+					mantissa = mantissa * 10 + static_cast<unsigned int>(*s - '0');
+				}
 
-    html_node html_node::prepend_child(const char_t* name)
-    {
-        html_node result = prepend_child(node_element);
+				exponent--;
+				empty = false;
+			}
+		}
 
-        result.set_name(name);
+		if (empty || *s == 'x' || *s == 'X') return 0;
 
-        return result;
-    }
+		if (*s == 'e' || *s == 'E')
+		{
+			const char_t* e = s + 1;
 
-    html_node html_node::insert_child_after(const char_t* name, const html_node& node)
-    {
-        html_node result = insert_child_after(node_element, node);
+			bool exponent_negative = (*e == '-');
+			if (*e == '-' || *e == '+') ++e;
 
-        result.set_name(name);
+			if (is_decimal_digit(*e))
+			{
+				int value = 0;
 
-        return result;
-    }
+				for (; is_decimal_digit(*e); ++e)
+					if (value < 10000) value = value * 10 + static_cast<int>(*e - '0');
 
-    html_node html_node::insert_child_before(const char_t* name, const html_node& node)
-    {
-        html_node result = insert_child_before(node_element, node);
+				exponent += exponent_negative ? -value : value;
+				s = e;
+			}
+		}
 
-        result.set_name(name);
+		double result = 0;
 
-        return result;
-    }
+		if (mantissa)
+		{
+			const uint64_t exact_limit = static_cast<uint64_t>(1) << 53;
 
-	html_node html_node::append_copy(const html_node& proto)
-	{
-		html_node result = append_child(proto.type());
+			if (mantissa > exact_limit) return 0;
 
-		if (result) recursive_copy_skip(result, proto, result);
+			// 123e25 is 1230000e20
+			while (exponent > 22 && mantissa * 10 <= exact_limit)
+			{
+				mantissa *= 10;
+				exponent--;
+			}
 
-		return result;
-	}
+			if (exponent < -22 || exponent > 22) return 0;
 
-	html_node html_node::prepend_copy(const html_node& proto)
-	{
-		html_node result = prepend_child(proto.type());
+			result = static_cast<double>(mantissa);
+			result = (exponent < 0) ? result / number_powers_of_ten[-exponent] : result * number_powers_of_ten[exponent];
+		}
 
-		if (result) recursive_copy_skip(result, proto, result);
+		*out_result = negative ? -result : result;
 
-		return result;
+		return s;
 	}
 
-	html_node html_node::insert_copy_after(const html_node& proto, const html_node& node)
+	// Parse decimal integer like strtol, saturating on overflow; returns the magnitude
+	unsigned int convert_chars_to_integer(const char_t* s, bool* out_negative)
 	{
-		html_node result = insert_child_after(proto.type(), node);
+		while (IS_CHARTYPE(*s, ct_space)) ++s;
 
-		if (result) recursive_copy_skip(result, proto, result);
+		*out_negative = (*s == '-');
+		if (*s == '-' || *s == '+') ++s;
 
-		return result;
-	}
+		unsigned int result = 0;
 
-	html_node html_node::insert_copy_before(const html_node& proto, const html_node& node)
-	{
-		html_node result = insert_child_before(proto.type(), node);
+		for (; is_decimal_digit(*s); ++s)
+		{
+			unsigned int digit = static_cast<unsigned int>(*s - '0');
 
-		if (result) recursive_copy_skip(result, proto, result);
+			if (result > (~0u - digit) / 10) return ~0u;
+
+			result = result * 10 + digit;
+		}
 
 		return result;
 	}
+}
 
-	bool html_node::remove_attribute(const char_t* name)
+namespace pugihtml
+{
+	html_writer_file::html_writer_file(void* file): file(file)
 	{
-		return remove_attribute(attribute(name));
 	}
 
-	bool html_node::remove_attribute(const html_attribute& a)
+	void html_writer_file::write(const void* data, size_t size)
 	{
-		if (!_root || !a._attr) return false;
-
-		// check that attribute belongs to *this
-		html_attribute_struct* attr = a._attr;
-
-		while (attr->prev_attribute_c->next_attribute) attr = attr->prev_attribute_c;
+		fwrite(data, size, 1, static_cast<FILE*>(file));
+	}
 
-		if (attr != _root->first_attribute) return false;
+#ifndef PUGIHTML_NO_STL
+	html_writer_stream::html_writer_stream(std::basic_ostream<char, std::char_traits<char> >& stream): narrow_stream(&stream), wide_stream(0)
+	{
+	}
 
-		if (a._attr->next_attribute) a._attr->next_attribute->prev_attribute_c = a._attr->prev_attribute_c;
-		else if (_root->first_attribute) _root->first_attribute->prev_attribute_c = a._attr->prev_attribute_c;
-		
-		if (a._attr->prev_attribute_c->next_attribute) a._attr->prev_attribute_c->next_attribute = a._attr->next_attribute;
-		else _root->first_attribute = a._attr->next_attribute;
+	html_writer_stream::html_writer_stream(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream): narrow_stream(0), wide_stream(&stream)
+	{
+	}
 
-		destroy_attribute(a._attr, get_allocator(_root));
+	void html_writer_stream::write(const void* data, size_t size)
+	{
+		if (narrow_stream)
+		{
+			assert(!wide_stream);
+			narrow_stream->write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+		}
+		else
+		{
+			assert(wide_stream);
+			assert(size % sizeof(wchar_t) == 0);
 
-		return true;
+			wide_stream->write(reinterpret_cast<const wchar_t*>(data), static_cast<std::streamsize>(size / sizeof(wchar_t)));
+		}
 	}
+#endif
 
-	bool html_node::remove_child(const char_t* name)
+	html_tree_walker::html_tree_walker(): _depth(0)
 	{
-		return remove_child(child(name));
 	}
-
-	bool html_node::remove_child(const html_node& n)
+	
+	html_tree_walker::~html_tree_walker()
 	{
-		if (!_root || !n._root || n._root->parent != _root) return false;
+	}
 
-		if (n._root->next_sibling) n._root->next_sibling->prev_sibling_c = n._root->prev_sibling_c;
-		else if (_root->first_child) _root->first_child->prev_sibling_c = n._root->prev_sibling_c;
-		
-		if (n._root->prev_sibling_c->next_sibling) n._root->prev_sibling_c->next_sibling = n._root->next_sibling;
-		else _root->first_child = n._root->next_sibling;
-        
-        destroy_node(n._root, get_allocator(_root));
+	int html_tree_walker::depth() const
+	{
+		return _depth;
+	}
 
+	bool html_tree_walker::begin(html_node&)
+	{
 		return true;
 	}
 
-	html_node html_node::find_child_by_attribute(const char_t* name, const char_t* attr_name, const char_t* attr_value) const
+	bool html_tree_walker::end(html_node&)
 	{
-		if (!_root) return html_node();
-		
-		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
-			if (i->name && strequal(name, i->name))
-			{
-				for (html_attribute_struct* a = i->first_attribute; a; a = a->next_attribute)
-					if (strequal(attr_name, a->name) && strequal(attr_value, a->value))
-						return html_node(i);
-			}
-
-		return html_node();
+		return true;
 	}
 
-	html_node html_node::find_child_by_attribute(const char_t* attr_name, const char_t* attr_value) const
+	html_attribute::html_attribute(): _attr(0)
 	{
-		if (!_root) return html_node();
-		
-		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
-			for (html_attribute_struct* a = i->first_attribute; a; a = a->next_attribute)
-				if (strequal(attr_name, a->name) && strequal(attr_value, a->value))
-					return html_node(i);
+	}
 
-		return html_node();
+	html_attribute::html_attribute(html_attribute_struct* attr): _attr(attr)
+	{
 	}
 
-#ifndef PUGIHTML_NO_STL
-	string_t html_node::path(char_t delimiter) const
+	html_attribute::operator html_attribute::unspecified_bool_type() const
 	{
-		string_t path;
+      	return _attr ? &html_attribute::_attr : 0;
+   	}
 
-		html_node cursor = *this; // Make a copy.
-		
-		path = cursor.name();
+   	bool html_attribute::operator!() const
+   	{
+   		return !_attr;
+   	}
 
-		while (cursor.parent())
-		{
-			cursor = cursor.parent();
-			
-			string_t temp = cursor.name();
-			temp += delimiter;
-			temp += path;
-			path.swap(temp);
-		}
+	bool html_attribute::operator==(const html_attribute& r) const
+	{
+		return (_attr == r._attr);
+	}
+	
+	bool html_attribute::operator!=(const html_attribute& r) const
+	{
+		return (_attr != r._attr);
+	}
 
-		return path;
+	bool html_attribute::operator<(const html_attribute& r) const
+	{
+		return (_attr < r._attr);
+	}
+	
+	bool html_attribute::operator>(const html_attribute& r) const
+	{
+		return (_attr > r._attr);
+	}
+	
+	bool html_attribute::operator<=(const html_attribute& r) const
+	{
+		return (_attr <= r._attr);
+	}
+	
+	bool html_attribute::operator>=(const html_attribute& r) const
+	{
+		return (_attr >= r._attr);
 	}
-#endif
 
-	html_node html_node::first_element_by_path(const char_t* path, char_t delimiter) const
+   	html_attribute html_attribute::next_attribute() const
+   	{
+    	return _attr ? html_attribute(_attr->next_attribute) : html_attribute();
+   	}
+
+    html_attribute html_attribute::previous_attribute() const
+    {
+    	return _attr && _attr->prev_attribute_c->next_attribute ? html_attribute(_attr->prev_attribute_c) : html_attribute();
+    }
+
+	int html_attribute::as_int() const
 	{
-		html_node found = *this; // Current search context.
+		if (!_attr || !_attr->value) return 0;
 
-		if (!_root || !path || !path[0]) return found;
+		bool negative;
+		unsigned int magnitude = convert_chars_to_integer(_attr->value, &negative);
 
-		if (path[0] == delimiter)
-		{
-			// Absolute path; e.g. '/foo/bar'
-			found = found.root();
-			++path;
-		}
+		const unsigned int limit = ~0u >> 1;
 
-		const char_t* path_segment = path;
+		if (negative) return magnitude > limit ? -static_cast<int>(limit) - 1 : -static_cast<int>(magnitude);
+		else return magnitude > limit ? static_cast<int>(limit) : static_cast<int>(magnitude);
+	}
 
-		while (*path_segment == delimiter) ++path_segment;
+	unsigned int html_attribute::as_uint() const
+	{
+		if (!_attr || !_attr->value) return 0;
 
-		const char_t* path_segment_end = path_segment;
+		// negative values wrap around like in strtoul
+		bool negative;
+		unsigned int magnitude = convert_chars_to_integer(_attr->value, &negative);
 
-		while (*path_segment_end && *path_segment_end != delimiter) ++path_segment_end;
+		return negative ? 0u - magnitude : magnitude;
+	}
 
-		if (path_segment == path_segment_end) return found;
+	double html_attribute::as_double() const
+	{
+		if (!_attr || !_attr->value) return 0;
 
-		const char_t* next_segment = path_segment_end;
+		double result;
+		if (convert_chars_to_number(_attr->value, &result)) return result;
 
-		while (*next_segment == delimiter) ++next_segment;
+	#ifdef PUGIHTML_WCHAR_MODE
+		return wcstod(_attr->value, 0);
+	#else
+		return strtod(_attr->value, 0);
+	#endif
+	}
 
-		if (*path_segment == '.' && path_segment + 1 == path_segment_end)
-			return found.first_element_by_path(next_segment, delimiter);
-		else if (*path_segment == '.' && *(path_segment+1) == '.' && path_segment + 2 == path_segment_end)
-			return found.parent().first_element_by_path(next_segment, delimiter);
-		else
-		{
-			for (html_node_struct* j = found._root->first_child; j; j = j->next_sibling)
-			{
-				if (j->name && strequalrange(j->name, path_segment, static_cast<size_t>(path_segment_end - path_segment)))
-				{
-					html_node subsearch = html_node(j).first_element_by_path(next_segment, delimiter);
+	float html_attribute::as_float() const
+	{
+		return static_cast<float>(as_double());
+	}
 
-					if (subsearch) return subsearch;
-				}
-			}
+	bool html_attribute::as_bool() const
+	{
+		if (!_attr || !_attr->value) return false;
 
-			return html_node();
-		}
+		// only look at first char
+		char_t first = *_attr->value;
+
+		// 1*, t* (true), T* (True), y* (yes), Y* (YES)
+		return (first == '1' || first == 't' || first == 'T' || first == 'y' || first == 'Y');
 	}
 
-	bool html_node::traverse(html_tree_walker& walker)
+	bool html_attribute::empty() const
 	{
-		walker._depth = -1;
-		
-		html_node arg_begin = *this;
-		if (!walker.begin(arg_begin)) return false;
+		return !_attr;
+	}
 
-		html_node cur = first_child();
-				
-		if (cur)
-		{
-			++walker._depth;
+	const char_t* html_attribute::name() const
+	{
+		return (_attr && _attr->name) ? _attr->name : PUGIHTML_TEXT("");
+	}
 
-			do 
-			{
-				html_node arg_for_each = cur;
-				if (!walker.for_each(arg_for_each))
-					return false;
-						
-				if (cur.first_child())
-				{
-					++walker._depth;
-					cur = cur.first_child();
-				}
-				else if (cur.next_sibling())
-					cur = cur.next_sibling();
-				else
-				{
-					// Borland C++ workaround
-					while (!cur.next_sibling() && cur != *this && (bool)cur.parent())
-					{
-						--walker._depth;
-						cur = cur.parent();
-					}
-						
-					if (cur != *this)
-						cur = cur.next_sibling();
-				}
-			}
-			while (cur && cur != *this);
-		}
-
-		assert(walker._depth == -1);
-
-		html_node arg_end = *this;
-		return walker.end(arg_end);
+	const char_t* html_attribute::value() const
+	{
+		return (_attr && _attr->value) ? _attr->value : PUGIHTML_TEXT("");
 	}
 
-    size_t html_node::hash_value() const
+    size_t html_attribute::hash_value() const
     {
-        return static_cast<size_t>(reinterpret_cast<uintptr_t>(_root) / sizeof(html_node_struct));
+        return static_cast<size_t>(reinterpret_cast<uintptr_t>(_attr) / sizeof(html_attribute_struct));
     }
 
-	html_node_struct* html_node::internal_object() const
+	html_attribute_struct* html_attribute::internal_object() const
 	{
-        return _root;
+        return _attr;
 	}
 
-	void html_node::print(html_writer& writer, const char_t* indent, unsigned int flags, html_encoding encoding, unsigned int depth) const
+	html_attribute& html_attribute::operator=(const char_t* rhs)
 	{
-		if (!_root) return;
-
-		html_buffered_writer buffered_writer(writer, encoding);
-
-		node_output(buffered_writer, *this, indent, flags, depth);
+		set_value(rhs);
+		return *this;
 	}
-
-#ifndef PUGIHTML_NO_STL
-	void html_node::print(std::basic_ostream<char, std::char_traits<char> >& stream, const char_t* indent, unsigned int flags, html_encoding encoding, unsigned int depth) const
+	
+	html_attribute& html_attribute::operator=(int rhs)
 	{
-		html_writer_stream writer(stream);
-
-		print(writer, indent, flags, encoding, depth);
+		set_value(rhs);
+		return *this;
 	}
 
-	void html_node::print(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream, const char_t* indent, unsigned int flags, unsigned int depth) const
+	html_attribute& html_attribute::operator=(unsigned int rhs)
 	{
-		html_writer_stream writer(stream);
+		set_value(rhs);
+		return *this;
+	}
 
-		print(writer, indent, flags, encoding_wchar, depth);
+	html_attribute& html_attribute::operator=(double rhs)
+	{
+		set_value(rhs);
+		return *this;
+	}
+	
+	html_attribute& html_attribute::operator=(bool rhs)
+	{
+		set_value(rhs);
+		return *this;
 	}
-#endif
 
-	ptrdiff_t html_node::offset_debug() const
+	bool html_attribute::set_name(const char_t* rhs)
 	{
-		html_node_struct* r = root()._root;
+		if (!_attr) return false;
+		
+		return strcpy_insitu(_attr->name, _attr->header, html_memory_page_name_allocated_mask, rhs);
+	}
+		
+	bool html_attribute::set_value(const char_t* rhs)
+	{
+		if (!_attr) return false;
 
-		if (!r) return -1;
+		return strcpy_insitu(_attr->value, _attr->header, html_memory_page_value_allocated_mask, rhs);
+	}
 
-		const char_t* buffer = static_cast<html_document_struct*>(r)->buffer;
+	bool html_attribute::set_value(int rhs)
+	{
+		char_t buf[16];
+		convert_integer_to_chars(rhs < 0 ? 0u - static_cast<unsigned int>(rhs) : static_cast<unsigned int>(rhs), rhs < 0, buf);
 
-		if (!buffer) return -1;
+		return set_value(buf);
+	}
 
-		switch (type())
-		{
-		case node_document:
-			return 0;
+	bool html_attribute::set_value(unsigned int rhs)
+	{
+		char_t buf[16];
+		convert_integer_to_chars(rhs, false, buf);
 
-		case node_element:
-		case node_declaration:
-		case node_pi:
-			return (_root->header & html_memory_page_name_allocated_mask) ? -1 : _root->name - buffer;
+		return set_value(buf);
+	}
 
-		case node_pcdata:
-		case node_cdata:
-		case node_comment:
-		case node_doctype:
-			return (_root->header & html_memory_page_value_allocated_mask) ? -1 : _root->value - buffer;
+	bool html_attribute::set_value(double rhs)
+	{
+		char_t buf[number_exponent_chars_size];
+		convert_number_to_chars_exponent(rhs, buf);
 
-		default:
-			return -1;
-		}
+		return set_value(buf);
+	}
+	
+	bool html_attribute::set_value(bool rhs)
+	{
+		return set_value(rhs ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
 	}
 
 #ifdef __BORLANDC__
-	bool operator&&(const html_node& lhs, bool rhs)
+	bool operator&&(const html_attribute& lhs, bool rhs)
 	{
 		return (bool)lhs && rhs;
 	}
 
-	bool operator||(const html_node& lhs, bool rhs)
+	bool operator||(const html_attribute& lhs, bool rhs)
 	{
 		return (bool)lhs || rhs;
 	}
 #endif
 
-	html_node_iterator::html_node_iterator()
+	html_node::html_node(): _root(0)
 	{
 	}
 
-	html_node_iterator::html_node_iterator(const html_node& node): _wrap(node), _parent(node.parent())
+	html_node::html_node(html_node_struct* p): _root(p)
 	{
 	}
+	
+	html_node::operator html_node::unspecified_bool_type() const
+	{
+      	return _root ? &html_node::_root : 0;
+   	}
 
-	html_node_iterator::html_node_iterator(html_node_struct* ref, html_node_struct* parent): _wrap(ref), _parent(parent)
+   	bool html_node::operator!() const
+   	{
+   		return !_root;
+   	}
+
+	html_node::iterator html_node::begin() const
 	{
+		return iterator(_root ? _root->first_child : 0, _root);
 	}
 
-	bool html_node_iterator::operator==(const html_node_iterator& rhs) const
+	html_node::iterator html_node::end() const
 	{
-		return _wrap._root == rhs._wrap._root && _parent._root == rhs._parent._root;
+		return iterator(0, _root);
 	}
 	
-	bool html_node_iterator::operator!=(const html_node_iterator& rhs) const
+	html_node::attribute_iterator html_node::attributes_begin() const
 	{
-		return _wrap._root != rhs._wrap._root || _parent._root != rhs._parent._root;
+		return attribute_iterator(_root ? _root->first_attribute : 0, _root);
 	}
 
-	html_node& html_node_iterator::operator*()
+	html_node::attribute_iterator html_node::attributes_end() const
 	{
-		assert(_wrap._root);
-		return _wrap;
+		return attribute_iterator(0, _root);
 	}
 
-	html_node* html_node_iterator::operator->()
+	bool html_node::operator==(const html_node& r) const
 	{
-		assert(_wrap._root);
-		return &_wrap;
+		return (_root == r._root);
 	}
 
-	const html_node_iterator& html_node_iterator::operator++()
+	bool html_node::operator!=(const html_node& r) const
 	{
-		assert(_wrap._root);
-		_wrap._root = _wrap._root->next_sibling;
-		return *this;
+		return (_root != r._root);
 	}
 
-	html_node_iterator html_node_iterator::operator++(int)
+	bool html_node::operator<(const html_node& r) const
 	{
-		html_node_iterator temp = *this;
-		++*this;
-		return temp;
+		return (_root < r._root);
 	}
-
-	const html_node_iterator& html_node_iterator::operator--()
+	
+	bool html_node::operator>(const html_node& r) const
 	{
-		_wrap = _wrap._root ? _wrap.previous_sibling() : _parent.last_child();
-		return *this;
+		return (_root > r._root);
 	}
-
-	html_node_iterator html_node_iterator::operator--(int)
+	
+	bool html_node::operator<=(const html_node& r) const
 	{
-		html_node_iterator temp = *this;
-		--*this;
-		return temp;
+		return (_root <= r._root);
 	}
-
-	html_attribute_iterator::html_attribute_iterator()
+	
+	bool html_node::operator>=(const html_node& r) const
 	{
+		return (_root >= r._root);
 	}
 
-	html_attribute_iterator::html_attribute_iterator(const html_attribute& attr, const html_node& parent): _wrap(attr), _parent(parent)
+	bool html_node::empty() const
 	{
+		return !_root;
 	}
-
-	html_attribute_iterator::html_attribute_iterator(html_attribute_struct* ref, html_node_struct* parent): _wrap(ref), _parent(parent)
+	
+	const char_t* html_node::name() const
 	{
+		return (_root && _root->name) ? _root->name : PUGIHTML_TEXT("");
 	}
 
-	bool html_attribute_iterator::operator==(const html_attribute_iterator& rhs) const
+	html_node_type html_node::type() const
 	{
-		return _wrap._attr == rhs._wrap._attr && _parent._root == rhs._parent._root;
+		return _root ? static_cast<html_node_type>((_root->header & html_memory_page_type_mask) + 1) : node_null;
 	}
 	
-	bool html_attribute_iterator::operator!=(const html_attribute_iterator& rhs) const
+	const char_t* html_node::value() const
 	{
-		return _wrap._attr != rhs._wrap._attr || _parent._root != rhs._parent._root;
+		return (_root && _root->value) ? _root->value : PUGIHTML_TEXT("");
 	}
-
-	html_attribute& html_attribute_iterator::operator*()
+	
+	html_node html_node::child(const char_t* name) const
 	{
-		assert(_wrap._attr);
-		return _wrap;
+		if (!_root) return html_node();
+
+		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+			if (i->name && strequal(name, i->name)) return html_node(i);
+
+		return html_node();
 	}
 
-	html_attribute* html_attribute_iterator::operator->()
+	html_attribute html_node::attribute(const char_t* name) const
 	{
-		assert(_wrap._attr);
-		return &_wrap;
-	}
+		if (!_root) return html_attribute();
 
-	const html_attribute_iterator& html_attribute_iterator::operator++()
+		for (html_attribute_struct* i = _root->first_attribute; i; i = i->next_attribute)
+			if (i->name && strequal(name, i->name))
+				return html_attribute(i);
+		
+		return html_attribute();
+	}
+	
+	html_node html_node::next_sibling(const char_t* name) const
 	{
-		assert(_wrap._attr);
-		_wrap._attr = _wrap._attr->next_attribute;
-		return *this;
+		if (!_root) return html_node();
+		
+		for (html_node_struct* i = _root->next_sibling; i; i = i->next_sibling)
+			if (i->name && strequal(name, i->name)) return html_node(i);
+
+		return html_node();
 	}
 
-	html_attribute_iterator html_attribute_iterator::operator++(int)
+	html_node html_node::next_sibling() const
 	{
-		html_attribute_iterator temp = *this;
-		++*this;
-		return temp;
+		if (!_root) return html_node();
+		
+		if (_root->next_sibling) return html_node(_root->next_sibling);
+		else return html_node();
 	}
 
-	const html_attribute_iterator& html_attribute_iterator::operator--()
+	html_node html_node::previous_sibling(const char_t* name) const
 	{
-		_wrap = _wrap._attr ? _wrap.previous_attribute() : _parent.last_attribute();
-		return *this;
+		if (!_root) return html_node();
+		
+		for (html_node_struct* i = _root->prev_sibling_c; i->next_sibling; i = i->prev_sibling_c)
+			if (i->name && strequal(name, i->name)) return html_node(i);
+
+		return html_node();
 	}
 
-	html_attribute_iterator html_attribute_iterator::operator--(int)
+	html_node html_node::previous_sibling() const
 	{
-		html_attribute_iterator temp = *this;
-		--*this;
-		return temp;
+		if (!_root) return html_node();
+		
+		if (_root->prev_sibling_c->next_sibling) return html_node(_root->prev_sibling_c);
+		else return html_node();
 	}
 
-    html_parse_result::html_parse_result(): status(status_internal_error), offset(0), encoding(encoding_auto)
-    {
-    }
-
-    html_parse_result::operator bool() const
-    {
-        return status == status_ok;
-    }
+	html_node html_node::parent() const
+	{
+		return _root ? html_node(_root->parent) : html_node();
+	}
 
-	const char* html_parse_result::description() const
+	html_node html_node::root() const
 	{
-		switch (status)
-		{
-		case status_ok: return "No error";
+		if (!_root) return html_node();
 
-		case status_file_not_found: return "File was not found";
-		case status_io_error: return "Error reading from file/stream";
-		case status_out_of_memory: return "Could not allocate memory";
-		case status_internal_error: return "Internal error occurred";
+		html_memory_page* page = reinterpret_cast<html_memory_page*>(_root->header & html_memory_page_pointer_mask);
 
-		case status_unrecognized_tag: return "Could not determine tag type";
+		return html_node(static_cast<html_document_struct*>(page->allocator));
+	}
 
-		case status_bad_pi: return "Error parsing document declaration/processing instruction";
-		case status_bad_comment: return "Error parsing comment";
-		case status_bad_cdata: return "Error parsing CDATA section";
-		case status_bad_doctype: return "Error parsing document type declaration";
-		case status_bad_pcdata: return "Error parsing PCDATA section";
-		case status_bad_start_element: return "Error parsing start element tag";
-		case status_bad_attribute: return "Error parsing element attribute";
-		case status_bad_end_element: return "Error parsing end element tag";
-		case status_end_element_mismatch: return "Start-end tags mismatch";
+	const char_t* html_node::child_value() const
+	{
+		if (!_root) return PUGIHTML_TEXT("");
+		
+		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+		{
+			html_node_type type = static_cast<html_node_type>((i->header & html_memory_page_type_mask) + 1);
 
-		default: return "Unknown error";
+			if (i->value && (type == node_pcdata || type == node_cdata))
+				return i->value;
 		}
+
+		return PUGIHTML_TEXT("");
 	}
 
-	html_document::html_document(): _buffer(0)
+	const char_t* html_node::child_value(const char_t* name) const
 	{
-		create();
+		return child(name).child_value();
 	}
 
-	html_document::~html_document()
+	html_attribute html_node::first_attribute() const
 	{
-		destroy();
+		return _root ? html_attribute(_root->first_attribute) : html_attribute();
 	}
 
-	void html_document::reset()
+	html_attribute html_node::last_attribute() const
 	{
-		destroy();
-		create();
+		return _root && _root->first_attribute ? html_attribute(_root->first_attribute->prev_attribute_c) : html_attribute();
 	}
 
-    void html_document::reset(const html_document& proto)
-    {
-        reset();
-
-        for (html_node cur = proto.first_child(); cur; cur = cur.next_sibling())
-            append_copy(cur);
-    }
-
-	void html_document::create()
+	html_node html_node::first_child() const
 	{
-		// initialize sentinel page
-		STATIC_ASSERT(offsetof(html_memory_page, data) + sizeof(html_document_struct) + html_memory_page_alignment <= sizeof(_memory));
-
-		// align upwards to page boundary
-		void* page_memory = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(_memory) + (html_memory_page_alignment - 1)) & ~(html_memory_page_alignment - 1));
-
-		// prepare page structure
-		html_memory_page* page = html_memory_page::construct(page_memory);
-
-		page->busy_size = html_memory_page_size;
-
-		// allocate new root
-		_root = new (page->data) html_document_struct(page);
-		_root->prev_sibling_c = _root;
-
-		// setup sentinel page
-		page->allocator = static_cast<html_document_struct*>(_root);
+		return _root ? html_node(_root->first_child) : html_node();
 	}
 
-	void html_document::destroy()
+	html_node html_node::last_child() const
 	{
-		// destroy static storage
-		if (_buffer)
-		{
-			global_deallocate(_buffer);
-			_buffer = 0;
-		}
+		return _root && _root->first_child ? html_node(_root->first_child->prev_sibling_c) : html_node();
+	}
 
-		// destroy dynamic storage, leave sentinel page (it's in static memory)
-		if (_root)
+	bool html_node::set_name(const char_t* rhs)
+	{
+		switch (type())
 		{
-			html_memory_page* root_page = reinterpret_cast<html_memory_page*>(_root->header & html_memory_page_pointer_mask);
-			assert(root_page && !root_page->prev && !root_page->memory);
-
-			// destroy all pages
-			for (html_memory_page* page = root_page->next; page; )
-			{
-				html_memory_page* next = page->next;
-
-				html_allocator::deallocate_page(page);
-
-				page = next;
-			}
-
-			// cleanup root page
-			root_page->allocator = 0;
-			root_page->next = 0;
-			root_page->busy_size = root_page->freed_size = 0;
+		case node_pi:
+		case node_declaration:
+		case node_element:
+			return strcpy_insitu(_root->name, _root->header, html_memory_page_name_allocated_mask, rhs);
 
-			_root = 0;
+		default:
+			return false;
 		}
 	}
-
-#ifndef PUGIHTML_NO_STL
-	html_parse_result html_document::load(std::basic_istream<char, std::char_traits<char> >& stream, unsigned int options, html_encoding encoding)
+		
+	bool html_node::set_value(const char_t* rhs)
 	{
-		reset();
+		switch (type())
+		{
+		case node_pi:
+		case node_cdata:
+		case node_pcdata:
+		case node_comment:
+        case node_doctype:
+			return strcpy_insitu(_root->value, _root->header, html_memory_page_value_allocated_mask, rhs);
 
-		return load_stream_impl(*this, stream, options, encoding);
+		default:
+			return false;
+		}
 	}
 
-	html_parse_result html_document::load(std::basic_istream<wchar_t, std::char_traits<wchar_t> >& stream, unsigned int options)
+	html_attribute html_node::append_attribute(const char_t* name)
 	{
-		reset();
-
-		return load_stream_impl(*this, stream, options, encoding_wchar);
+		if (type() != node_element && type() != node_declaration) return html_attribute();
+		
+		html_attribute a(append_attribute_ll(_root, get_allocator(_root)));
+		a.set_name(name);
+		
+		return a;
 	}
-#endif
 
-	html_parse_result html_document::load(const char_t* contents, unsigned int options)
+	html_attribute html_node::prepend_attribute(const char_t* name)
 	{
-		// Force native encoding (skip autodetection)
-	#ifdef PUGIHTML_WCHAR_MODE
-		html_encoding encoding = encoding_wchar;
-	#else
-		html_encoding encoding = encoding_utf8;
-	#endif
+		if (type() != node_element && type() != node_declaration) return html_attribute();
+		
+		html_attribute a(allocate_attribute(get_allocator(_root)));
+		if (!a) return html_attribute();
 
-		return load_buffer(contents, strlength(contents) * sizeof(char_t), options, encoding);
+		a.set_name(name);
+		
+        html_attribute_struct* head = _root->first_attribute;
+
+		if (head)
+        {
+            a._attr->prev_attribute_c = head->prev_attribute_c;
+            head->prev_attribute_c = a._attr;
+        }
+        else
+            a._attr->prev_attribute_c = a._attr;
+		
+		a._attr->next_attribute = head;
+        _root->first_attribute = a._attr;
+				
+		return a;
 	}
 
-	html_parse_result html_document::load_file(const char* path, unsigned int options, html_encoding encoding)
+	html_attribute html_node::insert_attribute_before(const char_t* name, const html_attribute& attr)
 	{
-		reset();
+		if ((type() != node_element && type() != node_declaration) || attr.empty()) return html_attribute();
+		
+		// check that attribute belongs to *this
+		html_attribute_struct* cur = attr._attr;
 
-		FILE* file = fopen(path, "rb");
+		while (cur->prev_attribute_c->next_attribute) cur = cur->prev_attribute_c;
 
-		return load_file_impl(*this, file, options, encoding);
-	}
+		if (cur != _root->first_attribute) return html_attribute();
 
-	html_parse_result html_document::load_file(const wchar_t* path, unsigned int options, html_encoding encoding)
-	{
-		reset();
+		html_attribute a(allocate_attribute(get_allocator(_root)));
+		if (!a) return html_attribute();
 
-		FILE* file = open_file_wide(path, L"rb");
+		a.set_name(name);
 
-		return load_file_impl(*this, file, options, encoding);
+		if (attr._attr->prev_attribute_c->next_attribute)
+			attr._attr->prev_attribute_c->next_attribute = a._attr;
+		else
+			_root->first_attribute = a._attr;
+		
+		a._attr->prev_attribute_c = attr._attr->prev_attribute_c;
+		a._attr->next_attribute = attr._attr;
+		attr._attr->prev_attribute_c = a._attr;
+				
+		return a;
 	}
 
-	html_parse_result html_document::load_buffer_impl(void* contents, size_t size, unsigned int options, html_encoding encoding, bool is_mutable, bool own)
+	html_attribute html_node::insert_attribute_after(const char_t* name, const html_attribute& attr)
 	{
-		reset();
+		if ((type() != node_element && type() != node_declaration) || attr.empty()) return html_attribute();
+		
+		// check that attribute belongs to *this
+		html_attribute_struct* cur = attr._attr;
 
-		// check input buffer
-		assert(contents || size == 0);
+		while (cur->prev_attribute_c->next_attribute) cur = cur->prev_attribute_c;
 
-		// get actual encoding
-		html_encoding buffer_encoding = get_buffer_encoding(encoding, contents, size);
+		if (cur != _root->first_attribute) return html_attribute();
 
-		// get private buffer
-		char_t* buffer = 0;
-		size_t length = 0;
+		html_attribute a(allocate_attribute(get_allocator(_root)));
+		if (!a) return html_attribute();
 
-		if (!convert_buffer(buffer, length, buffer_encoding, contents, size, is_mutable)) return make_parse_result(status_out_of_memory);
-		
-		// delete original buffer if we performed a conversion
-		if (own && buffer != contents && contents) global_deallocate(contents);
-
-		// parse
-		html_parse_result res = html_parser::parse(buffer, length, _root, options);
-
-		// remember encoding
-		res.encoding = buffer_encoding;
+		a.set_name(name);
 
-		// grab onto buffer if it's our buffer, user is responsible for deallocating contens himself
-		if (own || buffer != contents) _buffer = buffer;
+		if (attr._attr->next_attribute)
+			attr._attr->next_attribute->prev_attribute_c = a._attr;
+		else
+			_root->first_attribute->prev_attribute_c = a._attr;
+		
+		a._attr->next_attribute = attr._attr->next_attribute;
+		a._attr->prev_attribute_c = attr._attr;
+		attr._attr->next_attribute = a._attr;
 
-		return res;
+		return a;
 	}
 
-	html_parse_result html_document::load_buffer(const void* contents, size_t size, unsigned int options, html_encoding encoding)
+	html_attribute html_node::append_copy(const html_attribute& proto)
 	{
-		return load_buffer_impl(const_cast<void*>(contents), size, options, encoding, false, false);
-	}
+		if (!proto) return html_attribute();
 
-	html_parse_result html_document::load_buffer_inplace(void* contents, size_t size, unsigned int options, html_encoding encoding)
-	{
-		return load_buffer_impl(contents, size, options, encoding, true, false);
-	}
-		
-	html_parse_result html_document::load_buffer_inplace_own(void* contents, size_t size, unsigned int options, html_encoding encoding)
-	{
-		return load_buffer_impl(contents, size, options, encoding, true, true);
+		html_attribute result = append_attribute(proto.name());
+		result.set_value(proto.value());
+
+		return result;
 	}
 
-	void html_document::save(html_writer& writer, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	html_attribute html_node::prepend_copy(const html_attribute& proto)
 	{
-		if (flags & format_write_bom) write_bom(writer, get_write_encoding(encoding));
-
-		html_buffered_writer buffered_writer(writer, encoding);
+		if (!proto) return html_attribute();
 
-		if (!(flags & format_no_declaration) && !has_declaration(*this))
-		{
-			buffered_writer.write(PUGIHTML_TEXT("<?html version=\"1.0\"?>"));
-			if (!(flags & format_raw)) buffered_writer.write('\n');
-		}
+		html_attribute result = prepend_attribute(proto.name());
+		result.set_value(proto.value());
 
-		node_output(buffered_writer, *this, indent, flags, 0);
+		return result;
 	}
 
-#ifndef PUGIHTML_NO_STL
-	void html_document::save(std::basic_ostream<char, std::char_traits<char> >& stream, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	html_attribute html_node::insert_copy_after(const html_attribute& proto, const html_attribute& attr)
 	{
-		html_writer_stream writer(stream);
+		if (!proto) return html_attribute();
 
-		save(writer, indent, flags, encoding);
+		html_attribute result = insert_attribute_after(proto.name(), attr);
+		result.set_value(proto.value());
+
+		return result;
 	}
 
-	void html_document::save(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream, const char_t* indent, unsigned int flags) const
+	html_attribute html_node::insert_copy_before(const html_attribute& proto, const html_attribute& attr)
 	{
-		html_writer_stream writer(stream);
+		if (!proto) return html_attribute();
 
-		save(writer, indent, flags, encoding_wchar);
+		html_attribute result = insert_attribute_before(proto.name(), attr);
+		result.set_value(proto.value());
+
+		return result;
 	}
-#endif
 
-	bool html_document::save_file(const char* path, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	html_node html_node::append_child(html_node_type type)
 	{
-		FILE* file = fopen(path, "wb");
-		if (!file) return false;
+		if (!allow_insert_child(this->type(), type)) return html_node();
+		
+		html_node n(append_node(_root, get_allocator(_root), type));
+		if (!n) return html_node();
 
-		html_writer_file writer(file);
-		save(writer, indent, flags, encoding);
+		touch_document(_root->header);
 
-		fclose(file);
+		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
 
-		return true;
+		return n;
 	}
 
-	bool html_document::save_file(const wchar_t* path, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	html_node html_node::prepend_child(html_node_type type)
 	{
-		FILE* file = open_file_wide(path, L"wb");
-		if (!file) return false;
+		if (!allow_insert_child(this->type(), type)) return html_node();
+		
+		html_node n(allocate_node(get_allocator(_root), type));
+		if (!n) return html_node();
 
-		html_writer_file writer(file);
-		save(writer, indent, flags, encoding);
+		touch_document(_root->header);
 
-		fclose(file);
+        n._root->parent = _root;
 
-		return true;
-	}
+        html_node_struct* head = _root->first_child;
 
-    html_node html_document::document_element() const
-    {
-		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
-			if ((i->header & html_memory_page_type_mask) + 1 == node_element)
-                return html_node(i);
+		if (head)
+        {
+            n._root->prev_sibling_c = head->prev_sibling_c;
+            head->prev_sibling_c = n._root;
+        }
+        else
+            n._root->prev_sibling_c = n._root;
+		
+		n._root->next_sibling = head;
+        _root->first_child = n._root;
+				
+		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
 
-        return html_node();
-    }
+		return n;
+	}
 
-#ifndef PUGIHTML_NO_STL
-	std::string PUGIHTML_FUNCTION as_utf8(const wchar_t* str)
+	html_node html_node::insert_child_before(html_node_type type, const html_node& node)
 	{
-		assert(str);
+		if (!allow_insert_child(this->type(), type)) return html_node();
+		if (!node._root || node._root->parent != _root) return html_node();
+	
+		html_node n(allocate_node(get_allocator(_root), type));
+		if (!n) return html_node();
 
-        return as_utf8_impl(str, wcslen(str));
+		touch_document(_root->header);
+
+		n._root->parent = _root;
+		
+		if (node._root->prev_sibling_c->next_sibling)
+			node._root->prev_sibling_c->next_sibling = n._root;
+		else
+			_root->first_child = n._root;
+		
+		n._root->prev_sibling_c = node._root->prev_sibling_c;
+		n._root->next_sibling = node._root;
+		node._root->prev_sibling_c = n._root;
+
+		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+
+		return n;
 	}
 
-	std::string PUGIHTML_FUNCTION as_utf8(const std::wstring& str)
+	html_node html_node::insert_child_after(html_node_type type, const html_node& node)
 	{
-        return as_utf8_impl(str.c_str(), str.size());
-	}
+		if (!allow_insert_child(this->type(), type)) return html_node();
+		if (!node._root || node._root->parent != _root) return html_node();
 	
-	std::wstring PUGIHTML_FUNCTION as_wide(const char* str)
-	{
-		assert(str);
+		html_node n(allocate_node(get_allocator(_root), type));
+		if (!n) return html_node();
 
-        return as_wide_impl(str, strlen(str));
-	}
+		touch_document(_root->header);
+
+		n._root->parent = _root;
 	
-	std::wstring PUGIHTML_FUNCTION as_wide(const std::string& str)
-	{
-        return as_wide_impl(str.c_str(), str.size());
+		if (node._root->next_sibling)
+			node._root->next_sibling->prev_sibling_c = n._root;
+		else
+			_root->first_child->prev_sibling_c = n._root;
+		
+		n._root->next_sibling = node._root->next_sibling;
+		n._root->prev_sibling_c = node._root;
+		node._root->next_sibling = n._root;
+
+		if (type == node_declaration) n.set_name(PUGIHTML_TEXT("html"));
+
+		return n;
 	}
-#endif
 
-    void PUGIHTML_FUNCTION set_memory_management_functions(allocation_function allocate, deallocation_function deallocate)
+    html_node html_node::append_child(const char_t* name)
     {
-    	global_allocate = allocate;
-    	global_deallocate = deallocate;
+        html_node result = append_child(node_element);
+
+        result.set_name(name);
+
+        return result;
     }
 
-    allocation_function PUGIHTML_FUNCTION get_memory_allocation_function()
+    html_node html_node::prepend_child(const char_t* name)
     {
-    	return global_allocate;
+        html_node result = prepend_child(node_element);
+
+        result.set_name(name);
+
+        return result;
     }
 
-    deallocation_function PUGIHTML_FUNCTION get_memory_deallocation_function()
+    html_node html_node::insert_child_after(const char_t* name, const html_node& node)
     {
-    	return global_deallocate;
+        html_node result = insert_child_after(node_element, node);
+
+        result.set_name(name);
+
+        return result;
     }
-}
 
-#if !defined(PUGIHTML_NO_STL) && (defined(_MSC_VER) || defined(__ICC))
-namespace std
-{
-	// Workarounds for (non-standard) iterator category detection for older versions (MSVC7/IC8 and earlier)
-	std::bidirectional_iterator_tag _Iter_cat(const html_node_iterator&)
+    html_node html_node::insert_child_before(const char_t* name, const html_node& node)
+    {
+        html_node result = insert_child_before(node_element, node);
+
+        result.set_name(name);
+
+        return result;
+    }
+
+	html_node html_node::append_copy(const html_node& proto)
 	{
-		return std::bidirectional_iterator_tag();
+		html_node result = append_child(proto.type());
+
+		if (result) recursive_copy_skip(result, proto, result);
+
+		return result;
 	}
 
-	std::bidirectional_iterator_tag _Iter_cat(const html_attribute_iterator&)
+	html_node html_node::prepend_copy(const html_node& proto)
 	{
-		return std::bidirectional_iterator_tag();
+		html_node result = prepend_child(proto.type());
+
+		if (result) recursive_copy_skip(result, proto, result);
+
+		return result;
 	}
-}
-#endif
 
-#if !defined(PUGIHTML_NO_STL) && defined(__SUNPRO_CC)
-namespace std
-{
-	// Workarounds for (non-standard) iterator category detection
-	std::bidirectional_iterator_tag __iterator_category(const html_node_iterator&)
+	html_node html_node::insert_copy_after(const html_node& proto, const html_node& node)
 	{
-		return std::bidirectional_iterator_tag();
+		html_node result = insert_child_after(proto.type(), node);
+
+		if (result) recursive_copy_skip(result, proto, result);
+
+		return result;
 	}
 
-	std::bidirectional_iterator_tag __iterator_category(const html_attribute_iterator&)
+	html_node html_node::insert_copy_before(const html_node& proto, const html_node& node)
 	{
-		return std::bidirectional_iterator_tag();
-	}
-}
-#endif
+		html_node result = insert_child_before(proto.type(), node);
 
-#ifndef PUGIHTML_NO_XPATH
+		if (result) recursive_copy_skip(result, proto, result);
 
-// STL replacements
-namespace
-{
-	struct equal_to
-	{
-		template <typename T> bool operator()(const T& lhs, const T& rhs) const
-		{
-			return lhs == rhs;
-		}
-	};
+		return result;
+	}
 
-	struct not_equal_to
+	bool html_node::remove_attribute(const char_t* name)
 	{
-		template <typename T> bool operator()(const T& lhs, const T& rhs) const
-		{
-			return lhs != rhs;
-		}
-	};
+		return remove_attribute(attribute(name));
+	}
 
-	struct less
+	bool html_node::remove_attribute(const html_attribute& a)
 	{
-		template <typename T> bool operator()(const T& lhs, const T& rhs) const
-		{
-			return lhs < rhs;
-		}
-	};
+		if (!_root || !a._attr) return false;
 
-	struct less_equal
-	{
-		template <typename T> bool operator()(const T& lhs, const T& rhs) const
-		{
-			return lhs <= rhs;
-		}
-	};
+		// check that attribute belongs to *this
+		html_attribute_struct* attr = a._attr;
 
-	template <typename T> void swap(T& lhs, T& rhs)
+		while (attr->prev_attribute_c->next_attribute) attr = attr->prev_attribute_c;
+
+		if (attr != _root->first_attribute) return false;
+
+		if (a._attr->next_attribute) a._attr->next_attribute->prev_attribute_c = a._attr->prev_attribute_c;
+		else if (_root->first_attribute) _root->first_attribute->prev_attribute_c = a._attr->prev_attribute_c;
+		
+		if (a._attr->prev_attribute_c->next_attribute) a._attr->prev_attribute_c->next_attribute = a._attr->next_attribute;
+		else _root->first_attribute = a._attr->next_attribute;
+
+		destroy_attribute(a._attr, get_allocator(_root));
+		touch_document(_root->header);
+
+		return true;
+	}
+
+	bool html_node::remove_child(const char_t* name)
 	{
-		T temp = lhs;
-		lhs = rhs;
-		rhs = temp;
+		return remove_child(child(name));
 	}
 
-	template <typename I, typename Pred> I min_element(I begin, I end, const Pred& pred)
+	bool html_node::remove_child(const html_node& n)
 	{
-		I result = begin;
+		if (!_root || !n._root || n._root->parent != _root) return false;
 
-		for (I it = begin + 1; it != end; ++it)
-			if (pred(*it, *result))
-				result = it;
+		if (n._root->next_sibling) n._root->next_sibling->prev_sibling_c = n._root->prev_sibling_c;
+		else if (_root->first_child) _root->first_child->prev_sibling_c = n._root->prev_sibling_c;
+		
+		if (n._root->prev_sibling_c->next_sibling) n._root->prev_sibling_c->next_sibling = n._root->next_sibling;
+		else _root->first_child = n._root->next_sibling;
+        
+        destroy_node(n._root, get_allocator(_root));
+		touch_document(_root->header);
 
-		return result;
+		return true;
 	}
 
-	template <typename I> void reverse(I begin, I end)
+	html_node html_node::find_child_by_attribute(const char_t* name, const char_t* attr_name, const char_t* attr_value) const
 	{
-		while (begin + 1 < end) swap(*begin++, *--end);
+		if (!_root) return html_node();
+		
+		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+			if (i->name && strequal(name, i->name))
+			{
+				for (html_attribute_struct* a = i->first_attribute; a; a = a->next_attribute)
+					if (strequal(attr_name, a->name) && strequal(attr_value, a->value))
+						return html_node(i);
+			}
+
+		return html_node();
 	}
 
-	template <typename I> I unique(I begin, I end)
+	html_node html_node::find_child_by_attribute(const char_t* attr_name, const char_t* attr_value) const
 	{
-		// fast skip head
-		while (begin + 1 < end && *begin != *(begin + 1)) begin++;
+		if (!_root) return html_node();
+		
+		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+			for (html_attribute_struct* a = i->first_attribute; a; a = a->next_attribute)
+				if (strequal(attr_name, a->name) && strequal(attr_value, a->value))
+					return html_node(i);
 
-		if (begin == end) return begin;
+		return html_node();
+	}
 
-		// last written element
-		I write = begin++; 
+#ifndef PUGIHTML_NO_STL
+	string_t html_node::path(char_t delimiter) const
+	{
+		string_t path;
 
-		// merge unique elements
-		while (begin != end)
+		html_node cursor = *this; // Make a copy.
+		
+		path = cursor.name();
+
+		while (cursor.parent())
 		{
-			if (*begin != *write)
-				*++write = *begin++;
-			else
-				begin++;
+			cursor = cursor.parent();
+			
+			string_t temp = cursor.name();
+			temp += delimiter;
+			temp += path;
+			path.swap(temp);
 		}
 
-		// past-the-end (write points to live element)
-		return write + 1;
+		return path;
 	}
+#endif
 
-	template <typename I> void copy_backwards(I begin, I end, I target)
+	html_node html_node::first_element_by_path(const char_t* path, char_t delimiter) const
 	{
-		while (begin != end) *--target = *--end;
-	}
+		html_node found = *this; // Current search context.
 
-	template <typename I, typename Pred, typename T> void insertion_sort(I begin, I end, const Pred& pred, T*)
-	{
-		assert(begin != end);
+		if (!_root || !path || !path[0]) return found;
 
-		for (I it = begin + 1; it != end; ++it)
+		if (path[0] == delimiter)
 		{
-			T val = *it;
+			// Absolute path; e.g. '/foo/bar'
+			found = found.root();
+			++path;
+		}
 
-			if (pred(val, *begin))
-			{
-				// move to front
-				copy_backwards(begin, it, it + 1);
-				*begin = val;
-			}
-			else
-			{
-				I hole = it;
+		const char_t* path_segment = path;
 
-				// move hole backwards
-				while (pred(val, *(hole - 1)))
-				{
-					*hole = *(hole - 1);
-					hole--;
-				}
+		while (*path_segment == delimiter) ++path_segment;
 
-				// fill hole with element
-				*hole = val;
-			}
-		}
-	}
+		const char_t* path_segment_end = path_segment;
 
-	// std variant for elements with ==
-	template <typename I, typename Pred> void partition(I begin, I middle, I end, const Pred& pred, I* out_eqbeg, I* out_eqend)
-	{
-		I eqbeg = middle, eqend = middle + 1;
+		while (*path_segment_end && *path_segment_end != delimiter) ++path_segment_end;
 
-		// expand equal range
-		while (eqbeg != begin && *(eqbeg - 1) == *eqbeg) --eqbeg;
-		while (eqend != end && *eqend == *eqbeg) ++eqend;
+		if (path_segment == path_segment_end) return found;
 
-		// process outer elements
-		I ltend = eqbeg, gtbeg = eqend;
+		const char_t* next_segment = path_segment_end;
 
-		for (;;)
+		while (*next_segment == delimiter) ++next_segment;
+
+		if (*path_segment == '.' && path_segment + 1 == path_segment_end)
+			return found.first_element_by_path(next_segment, delimiter);
+		else if (*path_segment == '.' && *(path_segment+1) == '.' && path_segment + 2 == path_segment_end)
+			return found.parent().first_element_by_path(next_segment, delimiter);
+		else
 		{
-			// find the element from the right side that belongs to the left one
-			for (; gtbeg != end; ++gtbeg)
-				if (!pred(*eqbeg, *gtbeg))
+			for (html_node_struct* j = found._root->first_child; j; j = j->next_sibling)
+			{
+				if (j->name && strequalrange(j->name, path_segment, static_cast<size_t>(path_segment_end - path_segment)))
 				{
-					if (*gtbeg == *eqbeg) swap(*gtbeg, *eqend++);
-					else break;
-				}
+					html_node subsearch = html_node(j).first_element_by_path(next_segment, delimiter);
 
-			// find the element from the left side that belongs to the right one
-			for (; ltend != begin; --ltend)
-				if (!pred(*(ltend - 1), *eqbeg))
-				{
-					if (*eqbeg == *(ltend - 1)) swap(*(ltend - 1), *--eqbeg);
-					else break;
+					if (subsearch) return subsearch;
 				}
-
-			// scanned all elements
-			if (gtbeg == end && ltend == begin)
-			{
-				*out_eqbeg = eqbeg;
-				*out_eqend = eqend;
-				return;
 			}
 
-			// make room for elements by moving equal area
-			if (gtbeg == end)
-			{
-				if (--ltend != --eqbeg) swap(*ltend, *eqbeg);
-				swap(*eqbeg, *--eqend);
-			}
-			else if (ltend == begin)
-			{
-				if (eqend != gtbeg) swap(*eqbeg, *eqend);
-				++eqend;
-				swap(*gtbeg++, *eqbeg++);
-			}
-			else swap(*gtbeg++, *--ltend);
+			return html_node();
 		}
 	}
 
-	template <typename I, typename Pred> void median3(I first, I middle, I last, const Pred& pred)
+	bool html_node::traverse(html_tree_walker& walker)
 	{
-		if (pred(*middle, *first)) swap(*middle, *first);
-		if (pred(*last, *middle)) swap(*last, *middle);
-		if (pred(*middle, *first)) swap(*middle, *first);
-	}
+		walker._depth = -1;
+		
+		html_node arg_begin = *this;
+		if (!walker.begin(arg_begin)) return false;
 
-	template <typename I, typename Pred> void median(I first, I middle, I last, const Pred& pred)
-	{
-		if (last - first <= 40)
-		{
-			// median of three for small chunks
-			median3(first, middle, last, pred);
-		}
-		else
+		html_node cur = first_child();
+				
+		if (cur)
 		{
-			// median of nine
-			size_t step = (last - first + 1) / 8;
-
-			median3(first, first + step, first + 2 * step, pred);
-			median3(middle - step, middle, middle + step, pred);
-			median3(last - 2 * step, last - step, last, pred);
-			median3(first + step, middle, last - step, pred);
-		}
-	}
+			++walker._depth;
 
-	template <typename I, typename Pred> void sort(I begin, I end, const Pred& pred)
-	{
-		// sort large chunks
-		while (end - begin > 32)
-		{
-			// find median element
-			I middle = begin + (end - begin) / 2;
-			median(begin, middle, end - 1, pred);
-
-			// partition in three chunks (< = >)
-			I eqbeg, eqend;
-			partition(begin, middle, end, pred, &eqbeg, &eqend);
-
-			// loop on larger half
-			if (eqbeg - begin > end - eqend)
-			{
-				sort(eqend, end, pred);
-				end = eqbeg;
-			}
-			else
+			do 
 			{
-				sort(begin, eqbeg, pred);
-				begin = eqend;
+				html_node arg_for_each = cur;
+				if (!walker.for_each(arg_for_each))
+					return false;
+						
+				if (cur.first_child())
+				{
+					++walker._depth;
+					cur = cur.first_child();
+				}
+				else if (cur.next_sibling())
+					cur = cur.next_sibling();
+				else
+				{
+					// Borland C++ workaround
+					while (!cur.next_sibling() && cur != *this && (bool)cur.parent())
+					{
+						--walker._depth;
+						cur = cur.parent();
+					}
+						
+					if (cur != *this)
+						cur = cur.next_sibling();
+				}
 			}
+			while (cur && cur != *this);
 		}
 
-		// insertion sort small chunk
-		if (begin != end) insertion_sort(begin, end, pred, &*begin);
+		assert(walker._depth == -1);
+
+		html_node arg_end = *this;
+		return walker.end(arg_end);
 	}
-}
 
-// Allocator used for AST and evaluation stacks
-namespace
-{
-	struct xpath_memory_block
-	{	
-		xpath_memory_block* next;
+    size_t html_node::hash_value() const
+    {
+        return static_cast<size_t>(reinterpret_cast<uintptr_t>(_root) / sizeof(html_node_struct));
+    }
 
-		char data[4096];
-	};
-		
-	class xpath_allocator
+	html_node_struct* html_node::internal_object() const
 	{
-		xpath_memory_block* _root;
-		size_t _root_size;
-
-	public:
-	#ifdef PUGIHTML_NO_EXCEPTIONS
-		jmp_buf* error_handler;
-	#endif
-
-		xpath_allocator(xpath_memory_block* root, size_t root_size = 0): _root(root), _root_size(root_size)
-		{
-		#ifdef PUGIHTML_NO_EXCEPTIONS
-			error_handler = 0;
-		#endif
-		}
-		
-		void* allocate_nothrow(size_t size)
-		{
-			const size_t block_capacity = sizeof(_root->data);
-
-			// align size so that we're able to store pointers in subsequent blocks
-			size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
-
-			if (_root_size + size <= block_capacity)
-			{
-				void* buf = _root->data + _root_size;
-				_root_size += size;
-				return buf;
-			}
-			else
-			{
-				size_t block_data_size = (size > block_capacity) ? size : block_capacity;
-				size_t block_size = block_data_size + offsetof(xpath_memory_block, data);
-
-				xpath_memory_block* block = static_cast<xpath_memory_block*>(global_allocate(block_size));
-				if (!block) return 0;
-				
-				block->next = _root;
-				
-				_root = block;
-				_root_size = size;
-				
-				return block->data;
-			}
-		}
-
-		void* allocate(size_t size)
-		{
-			void* result = allocate_nothrow(size);
-
-			if (!result)
-			{
-			#ifdef PUGIHTML_NO_EXCEPTIONS
-				assert(error_handler);
-				longjmp(*error_handler, 1);
-			#else
-				throw std::bad_alloc();
-			#endif
-			}
-
-			return result;
-		}
-
-		void* reallocate(void* ptr, size_t old_size, size_t new_size)
-		{
-			// align size so that we're able to store pointers in subsequent blocks
-			old_size = (old_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
-			new_size = (new_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
-
-			// we can only reallocate the last object
-			assert(ptr == 0 || static_cast<char*>(ptr) + old_size == _root->data + _root_size);
-
-			// adjust root size so that we have not allocated the object at all
-			bool only_object = (_root_size == old_size);
-
-			if (ptr) _root_size -= old_size;
+        return _root;
+	}
 
-			// allocate a new version (this will obviously reuse the memory if possible)
-			void* result = allocate(new_size);
-			assert(result);
+	void html_node::print(html_writer& writer, const char_t* indent, unsigned int flags, html_encoding encoding, unsigned int depth) const
+	{
+		if (!_root) return;
 
-			// we have a new block
-			if (result != ptr && ptr)
-			{
-				// copy old data
-				assert(new_size > old_size);
-				memcpy(result, ptr, old_size);
+		html_buffered_writer buffered_writer(writer, encoding);
 
-				// free the previous page if it had no other objects
-				if (only_object)
-				{
-					assert(_root->data == result);
-					assert(_root->next);
+		node_output(buffered_writer, *this, indent, flags, depth);
+	}
 
-					xpath_memory_block* next = _root->next->next;
+#ifndef PUGIHTML_NO_STL
+	void html_node::print(std::basic_ostream<char, std::char_traits<char> >& stream, const char_t* indent, unsigned int flags, html_encoding encoding, unsigned int depth) const
+	{
+		html_writer_stream writer(stream);
 
-					if (next)
-					{
-						// deallocate the whole page, unless it was the first one
-						global_deallocate(_root->next);
-						_root->next = next;
-					}
-				}
-			}
+		print(writer, indent, flags, encoding, depth);
+	}
 
-			return result;
-		}
+	void html_node::print(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream, const char_t* indent, unsigned int flags, unsigned int depth) const
+	{
+		html_writer_stream writer(stream);
 
-		void revert(const xpath_allocator& state)
-		{
-			// free all new pages
-			xpath_memory_block* cur = _root;
+		print(writer, indent, flags, encoding_wchar, depth);
+	}
+#endif
 
-			while (cur != state._root)
-			{
-				xpath_memory_block* next = cur->next;
+	ptrdiff_t html_node::offset_debug() const
+	{
+		html_node_struct* r = root()._root;
 
-				global_deallocate(cur);
+		if (!r) return -1;
 
-				cur = next;
-			}
+		const char_t* buffer = static_cast<html_document_struct*>(r)->buffer;
 
-			// restore state
-			_root = state._root;
-			_root_size = state._root_size;
-		}
+		if (!buffer) return -1;
 
-		void release()
+		switch (type())
 		{
-			xpath_memory_block* cur = _root;
-			assert(cur);
+		case node_document:
+			return 0;
 
-			while (cur->next)
-			{
-				xpath_memory_block* next = cur->next;
+		case node_element:
+		case node_declaration:
+		case node_pi:
+			return (_root->header & html_memory_page_name_allocated_mask) ? -1 : _root->name - buffer;
 
-				global_deallocate(cur);
+		case node_pcdata:
+		case node_cdata:
+		case node_comment:
+		case node_doctype:
+			return (_root->header & html_memory_page_value_allocated_mask) ? -1 : _root->value - buffer;
 
-				cur = next;
-			}
+		default:
+			return -1;
 		}
-	};
+	}
 
-	struct xpath_allocator_capture
+#ifdef __BORLANDC__
+	bool operator&&(const html_node& lhs, bool rhs)
 	{
-		xpath_allocator_capture(xpath_allocator* alloc): _target(alloc), _state(*alloc)
-		{
-		}
+		return (bool)lhs && rhs;
+	}
 
-		~xpath_allocator_capture()
-		{
-			_target->revert(_state);
-		}
+	bool operator||(const html_node& lhs, bool rhs)
+	{
+		return (bool)lhs || rhs;
+	}
+#endif
 
-		xpath_allocator* _target;
-		xpath_allocator _state;
-	};
+	html_node_iterator::html_node_iterator()
+	{
+	}
 
-	struct xpath_stack
+	html_node_iterator::html_node_iterator(const html_node& node): _wrap(node), _parent(node.parent())
 	{
-		xpath_allocator* result;
-		xpath_allocator* temp;
-	};
+	}
 
-	struct xpath_stack_data
+	html_node_iterator::html_node_iterator(html_node_struct* ref, html_node_struct* parent): _wrap(ref), _parent(parent)
 	{
-		xpath_memory_block blocks[2];
-		xpath_allocator result;
-		xpath_allocator temp;
-		xpath_stack stack;
-
-	#ifdef PUGIHTML_NO_EXCEPTIONS
-		jmp_buf error_handler;
-	#endif
-
-		xpath_stack_data(): result(blocks + 0), temp(blocks + 1)
-		{
-			blocks[0].next = blocks[1].next = 0;
-
-			stack.result = &result;
-			stack.temp = &temp;
-
-		#ifdef PUGIHTML_NO_EXCEPTIONS
-			result.error_handler = temp.error_handler = &error_handler;
-		#endif
-		}
-
-		~xpath_stack_data()
-		{
-			result.release();
-			temp.release();
-		}
-	};
-}
+	}
 
-// String class
-namespace
-{
-	class xpath_string
+	bool html_node_iterator::operator==(const html_node_iterator& rhs) const
 	{
-		const char_t* _buffer;
-		bool _uses_heap;
+		return _wrap._root == rhs._wrap._root && _parent._root == rhs._parent._root;
+	}
+	
+	bool html_node_iterator::operator!=(const html_node_iterator& rhs) const
+	{
+		return _wrap._root != rhs._wrap._root || _parent._root != rhs._parent._root;
+	}
 
-		static char_t* duplicate_string(const char_t* string, size_t length, xpath_allocator* alloc)
-		{
-			char_t* result = static_cast<char_t*>(alloc->allocate((length + 1) * sizeof(char_t)));
-			assert(result);
+	html_node& html_node_iterator::operator*()
+	{
+		assert(_wrap._root);
+		return _wrap;
+	}
 
-			memcpy(result, string, length * sizeof(char_t));
-			result[length] = 0;
+	html_node* html_node_iterator::operator->()
+	{
+		assert(_wrap._root);
+		return &_wrap;
+	}
 
-			return result;
-		}
+	const html_node_iterator& html_node_iterator::operator++()
+	{
+		assert(_wrap._root);
+		_wrap._root = _wrap._root->next_sibling;
+		return *this;
+	}
 
-		static char_t* duplicate_string(const char_t* string, xpath_allocator* alloc)
-		{
-			return duplicate_string(string, strlength(string), alloc);
-		}
+	html_node_iterator html_node_iterator::operator++(int)
+	{
+		html_node_iterator temp = *this;
+		++*this;
+		return temp;
+	}
 
-	public:
-		xpath_string(): _buffer(PUGIHTML_TEXT("")), _uses_heap(false)
-		{
-		}
+	const html_node_iterator& html_node_iterator::operator--()
+	{
+		_wrap = _wrap._root ? _wrap.previous_sibling() : _parent.last_child();
+		return *this;
+	}
 
-		explicit xpath_string(const char_t* str, xpath_allocator* alloc)
-		{
-			bool empty = (*str == 0);
+	html_node_iterator html_node_iterator::operator--(int)
+	{
+		html_node_iterator temp = *this;
+		--*this;
+		return temp;
+	}
 
-			_buffer = empty ? PUGIHTML_TEXT("") : duplicate_string(str, alloc);
-			_uses_heap = !empty;
-		}
+	html_attribute_iterator::html_attribute_iterator()
+	{
+	}
 
-		explicit xpath_string(const char_t* str, bool use_heap): _buffer(str), _uses_heap(use_heap)
-		{
-		}
+	html_attribute_iterator::html_attribute_iterator(const html_attribute& attr, const html_node& parent): _wrap(attr), _parent(parent)
+	{
+	}
 
-		xpath_string(const char_t* begin, const char_t* end, xpath_allocator* alloc)
-		{
-			assert(begin <= end);
+	html_attribute_iterator::html_attribute_iterator(html_attribute_struct* ref, html_node_struct* parent): _wrap(ref), _parent(parent)
+	{
+	}
 
-			bool empty = (begin == end);
+	bool html_attribute_iterator::operator==(const html_attribute_iterator& rhs) const
+	{
+		return _wrap._attr == rhs._wrap._attr && _parent._root == rhs._parent._root;
+	}
+	
+	bool html_attribute_iterator::operator!=(const html_attribute_iterator& rhs) const
+	{
+		return _wrap._attr != rhs._wrap._attr || _parent._root != rhs._parent._root;
+	}
 
-			_buffer = empty ? PUGIHTML_TEXT("") : duplicate_string(begin, static_cast<size_t>(end - begin), alloc);
-			_uses_heap = !empty;
-		}
+	html_attribute& html_attribute_iterator::operator*()
+	{
+		assert(_wrap._attr);
+		return _wrap;
+	}
 
-		void append(const xpath_string& o, xpath_allocator* alloc)
-		{
-			// skip empty sources
-			if (!*o._buffer) return;
+	html_attribute* html_attribute_iterator::operator->()
+	{
+		assert(_wrap._attr);
+		return &_wrap;
+	}
 
-			// fast append for constant empty target and constant source
-			if (!*_buffer && !_uses_heap && !o._uses_heap)
-			{
-				_buffer = o._buffer;
-			}
-			else
-			{
-				// need to make heap copy
-				size_t target_length = strlength(_buffer);
-				size_t source_length = strlength(o._buffer);
-				size_t length = target_length + source_length;
+	const html_attribute_iterator& html_attribute_iterator::operator++()
+	{
+		assert(_wrap._attr);
+		_wrap._attr = _wrap._attr->next_attribute;
+		return *this;
+	}
 
-				// allocate new buffer
-				char_t* result = static_cast<char_t*>(alloc->reallocate(_uses_heap ? const_cast<char_t*>(_buffer) : 0, (target_length + 1) * sizeof(char_t), (length + 1) * sizeof(char_t)));
-				assert(result);
+	html_attribute_iterator html_attribute_iterator::operator++(int)
+	{
+		html_attribute_iterator temp = *this;
+		++*this;
+		return temp;
+	}
 
-				// append first string to the new buffer in case there was no reallocation
-				if (!_uses_heap) memcpy(result, _buffer, target_length * sizeof(char_t));
+	const html_attribute_iterator& html_attribute_iterator::operator--()
+	{
+		_wrap = _wrap._attr ? _wrap.previous_attribute() : _parent.last_attribute();
+		return *this;
+	}
 
-				// append second string to the new buffer
-				memcpy(result + target_length, o._buffer, source_length * sizeof(char_t));
-				result[length] = 0;
+	html_attribute_iterator html_attribute_iterator::operator--(int)
+	{
+		html_attribute_iterator temp = *this;
+		--*this;
+		return temp;
+	}
 
-				// finalize
-				_buffer = result;
-				_uses_heap = true;
-			}
-		}
+    html_parse_result::html_parse_result(): status(status_internal_error), offset(0), encoding(encoding_auto)
+    {
+    }
 
-		const char_t* c_str() const
-		{
-			return _buffer;
-		}
+    html_parse_result::operator bool() const
+    {
+        return status == status_ok;
+    }
 
-		size_t length() const
-		{
-			return strlength(_buffer);
-		}
-		
-		char_t* data(xpath_allocator* alloc)
+	const char* html_parse_result::description() const
+	{
+		switch (status)
 		{
-			// make private heap copy
-			if (!_uses_heap)
-			{
-				_buffer = duplicate_string(_buffer, alloc);
-				_uses_heap = true;
-			}
+		case status_ok: return "No error";
 
-			return const_cast<char_t*>(_buffer);
-		}
+		case status_file_not_found: return "File was not found";
+		case status_io_error: return "Error reading from file/stream";
+		case status_out_of_memory: return "Could not allocate memory";
+		case status_internal_error: return "Internal error occurred";
 
-		bool empty() const
-		{
-			return *_buffer == 0;
-		}
+		case status_unrecognized_tag: return "Could not determine tag type";
 
-		bool operator==(const xpath_string& o) const
-		{
-			return strequal(_buffer, o._buffer);
-		}
+		case status_bad_pi: return "Error parsing document declaration/processing instruction";
+		case status_bad_comment: return "Error parsing comment";
+		case status_bad_cdata: return "Error parsing CDATA section";
+		case status_bad_doctype: return "Error parsing document type declaration";
+		case status_bad_pcdata: return "Error parsing PCDATA section";
+		case status_bad_start_element: return "Error parsing start element tag";
+		case status_bad_attribute: return "Error parsing element attribute";
+		case status_bad_end_element: return "Error parsing end element tag";
+		case status_end_element_mismatch: return "Start-end tags mismatch";
 
-		bool operator!=(const xpath_string& o) const
-		{
-			return !strequal(_buffer, o._buffer);
-		}
+		case status_unsupported_query: return "Query can not be evaluated during parsing";
 
-		bool uses_heap() const
-		{
-			return _uses_heap;
+		default: return "Unknown error";
 		}
-	};
+	}
 
-	xpath_string xpath_string_const(const char_t* str)
+	html_document::html_document(): _buffer(0)
 	{
-		return xpath_string(str, false);
+		create();
 	}
-}
 
-namespace
-{
-	bool starts_with(const char_t* string, const char_t* pattern)
+	html_document::~html_document()
 	{
-		while (*pattern && *string == *pattern)
-		{
-			string++;
-			pattern++;
-		}
-
-		return *pattern == 0;
+		destroy();
 	}
 
-	const char_t* find_char(const char_t* s, char_t c)
+	void html_document::reset()
 	{
-	#ifdef PUGIHTML_WCHAR_MODE
-		return wcschr(s, c);
-	#else
-		return strchr(s, c);
-	#endif
+		destroy();
+		create();
 	}
 
-	const char_t* find_substring(const char_t* s, const char_t* p)
-	{
-	#ifdef PUGIHTML_WCHAR_MODE
-		// MSVC6 wcsstr bug workaround (if s is empty it always returns 0)
-		return (*p == 0) ? s : wcsstr(s, p);
-	#else
-		return strstr(s, p);
-	#endif
-	}
+    void html_document::reset(const html_document& proto)
+    {
+        reset();
 
-	// Converts symbol to lower case, if it is an ASCII one
-	char_t tolower_ascii(char_t ch)
+        for (html_node cur = proto.first_child(); cur; cur = cur.next_sibling())
+            append_copy(cur);
+    }
+
+	void html_document::create()
 	{
-		return static_cast<unsigned int>(ch - 'A') < 26 ? static_cast<char_t>(ch | ' ') : ch;
+		// initialize sentinel page
+		STATIC_ASSERT(offsetof(html_memory_page, data) + sizeof(html_document_struct) + html_memory_page_alignment <= sizeof(_memory));
+
+		// align upwards to page boundary
+		void* page_memory = reinterpret_cast<void*>((reinterpret_cast<uintptr_t>(_memory) + (html_memory_page_alignment - 1)) & ~(html_memory_page_alignment - 1));
+
+		// prepare page structure
+		html_memory_page* page = html_memory_page::construct(page_memory);
+
+		page->busy_size = html_memory_page_size;
+
+		// allocate new root
+		_root = new (page->data) html_document_struct(page);
+		_root->prev_sibling_c = _root;
+
+		// setup sentinel page
+		page->allocator = static_cast<html_document_struct*>(_root);
 	}
 
-	xpath_string string_value(const xpath_node& na, xpath_allocator* alloc)
+	void html_document::destroy()
 	{
-		if (na.attribute())
-			return xpath_string_const(na.attribute().value());
-		else
+		// destroy static storage
+		if (_buffer)
 		{
-			const html_node& n = na.node();
+			global_deallocate(_buffer);
+			_buffer = 0;
+		}
 
-			switch (n.type())
+		// destroy dynamic storage, leave sentinel page (it's in static memory)
+		if (_root)
+		{
+			html_document_struct* doc = static_cast<html_document_struct*>(_root);
+
+			if (doc->index)
 			{
-			case node_pcdata:
-			case node_cdata:
-			case node_comment:
-			case node_pi:
-				return xpath_string_const(n.value());
-			
-			case node_document:
-			case node_element:
+				index_destroy(doc->index);
+				doc->index = 0;
+			}
+
+			if (doc->text_index)
 			{
-				xpath_string result;
+				text_index_destroy(doc->text_index);
+				doc->text_index = 0;
+			}
 
-				html_node cur = n.first_child();
-				
-				while (cur && cur != n)
-				{
-					if (cur.type() == node_pcdata || cur.type() == node_cdata)
-						result.append(xpath_string_const(cur.value()), alloc);
+		#ifdef PUGIHTML_XPATH_THREADS
+			if (doc->order_checkpoints)
+			{
+				global_deallocate(doc->order_checkpoints);
+				doc->order_checkpoints = 0;
+			}
+		#endif
 
-					if (cur.first_child())
-						cur = cur.first_child();
-					else if (cur.next_sibling())
-						cur = cur.next_sibling();
-					else
-					{
-						while (!cur.next_sibling() && cur != n)
-							cur = cur.parent();
+			html_memory_page* root_page = reinterpret_cast<html_memory_page*>(_root->header & html_memory_page_pointer_mask);
+			assert(root_page && !root_page->prev && !root_page->memory);
 
-						if (cur != n) cur = cur.next_sibling();
-					}
-				}
-				
-				return result;
-			}
-			
-			default:
-				return xpath_string();
+			// destroy all pages
+			for (html_memory_page* page = root_page->next; page; )
+			{
+				html_memory_page* next = page->next;
+
+				html_allocator::deallocate_page(page);
+
+				page = next;
 			}
+
+			// cleanup root page
+			root_page->allocator = 0;
+			root_page->next = 0;
+			root_page->busy_size = root_page->freed_size = 0;
+
+			_root = 0;
 		}
 	}
-	
-	unsigned int node_height(html_node n)
+
+#ifndef PUGIHTML_NO_STL
+	html_parse_result html_document::load(std::basic_istream<char, std::char_traits<char> >& stream, unsigned int options, html_encoding encoding)
 	{
-	    unsigned int result = 0;
-	    
-	    while (n)
-	    {
-	        ++result;
-	        n = n.parent();
-	    }
-	    
-	    return result;
+		reset();
+
+		return load_stream_impl(*this, stream, options, encoding);
 	}
-	
-	bool node_is_before(html_node ln, unsigned int lh, html_node rn, unsigned int rh)
+
+	html_parse_result html_document::load(std::basic_istream<wchar_t, std::char_traits<wchar_t> >& stream, unsigned int options)
 	{
-		// normalize heights
-		for (unsigned int i = rh; i < lh; i++) ln = ln.parent();
-		for (unsigned int j = lh; j < rh; j++) rn = rn.parent();
-	    
-		// one node is the ancestor of the other
-	    if (ln == rn) return lh < rh;
-	    
-		// find common ancestor
-	    while (ln.parent() != rn.parent())
-	    {
-	        ln = ln.parent();
-	        rn = rn.parent();
-	    }
+		reset();
 
-		// there is no common ancestor (the shared parent is null), nodes are from different documents
-		if (!ln.parent()) return ln < rn;
+		return load_stream_impl(*this, stream, options, encoding_wchar);
+	}
+#endif
 
-		// determine sibling order
-        for (; ln; ln = ln.next_sibling())
-            if (ln == rn)
-                return true;
-                
-        return false;
-    }
+	html_parse_result html_document::load(const char_t* contents, unsigned int options)
+	{
+		// Force native encoding (skip autodetection)
+	#ifdef PUGIHTML_WCHAR_MODE
+		html_encoding encoding = encoding_wchar;
+	#else
+		html_encoding encoding = encoding_utf8;
+	#endif
 
-    bool node_is_ancestor(html_node parent, html_node node)
-    {
-    	while (node && node != parent) node = node.parent();
+		return load_buffer(contents, strlength(contents) * sizeof(char_t), options, encoding);
+	}
 
-    	return parent && node == parent;
-    }
+	html_parse_result html_document::load_file(const char* path, unsigned int options, html_encoding encoding)
+	{
+		reset();
 
-    const void* document_order(const xpath_node& xnode)
-    {
-        html_node_struct* node = xnode.node().internal_object();
+		FILE* file = fopen(path, "rb");
 
-        if (node)
-        {
-            if (node->name && (node->header & html_memory_page_name_allocated_mask) == 0) return node->name;
-            if (node->value && (node->header & html_memory_page_value_allocated_mask) == 0) return node->value;
-            return 0;
-        }
+		return load_file_impl(*this, file, options, encoding);
+	}
 
-        html_attribute_struct* attr = xnode.attribute().internal_object();
+	html_parse_result html_document::load_file(const wchar_t* path, unsigned int options, html_encoding encoding)
+	{
+		reset();
 
-        if (attr)
-        {
-            if ((attr->header & html_memory_page_name_allocated_mask) == 0) return attr->name;
-            if ((attr->header & html_memory_page_value_allocated_mask) == 0) return attr->value;
-            return 0;
-        }
+		FILE* file = open_file_wide(path, L"rb");
 
-		return 0;
-    }
-    
-	struct document_order_comparator
+		return load_file_impl(*this, file, options, encoding);
+	}
+
+	html_parse_result html_document::load_buffer_impl(void* contents, size_t size, unsigned int options, html_encoding encoding, bool is_mutable, bool own, html_parse_listener* listener)
 	{
-		bool operator()(const xpath_node& lhs, const xpath_node& rhs) const
-		{
-			// optimized document order based check
-			const void* lo = document_order(lhs);
-			const void* ro = document_order(rhs);
+		reset();
 
-			if (lo && ro) return lo < ro;
+		// check input buffer
+		assert(contents || size == 0);
 
-            // slow comparison
-			html_node ln = lhs.node(), rn = rhs.node();
+		// get actual encoding
+		html_encoding buffer_encoding = get_buffer_encoding(encoding, contents, size);
 
-			// compare attributes
-			if (lhs.attribute() && rhs.attribute())
-			{
-				// shared parent
-				if (lhs.parent() == rhs.parent())
-				{
-					// determine sibling order
-				    for (html_attribute a = lhs.attribute(); a; a = a.next_attribute())
-				        if (a == rhs.attribute())
-				            return true;
-				    
-				    return false;
-				}
-				
-				// compare attribute parents
-				ln = lhs.parent();
-				rn = rhs.parent();
-			}
-			else if (lhs.attribute())
-			{
-				// attributes go after the parent element
-				if (lhs.parent() == rhs.node()) return false;
-				
-				ln = lhs.parent();
-			}
-			else if (rhs.attribute())
-			{
-				// attributes go after the parent element
-				if (rhs.parent() == lhs.node()) return true;
-				
-				rn = rhs.parent();
-			}
+		// get private buffer
+		char_t* buffer = 0;
+		size_t length = 0;
 
-			if (ln == rn) return false;
-			
-			unsigned int lh = node_height(ln);
-			unsigned int rh = node_height(rn);
-			
-			return node_is_before(ln, lh, rn, rh);
-		}
-	};
+		if (!convert_buffer(buffer, length, buffer_encoding, contents, size, is_mutable)) return make_parse_result(status_out_of_memory);
+		
+		// delete original buffer if we performed a conversion
+		if (own && buffer != contents && contents) global_deallocate(contents);
 
-	struct duplicate_comparator
-	{
-		bool operator()(const xpath_node& lhs, const xpath_node& rhs) const
-		{
-			if (lhs.attribute()) return rhs.attribute() ? lhs.attribute() < rhs.attribute() : true;
-			else return rhs.attribute() ? false : lhs.node() < rhs.node();
-		}
-	};
-	
-	double gen_nan()
-	{
-	#if defined(__STDC_IEC_559__) || ((FLT_RADIX - 0 == 2) && (FLT_MAX_EXP - 0 == 128) && (FLT_MANT_DIG - 0 == 24))
-		union { float f; int32_t i; } u[sizeof(float) == sizeof(int32_t) ? 1 : -1];
-		u[0].i = 0x7fc00000;
-		return u[0].f;
-	#else
-		// fallback
-		const volatile double zero = 0.0;
-		return zero / zero;
-	#endif
-	}
-	
-	bool is_nan(double value)
-	{
-	#if defined(_MSC_VER) || defined(__BORLANDC__)
-		return !!_isnan(value);
-	#elif defined(fpclassify) && defined(FP_NAN)
-		return fpclassify(value) == FP_NAN;
-	#else
-		// fallback
-		const volatile double v = value;
-		return v != v;
-	#endif
-	}
-	
-	const char_t* convert_number_to_string_special(double value)
-	{
-	#if defined(_MSC_VER) || defined(__BORLANDC__)
-		if (_finite(value)) return (value == 0) ? PUGIHTML_TEXT("0") : 0;
-		if (_isnan(value)) return PUGIHTML_TEXT("NaN");
-		return PUGIHTML_TEXT("-Infinity") + (value > 0);
-	#elif defined(fpclassify) && defined(FP_NAN) && defined(FP_INFINITE) && defined(FP_ZERO)
-		switch (fpclassify(value))
-		{
-		case FP_NAN:
-			return PUGIHTML_TEXT("NaN");
+		// parse
+		html_parse_result res = html_parser::parse(buffer, length, _root, options, listener);
 
-		case FP_INFINITE:
-			return PUGIHTML_TEXT("-Infinity") + (value > 0);
+		// number the nodes so that document order queries on an unmodified tree do not need to write to it
+		order_document(*static_cast<html_document_struct*>(_root));
 
-		case FP_ZERO:
-			return PUGIHTML_TEXT("0");
+		// remember encoding
+		res.encoding = buffer_encoding;
 
-		default:
-			return 0;
-		}
-	#else
-		// fallback
-		const volatile double v = value;
+		// grab onto buffer if it's our buffer, user is responsible for deallocating contens himself
+		if (own || buffer != contents) _buffer = buffer;
 
-		if (v == 0) return PUGIHTML_TEXT("0");
-		if (v != v) return PUGIHTML_TEXT("NaN");
-		if (v * 2 == v) return PUGIHTML_TEXT("-Infinity") + (value > 0);
-		return 0;
-	#endif
-	}
-	
-	bool convert_number_to_boolean(double value)
-	{
-		return (value != 0 && !is_nan(value));
+		return res;
 	}
-	
-	void truncate_zeros(char* begin, char* end)
-	{
-		while (begin != end && end[-1] == '0') end--;
 
-		*end = 0;
+	html_parse_result html_document::load_buffer(const void* contents, size_t size, unsigned int options, html_encoding encoding)
+	{
+		return load_buffer_impl(const_cast<void*>(contents), size, options, encoding, false, false);
 	}
 
-	// gets mantissa digits in the form of 0.xxxxx with 0. implied and the exponent
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-	void convert_number_to_mantissa_exponent(double value, char* buffer, size_t buffer_size, char** out_mantissa, int* out_exponent)
+	html_parse_result html_document::load_buffer_inplace(void* contents, size_t size, unsigned int options, html_encoding encoding)
 	{
-		// get base values
-		int sign, exponent;
-		_ecvt_s(buffer, buffer_size, value, DBL_DIG + 1, &exponent, &sign);
-
-		// truncate redundant zeros
-		truncate_zeros(buffer, buffer + strlen(buffer));
-
-		// fill results
-		*out_mantissa = buffer;
-		*out_exponent = exponent;
+		return load_buffer_impl(contents, size, options, encoding, true, false);
 	}
-#else
-	void convert_number_to_mantissa_exponent(double value, char* buffer, size_t buffer_size, char** out_mantissa, int* out_exponent)
+		
+	html_parse_result html_document::load_buffer_inplace_own(void* contents, size_t size, unsigned int options, html_encoding encoding)
 	{
-		// get a scientific notation value with IEEE DBL_DIG decimals
-		sprintf(buffer, "%.*e", DBL_DIG, value);
-		assert(strlen(buffer) < buffer_size);
-		(void)!buffer_size;
-
-		// get the exponent (possibly negative)
-		char* exponent_string = strchr(buffer, 'e');
-		assert(exponent_string);
-
-		int exponent = atoi(exponent_string + 1);
+		return load_buffer_impl(contents, size, options, encoding, true, true);
+	}
 
-		// extract mantissa string: skip sign
-		char* mantissa = buffer[0] == '-' ? buffer + 1 : buffer;
-		assert(mantissa[0] != '0' && mantissa[1] == '.');
+	void html_document::save(html_writer& writer, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	{
+		if (flags & format_write_bom) write_bom(writer, get_write_encoding(encoding));
 
-		// divide mantissa by 10 to eliminate integer part
-		mantissa[1] = mantissa[0];
-		mantissa++;
-		exponent++;
+		html_buffered_writer buffered_writer(writer, encoding);
 
-		// remove extra mantissa digits and zero-terminate mantissa
-		truncate_zeros(mantissa, exponent_string);
+		if (!(flags & format_no_declaration) && !has_declaration(*this))
+		{
+			buffered_writer.write(PUGIHTML_TEXT("<?html version=\"1.0\"?>"));
+			if (!(flags & format_raw)) buffered_writer.write('\n');
+		}
 
-		// fill results
-		*out_mantissa = mantissa;
-		*out_exponent = exponent;
+		node_output(buffered_writer, *this, indent, flags, 0);
 	}
-#endif
 
-	xpath_string convert_number_to_string(double value, xpath_allocator* alloc)
+#ifndef PUGIHTML_NO_STL
+	void html_document::save(std::basic_ostream<char, std::char_traits<char> >& stream, const char_t* indent, unsigned int flags, html_encoding encoding) const
 	{
-		// try special number conversion
-		const char_t* special = convert_number_to_string_special(value);
-		if (special) return xpath_string_const(special);
-
-		// get mantissa + exponent form
-		char mantissa_buffer[64];
-
-		char* mantissa;
-		int exponent;
-		convert_number_to_mantissa_exponent(value, mantissa_buffer, sizeof(mantissa_buffer), &mantissa, &exponent);
-
-		// make the number!
-		char_t result[512];
-		char_t* s = result;
+		html_writer_stream writer(stream);
 
-		// sign
-		if (value < 0) *s++ = '-';
+		save(writer, indent, flags, encoding);
+	}
 
-		// integer part
-		if (exponent <= 0)
-		{
-			*s++ = '0';
-		}
-		else
-		{
-			while (exponent > 0)
-			{
-				assert(*mantissa == 0 || (unsigned)(*mantissa - '0') <= 9);
-				*s++ = *mantissa ? *mantissa++ : '0';
-				exponent--;
-			}
-		}
+	void html_document::save(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream, const char_t* indent, unsigned int flags) const
+	{
+		html_writer_stream writer(stream);
 
-		// fractional part
-		if (*mantissa)
-		{
-			// decimal point
-			*s++ = '.';
+		save(writer, indent, flags, encoding_wchar);
+	}
+#endif
 
-			// extra zeroes from negative exponent
-			while (exponent < 0)
-			{
-				*s++ = '0';
-				exponent++;
-			}
+	bool html_document::save_file(const char* path, const char_t* indent, unsigned int flags, html_encoding encoding) const
+	{
+		FILE* file = fopen(path, "wb");
+		if (!file) return false;
 
-			// extra mantissa digits
-			while (*mantissa)
-			{
-				assert((unsigned)(*mantissa - '0') <= 9);
-				*s++ = *mantissa++;
-			}
-		}
+		html_writer_file writer(file);
+		save(writer, indent, flags, encoding);
 
-		// zero-terminate
-		assert(s < result + sizeof(result) / sizeof(result[0]));
-		*s = 0;
+		fclose(file);
 
-		return xpath_string(result, alloc);
+		return true;
 	}
-	
-	bool check_string_to_number_format(const char_t* string)
+
+	bool html_document::save_file(const wchar_t* path, const char_t* indent, unsigned int flags, html_encoding encoding) const
 	{
-		// parse leading whitespace
-		while (IS_CHARTYPE(*string, ct_space)) ++string;
+		FILE* file = open_file_wide(path, L"wb");
+		if (!file) return false;
 
-		// parse sign
-		if (*string == '-') ++string;
+		html_writer_file writer(file);
+		save(writer, indent, flags, encoding);
 
-		if (!*string) return false;
+		fclose(file);
 
-		// if there is no integer part, there should be a decimal part with at least one digit
-		if (!IS_CHARTYPEX(string[0], ctx_digit) && (string[0] != '.' || !IS_CHARTYPEX(string[1], ctx_digit))) return false;
+		return true;
+	}
 
-		// parse integer part
-		while (IS_CHARTYPEX(*string, ctx_digit)) ++string;
+    html_node html_document::document_element() const
+    {
+		for (html_node_struct* i = _root->first_child; i; i = i->next_sibling)
+			if ((i->header & html_memory_page_type_mask) + 1 == node_element)
+                return html_node(i);
 
-		// parse decimal part
-		if (*string == '.')
-		{
-			++string;
+        return html_node();
+    }
 
-			while (IS_CHARTYPEX(*string, ctx_digit)) ++string;
-		}
+	bool html_document::index_attribute(const char_t* name)
+	{
+		html_document_struct* doc = static_cast<html_document_struct*>(_root);
 
-		// parse trailing whitespace
-		while (IS_CHARTYPE(*string, ct_space)) ++string;
+		if (!doc->index && (doc->index = index_create()) == 0) return false;
 
-		return *string == 0;
+		return index_declare(doc->index, name);
 	}
 
-	double convert_string_to_number(const char_t* string)
+	bool html_document::build_index()
 	{
-		// check string format
-		if (!check_string_to_number_format(string)) return gen_nan();
-
-		// parse string
-	#ifdef PUGIHTML_WCHAR_MODE
-		return wcstod(string, 0);
-	#else
-		return atof(string);
-	#endif
+		return index_get(*static_cast<html_document_struct*>(_root)) != 0;
 	}
 
-	bool convert_string_to_number(const char_t* begin, const char_t* end, double* out_result)
+	bool html_document::build_text_index()
 	{
-		char_t buffer[32];
-
-		size_t length = static_cast<size_t>(end - begin);
-		char_t* scratch = buffer;
+		return text_index_get(*static_cast<html_document_struct*>(_root)) != 0;
+	}
 
-		if (length >= sizeof(buffer) / sizeof(buffer[0]))
-		{
-			// need to make dummy on-heap copy
-			scratch = static_cast<char_t*>(global_allocate((length + 1) * sizeof(char_t)));
-			if (!scratch) return false;
-		}
+	void html_document::update_order()
+	{
+		update_document_order(_root);
+	}
 
-		// copy string to zero-terminated buffer and perform conversion
-		memcpy(scratch, begin, length * sizeof(char_t));
-		scratch[length] = 0;
+#ifndef PUGIHTML_NO_STL
+	std::string PUGIHTML_FUNCTION as_utf8(const wchar_t* str)
+	{
+		assert(str);
 
-		*out_result = convert_string_to_number(scratch);
+        return as_utf8_impl(str, wcslen(str));
+	}
 
-		// free dummy buffer
-		if (scratch != buffer) global_deallocate(scratch);
+	std::string PUGIHTML_FUNCTION as_utf8(const std::wstring& str)
+	{
+        return as_utf8_impl(str.c_str(), str.size());
+	}
+	
+	std::wstring PUGIHTML_FUNCTION as_wide(const char* str)
+	{
+		assert(str);
 
-		return true;
+        return as_wide_impl(str, strlen(str));
 	}
 	
-	double round_nearest(double value)
+	std::wstring PUGIHTML_FUNCTION as_wide(const std::string& str)
 	{
-		return floor(value + 0.5);
+        return as_wide_impl(str.c_str(), str.size());
 	}
+#endif
 
-	double round_nearest_nzero(double value)
+    void PUGIHTML_FUNCTION set_memory_management_functions(allocation_function allocate, deallocation_function deallocate)
+    {
+    	global_allocate = allocate;
+    	global_deallocate = deallocate;
+    }
+
+    allocation_function PUGIHTML_FUNCTION get_memory_allocation_function()
+    {
+    	return global_allocate;
+    }
+
+    deallocation_function PUGIHTML_FUNCTION get_memory_deallocation_function()
+    {
+    	return global_deallocate;
+    }
+}
+
+#if !defined(PUGIHTML_NO_STL) && (defined(_MSC_VER) || defined(__ICC))
+namespace std
+{
+	// Workarounds for (non-standard) iterator category detection for older versions (MSVC7/IC8 and earlier)
+	std::bidirectional_iterator_tag _Iter_cat(const html_node_iterator&)
 	{
-		// same as round_nearest, but returns -0 for [-0.5, -0]
-		// ceil is used to differentiate between +0 and -0 (we return -0 for [-0.5, -0] and +0 for +0)
-		return (value >= -0.5 && value <= 0) ? ceil(value) : floor(value + 0.5);
+		return std::bidirectional_iterator_tag();
 	}
-	
-	const char_t* qualified_name(const xpath_node& node)
+
+	std::bidirectional_iterator_tag _Iter_cat(const html_attribute_iterator&)
 	{
-		return node.attribute() ? node.attribute().name() : node.node().name();
+		return std::bidirectional_iterator_tag();
 	}
-	
-	const char_t* local_name(const xpath_node& node)
+}
+#endif
+
+#if !defined(PUGIHTML_NO_STL) && defined(__SUNPRO_CC)
+namespace std
+{
+	// Workarounds for (non-standard) iterator category detection
+	std::bidirectional_iterator_tag __iterator_category(const html_node_iterator&)
 	{
-		const char_t* name = qualified_name(node);
-		const char_t* p = find_char(name, ':');
-		
-		return p ? p + 1 : name;
+		return std::bidirectional_iterator_tag();
 	}
 
-	struct namespace_uri_predicate
+	std::bidirectional_iterator_tag __iterator_category(const html_attribute_iterator&)
 	{
-		const char_t* prefix;
-		size_t prefix_length;
+		return std::bidirectional_iterator_tag();
+	}
+}
+#endif
 
-		namespace_uri_predicate(const char_t* name)
-		{
-			const char_t* pos = find_char(name, ':');
+#ifndef PUGIHTML_NO_XPATH
 
-			prefix = pos ? name : 0;
-			prefix_length = pos ? static_cast<size_t>(pos - name) : 0;
+// STL replacements
+namespace
+{
+	struct equal_to
+	{
+		template <typename T> bool operator()(const T& lhs, const T& rhs) const
+		{
+			return lhs == rhs;
 		}
+	};
 
-		bool operator()(const html_attribute& a) const
+	struct not_equal_to
+	{
+		template <typename T> bool operator()(const T& lhs, const T& rhs) const
 		{
-			const char_t* name = a.name();
-
-			if (!starts_with(name, PUGIHTML_TEXT("htmlns"))) return false;
-
-			return prefix ? name[5] == ':' && strequalrange(name + 6, prefix, prefix_length) : name[5] == 0;
+			return lhs != rhs;
 		}
 	};
 
-	const char_t* namespace_uri(const html_node& node)
+	struct less
 	{
-		namespace_uri_predicate pred = node.name();
-		
-		html_node p = node;
-		
-		while (p)
+		template <typename T> bool operator()(const T& lhs, const T& rhs) const
 		{
-			html_attribute a = p.find_attribute(pred);
-			
-			if (a) return a.value();
-			
-			p = p.parent();
+			return lhs < rhs;
 		}
-		
-		return PUGIHTML_TEXT("");
-	}
+	};
 
-	const char_t* namespace_uri(const html_attribute& attr, const html_node& parent)
+	struct less_equal
 	{
-		namespace_uri_predicate pred = attr.name();
-		
-		// Default namespace does not apply to attributes
-		if (!pred.prefix) return PUGIHTML_TEXT("");
-		
-		html_node p = parent;
-		
-		while (p)
+		template <typename T> bool operator()(const T& lhs, const T& rhs) const
 		{
-			html_attribute a = p.find_attribute(pred);
-			
-			if (a) return a.value();
-			
-			p = p.parent();
+			return lhs <= rhs;
 		}
-		
-		return PUGIHTML_TEXT("");
-	}
+	};
 
-	const char_t* namespace_uri(const xpath_node& node)
+	template <typename T> void swap(T& lhs, T& rhs)
 	{
-		return node.attribute() ? namespace_uri(node.attribute(), node.parent()) : namespace_uri(node.node());
+		T temp = lhs;
+		lhs = rhs;
+		rhs = temp;
 	}
 
-	void normalize_space(char_t* buffer)
+	template <typename I, typename Pred> I min_element(I begin, I end, const Pred& pred)
 	{
-		char_t* write = buffer;
-
-		for (char_t* it = buffer; *it; )
-		{
-			char_t ch = *it++;
-
-			if (IS_CHARTYPE(ch, ct_space))
-			{
-				// replace whitespace sequence with single space
-				while (IS_CHARTYPE(*it, ct_space)) it++;
-
-				// avoid leading spaces
-				if (write != buffer) *write++ = ' ';
-			}
-			else *write++ = ch;
-		}
+		I result = begin;
 
-		// remove trailing space
-		if (write != buffer && IS_CHARTYPE(write[-1], ct_space)) write--;
+		for (I it = begin + 1; it != end; ++it)
+			if (pred(*it, *result))
+				result = it;
 
-		// zero-terminate
-		*write = 0;
+		return result;
 	}
 
-	void translate(char_t* buffer, const char_t* from, const char_t* to)
+	template <typename I> void reverse(I begin, I end)
 	{
-		size_t to_length = strlength(to);
+		while (begin + 1 < end) swap(*begin++, *--end);
+	}
 
-		char_t* write = buffer;
+	template <typename I> I unique(I begin, I end)
+	{
+		// fast skip head
+		while (begin + 1 < end && *begin != *(begin + 1)) begin++;
 
-		while (*buffer)
-		{
-			DMC_VOLATILE char_t ch = *buffer++;
+		if (begin == end) return begin;
 
-			const char_t* pos = find_char(from, ch);
+		// last written element
+		I write = begin++; 
 
-			if (!pos)
-				*write++ = ch; // do not process
-			else if (static_cast<size_t>(pos - from) < to_length)
-				*write++ = to[pos - from]; // replace
+		// merge unique elements
+		while (begin != end)
+		{
+			if (*begin != *write)
+				*++write = *begin++;
+			else
+				begin++;
 		}
 
-		// zero-terminate
-		*write = 0;
+		// past-the-end (write points to live element)
+		return write + 1;
 	}
 
-	struct xpath_variable_boolean: xpath_variable
+	template <typename I> void copy_backwards(I begin, I end, I target)
 	{
-		xpath_variable_boolean(): value(false)
-		{
-		}
-
-		bool value;
-		char_t name[1];
-	};
+		while (begin != end) *--target = *--end;
+	}
 
-	struct xpath_variable_number: xpath_variable
+	template <typename I, typename Pred, typename T> void insertion_sort(I begin, I end, const Pred& pred, T*)
 	{
-		xpath_variable_number(): value(0)
+		assert(begin != end);
+
+		for (I it = begin + 1; it != end; ++it)
 		{
-		}
+			T val = *it;
 
-		double value;
-		char_t name[1];
-	};
+			if (pred(val, *begin))
+			{
+				// move to front
+				copy_backwards(begin, it, it + 1);
+				*begin = val;
+			}
+			else
+			{
+				I hole = it;
 
-	struct xpath_variable_string: xpath_variable
-	{
-		xpath_variable_string(): value(0)
-		{
-		}
+				// move hole backwards
+				while (pred(val, *(hole - 1)))
+				{
+					*hole = *(hole - 1);
+					hole--;
+				}
 
-		~xpath_variable_string()
-		{
-			if (value) global_deallocate(value);
+				// fill hole with element
+				*hole = val;
+			}
 		}
+	}
 
-		char_t* value;
-		char_t name[1];
-	};
-
-	struct xpath_variable_node_set: xpath_variable
+	// std variant for elements with ==
+	template <typename I, typename Pred> void partition(I begin, I middle, I end, const Pred& pred, I* out_eqbeg, I* out_eqend)
 	{
-		xpath_node_set value;
-		char_t name[1];
-	};
+		I eqbeg = middle, eqend = middle + 1;
 
-	const xpath_node_set dummy_node_set;
+		// expand equal range
+		while (eqbeg != begin && *(eqbeg - 1) == *eqbeg) --eqbeg;
+		while (eqend != end && *eqend == *eqbeg) ++eqend;
 
-	unsigned int hash_string(const char_t* str)
-	{
-		// Jenkins one-at-a-time hash (http://en.wikipedia.org/wiki/Jenkins_hash_function#one-at-a-time)
-		unsigned int result = 0;
+		// process outer elements
+		I ltend = eqbeg, gtbeg = eqend;
 
-		while (*str)
+		for (;;)
 		{
-			result += static_cast<unsigned int>(*str++);
-			result += result << 10;
-			result ^= result >> 6;
-		}
-	
-		result += result << 3;
-		result ^= result >> 11;
-		result += result << 15;
-	
-		return result;
-	}
-
-	template <typename T> T* new_xpath_variable(const char_t* name)
-	{
-		size_t length = strlength(name);
-		if (length == 0) return 0; // empty variable names are invalid
-
-		// $$ we can't use offsetof(T, name) because T is non-POD, so we just allocate additional length characters
-		void* memory = global_allocate(sizeof(T) + length * sizeof(char_t));
-		if (!memory) return 0;
-
-		T* result = new (memory) T();
-
-		memcpy(result->name, name, (length + 1) * sizeof(char_t));
-
-		return result;
-	}
-
-	xpath_variable* new_xpath_variable(xpath_value_type type, const char_t* name)
-	{
-		switch (type)
-		{
-		case xpath_type_node_set:
-			return new_xpath_variable<xpath_variable_node_set>(name);
-
-		case xpath_type_number:
-			return new_xpath_variable<xpath_variable_number>(name);
+			// find the element from the right side that belongs to the left one
+			for (; gtbeg != end; ++gtbeg)
+				if (!pred(*eqbeg, *gtbeg))
+				{
+					if (*gtbeg == *eqbeg) swap(*gtbeg, *eqend++);
+					else break;
+				}
 
-		case xpath_type_string:
-			return new_xpath_variable<xpath_variable_string>(name);
+			// find the element from the left side that belongs to the right one
+			for (; ltend != begin; --ltend)
+				if (!pred(*(ltend - 1), *eqbeg))
+				{
+					if (*eqbeg == *(ltend - 1)) swap(*(ltend - 1), *--eqbeg);
+					else break;
+				}
 
-		case xpath_type_boolean:
-			return new_xpath_variable<xpath_variable_boolean>(name);
+			// scanned all elements
+			if (gtbeg == end && ltend == begin)
+			{
+				*out_eqbeg = eqbeg;
+				*out_eqend = eqend;
+				return;
+			}
 
-		default:
-			return 0;
+			// make room for elements by moving equal area
+			if (gtbeg == end)
+			{
+				if (--ltend != --eqbeg) swap(*ltend, *eqbeg);
+				swap(*eqbeg, *--eqend);
+			}
+			else if (ltend == begin)
+			{
+				if (eqend != gtbeg) swap(*eqbeg, *eqend);
+				++eqend;
+				swap(*gtbeg++, *eqbeg++);
+			}
+			else swap(*gtbeg++, *--ltend);
 		}
 	}
 
-	template <typename T> void delete_xpath_variable(T* var)
+	template <typename I, typename Pred> void median3(I first, I middle, I last, const Pred& pred)
 	{
-		var->~T();
-		global_deallocate(var);
+		if (pred(*middle, *first)) swap(*middle, *first);
+		if (pred(*last, *middle)) swap(*last, *middle);
+		if (pred(*middle, *first)) swap(*middle, *first);
 	}
 
-	void delete_xpath_variable(xpath_value_type type, xpath_variable* var)
+	template <typename I, typename Pred> void median(I first, I middle, I last, const Pred& pred)
 	{
-		switch (type)
+		if (last - first <= 40)
 		{
-		case xpath_type_node_set:
-			delete_xpath_variable(static_cast<xpath_variable_node_set*>(var));
-			break;
-
-		case xpath_type_number:
-			delete_xpath_variable(static_cast<xpath_variable_number*>(var));
-			break;
-
-		case xpath_type_string:
-			delete_xpath_variable(static_cast<xpath_variable_string*>(var));
-			break;
-
-		case xpath_type_boolean:
-			delete_xpath_variable(static_cast<xpath_variable_boolean*>(var));
-			break;
+			// median of three for small chunks
+			median3(first, middle, last, pred);
+		}
+		else
+		{
+			// median of nine
+			size_t step = (last - first + 1) / 8;
 
-		default:
-			assert(!"Invalid variable type");
+			median3(first, first + step, first + 2 * step, pred);
+			median3(middle - step, middle, middle + step, pred);
+			median3(last - 2 * step, last - step, last, pred);
+			median3(first + step, middle, last - step, pred);
 		}
 	}
 
-	xpath_variable* get_variable(xpath_variable_set* set, const char_t* begin, const char_t* end)
+	template <typename I, typename Pred> void sort(I begin, I end, const Pred& pred)
 	{
-		char_t buffer[32];
+		// sort large chunks
+		while (end - begin > 32)
+		{
+			// find median element
+			I middle = begin + (end - begin) / 2;
+			median(begin, middle, end - 1, pred);
 
-		size_t length = static_cast<size_t>(end - begin);
-		char_t* scratch = buffer;
+			// partition in three chunks (< = >)
+			I eqbeg, eqend;
+			partition(begin, middle, end, pred, &eqbeg, &eqend);
 
-		if (length >= sizeof(buffer) / sizeof(buffer[0]))
-		{
-			// need to make dummy on-heap copy
-			scratch = static_cast<char_t*>(global_allocate((length + 1) * sizeof(char_t)));
-			if (!scratch) return 0;
+			// loop on larger half
+			if (eqbeg - begin > end - eqend)
+			{
+				sort(eqend, end, pred);
+				end = eqbeg;
+			}
+			else
+			{
+				sort(begin, eqbeg, pred);
+				begin = eqend;
+			}
 		}
 
-		// copy string to zero-terminated buffer and perform lookup
-		memcpy(scratch, begin, length * sizeof(char_t));
-		scratch[length] = 0;
-
-		xpath_variable* result = set->get(scratch);
+		// insertion sort small chunk
+		if (begin != end) insertion_sort(begin, end, pred, &*begin);
+	}
 
-		// free dummy buffer
-		if (scratch != buffer) global_deallocate(scratch);
+	struct xpath_memory_block
+	{	
+		xpath_memory_block* next;
 
-		return result;
-	}
+		char data[4096];
+	};
 }
 
-// Internal node set class
-namespace
+// Memory retained between evaluations and resource limits of xpath_eval_context
+namespace pugihtml
 {
-	xpath_node_set::type_t xpath_sort(xpath_node* begin, xpath_node* end, xpath_node_set::type_t type, bool rev)
-	{
-		xpath_node_set::type_t order = rev ? xpath_node_set::type_sorted_reverse : xpath_node_set::type_sorted;
-
-		if (type == xpath_node_set::type_unsorted)
-		{
-			sort(begin, end, document_order_comparator());
-
-			type = xpath_node_set::type_sorted;
-		}
-		
-		if (type != order) reverse(begin, end);
-			
-		return order;
-	}
+	// number of node visits between checks of the cancellation flag (power of two)
+	const size_t xpath_cancel_interval = 256;
 
-	xpath_node xpath_first(const xpath_node* begin, const xpath_node* end, xpath_node_set::type_t type)
+	struct xpath_block_cache
 	{
-		if (begin == end) return xpath_node();
-
-		switch (type)
+		// blocks are prefixed with their size; retained blocks are linked through the header
+		struct header
 		{
-		case xpath_node_set::type_sorted:
-			return *begin;
-
-		case xpath_node_set::type_sorted_reverse:
-			return *(end - 1);
-
-		case xpath_node_set::type_unsorted:
-			return *min_element(begin, end, document_order_comparator());
+			header* next;
+			size_t size;
+		};
 
-		default:
-			assert(!"Invalid node set type");
-			return xpath_node();
-		}
-	}
-	class xpath_node_set_raw
-	{
-		xpath_node_set::type_t _type;
-
-		xpath_node* _begin;
-		xpath_node* _end;
-		xpath_node* _eos;
-
-	public:
-		xpath_node_set_raw(): _type(xpath_node_set::type_unsorted), _begin(0), _end(0), _eos(0)
+		// Reset the counters of the limits before an evaluation
+		static void start(xpath_eval_context* context)
 		{
+			context->_memory = 0;
+			context->_visits = 0;
+			context->_status = xpath_eval_ok;
 		}
 
-		xpath_node* begin() const
+		// Record the reason evaluation stops with; returns false for convenience
+		static bool stop(xpath_eval_context* context, xpath_eval_status status)
 		{
-			return _begin;
-		}
+			if (context->_status == xpath_eval_ok) context->_status = status;
 
-		xpath_node* end() const
-		{
-			return _end;
+			return false;
 		}
 
-		bool empty() const
+		static bool cancelled(xpath_eval_context* context)
 		{
-			return _begin == _end;
+			return context->_limits.cancel && *context->_limits.cancel;
 		}
 
-		size_t size() const
+		// Count a node visit; returns false if evaluation has to stop
+		static bool visit(xpath_eval_context* context)
 		{
-			return static_cast<size_t>(_end - _begin);
-		}
+			size_t visits = ++context->_visits;
 
-		xpath_node first() const
-		{
-			return xpath_first(_begin, _end, _type);
+			if (context->_limits.visits && visits > context->_limits.visits) return stop(context, xpath_eval_visit_limit);
+
+			if ((visits & (xpath_cancel_interval - 1)) == 0 && cancelled(context)) return stop(context, xpath_eval_cancelled);
+
+			return true;
 		}
 
-		void push_back(const xpath_node& node, xpath_allocator* alloc)
+		static void* allocate(xpath_eval_context* context, size_t size)
 		{
-			if (_end == _eos)
+			if (cancelled(context))
 			{
-				size_t capacity = static_cast<size_t>(_eos - _begin);
+				stop(context, xpath_eval_cancelled);
+				return 0;
+			}
 
-				// get new capacity (1.5x rule)
-				size_t new_capacity = capacity + capacity / 2 + 1;
+			header* block = take(context, size);
+			if (!block)
+			{
+				stop(context, xpath_eval_out_of_memory);
+				return 0;
+			}
 
-				// reallocate the old array or allocate a new one
-				xpath_node* data = static_cast<xpath_node*>(alloc->reallocate(_begin, capacity * sizeof(xpath_node), new_capacity * sizeof(xpath_node)));
-				assert(data);
+			context->_memory += block->size;
 
-				// finalize
-				_begin = data;
-				_end = data + capacity;
-				_eos = data + new_capacity;
+			if (context->_limits.memory && context->_memory > context->_limits.memory)
+			{
+				stop(context, xpath_eval_memory_limit);
+				deallocate(context, block + 1);
+				return 0;
 			}
 
-			*_end++ = node;
+			return block + 1;
 		}
 
-		void append(const xpath_node* begin, const xpath_node* end, xpath_allocator* alloc)
+		static header* take(xpath_eval_context* context, size_t size)
 		{
-			size_t size = static_cast<size_t>(_end - _begin);
-			size_t capacity = static_cast<size_t>(_eos - _begin);
-			size_t count = static_cast<size_t>(end - begin);
+			header* prev = 0;
 
-			if (size + count > capacity)
-			{
-				// reallocate the old array or allocate a new one
-				xpath_node* data = static_cast<xpath_node*>(alloc->reallocate(_begin, capacity * sizeof(xpath_node), (size + count) * sizeof(xpath_node)));
-				assert(data);
+			// retained blocks are almost always pages of the same size, so the first fit is usually exact;
+			// large grown blocks are not handed out for small requests so that they stay available for regrowth
+			for (header* cur = static_cast<header*>(context->_blocks); cur; prev = cur, cur = cur->next)
+				if (cur->size >= size && cur->size / 2 < size)
+				{
+					if (prev) prev->next = cur->next;
+					else context->_blocks = cur->next;
 
-				// finalize
-				_begin = data;
-				_end = data + size;
-				_eos = data + size + count;
-			}
+					context->_retained -= cur->size;
 
-			memcpy(_end, begin, count * sizeof(xpath_node));
-			_end += count;
-		}
+					return cur;
+				}
 
-		void sort_do()
-		{
-			_type = xpath_sort(_begin, _end, _type, false);
-		}
+			// round grown blocks up to a power of two so that a string growing in small steps keeps reusing its block
+			size_t capacity = sizeof(xpath_memory_block);
+			while (capacity < size) capacity *= 2;
 
-		void truncate(xpath_node* pos)
-		{
-			assert(_begin <= pos && pos <= _end);
+			header* result = static_cast<header*>(global_allocate(sizeof(header) + capacity));
+			if (!result) return 0;
 
-			_end = pos;
-		}
+			result->size = capacity;
 
-		void remove_duplicates()
-		{
-			if (_type == xpath_node_set::type_unsorted)
-				sort(_begin, _end, duplicate_comparator());
-		
-			_end = unique(_begin, _end);
+			return result;
 		}
 
-		xpath_node_set::type_t type() const
+		static void deallocate(xpath_eval_context* context, void* ptr)
 		{
-			return _type;
+			header* block = static_cast<header*>(ptr) - 1;
+
+			context->_memory -= block->size;
+
+			if (context->_retained + block->size > context->_limit)
+			{
+				global_deallocate(block);
+				return;
+			}
+
+			block->next = static_cast<header*>(context->_blocks);
+			context->_blocks = block;
+			context->_retained += block->size;
 		}
 
-		void set_type(xpath_node_set::type_t type)
+		// Free retained blocks until at most limit bytes are retained
+		static void trim(xpath_eval_context* context, size_t limit)
 		{
-			_type = type;
+			while (context->_retained > limit)
+			{
+				header* block = static_cast<header*>(context->_blocks);
+				assert(block);
+
+				context->_blocks = block->next;
+				context->_retained -= block->size;
+
+				global_deallocate(block);
+			}
 		}
 	};
 }
 
+// Allocator used for AST and evaluation stacks
 namespace
 {
-	struct xpath_context
+#ifndef PUGIHTML_NO_EXCEPTIONS
+	void throw_limit_error(xpath_eval_status status)
 	{
-		xpath_node n;
-		size_t position, size;
+		xpath_parse_result result;
 
-		xpath_context(const xpath_node& n, size_t position, size_t size): n(n), position(position), size(size)
+		switch (status)
 		{
+		case xpath_eval_memory_limit:
+			result.error = "Memory limit exceeded";
+			break;
+
+		case xpath_eval_visit_limit:
+			result.error = "Node visit limit exceeded";
+			break;
+
+		case xpath_eval_cancelled:
+			result.error = "Evaluation cancelled";
+			break;
+
+		default:
+			return;
 		}
-	};
 
-	enum lexeme_t
-	{
-		lex_none = 0,
-		lex_equal,
-		lex_not_equal,
-		lex_less,
-		lex_greater,
-		lex_less_or_equal,
-		lex_greater_or_equal,
-		lex_plus,
-		lex_minus,
-		lex_multiply,
-		lex_union,
-		lex_var_ref,
-		lex_open_brace,
-		lex_close_brace,
-		lex_quoted_string,
-		lex_number,
-		lex_slash,
-		lex_double_slash,
-		lex_open_square_brace,
-		lex_close_square_brace,
-		lex_string,
-		lex_comma,
-		lex_axis_attribute,
-		lex_dot,
-		lex_double_dot,
-		lex_double_colon,
-		lex_eof
-	};
+		result.offset = 0;
 
-	struct xpath_lexer_string
+		throw xpath_exception(result);
+	}
+#endif
+
+	class xpath_allocator
 	{
-		const char_t* begin;
-		const char_t* end;
+		xpath_memory_block* _root;
+		size_t _root_size;
 
-		xpath_lexer_string(): begin(0), end(0)
+		void* allocate_block(size_t size)
 		{
+			return scratch ? xpath_block_cache::allocate(scratch, size) : global_allocate(size);
 		}
 
-		bool operator==(const char_t* other) const
+		void deallocate_block(void* block)
 		{
-			size_t length = static_cast<size_t>(end - begin);
-
-			return strequalrange(other, begin, length);
+			if (scratch) xpath_block_cache::deallocate(scratch, block);
+			else global_deallocate(block);
 		}
-	};
 
-	class xpath_lexer
-	{
-		const char_t* _cur;
-		const char_t* _cur_lexeme_pos;
-		xpath_lexer_string _cur_lexeme_contents;
+	public:
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		jmp_buf* error_handler;
+	#endif
 
-		lexeme_t _cur_lexeme;
+		// if set, pages are taken from and returned to the evaluation context
+		xpath_eval_context* scratch;
 
-	public:
-		explicit xpath_lexer(const char_t* query): _cur(query)
-		{
-			next();
-		}
-		
-		const char_t* state() const
+		xpath_allocator(xpath_memory_block* root, size_t root_size = 0): _root(root), _root_size(root_size), scratch(0)
 		{
-			return _cur;
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			error_handler = 0;
+		#endif
 		}
 		
-		void next()
+		void* allocate_nothrow(size_t size)
 		{
-			const char_t* cur = _cur;
-
-			while (IS_CHARTYPE(*cur, ct_space)) ++cur;
+			const size_t block_capacity = sizeof(_root->data);
 
-			// save lexeme position for error reporting
-			_cur_lexeme_pos = cur;
+			// align size so that we're able to store pointers in subsequent blocks
+			size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
 
-			switch (*cur)
+			if (_root_size + size <= block_capacity)
 			{
-			case 0:
-				_cur_lexeme = lex_eof;
-				break;
-			
-			case '>':
-				if (*(cur+1) == '=')
-				{
-					cur += 2;
-					_cur_lexeme = lex_greater_or_equal;
-				}
-				else
-				{
-					cur += 1;
-					_cur_lexeme = lex_greater;
-				}
-				break;
+				void* buf = _root->data + _root_size;
+				_root_size += size;
+				return buf;
+			}
+			else
+			{
+				size_t block_data_size = (size > block_capacity) ? size : block_capacity;
+				size_t block_size = block_data_size + offsetof(xpath_memory_block, data);
 
-			case '<':
-				if (*(cur+1) == '=')
-				{
-					cur += 2;
-					_cur_lexeme = lex_less_or_equal;
-				}
-				else
-				{
-					cur += 1;
-					_cur_lexeme = lex_less;
-				}
-				break;
+				xpath_memory_block* block = static_cast<xpath_memory_block*>(allocate_block(block_size));
+				if (!block) return 0;
+				
+				block->next = _root;
+				
+				_root = block;
+				_root_size = size;
+				
+				return block->data;
+			}
+		}
 
-			case '!':
-				if (*(cur+1) == '=')
-				{
-					cur += 2;
-					_cur_lexeme = lex_not_equal;
-				}
-				else
-				{
-					_cur_lexeme = lex_none;
-				}
-				break;
+		void* allocate(size_t size)
+		{
+			void* result = allocate_nothrow(size);
+			if (!result) fail();
 
-			case '=':
-				cur += 1;
-				_cur_lexeme = lex_equal;
+			return result;
+		}
 
-				break;
-			
-			case '+':
-				cur += 1;
-				_cur_lexeme = lex_plus;
+		// Abort evaluation on out of memory errors or if a limit of the evaluation context is exceeded
+		void fail()
+		{
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			assert(error_handler);
+			longjmp(*error_handler, 1);
+		#else
+			if (scratch) throw_limit_error(scratch->status());
 
-				break;
+			throw std::bad_alloc();
+		#endif
+		}
 
-			case '-':
-				cur += 1;
-				_cur_lexeme = lex_minus;
+		// Count a node visit of a location step
+		void visit()
+		{
+			if (scratch && !xpath_block_cache::visit(scratch)) fail();
+		}
 
-				break;
+		void* reallocate(void* ptr, size_t old_size, size_t new_size)
+		{
+			// align size so that we're able to store pointers in subsequent blocks
+			old_size = (old_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+			new_size = (new_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
 
-			case '*':
-				cur += 1;
-				_cur_lexeme = lex_multiply;
+			// we can only reallocate the last object
+			assert(ptr == 0 || static_cast<char*>(ptr) + old_size == _root->data + _root_size);
 
-				break;
+			// adjust root size so that we have not allocated the object at all
+			bool only_object = (_root_size == old_size);
 
-			case '|':
-				cur += 1;
-				_cur_lexeme = lex_union;
+			if (ptr) _root_size -= old_size;
 
-				break;
-			
-			case '$':
-				cur += 1;
+			// allocate a new version (this will obviously reuse the memory if possible)
+			void* result = allocate(new_size);
+			assert(result);
 
-				if (IS_CHARTYPEX(*cur, ctx_start_symbol))
+			// we have a new block
+			if (result != ptr && ptr)
+			{
+				// copy old data
+				assert(new_size >= old_size);
+				memcpy(result, ptr, old_size);
+
+				// free the previous page if it had no other objects
+				if (only_object)
 				{
-					_cur_lexeme_contents.begin = cur;
+					assert(_root->data == result);
+					assert(_root->next);
 
-					while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+					xpath_memory_block* next = _root->next->next;
 
-					if (cur[0] == ':' && IS_CHARTYPEX(cur[1], ctx_symbol)) // qname
+					if (next)
 					{
-						cur++; // :
-
-						while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
-					}
-
-					_cur_lexeme_contents.end = cur;
-				
-					_cur_lexeme = lex_var_ref;
-				}
-				else
-				{
-					_cur_lexeme = lex_none;
+						// deallocate the whole page, unless it was the first one
+						deallocate_block(_root->next);
+						_root->next = next;
+					}
 				}
+			}
 
-				break;
-
-			case '(':
-				cur += 1;
-				_cur_lexeme = lex_open_brace;
+			return result;
+		}
 
-				break;
+		void revert(const xpath_allocator& state)
+		{
+			// free all new pages
+			xpath_memory_block* cur = _root;
 
-			case ')':
-				cur += 1;
-				_cur_lexeme = lex_close_brace;
+			while (cur != state._root)
+			{
+				xpath_memory_block* next = cur->next;
 
-				break;
-			
-			case '[':
-				cur += 1;
-				_cur_lexeme = lex_open_square_brace;
+				deallocate_block(cur);
 
-				break;
+				cur = next;
+			}
 
-			case ']':
-				cur += 1;
-				_cur_lexeme = lex_close_square_brace;
+			// restore state
+			_root = state._root;
+			_root_size = state._root_size;
+		}
 
-				break;
+		void release()
+		{
+			xpath_memory_block* cur = _root;
+			assert(cur);
 
-			case ',':
-				cur += 1;
-				_cur_lexeme = lex_comma;
+			while (cur->next)
+			{
+				xpath_memory_block* next = cur->next;
 
-				break;
+				deallocate_block(cur);
 
-			case '/':
-				if (*(cur+1) == '/')
-				{
-					cur += 2;
-					_cur_lexeme = lex_double_slash;
-				}
-				else
-				{
-					cur += 1;
-					_cur_lexeme = lex_slash;
-				}
-				break;
-		
-			case '.':
-				if (*(cur+1) == '.')
-				{
-					cur += 2;
-					_cur_lexeme = lex_double_dot;
-				}
-				else if (IS_CHARTYPEX(*(cur+1), ctx_digit))
-				{
-					_cur_lexeme_contents.begin = cur; // .
+				cur = next;
+			}
+		}
+	};
 
-					++cur;
+	struct xpath_allocator_capture
+	{
+		xpath_allocator_capture(xpath_allocator* alloc): _target(alloc), _state(*alloc)
+		{
+		}
 
-					while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
+		~xpath_allocator_capture()
+		{
+			_target->revert(_state);
+		}
 
-					_cur_lexeme_contents.end = cur;
-					
-					_cur_lexeme = lex_number;
-				}
-				else
-				{
-					cur += 1;
-					_cur_lexeme = lex_dot;
-				}
-				break;
+		xpath_allocator* _target;
+		xpath_allocator _state;
+	};
 
-			case '@':
-				cur += 1;
-				_cur_lexeme = lex_axis_attribute;
+	struct xpath_invariant_cache;
 
-				break;
+	struct xpath_stack
+	{
+		xpath_allocator* result;
+		xpath_allocator* temp;
+		xpath_invariant_cache* invariants;
+	};
 
-			case '"':
-			case '\'':
-			{
-				char_t terminator = *cur;
+	struct xpath_invariant;
 
-				++cur;
+	// Maximum number of characters of string values kept by xpath_string_memo during one evaluation
+	const size_t xpath_string_memo_limit = 256 * 1024;
 
-				_cur_lexeme_contents.begin = cur;
-				while (*cur && *cur != terminator) cur++;
-				_cur_lexeme_contents.end = cur;
-				
-				if (!*cur)
-					_cur_lexeme = lex_none;
-				else
-				{
-					cur += 1;
-					_cur_lexeme = lex_quoted_string;
-				}
+	// String values of elements computed during one evaluation (see string_value); open addressing, at most half full
+	struct xpath_string_memo
+	{
+		struct entry
+		{
+			const html_node_struct* node;
+			const char_t* value;
+		};
 
-				break;
-			}
+		entry* table;
+		size_t size;
+		size_t count;
+		size_t characters;
 
-			case ':':
-				if (*(cur+1) == ':')
-				{
-					cur += 2;
-					_cur_lexeme = lex_double_colon;
-				}
-				else
-				{
-					_cur_lexeme = lex_none;
-				}
-				break;
+		// only set for queries that look at the same string value more than once (see xpath_ast_node::repeats_context_value)
+		bool enabled;
 
-			default:
-				if (IS_CHARTYPEX(*cur, ctx_digit))
-				{
-					_cur_lexeme_contents.begin = cur;
+		static size_t hash(const html_node_struct* n)
+		{
+			return static_cast<size_t>(reinterpret_cast<uintptr_t>(n) / sizeof(void*));
+		}
 
-					while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
-				
-					if (*cur == '.')
-					{
-						cur++;
+		const char_t* find(const html_node_struct* n) const
+		{
+			if (!table) return 0;
 
-						while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
-					}
+			for (size_t i = hash(n) & (size - 1); table[i].node; i = (i + 1) & (size - 1))
+				if (table[i].node == n) return table[i].value;
 
-					_cur_lexeme_contents.end = cur;
+			return 0;
+		}
 
-					_cur_lexeme = lex_number;
-				}
-				else if (IS_CHARTYPEX(*cur, ctx_start_symbol))
-				{
-					_cur_lexeme_contents.begin = cur;
+		void insert(const html_node_struct* n, const char_t* value, size_t length, xpath_allocator* alloc)
+		{
+			if (count * 2 >= size)
+			{
+				// the old table stays in the allocator until the end of the evaluation
+				size_t new_size = size ? size * 2 : 64;
 
-					while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+				entry* new_table = static_cast<entry*>(alloc->allocate(new_size * sizeof(entry)));
+				memset(new_table, 0, new_size * sizeof(entry));
 
-					if (cur[0] == ':')
-					{
-						if (cur[1] == '*') // namespace test ncname:*
-						{
-							cur += 2; // :*
-						}
-						else if (IS_CHARTYPEX(cur[1], ctx_symbol)) // namespace test qname
-						{
-							cur++; // :
+				entry* old_table = table;
+				size_t old_size = size;
 
-							while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
-						}
-					}
+				table = new_table;
+				size = new_size;
 
-					_cur_lexeme_contents.end = cur;
-				
-					_cur_lexeme = lex_string;
-				}
-				else
-				{
-					_cur_lexeme = lex_none;
-				}
+				for (size_t i = 0; i < old_size; ++i)
+					if (old_table[i].node) place(old_table[i]);
 			}
 
-			_cur = cur;
+			entry e = {n, value};
+			place(e);
+
+			count++;
+			characters += length;
 		}
 
-		lexeme_t current() const
+		void place(const entry& e)
 		{
-			return _cur_lexeme;
+			size_t i = hash(e.node) & (size - 1);
+
+			while (table[i].node) i = (i + 1) & (size - 1);
+
+			table[i] = e;
 		}
+	};
 
-		const char_t* current_pos() const
+	// Values computed during one evaluation: context-independent subexpressions (see ast_invariant) and string values of elements
+	struct xpath_invariant_cache
+	{
+		xpath_allocator* alloc;
+		xpath_invariant* first;
+
+		xpath_string_memo values;
+	};
+
+	struct xpath_stack_data
+	{
+		xpath_memory_block blocks[2];
+		xpath_allocator result;
+		xpath_allocator temp;
+		xpath_allocator invariant;
+		xpath_invariant_cache invariants;
+		xpath_stack stack;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		jmp_buf error_handler;
+	#endif
+
+		// the invariant allocator starts with a block that is reported as full, so that cached values are only allocated on demand
+		explicit xpath_stack_data(xpath_eval_context* scratch = 0): result(blocks + 0), temp(blocks + 1), invariant(blocks + 1, sizeof(blocks[1].data))
 		{
-			return _cur_lexeme_pos;
+			blocks[0].next = blocks[1].next = 0;
+
+			result.scratch = temp.scratch = invariant.scratch = scratch;
+			if (scratch) xpath_block_cache::start(scratch);
+
+			invariants.alloc = &invariant;
+			invariants.first = 0;
+
+			memset(&invariants.values, 0, sizeof(invariants.values));
+
+			stack.result = &result;
+			stack.temp = &temp;
+			stack.invariants = &invariants;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			result.error_handler = temp.error_handler = invariant.error_handler = &error_handler;
+		#endif
 		}
 
-		const xpath_lexer_string& contents() const
+		~xpath_stack_data()
 		{
-			assert(_cur_lexeme == lex_var_ref || _cur_lexeme == lex_number || _cur_lexeme == lex_string || _cur_lexeme == lex_quoted_string);
-
-			return _cur_lexeme_contents;
+			result.release();
+			temp.release();
+			invariant.release();
 		}
 	};
+}
 
-	enum ast_type_t
+// String class
+namespace
+{
+	class xpath_string
 	{
-		ast_op_or,						// left or right
-		ast_op_and,						// left and right
-		ast_op_equal,					// left = right
-		ast_op_not_equal, 				// left != right
-		ast_op_less,					// left < right
-		ast_op_greater,					// left > right
-		ast_op_less_or_equal,			// left <= right
-		ast_op_greater_or_equal,		// left >= right
-		ast_op_add,						// left + right
-		ast_op_subtract,				// left - right
-		ast_op_multiply,				// left * right
-		ast_op_divide,					// left / right
-		ast_op_mod,						// left % right
-		ast_op_negate,					// left - right
-		ast_op_union,					// left | right
-		ast_predicate,					// apply predicate to set; next points to next predicate
-		ast_filter,						// select * from left where right
-		ast_filter_posinv,				// select * from left where right; proximity position invariant
-		ast_string_constant,			// string constant
-		ast_number_constant,			// number constant
-		ast_variable,					// variable
-		ast_func_last,					// last()
-		ast_func_position,				// position()
-		ast_func_count,					// count(left)
-		ast_func_id,					// id(left)
-		ast_func_local_name_0,			// local-name()
-		ast_func_local_name_1,			// local-name(left)
-		ast_func_namespace_uri_0,		// namespace-uri()
-		ast_func_namespace_uri_1,		// namespace-uri(left)
-		ast_func_name_0,				// name()
-		ast_func_name_1,				// name(left)
-		ast_func_string_0,				// string()
-		ast_func_string_1,				// string(left)
-		ast_func_concat,				// concat(left, right, siblings)
-		ast_func_starts_with,			// starts_with(left, right)
-		ast_func_contains,				// contains(left, right)
-		ast_func_substring_before,		// substring-before(left, right)
-		ast_func_substring_after,		// substring-after(left, right)
-		ast_func_substring_2,			// substring(left, right)
-		ast_func_substring_3,			// substring(left, right, third)
-		ast_func_string_length_0,		// string-length()
-		ast_func_string_length_1,		// string-length(left)
-		ast_func_normalize_space_0,		// normalize-space()
-		ast_func_normalize_space_1,		// normalize-space(left)
-		ast_func_translate,				// translate(left, right, third)
-		ast_func_boolean,				// boolean(left)
-		ast_func_not,					// not(left)
-		ast_func_true,					// true()
-		ast_func_false,					// false()
-		ast_func_lang,					// lang(left)
-		ast_func_number_0,				// number()
-		ast_func_number_1,				// number(left)
-		ast_func_sum,					// sum(left)
-		ast_func_floor,					// floor(left)
-		ast_func_ceiling,				// ceiling(left)
-		ast_func_round,					// round(left)
-		ast_step,						// process set left with step
-		ast_step_root					// select root node
-	};
-
-	enum axis_t
-	{
-		axis_ancestor,
-		axis_ancestor_or_self,
-		axis_attribute,
-		axis_child,
-		axis_descendant,
-		axis_descendant_or_self,
-		axis_following,
-		axis_following_sibling,
-		axis_namespace,
-		axis_parent,
-		axis_preceding,
-		axis_preceding_sibling,
-		axis_self
-	};
-	
-	enum nodetest_t
-	{
-		nodetest_none,
-		nodetest_name,
-		nodetest_type_node,
-		nodetest_type_comment,
-		nodetest_type_pi,
-		nodetest_type_text,
-		nodetest_pi,
-		nodetest_all,
-		nodetest_all_in_namespace
-	};
-
-	template <axis_t N> struct axis_to_type
-	{
-		static const axis_t axis;
-	};
+		const char_t* _buffer;
+		bool _uses_heap;
 
-	template <axis_t N> const axis_t axis_to_type<N>::axis = N;
-		
-	class xpath_ast_node
-	{
-	private:
-		// node type
-		char _type;
-		char _rettype;
+		static char_t* duplicate_string(const char_t* string, size_t length, xpath_allocator* alloc)
+		{
+			char_t* result = static_cast<char_t*>(alloc->allocate((length + 1) * sizeof(char_t)));
+			assert(result);
 
-		// for ast_step / ast_predicate
-		char _axis;
-		char _test;
+			memcpy(result, string, length * sizeof(char_t));
+			result[length] = 0;
 
-		// tree node structure
-		xpath_ast_node* _left;
-		xpath_ast_node* _right;
-		xpath_ast_node* _next;
+			return result;
+		}
 
-		union
+		static char_t* duplicate_string(const char_t* string, xpath_allocator* alloc)
 		{
-			// value for ast_string_constant
-			const char_t* string;
-			// value for ast_number_constant
-			double number;
-			// variable for ast_variable
-			xpath_variable* variable;
-			// node test for ast_step (node name/namespace/node type/pi target)
-			const char_t* nodetest;
-		} _data;
+			return duplicate_string(string, strlength(string), alloc);
+		}
 
-		xpath_ast_node(const xpath_ast_node&);
-		xpath_ast_node& operator=(const xpath_ast_node&);
+	public:
+		xpath_string(): _buffer(PUGIHTML_TEXT("")), _uses_heap(false)
+		{
+		}
 
-		template <class Comp> static bool compare_eq(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack, const Comp& comp)
+		explicit xpath_string(const char_t* str, xpath_allocator* alloc)
 		{
-			xpath_value_type lt = lhs->rettype(), rt = rhs->rettype();
+			bool empty = (*str == 0);
 
-			if (lt != xpath_type_node_set && rt != xpath_type_node_set)
-			{
-				if (lt == xpath_type_boolean || rt == xpath_type_boolean)
-					return comp(lhs->eval_boolean(c, stack), rhs->eval_boolean(c, stack));
-				else if (lt == xpath_type_number || rt == xpath_type_number)
-					return comp(lhs->eval_number(c, stack), rhs->eval_number(c, stack));
-				else if (lt == xpath_type_string || rt == xpath_type_string)
-				{
-					xpath_allocator_capture cr(stack.result);
+			_buffer = empty ? PUGIHTML_TEXT("") : duplicate_string(str, alloc);
+			_uses_heap = !empty;
+		}
 
-					xpath_string ls = lhs->eval_string(c, stack);
-					xpath_string rs = rhs->eval_string(c, stack);
+		explicit xpath_string(const char_t* str, bool use_heap): _buffer(str), _uses_heap(use_heap)
+		{
+		}
 
-					return comp(ls, rs);
-				}
-			}
-			else if (lt == xpath_type_node_set && rt == xpath_type_node_set)
-			{
-				xpath_allocator_capture cr(stack.result);
+		xpath_string(const char_t* begin, const char_t* end, xpath_allocator* alloc)
+		{
+			assert(begin <= end);
 
-				xpath_node_set_raw ls = lhs->eval_node_set(c, stack);
-				xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+			bool empty = (begin == end);
 
-				for (const xpath_node* li = ls.begin(); li != ls.end(); ++li)
-					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
-					{
-						xpath_allocator_capture cri(stack.result);
+			_buffer = empty ? PUGIHTML_TEXT("") : duplicate_string(begin, static_cast<size_t>(end - begin), alloc);
+			_uses_heap = !empty;
+		}
 
-						if (comp(string_value(*li, stack.result), string_value(*ri, stack.result)))
-							return true;
-					}
+		void append(const xpath_string& o, xpath_allocator* alloc)
+		{
+			// skip empty sources
+			if (!*o._buffer) return;
 
-				return false;
+			// fast append for constant empty target and constant source
+			if (!*_buffer && !_uses_heap && !o._uses_heap)
+			{
+				_buffer = o._buffer;
 			}
 			else
 			{
-				if (lt == xpath_type_node_set)
-				{
-					swap(lhs, rhs);
-					swap(lt, rt);
-				}
-
-				if (lt == xpath_type_boolean)
-					return comp(lhs->eval_boolean(c, stack), rhs->eval_boolean(c, stack));
-				else if (lt == xpath_type_number)
-				{
-					xpath_allocator_capture cr(stack.result);
-
-					double l = lhs->eval_number(c, stack);
-					xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
-
-					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
-					{
-						xpath_allocator_capture cri(stack.result);
-
-						if (comp(l, convert_string_to_number(string_value(*ri, stack.result).c_str())))
-							return true;
-					}
-
-					return false;
-				}
-				else if (lt == xpath_type_string)
-				{
-					xpath_allocator_capture cr(stack.result);
+				// need to make heap copy
+				size_t target_length = strlength(_buffer);
+				size_t source_length = strlength(o._buffer);
+				size_t length = target_length + source_length;
 
-					xpath_string l = lhs->eval_string(c, stack);
-					xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+				// allocate new buffer
+				char_t* result = static_cast<char_t*>(alloc->reallocate(_uses_heap ? const_cast<char_t*>(_buffer) : 0, (target_length + 1) * sizeof(char_t), (length + 1) * sizeof(char_t)));
+				assert(result);
 
-					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
-					{
-						xpath_allocator_capture cri(stack.result);
+				// append first string to the new buffer in case there was no reallocation
+				if (!_uses_heap) memcpy(result, _buffer, target_length * sizeof(char_t));
 
-						if (comp(l, string_value(*ri, stack.result)))
-							return true;
-					}
+				// append second string to the new buffer
+				memcpy(result + target_length, o._buffer, source_length * sizeof(char_t));
+				result[length] = 0;
 
-					return false;
-				}
+				// finalize
+				_buffer = result;
+				_uses_heap = true;
 			}
-
-			assert(!"Wrong types");
-			return false;
 		}
 
-		template <class Comp> static bool compare_rel(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack, const Comp& comp)
+		const char_t* c_str() const
 		{
-			xpath_value_type lt = lhs->rettype(), rt = rhs->rettype();
+			return _buffer;
+		}
 
-			if (lt != xpath_type_node_set && rt != xpath_type_node_set)
-				return comp(lhs->eval_number(c, stack), rhs->eval_number(c, stack));
-			else if (lt == xpath_type_node_set && rt == xpath_type_node_set)
+		size_t length() const
+		{
+			return strlength(_buffer);
+		}
+		
+		char_t* data(xpath_allocator* alloc)
+		{
+			// make private heap copy
+			if (!_uses_heap)
 			{
-				xpath_allocator_capture cr(stack.result);
+				_buffer = duplicate_string(_buffer, alloc);
+				_uses_heap = true;
+			}
 
-				xpath_node_set_raw ls = lhs->eval_node_set(c, stack);
-				xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+			return const_cast<char_t*>(_buffer);
+		}
 
-				for (const xpath_node* li = ls.begin(); li != ls.end(); ++li)
-				{
-					xpath_allocator_capture cri(stack.result);
+		bool empty() const
+		{
+			return *_buffer == 0;
+		}
 
-					double l = convert_string_to_number(string_value(*li, stack.result).c_str());
+		bool operator==(const xpath_string& o) const
+		{
+			return strequal(_buffer, o._buffer);
+		}
 
-					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
-					{
-						xpath_allocator_capture crii(stack.result);
-
-						if (comp(l, convert_string_to_number(string_value(*ri, stack.result).c_str())))
-							return true;
-					}
-				}
+		bool operator!=(const xpath_string& o) const
+		{
+			return !strequal(_buffer, o._buffer);
+		}
 
-				return false;
-			}
-			else if (lt != xpath_type_node_set && rt == xpath_type_node_set)
-			{
-				xpath_allocator_capture cr(stack.result);
+		bool uses_heap() const
+		{
+			return _uses_heap;
+		}
+	};
 
-				double l = lhs->eval_number(c, stack);
-				xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+	xpath_string xpath_string_const(const char_t* str)
+	{
+		return xpath_string(str, false);
+	}
+}
 
-				for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
-				{
-					xpath_allocator_capture cri(stack.result);
+namespace
+{
+	bool starts_with(const char_t* string, const char_t* pattern)
+	{
+		while (*pattern && *string == *pattern)
+		{
+			string++;
+			pattern++;
+		}
 
-					if (comp(l, convert_string_to_number(string_value(*ri, stack.result).c_str())))
-						return true;
-				}
+		return *pattern == 0;
+	}
 
-				return false;
-			}
-			else if (lt == xpath_type_node_set && rt != xpath_type_node_set)
-			{
-				xpath_allocator_capture cr(stack.result);
+	const char_t* find_char(const char_t* s, char_t c)
+	{
+	#ifdef PUGIHTML_WCHAR_MODE
+		return wcschr(s, c);
+	#else
+		return strchr(s, c);
+	#endif
+	}
 
-				xpath_node_set_raw ls = lhs->eval_node_set(c, stack);
-				double r = rhs->eval_number(c, stack);
+	const char_t* find_substring(const char_t* s, const char_t* p)
+	{
+	#ifdef PUGIHTML_WCHAR_MODE
+		// MSVC6 wcsstr bug workaround (if s is empty it always returns 0)
+		return (*p == 0) ? s : wcsstr(s, p);
+	#else
+		return strstr(s, p);
+	#endif
+	}
 
-				for (const xpath_node* li = ls.begin(); li != ls.end(); ++li)
-				{
-					xpath_allocator_capture cri(stack.result);
+	// Converts symbol to lower case, if it is an ASCII one
+	char_t tolower_ascii(char_t ch)
+	{
+		return static_cast<unsigned int>(ch - 'A') < 26 ? static_cast<char_t>(ch | ' ') : ch;
+	}
 
-					if (comp(convert_string_to_number(string_value(*li, stack.result).c_str()), r))
-						return true;
-				}
+	bool ends_with(const char_t* string, size_t length, const char_t* pattern, size_t pattern_length)
+	{
+		return pattern_length <= length && memcmp(string + length - pattern_length, pattern, pattern_length * sizeof(char_t)) == 0;
+	}
 
-				return false;
+	// Find the first ASCII upper case letter; lower-case() only folds ASCII letters, like HTML tag and attribute names
+	bool find_upper_case_ascii(const char_t* string, size_t& offset)
+	{
+		for (const char_t* s = string; *s; ++s)
+			if (static_cast<unsigned int>(*s - 'A') < 26)
+			{
+				offset = static_cast<size_t>(s - string);
+				return true;
 			}
+
+		return false;
+	}
+
+	const char_t* text_value(const html_node_struct* node)
+	{
+		return node->value ? node->value : PUGIHTML_TEXT("");
+	}
+
+	// Get the next text (pcdata/cdata) descendant of root after cur in document order; the string value of an element is the concatenation of these
+	html_node_struct* next_text_descendant(html_node_struct* cur, html_node_struct* root)
+	{
+		for (;;)
+		{
+			if (cur->first_child)
+				cur = cur->first_child;
 			else
 			{
-				assert(!"Wrong types");
-				return false;
+				while (cur != root && !cur->next_sibling) cur = cur->parent;
+
+				if (cur == root) return 0;
+
+				cur = cur->next_sibling;
 			}
+
+			html_node_type type = static_cast<html_node_type>((cur->header & html_memory_page_type_mask) + 1);
+
+			if (type == node_pcdata || type == node_cdata) return cur;
 		}
+	}
 
-		void apply_predicate(xpath_node_set_raw& ns, size_t first, xpath_ast_node* expr, const xpath_stack& stack)
+	xpath_string string_value(const xpath_node& na, xpath_allocator* alloc)
+	{
+		if (na.attribute())
+			return xpath_string_const(na.attribute().value());
+		else
 		{
-			assert(ns.size() >= first);
+			const html_node& n = na.node();
 
-			size_t i = 1;
-			size_t size = ns.size() - first;
-				
-			xpath_node* last = ns.begin() + first;
-				
-			// remove_if... or well, sort of
-			for (xpath_node* it = last; it != ns.end(); ++it, ++i)
+			switch (n.type())
 			{
-				xpath_context c(*it, i, size);
+			case node_pcdata:
+			case node_cdata:
+			case node_comment:
+			case node_pi:
+				return xpath_string_const(n.value());
 			
-				if (expr->rettype() == xpath_type_number)
+			case node_document:
+			case node_element:
+			{
+				html_node_struct* root = n.internal_object();
+				html_node_struct* first = next_text_descendant(root, root);
+
+				if (!first) return xpath_string();
+
+				// the value of a single text node is used in place
+				if (!next_text_descendant(first, root)) return xpath_string_const(text_value(first));
+
+				// the buffer is sized in advance, since appending text nodes one by one copies the result over and over for large elements
+				size_t length = 0;
+
+				for (html_node_struct* cur = first; cur; cur = next_text_descendant(cur, root))
+					length += strlength(text_value(cur));
+
+				char_t* result = static_cast<char_t*>(alloc->allocate((length + 1) * sizeof(char_t)));
+				char_t* write = result;
+
+				for (html_node_struct* cur = first; cur; cur = next_text_descendant(cur, root))
 				{
-					if (expr->eval_number(c, stack) == i)
-						*last++ = *it;
+					size_t size = strlength(text_value(cur));
+
+					memcpy(write, text_value(cur), size * sizeof(char_t));
+					write += size;
 				}
-				else if (expr->eval_boolean(c, stack))
-					*last++ = *it;
+
+				*write = 0;
+
+				return xpath_string(result, true);
 			}
 			
-			ns.truncate(last);
+			default:
+				return xpath_string();
+			}
 		}
+	}
+	
+	// String value of an element kept in the memo of the evaluation
+	PUGIHTML_NO_INLINE xpath_string string_value_memo(const xpath_node& na, const xpath_stack& stack)
+	{
+		xpath_string_memo& memo = stack.invariants->values;
+		html_node_type type = na.attribute() ? node_null : na.node().type();
+
+		if (type != node_element && type != node_document) return string_value(na, stack.result);
+
+		html_node_struct* root = na.node().internal_object();
+		html_node_struct* first = next_text_descendant(root, root);
+
+		// values of a single text node are used in place anyway
+		if (!first) return xpath_string();
+		if (!next_text_descendant(first, root)) return xpath_string_const(text_value(first));
+
+		const char_t* value = memo.find(root);
+		if (value) return xpath_string_const(value);
+
+		// the memo stays well within the memory limit of the evaluation context, if there is one
+		size_t limit = xpath_string_memo_limit;
+		xpath_eval_context* scratch = stack.invariants->alloc->scratch;
+
+		if (scratch && scratch->limits().memory && scratch->limits().memory / 4 / sizeof(char_t) < limit) limit = scratch->limits().memory / 4 / sizeof(char_t);
+
+		if (memo.characters >= limit) return string_value(na, stack.result);
+
+		// the memo owns the value, so it is returned as a constant that is copied before modification
+		xpath_string result = string_value(na, stack.invariants->alloc);
+		memo.insert(root, result.c_str(), result.length(), stack.invariants->alloc);
+
+		return xpath_string_const(result.c_str());
+	}
 
-		void apply_predicates(xpath_node_set_raw& ns, size_t first, const xpath_stack& stack)
+	// String value of the node for evaluation; if the query looks at the value of the same node more than once (e.g. [. = 'a' or . = 'b']),
+	// the values of elements with several text nodes are kept until the end of the evaluation
+	xpath_string string_value(const xpath_node& na, const xpath_stack& stack)
+	{
+		return stack.invariants->values.enabled ? string_value_memo(na, stack) : string_value(na, stack.result);
+	}
+
+	// Longest pattern that string_value_contains searches for without building the string value
+	const size_t xpath_inplace_pattern_limit = 64;
+
+	// Constant pattern of contains(), prepared when the query is compiled
+	struct xpath_pattern
+	{
+		const char_t* string;
+		size_t length;
+	};
+
+	// Find the pattern in a string of the given length; strings shorter than the pattern, like the text of most inline elements,
+	// are not scanned, and the rest is left to the library search, which compares several characters at once on common platforms
+	const char_t* find_pattern(const char_t* s, size_t length, const xpath_pattern& p)
+	{
+		assert(s[length] == 0);
+
+		return length < p.length ? 0 : find_substring(s, p.string);
+	}
+
+	// Check if the string value of the node contains the pattern; the text nodes of elements are searched one by one instead of
+	// being concatenated, with matches that span text nodes found in a window around each boundary
+	bool string_value_contains(const xpath_node& na, const xpath_pattern& p)
+	{
+		assert(p.length <= xpath_inplace_pattern_limit);
+
+		html_node_type type = na.attribute() ? node_null : na.node().type();
+
+		if (type != node_element && type != node_document)
 		{
-			if (ns.size() == first) return;
-			
-			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
-			{
-				apply_predicate(ns, first, pred->_left, stack);
-			}
+			const char_t* value = na.attribute() ? na.attribute().value() : (type == node_null ? PUGIHTML_TEXT("") : na.node().value());
+
+			return find_pattern(value, strlength(value), p) != 0;
 		}
 
-		void step_push(xpath_node_set_raw& ns, const html_attribute& a, const html_node& parent, xpath_allocator* alloc)
-		{
-			if (!a) return;
+		// last pattern_length - 1 characters of the text before the current node, followed by the start of the node
+		char_t window[2 * xpath_inplace_pattern_limit + 1];
+		size_t carry = 0;
+		size_t keep = p.length ? p.length - 1 : 0;
 
-			const char_t* name = a.name();
+		html_node_struct* root = na.node().internal_object();
 
-			// There are no attribute nodes corresponding to attributes that declare namespaces
-			// That is, "htmlns:..." or "htmlns"
-			if (starts_with(name, PUGIHTML_TEXT("htmlns")) && (name[5] == 0 || name[5] == ':')) return;
-			
-			switch (_test)
-			{
-			case nodetest_name:
-				if (strequal(name, _data.nodetest)) ns.push_back(xpath_node(a, parent), alloc);
-				break;
-				
-			case nodetest_type_node:
-			case nodetest_all:
-				ns.push_back(xpath_node(a, parent), alloc);
-				break;
-				
-			case nodetest_all_in_namespace:
-				if (starts_with(name, _data.nodetest))
-					ns.push_back(xpath_node(a, parent), alloc);
-				break;
-			
-			default:
-				;
-			}
-		}
-		
-		void step_push(xpath_node_set_raw& ns, const html_node& n, xpath_allocator* alloc)
+		for (html_node_struct* cur = next_text_descendant(root, root); cur; cur = next_text_descendant(cur, root))
 		{
-			if (!n) return;
+			const char_t* text = text_value(cur);
+			size_t length = strlength(text);
 
-			switch (_test)
+			if (carry)
 			{
-			case nodetest_name:
-				if (n.type() == node_element && strequal(n.name(), _data.nodetest)) ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_type_node:
-				ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_type_comment:
-				if (n.type() == node_comment)
-					ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_type_text:
-				if (n.type() == node_pcdata || n.type() == node_cdata)
-					ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_type_pi:
-				if (n.type() == node_pi)
-					ns.push_back(n, alloc);
-				break;
-									
-			case nodetest_pi:
-				if (n.type() == node_pi && strequal(n.name(), _data.nodetest))
-					ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_all:
-				if (n.type() == node_element)
-					ns.push_back(n, alloc);
-				break;
-				
-			case nodetest_all_in_namespace:
-				if (n.type() == node_element && starts_with(n.name(), _data.nodetest))
-					ns.push_back(n, alloc);
-				break;
+				size_t head = length < keep ? length : keep;
 
-			default:
-				assert(!"Unknown axis");
-			} 
-		}
+				memcpy(window + carry, text, head * sizeof(char_t));
+				window[carry + head] = 0;
 
-		template <class T> void step_fill(xpath_node_set_raw& ns, const html_node& n, xpath_allocator* alloc, T)
-		{
-			const axis_t axis = T::axis;
+				if (find_pattern(window, carry + head, p)) return true;
+			}
 
-			switch (axis)
-			{
-			case axis_attribute:
+			if (find_pattern(text, length, p)) return true;
+
+			if (length >= keep)
 			{
-				for (html_attribute a = n.first_attribute(); a; a = a.next_attribute())
-					step_push(ns, a, n, alloc);
-				
-				break;
+				memcpy(window, text + (length - keep), keep * sizeof(char_t));
+				carry = keep;
 			}
-			
-			case axis_child:
+			else
 			{
-				for (html_node c = n.first_child(); c; c = c.next_sibling())
-					step_push(ns, c, alloc);
-					
-				break;
+				// short text node: the window already holds it after the previous characters
+				if (!carry) memcpy(window, text, length * sizeof(char_t));
+
+				size_t total = carry + length;
+
+				if (total > keep) memmove(window, window + (total - keep), keep * sizeof(char_t));
+
+				carry = total > keep ? keep : total;
 			}
-			
-			case axis_descendant:
-			case axis_descendant_or_self:
-			{
-				if (axis == axis_descendant_or_self)
-					step_push(ns, n, alloc);
-					
-				html_node cur = n.first_child();
-				
-				while (cur && cur != n)
-				{
-					step_push(ns, cur, alloc);
-					
-					if (cur.first_child())
-						cur = cur.first_child();
-					else if (cur.next_sibling())
-						cur = cur.next_sibling();
-					else
-					{
-						while (!cur.next_sibling() && cur != n)
-							cur = cur.parent();
-					
-						if (cur != n) cur = cur.next_sibling();
-					}
-				}
-				
-				break;
-			}
-			
-			case axis_following_sibling:
-			{
-				for (html_node c = n.next_sibling(); c; c = c.next_sibling())
-					step_push(ns, c, alloc);
-				
-				break;
-			}
-			
-			case axis_preceding_sibling:
-			{
-				for (html_node c = n.previous_sibling(); c; c = c.previous_sibling())
-					step_push(ns, c, alloc);
-				
-				break;
-			}
-			
-			case axis_following:
-			{
-				html_node cur = n;
+		}
 
-				// exit from this node so that we don't include descendants
-				while (cur && !cur.next_sibling()) cur = cur.parent();
-				cur = cur.next_sibling();
+		return p.length == 0;
+	}
 
-				for (;;)
-				{
-					step_push(ns, cur, alloc);
+	unsigned int node_height(html_node n)
+	{
+	    unsigned int result = 0;
+	    
+	    while (n)
+	    {
+	        ++result;
+	        n = n.parent();
+	    }
+	    
+	    return result;
+	}
+	
+	bool node_is_before(html_node ln, unsigned int lh, html_node rn, unsigned int rh)
+	{
+		// normalize heights
+		for (unsigned int i = rh; i < lh; i++) ln = ln.parent();
+		for (unsigned int j = lh; j < rh; j++) rn = rn.parent();
+	    
+		// one node is the ancestor of the other
+	    if (ln == rn) return lh < rh;
+	    
+		// find common ancestor
+	    while (ln.parent() != rn.parent())
+	    {
+	        ln = ln.parent();
+	        rn = rn.parent();
+	    }
 
-					if (cur.first_child())
-						cur = cur.first_child();
-					else if (cur.next_sibling())
-						cur = cur.next_sibling();
-					else
-					{
-						while (cur && !cur.next_sibling()) cur = cur.parent();
-						cur = cur.next_sibling();
+		// there is no common ancestor (the shared parent is null), nodes are from different documents
+		if (!ln.parent()) return ln < rn;
 
-						if (!cur) break;
-					}
-				}
+		// determine sibling order
+        for (; ln; ln = ln.next_sibling())
+            if (ln == rn)
+                return true;
+                
+        return false;
+    }
 
-				break;
-			}
+    bool node_is_ancestor(html_node parent, html_node node)
+    {
+		html_node_struct* p = parent.internal_object();
+		html_node_struct* n = node.internal_object();
 
-			case axis_preceding:
-			{
-				html_node cur = n;
+		// ancestors are numbered before the node in pre-order and after the node in post-order
+		if (p && n && document_order_current(p, n)) return p->pre <= n->pre && n->post <= p->post;
 
-				while (cur && !cur.previous_sibling()) cur = cur.parent();
-				cur = cur.previous_sibling();
+    	while (node && node != parent) node = node.parent();
 
-				for (;;)
-				{
-					if (cur.last_child())
-						cur = cur.last_child();
-					else
-					{
-						// leaf node, can't be ancestor
-						step_push(ns, cur, alloc);
+    	return parent && node == parent;
+    }
 
-						if (cur.previous_sibling())
-							cur = cur.previous_sibling();
-						else
-						{
-							do 
-							{
-								cur = cur.parent();
-								if (!cur) break;
+    const void* document_order(const xpath_node& xnode)
+    {
+        html_node_struct* node = xnode.node().internal_object();
 
-								if (!node_is_ancestor(cur, n)) step_push(ns, cur, alloc);
-							}
-							while (!cur.previous_sibling());
+        if (node)
+        {
+            if (node->name && (node->header & html_memory_page_name_allocated_mask) == 0) return node->name;
+            if (node->value && (node->header & html_memory_page_value_allocated_mask) == 0) return node->value;
+            return 0;
+        }
 
-							cur = cur.previous_sibling();
+        html_attribute_struct* attr = xnode.attribute().internal_object();
 
-							if (!cur) break;
-						}
-					}
-				}
+        if (attr)
+        {
+            if ((attr->header & html_memory_page_name_allocated_mask) == 0) return attr->name;
+            if ((attr->header & html_memory_page_value_allocated_mask) == 0) return attr->value;
+            return 0;
+        }
 
-				break;
-			}
-			
-			case axis_ancestor:
-			case axis_ancestor_or_self:
+		return 0;
+    }
+    
+	struct document_order_comparator
+	{
+		bool operator()(const xpath_node& lhs, const xpath_node& rhs) const
+		{
+			// pre-order number based check; attributes are ordered by their parent element
+			html_node_struct* lp = (lhs.attribute() ? lhs.parent() : lhs.node()).internal_object();
+			html_node_struct* rp = (rhs.attribute() ? rhs.parent() : rhs.node()).internal_object();
+
+			if (lp && rp && document_order_current(lp, rp))
 			{
-				if (axis == axis_ancestor_or_self)
-					step_push(ns, n, alloc);
+				if (lp != rp) return lp->pre < rp->pre;
 
-				html_node cur = n.parent();
-				
-				while (cur)
-				{
-					step_push(ns, cur, alloc);
-					
-					cur = cur.parent();
-				}
-				
-				break;
-			}
+				// attributes go after the parent element
+				if (!lhs.attribute()) return !!rhs.attribute();
+				if (!rhs.attribute()) return false;
 
-			case axis_self:
-			{
-				step_push(ns, n, alloc);
+				// determine sibling order
+				for (html_attribute a = lhs.attribute().next_attribute(); a; a = a.next_attribute())
+					if (a == rhs.attribute())
+						return true;
 
-				break;
+				return false;
 			}
 
-			case axis_parent:
-			{
-				if (n.parent()) step_push(ns, n.parent(), alloc);
+			// optimized document order based check
+			const void* lo = document_order(lhs);
+			const void* ro = document_order(rhs);
 
-				break;
-			}
-				
-			default:
-				assert(!"Unimplemented axis");
-			}
-		}
-		
-		template <class T> void step_fill(xpath_node_set_raw& ns, const html_attribute& a, const html_node& p, xpath_allocator* alloc, T v)
-		{
-			const axis_t axis = T::axis;
+			if (lo && ro) return lo < ro;
 
-			switch (axis)
-			{
-			case axis_ancestor:
-			case axis_ancestor_or_self:
-			{
-				if (axis == axis_ancestor_or_self && _test == nodetest_type_node) // reject attributes based on principal node type test
-					step_push(ns, a, p, alloc);
+            // slow comparison
+			html_node ln = lhs.node(), rn = rhs.node();
 
-				html_node cur = p;
-				
-				while (cur)
+			// compare attributes
+			if (lhs.attribute() && rhs.attribute())
+			{
+				// shared parent
+				if (lhs.parent() == rhs.parent())
 				{
-					step_push(ns, cur, alloc);
-					
-					cur = cur.parent();
+					// determine sibling order
+				    for (html_attribute a = lhs.attribute(); a; a = a.next_attribute())
+				        if (a == rhs.attribute())
+				            return true;
+				    
+				    return false;
 				}
 				
-				break;
-			}
-
-			case axis_descendant_or_self:
-			case axis_self:
-			{
-				if (_test == nodetest_type_node) // reject attributes based on principal node type test
-					step_push(ns, a, p, alloc);
-
-				break;
+				// compare attribute parents
+				ln = lhs.parent();
+				rn = rhs.parent();
 			}
-
-			case axis_following:
+			else if (lhs.attribute())
 			{
-				html_node cur = p;
+				// attributes go after the parent element
+				if (lhs.parent() == rhs.node()) return false;
 				
-				for (;;)
-				{
-					if (cur.first_child())
-						cur = cur.first_child();
-					else if (cur.next_sibling())
-						cur = cur.next_sibling();
-					else
-					{
-						while (cur && !cur.next_sibling()) cur = cur.parent();
-						cur = cur.next_sibling();
-						
-						if (!cur) break;
-					}
-
-					step_push(ns, cur, alloc);
-				}
-
-				break;
+				ln = lhs.parent();
 			}
-
-			case axis_parent:
+			else if (rhs.attribute())
 			{
-				step_push(ns, p, alloc);
-
-				break;
+				// attributes go after the parent element
+				if (rhs.parent() == lhs.node()) return true;
+				
+				rn = rhs.parent();
 			}
 
-			case axis_preceding:
-			{
-				// preceding:: axis does not include attribute nodes and attribute ancestors (they are the same as parent's ancestors), so we can reuse node preceding
-				step_fill(ns, p, alloc, v);
-				break;
-			}
+			if (ln == rn) return false;
 			
-			default:
-				assert(!"Unimplemented axis");
-			}
+			unsigned int lh = node_height(ln);
+			unsigned int rh = node_height(rn);
+			
+			return node_is_before(ln, lh, rn, rh);
 		}
-		
-		template <class T> xpath_node_set_raw step_do(const xpath_context& c, const xpath_stack& stack, T v)
-		{
-			const axis_t axis = T::axis;
-			bool attributes = (axis == axis_ancestor || axis == axis_ancestor_or_self || axis == axis_descendant_or_self || axis == axis_following || axis == axis_parent || axis == axis_preceding || axis == axis_self);
+	};
+
+	// Renumber the document of the node so that document order checks during evaluation are integer compares
+	void update_document_order(const xpath_node& n)
+	{
+		update_document_order((n.attribute() ? n.parent() : n.node()).internal_object());
+	}
+
+	struct duplicate_comparator
+	{
+		bool operator()(const xpath_node& lhs, const xpath_node& rhs) const
+		{
+			if (lhs.attribute()) return rhs.attribute() ? lhs.attribute() < rhs.attribute() : true;
+			else return rhs.attribute() ? false : lhs.node() < rhs.node();
+		}
+	};
+	
+	double gen_nan()
+	{
+	#if defined(__STDC_IEC_559__) || ((FLT_RADIX - 0 == 2) && (FLT_MAX_EXP - 0 == 128) && (FLT_MANT_DIG - 0 == 24))
+		union { float f; int32_t i; } u[sizeof(float) == sizeof(int32_t) ? 1 : -1];
+		u[0].i = 0x7fc00000;
+		return u[0].f;
+	#else
+		// fallback
+		const volatile double zero = 0.0;
+		return zero / zero;
+	#endif
+	}
+	
+	bool is_nan(double value)
+	{
+	#if defined(_MSC_VER) || defined(__BORLANDC__)
+		return !!_isnan(value);
+	#elif defined(fpclassify) && defined(FP_NAN)
+		return fpclassify(value) == FP_NAN;
+	#else
+		// fallback
+		const volatile double v = value;
+		return v != v;
+	#endif
+	}
+	
+	const char_t* convert_number_to_string_special(double value)
+	{
+	#if defined(_MSC_VER) || defined(__BORLANDC__)
+		if (_finite(value)) return (value == 0) ? PUGIHTML_TEXT("0") : 0;
+		if (_isnan(value)) return PUGIHTML_TEXT("NaN");
+		return PUGIHTML_TEXT("-Infinity") + (value > 0);
+	#elif defined(fpclassify) && defined(FP_NAN) && defined(FP_INFINITE) && defined(FP_ZERO)
+		switch (fpclassify(value))
+		{
+		case FP_NAN:
+			return PUGIHTML_TEXT("NaN");
+
+		case FP_INFINITE:
+			return PUGIHTML_TEXT("-Infinity") + (value > 0);
+
+		case FP_ZERO:
+			return PUGIHTML_TEXT("0");
+
+		default:
+			return 0;
+		}
+	#else
+		// fallback
+		const volatile double v = value;
+
+		if (v == 0) return PUGIHTML_TEXT("0");
+		if (v != v) return PUGIHTML_TEXT("NaN");
+		if (v * 2 == v) return PUGIHTML_TEXT("-Infinity") + (value > 0);
+		return 0;
+	#endif
+	}
+	
+	bool convert_number_to_boolean(double value)
+	{
+		return (value != 0 && !is_nan(value));
+	}
+	
+	xpath_string convert_number_to_string(double value, xpath_allocator* alloc)
+	{
+		// try special number conversion
+		const char_t* special = convert_number_to_string_special(value);
+		if (special) return xpath_string_const(special);
+
+		char_t result[number_chars_size];
+		convert_number_to_chars(value, result);
+
+		return xpath_string(result, alloc);
+	}
+	
+	bool check_string_to_number_format(const char_t* string)
+	{
+		// parse leading whitespace
+		while (IS_CHARTYPE(*string, ct_space)) ++string;
+
+		// parse sign
+		if (*string == '-') ++string;
+
+		if (!*string) return false;
+
+		// if there is no integer part, there should be a decimal part with at least one digit
+		if (!IS_CHARTYPEX(string[0], ctx_digit) && (string[0] != '.' || !IS_CHARTYPEX(string[1], ctx_digit))) return false;
+
+		// parse integer part
+		while (IS_CHARTYPEX(*string, ctx_digit)) ++string;
+
+		// parse decimal part
+		if (*string == '.')
+		{
+			++string;
+
+			while (IS_CHARTYPEX(*string, ctx_digit)) ++string;
+		}
+
+		// parse trailing whitespace
+		while (IS_CHARTYPE(*string, ct_space)) ++string;
+
+		return *string == 0;
+	}
+
+	double convert_string_to_number(const char_t* string)
+	{
+		// check string format
+		if (!check_string_to_number_format(string)) return gen_nan();
+
+		double result;
+		if (convert_chars_to_number(string, &result)) return result;
+
+		// parse string
+	#ifdef PUGIHTML_WCHAR_MODE
+		return wcstod(string, 0);
+	#else
+		return atof(string);
+	#endif
+	}
+
+	bool convert_string_to_number(const char_t* begin, const char_t* end, double* out_result)
+	{
+		char_t buffer[32];
+
+		size_t length = static_cast<size_t>(end - begin);
+		char_t* scratch = buffer;
+
+		if (length >= sizeof(buffer) / sizeof(buffer[0]))
+		{
+			// need to make dummy on-heap copy
+			scratch = static_cast<char_t*>(global_allocate((length + 1) * sizeof(char_t)));
+			if (!scratch) return false;
+		}
+
+		// copy string to zero-terminated buffer and perform conversion
+		memcpy(scratch, begin, length * sizeof(char_t));
+		scratch[length] = 0;
+
+		*out_result = convert_string_to_number(scratch);
+
+		// free dummy buffer
+		if (scratch != buffer) global_deallocate(scratch);
+
+		return true;
+	}
+	
+	double round_nearest(double value)
+	{
+		return floor(value + 0.5);
+	}
+
+	double round_nearest_nzero(double value)
+	{
+		// same as round_nearest, but returns -0 for [-0.5, -0]
+		// ceil is used to differentiate between +0 and -0 (we return -0 for [-0.5, -0] and +0 for +0)
+		return (value >= -0.5 && value <= 0) ? ceil(value) : floor(value + 0.5);
+	}
+	
+	const char_t* qualified_name(const xpath_node& node)
+	{
+		return node.attribute() ? node.attribute().name() : node.node().name();
+	}
+	
+	const char_t* local_name(const xpath_node& node)
+	{
+		const char_t* name = qualified_name(node);
+		const char_t* p = find_char(name, ':');
+		
+		return p ? p + 1 : name;
+	}
+
+	struct namespace_uri_predicate
+	{
+		const char_t* prefix;
+		size_t prefix_length;
+
+		namespace_uri_predicate(const char_t* name)
+		{
+			const char_t* pos = find_char(name, ':');
+
+			prefix = pos ? name : 0;
+			prefix_length = pos ? static_cast<size_t>(pos - name) : 0;
+		}
+
+		bool operator()(const html_attribute& a) const
+		{
+			const char_t* name = a.name();
+
+			if (!starts_with(name, PUGIHTML_TEXT("htmlns"))) return false;
+
+			return prefix ? name[5] == ':' && strequalrange(name + 6, prefix, prefix_length) : name[5] == 0;
+		}
+	};
+
+	const char_t* namespace_uri(const html_node& node)
+	{
+		namespace_uri_predicate pred = node.name();
+		
+		html_node p = node;
+		
+		while (p)
+		{
+			html_attribute a = p.find_attribute(pred);
+			
+			if (a) return a.value();
+			
+			p = p.parent();
+		}
+		
+		return PUGIHTML_TEXT("");
+	}
+
+	const char_t* namespace_uri(const html_attribute& attr, const html_node& parent)
+	{
+		namespace_uri_predicate pred = attr.name();
+		
+		// Default namespace does not apply to attributes
+		if (!pred.prefix) return PUGIHTML_TEXT("");
+		
+		html_node p = parent;
+		
+		while (p)
+		{
+			html_attribute a = p.find_attribute(pred);
+			
+			if (a) return a.value();
+			
+			p = p.parent();
+		}
+		
+		return PUGIHTML_TEXT("");
+	}
+
+	const char_t* namespace_uri(const xpath_node& node)
+	{
+		return node.attribute() ? namespace_uri(node.attribute(), node.parent()) : namespace_uri(node.node());
+	}
+
+	void normalize_space(char_t* buffer)
+	{
+		char_t* write = buffer;
+
+		for (char_t* it = buffer; *it; )
+		{
+			char_t ch = *it++;
+
+			if (IS_CHARTYPE(ch, ct_space))
+			{
+				// replace whitespace sequence with single space
+				while (IS_CHARTYPE(*it, ct_space)) it++;
+
+				// avoid leading spaces
+				if (write != buffer) *write++ = ' ';
+			}
+			else *write++ = ch;
+		}
+
+		// remove trailing space
+		if (write != buffer && IS_CHARTYPE(write[-1], ct_space)) write--;
+
+		// zero-terminate
+		*write = 0;
+	}
+
+	void translate(char_t* buffer, const char_t* from, const char_t* to)
+	{
+		size_t to_length = strlength(to);
+
+		char_t* write = buffer;
+
+		while (*buffer)
+		{
+			DMC_VOLATILE char_t ch = *buffer++;
+
+			const char_t* pos = find_char(from, ch);
+
+			if (!pos)
+				*write++ = ch; // do not process
+			else if (static_cast<size_t>(pos - from) < to_length)
+				*write++ = to[pos - from]; // replace
+		}
+
+		// zero-terminate
+		*write = 0;
+	}
+
+	struct xpath_variable_boolean: xpath_variable
+	{
+		xpath_variable_boolean(): value(false)
+		{
+		}
+
+		bool value;
+		char_t name[1];
+	};
+
+	struct xpath_variable_number: xpath_variable
+	{
+		xpath_variable_number(): value(0)
+		{
+		}
+
+		double value;
+		char_t name[1];
+	};
+
+	struct xpath_variable_string: xpath_variable
+	{
+		xpath_variable_string(): value(0)
+		{
+		}
+
+		~xpath_variable_string()
+		{
+			if (value) global_deallocate(value);
+		}
+
+		char_t* value;
+		char_t name[1];
+	};
+
+	struct xpath_variable_node_set: xpath_variable
+	{
+		xpath_node_set value;
+		char_t name[1];
+	};
+
+	const xpath_node_set dummy_node_set;
+
+	unsigned int hash_string(const char_t* begin, const char_t* end)
+	{
+		// Jenkins one-at-a-time hash (http://en.wikipedia.org/wiki/Jenkins_hash_function#one-at-a-time)
+		unsigned int result = 0;
+
+		for (const char_t* it = begin; it != end; ++it)
+		{
+			result += static_cast<unsigned int>(*it);
+			result += result << 10;
+			result ^= result >> 6;
+		}
+	
+		result += result << 3;
+		result ^= result >> 11;
+		result += result << 15;
+	
+		return result;
+	}
+
+	unsigned int hash_string(const char_t* str)
+	{
+		return hash_string(str, str + strlength(str));
+	}
+
+	template <typename T> T* new_xpath_variable(const char_t* name)
+	{
+		size_t length = strlength(name);
+		if (length == 0) return 0; // empty variable names are invalid
+
+		// $$ we can't use offsetof(T, name) because T is non-POD, so we just allocate additional length characters
+		void* memory = global_allocate(sizeof(T) + length * sizeof(char_t));
+		if (!memory) return 0;
+
+		T* result = new (memory) T();
+
+		memcpy(result->name, name, (length + 1) * sizeof(char_t));
+
+		return result;
+	}
+
+	xpath_variable* new_xpath_variable(xpath_value_type type, const char_t* name)
+	{
+		switch (type)
+		{
+		case xpath_type_node_set:
+			return new_xpath_variable<xpath_variable_node_set>(name);
+
+		case xpath_type_number:
+			return new_xpath_variable<xpath_variable_number>(name);
+
+		case xpath_type_string:
+			return new_xpath_variable<xpath_variable_string>(name);
+
+		case xpath_type_boolean:
+			return new_xpath_variable<xpath_variable_boolean>(name);
+
+		default:
+			return 0;
+		}
+	}
+
+	template <typename T> void delete_xpath_variable(T* var)
+	{
+		var->~T();
+		global_deallocate(var);
+	}
+
+	void delete_xpath_variable(xpath_value_type type, xpath_variable* var)
+	{
+		switch (type)
+		{
+		case xpath_type_node_set:
+			delete_xpath_variable(static_cast<xpath_variable_node_set*>(var));
+			break;
+
+		case xpath_type_number:
+			delete_xpath_variable(static_cast<xpath_variable_number*>(var));
+			break;
+
+		case xpath_type_string:
+			delete_xpath_variable(static_cast<xpath_variable_string*>(var));
+			break;
+
+		case xpath_type_boolean:
+			delete_xpath_variable(static_cast<xpath_variable_boolean*>(var));
+			break;
+
+		default:
+			assert(!"Invalid variable type");
+		}
+	}
+
+	xpath_variable* get_variable(xpath_variable_set* set, const char_t* begin, const char_t* end)
+	{
+		char_t buffer[32];
+
+		size_t length = static_cast<size_t>(end - begin);
+		char_t* scratch = buffer;
+
+		if (length >= sizeof(buffer) / sizeof(buffer[0]))
+		{
+			// need to make dummy on-heap copy
+			scratch = static_cast<char_t*>(global_allocate((length + 1) * sizeof(char_t)));
+			if (!scratch) return 0;
+		}
+
+		// copy string to zero-terminated buffer and perform lookup
+		memcpy(scratch, begin, length * sizeof(char_t));
+		scratch[length] = 0;
+
+		xpath_variable* result = set->get(scratch);
+
+		// free dummy buffer
+		if (scratch != buffer) global_deallocate(scratch);
+
+		return result;
+	}
+}
+
+// XPath extension functions
+namespace pugihtml
+{
+	struct xpath_function_entry
+	{
+		xpath_function_entry* next;
+
+		xpath_function_callback callback;
+		void* data;
+
+		xpath_value_type result;
+		size_t argument_count;
+
+		// argument types and name are allocated after the entry
+		xpath_value_type* arguments;
+		char_t* name;
+
+		static xpath_function_entry* create(const char_t* name, xpath_value_type result, const xpath_value_type* arguments, size_t argument_count)
+		{
+			size_t length = strlength(name);
+
+			void* memory = global_allocate(sizeof(xpath_function_entry) + argument_count * sizeof(xpath_value_type) + (length + 1) * sizeof(char_t));
+			if (!memory) return 0;
+
+			xpath_function_entry* entry = static_cast<xpath_function_entry*>(memory);
+
+			entry->next = 0;
+			entry->callback = 0;
+			entry->data = 0;
+			entry->result = result;
+			entry->argument_count = argument_count;
+			entry->arguments = reinterpret_cast<xpath_value_type*>(entry + 1);
+			entry->name = reinterpret_cast<char_t*>(entry->arguments + argument_count);
+
+			if (argument_count) memcpy(entry->arguments, arguments, argument_count * sizeof(xpath_value_type));
+			memcpy(entry->name, name, (length + 1) * sizeof(char_t));
+
+			return entry;
+		}
+
+		static xpath_function_entry* find(const xpath_function_set* set, const char_t* begin, const char_t* end, size_t argument_count)
+		{
+			const size_t hash_size = sizeof(set->_data) / sizeof(set->_data[0]);
+			size_t hash = hash_string(begin, end) % hash_size;
+			size_t length = static_cast<size_t>(end - begin);
+
+			for (xpath_function_entry* f = set->_data[hash]; f; f = f->next)
+				if (f->argument_count == argument_count && strequalrange(f->name, begin, length))
+					return f;
+
+			return 0;
+		}
+
+		static void insert(xpath_function_set* set, xpath_function_entry* entry)
+		{
+			const size_t hash_size = sizeof(set->_data) / sizeof(set->_data[0]);
+			size_t hash = hash_string(entry->name) % hash_size;
+
+			entry->next = set->_data[hash];
+			set->_data[hash] = entry;
+		}
+
+		static void destroy(xpath_function_set* set)
+		{
+			const size_t hash_size = sizeof(set->_data) / sizeof(set->_data[0]);
+
+			for (size_t i = 0; i < hash_size; ++i)
+			{
+				xpath_function_entry* f = set->_data[i];
+
+				while (f)
+				{
+					xpath_function_entry* next = f->next;
+
+					global_deallocate(f);
+
+					f = next;
+				}
+
+				set->_data[i] = 0;
+			}
+		}
+	};
+}
+
+// Internal node set class
+namespace
+{
+	xpath_node_set::type_t xpath_sort(xpath_node* begin, xpath_node* end, xpath_node_set::type_t type, bool rev)
+	{
+		xpath_node_set::type_t order = rev ? xpath_node_set::type_sorted_reverse : xpath_node_set::type_sorted;
+
+		if (type == xpath_node_set::type_unsorted)
+		{
+			sort(begin, end, document_order_comparator());
+
+			type = xpath_node_set::type_sorted;
+		}
+		
+		if (type != order) reverse(begin, end);
+			
+		return order;
+	}
+
+	xpath_node xpath_first(const xpath_node* begin, const xpath_node* end, xpath_node_set::type_t type)
+	{
+		if (begin == end) return xpath_node();
+
+		switch (type)
+		{
+		case xpath_node_set::type_sorted:
+			return *begin;
+
+		case xpath_node_set::type_sorted_reverse:
+			return *(end - 1);
+
+		case xpath_node_set::type_unsorted:
+			return *min_element(begin, end, document_order_comparator());
+
+		default:
+			assert(!"Invalid node set type");
+			return xpath_node();
+		}
+	}
+	// Minimal size of node sets that are sorted with a bitmap (see xpath_node_set_raw::sort_dense), and the maximal range of pre-order numbers per node
+	const size_t xpath_bitmap_min_size = 256;
+	const size_t xpath_bitmap_max_range = 16;
+
+	class xpath_node_set_raw
+	{
+		xpath_node_set::type_t _type;
+
+		xpath_node* _begin;
+		xpath_node* _end;
+		xpath_node* _eos;
+
+	public:
+		xpath_node_set_raw(): _type(xpath_node_set::type_unsorted), _begin(0), _end(0), _eos(0)
+		{
+		}
+
+		xpath_node* begin() const
+		{
+			return _begin;
+		}
+
+		xpath_node* end() const
+		{
+			return _end;
+		}
+
+		bool empty() const
+		{
+			return _begin == _end;
+		}
+
+		size_t size() const
+		{
+			return static_cast<size_t>(_end - _begin);
+		}
+
+		xpath_node first() const
+		{
+			return xpath_first(_begin, _end, _type);
+		}
+
+		void push_back(const xpath_node& node, xpath_allocator* alloc)
+		{
+			if (_end == _eos)
+			{
+				size_t capacity = static_cast<size_t>(_eos - _begin);
+
+				// get new capacity (1.5x rule)
+				size_t new_capacity = capacity + capacity / 2 + 1;
+
+				// reallocate the old array or allocate a new one
+				xpath_node* data = static_cast<xpath_node*>(alloc->reallocate(_begin, capacity * sizeof(xpath_node), new_capacity * sizeof(xpath_node)));
+				assert(data);
+
+				// finalize
+				_begin = data;
+				_end = data + capacity;
+				_eos = data + new_capacity;
+			}
+
+			*_end++ = node;
+		}
+
+		void append(const xpath_node* begin, const xpath_node* end, xpath_allocator* alloc)
+		{
+			size_t size = static_cast<size_t>(_end - _begin);
+			size_t capacity = static_cast<size_t>(_eos - _begin);
+			size_t count = static_cast<size_t>(end - begin);
+			if (count == 0) return;
+
+			if (size + count > capacity)
+			{
+				// reallocate the old array or allocate a new one
+				xpath_node* data = static_cast<xpath_node*>(alloc->reallocate(_begin, capacity * sizeof(xpath_node), (size + count) * sizeof(xpath_node)));
+				assert(data);
+
+				// finalize
+				_begin = data;
+				_end = data + size;
+				_eos = data + size + count;
+			}
+
+			memcpy(_end, begin, count * sizeof(xpath_node));
+			_end += count;
+		}
+
+		void sort_do()
+		{
+			_type = xpath_sort(_begin, _end, _type, false);
+		}
+
+		void truncate(xpath_node* pos)
+		{
+			assert(_begin <= pos && pos <= _end);
+
+			_end = pos;
+		}
+
+		// Merge a set in document order into this set in document order; the nodes that are in both sets are kept once
+		void merge(const xpath_node* begin, const xpath_node* end, xpath_allocator* alloc)
+		{
+			assert(_type == xpath_node_set::type_sorted);
+
+			size_t size = static_cast<size_t>(_end - _begin);
+			size_t capacity = static_cast<size_t>(_eos - _begin);
+			size_t count = static_cast<size_t>(end - begin);
+			if (count == 0) return;
+
+			if (size + count > capacity)
+			{
+				// reallocate the old array or allocate a new one
+				xpath_node* data = static_cast<xpath_node*>(alloc->reallocate(_begin, capacity * sizeof(xpath_node), (size + count) * sizeof(xpath_node)));
+				assert(data);
+
+				// finalize
+				_begin = data;
+				_end = data + size;
+				_eos = data + size + count;
+			}
+
+			// merge from the back so that the nodes of this set are moved at most once
+			xpath_node* write = _begin + size + count;
+			xpath_node* left = _end;
+			document_order_comparator pred;
+
+			while (end != begin)
+			{
+				if (left != _begin && pred(*(end - 1), *(left - 1)))
+					*--write = *--left;
+				else
+					*--write = *--end;
+			}
+
+			_end = unique(_begin, _begin + size + count);
+		}
+
+		void remove_duplicates(xpath_allocator* alloc)
+		{
+			if (_type == xpath_node_set::type_unsorted)
+			{
+				// sorting by pre-order numbers is as cheap as sorting by address and leaves the set in document order
+				html_node_struct* first = _begin == _end ? 0 : (_begin->attribute() ? _begin->parent() : _begin->node()).internal_object();
+
+				if (first && document_order_current(first, first))
+				{
+					if (sort_dense(alloc)) return;
+
+					sort(_begin, _end, document_order_comparator());
+					_type = xpath_node_set::type_sorted;
+				}
+				else
+					sort(_begin, _end, duplicate_comparator());
+			}
+		
+			_end = unique(_begin, _end);
+		}
+
+		// Sort the nodes of a large set that covers a dense range of pre-order numbers and remove duplicates in linear time: the nodes are
+		// marked in a bitmap indexed by pre-order number and collected by a traversal of the range. Returns false if the set is too small
+		// or too sparse, or contains attributes or nodes of several documents; document order has to be current.
+		bool sort_dense(xpath_allocator* alloc)
+		{
+			size_t count = static_cast<size_t>(_end - _begin);
+			if (count < xpath_bitmap_min_size) return false;
+
+			html_node_struct* first = _begin->node().internal_object();
+			if (!first) return false;
+
+			html_node_struct* last = first;
+			const html_document_struct* doc = &get_document(first->header);
+
+			for (const xpath_node* it = _begin; it != _end; ++it)
+			{
+				html_node_struct* node = it->node().internal_object();
+				if (!node || &get_document(node->header) != doc) return false;
+
+				if (node->pre < first->pre) first = node;
+				if (node->pre > last->pre) last = node;
+			}
+
+			size_t range = last->pre - first->pre + 1;
+			if (range / xpath_bitmap_max_range > count) return false;
+
+			xpath_allocator_capture cr(alloc);
+
+			const size_t word_bits = sizeof(size_t) * 8;
+			size_t words = (range + word_bits - 1) / word_bits;
+
+			size_t* bitmap = static_cast<size_t*>(alloc->allocate(words * sizeof(size_t)));
+			memset(bitmap, 0, words * sizeof(size_t));
+
+			for (const xpath_node* it = _begin; it != _end; ++it)
+			{
+				size_t index = it->node().internal_object()->pre - first->pre;
+
+				bitmap[index / word_bits] |= static_cast<size_t>(1) << (index % word_bits);
+			}
+
+			// no more nodes are collected than the set had, so they are written over the set
+			xpath_node* write = _begin;
+
+			for (html_node_struct* cur = first; ; )
+			{
+				size_t index = cur->pre - first->pre;
+
+				if (bitmap[index / word_bits] & (static_cast<size_t>(1) << (index % word_bits))) *write++ = xpath_node(html_node(cur));
+
+				if (cur == last) break;
+
+				if (cur->first_child)
+					cur = cur->first_child;
+				else
+				{
+					while (!cur->next_sibling) cur = cur->parent;
+					cur = cur->next_sibling;
+				}
+			}
+
+			_end = write;
+			_type = xpath_node_set::type_sorted;
+
+			return true;
+		}
+
+		xpath_node_set::type_t type() const
+		{
+			return _type;
+		}
+
+		void set_type(xpath_node_set::type_t type)
+		{
+			_type = type;
+		}
+	};
+}
+
+// Lookup structures for comparisons against node sets
+namespace
+{
+	// Open addressing hash set of node string values
+	struct xpath_string_set
+	{
+		const char_t** slots;
+		size_t capacity;
+		size_t size;
+
+		// The strings are allocated from alloc and stay valid as long as the table
+		void build(const xpath_node* begin, const xpath_node* end, xpath_allocator* alloc)
+		{
+			capacity = 8;
+			while (capacity < static_cast<size_t>(end - begin) * 2) capacity *= 2;
+
+			slots = static_cast<const char_t**>(alloc->allocate(capacity * sizeof(const char_t*)));
+			memset(slots, 0, capacity * sizeof(const char_t*));
+			size = 0;
+
+			for (const xpath_node* it = begin; it != end; ++it)
+			{
+				const char_t* value = string_value(*it, alloc).c_str();
+				const char_t** slot = find(value);
+
+				if (!*slot)
+				{
+					*slot = value;
+					size++;
+				}
+			}
+		}
+
+		const char_t** find(const char_t* value) const
+		{
+			size_t mask = capacity - 1;
+			size_t bucket = hash_string(value) & mask;
+
+			// linear probing; the table is at most half full so an empty slot is always reached
+			while (slots[bucket] && !strequal(slots[bucket], value)) bucket = (bucket + 1) & mask;
+
+			return slots + bucket;
+		}
+
+		bool contains(const char_t* value) const
+		{
+			return *find(value) != 0;
+		}
+	};
+
+	// Sorted numeric values of a node set; nodes that do not convert to a number are left out since they compare false
+	struct xpath_number_list
+	{
+		double* values;
+		size_t size;
+
+		void build(const xpath_node* begin, const xpath_node* end, xpath_allocator* alloc)
+		{
+			values = static_cast<double*>(alloc->allocate((static_cast<size_t>(end - begin) + 1) * sizeof(double)));
+			size = 0;
+
+			for (const xpath_node* it = begin; it != end; ++it)
+			{
+				xpath_allocator_capture cr(alloc);
+
+				double value = convert_string_to_number(string_value(*it, alloc).c_str());
+
+				if (!is_nan(value)) values[size++] = value;
+			}
+
+			sort(values, values + size, less());
+		}
+
+		bool contains(double value) const
+		{
+			size_t begin = 0, end = size;
+
+			while (begin < end)
+			{
+				size_t middle = begin + (end - begin) / 2;
+
+				if (values[middle] < value) begin = middle + 1;
+				else end = middle;
+			}
+
+			return begin < size && values[begin] == value;
+		}
+	};
+}
+
+// Attribute lookups for elements_with_class/elements_with_attribute
+namespace
+{
+	// Check if string is a valid class token (non-empty, no whitespace)
+	bool is_token(const char_t* s, size_t length)
+	{
+		if (length == 0) return false;
+
+		for (size_t i = 0; i < length; ++i)
+			if (IS_CHARTYPE(s[i], ct_space)) return false;
+
+		return true;
+	}
+
+	bool has_token(const char_t* value, const char_t* token, size_t length)
+	{
+		for (const char_t* s = value; *s; )
+		{
+			while (IS_CHARTYPE(*s, ct_space)) ++s;
+
+			const char_t* begin = s;
+
+			while (*s && !IS_CHARTYPE(*s, ct_space)) ++s;
+
+			if (static_cast<size_t>(s - begin) == length && memcmp(begin, token, length * sizeof(char_t)) == 0) return true;
+		}
+
+		return false;
+	}
+
+	// Check if the element has the class token; the class attribute name is the one of the document of the node
+	bool node_has_class(html_node_struct* node, const char_t* token, size_t length)
+	{
+		const html_document_struct& doc = get_document(node->header);
+
+		const char_t* name = document_class_name(doc);
+		bool nocase = document_class_nocase(doc);
+
+		for (html_attribute_struct* a = node->first_attribute; a; a = a->next_attribute)
+			if (a->name && is_class_name(a->name, name, nocase) && has_token(a->value ? a->value : PUGIHTML_TEXT(""), token, length))
+				return true;
+
+		return false;
+	}
+
+	bool attribute_matches(html_node_struct* node, const char_t* name, const char_t* value)
+	{
+		for (html_attribute_struct* a = node->first_attribute; a; a = a->next_attribute)
+			if (a->name && strequal(a->name, name) && strequal(a->value ? a->value : PUGIHTML_TEXT(""), value))
+				return true;
+
+		return false;
+	}
+
+	bool node_is_descendant(const html_node_struct* node, const html_node_struct* root)
+	{
+		if (document_order_current(node, root)) return root->pre < node->pre && node->post < root->post;
+
+		for (node = node->parent; node; node = node->parent)
+			if (node == root) return true;
+
+		return false;
+	}
+
+	// Get the range of posting list elements that are descendants of root (and root itself if self is set); they are consecutive in document order
+	void index_subtree(const html_attribute_index* index, const html_index_entry* entry, const html_node_struct* root, bool self, html_node_struct**& begin, html_node_struct**& end)
+	{
+		html_node_struct** it = index->postings + entry->offset;
+		html_node_struct** last = it + entry->count;
+
+		if (static_cast<html_node_type>((root->header & html_memory_page_type_mask) + 1) != node_document)
+		{
+			while (it != last && !(*it == root ? self : node_is_descendant(*it, root))) ++it;
+
+			html_node_struct** stop = it;
+
+			while (stop != last && (*stop == root ? self : node_is_descendant(*stop, root))) ++stop;
+
+			last = stop;
+		}
+
+		begin = it;
+		end = last;
+	}
+
+	// Select descendant elements of n that have attribute with the specified value (or value token), using document index if possible
+	void select_by_attribute(xpath_node_set_raw& ns, const html_node& n, const char_t* name, const char_t* value, bool token, xpath_allocator* alloc)
+	{
+		html_node_struct* root = n.internal_object();
+		html_document_struct& doc = get_document(root->header);
+		size_t length = strlength(value);
+
+		html_attribute_index* index = index_get(doc);
+		size_t attribute = index ? index_attribute_id(index, name) : static_cast<size_t>(-1);
+
+		// class values that are not single tokens can not be found via token index
+		if (attribute != static_cast<size_t>(-1) && (attribute != 0 || is_token(value, length)))
+		{
+			const html_index_entry* entry = index_find(index, attribute, value, length);
+			if (!entry) return;
+
+			html_node_struct** begin;
+			html_node_struct** end;
+
+			index_subtree(index, entry, root, false, begin, end);
+
+			for (html_node_struct** it = begin; it != end; ++it)
+			{
+				// class value equality implies that the value is one of the class tokens
+				if (token || attribute != 0 || attribute_matches(*it, name, value))
+					ns.push_back(html_node(*it), alloc);
+			}
+		}
+		else
+		{
+			html_node_struct* cur = root->first_child;
+
+			while (cur)
+			{
+				if (static_cast<html_node_type>((cur->header & html_memory_page_type_mask) + 1) == node_element &&
+					(token ? node_has_class(cur, value, length) : attribute_matches(cur, name, value)))
+					ns.push_back(html_node(cur), alloc);
+
+				if (cur->first_child)
+					cur = cur->first_child;
+				else
+				{
+					while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+					cur = (cur == root) ? 0 : cur->next_sibling;
+				}
+			}
+		}
+	}
+}
+
+// Text lookups for find_text_nodes and contains() steps
+namespace
+{
+	struct text_span_less
+	{
+		bool operator()(const html_text_span& lhs, const html_text_span& rhs) const
+		{
+			return lhs.first != rhs.first ? lhs.first->pre < rhs.first->pre : lhs.last->pre < rhs.last->pre;
+		}
+	};
+
+	// Check if the token can contain the word: as a whole (delimited on both sides in the text), as a prefix (delimited on the left),
+	// as a suffix (delimited on the right) or anywhere
+	bool text_token_matches(const html_text_index* index, const html_text_token& token, const char_t* word, size_t length, bool left, bool right)
+	{
+		if (token.length < length || ((left && right) && token.length != length)) return false;
+
+		const char_t* key = index->chars + token.key;
+
+		if (left) return text_key_equal(key, word, length);
+		if (right) return text_key_equal(key + token.length - length, word, length);
+
+		for (size_t i = 0; i + length <= token.length; ++i)
+			if (text_key_equal(key + i, word, length)) return true;
+
+		return false;
+	}
+
+	// Get token occurrences in document order such that every string value containing the text overlaps one of them; returns false if the
+	// index does not narrow the search (the text has no word characters or matches most of the document)
+	bool text_candidates(const html_text_index* index, const char_t* text, xpath_allocator* alloc, const html_text_span*& begin, const html_text_span*& end)
+	{
+		const html_text_token* best = 0;
+
+		const char_t* part = 0;
+		size_t part_length = 0;
+		bool part_left = false, part_right = false;
+
+		for (const char_t* s = text; *s; )
+		{
+			if (!text_is_word(*s))
+			{
+				++s;
+				continue;
+			}
+
+			const char_t* word = s;
+
+			while (text_is_word(*s)) ++s;
+
+			size_t length = static_cast<size_t>(s - word);
+			bool left = word != text, right = *s != 0;
+
+			if (left && right)
+			{
+				// the word is a whole token of any string that contains the text
+				const html_text_token* token = text_index_find(index, word, length);
+
+				if (!token)
+				{
+					begin = end = index->spans;
+					return true;
+				}
+
+				if (!best || token->count < best->count) best = token;
+			}
+			else if (length > part_length)
+			{
+				part = word;
+				part_length = length;
+				part_left = left;
+				part_right = right;
+			}
+		}
+
+		if (best)
+		{
+			begin = index->spans + best->offset;
+			end = begin + best->count;
+			return true;
+		}
+
+		if (!part) return false;
+
+		// otherwise merge the occurrences of all tokens that can contain the longest word
+		const html_text_token* match = 0;
+		size_t count = 0, total = 0;
+
+		for (size_t i = 0; i < index->token_count; ++i)
+			if (text_token_matches(index, index->tokens[i], part, part_length, part_left, part_right))
+			{
+				match = index->tokens + i;
+				count++;
+				total += match->count;
+			}
+
+		if (count <= 1)
+		{
+			begin = match ? index->spans + match->offset : index->spans;
+			end = match ? begin + match->count : begin;
+			return true;
+		}
+
+		if (total > index->span_count / 2) return false;
+
+		html_text_span* spans = static_cast<html_text_span*>(alloc->allocate(total * sizeof(html_text_span)));
+		html_text_span* write = spans;
+
+		for (size_t i = 0; i < index->token_count; ++i)
+		{
+			const html_text_token& token = index->tokens[i];
+
+			if (text_token_matches(index, token, part, part_length, part_left, part_right))
+			{
+				memcpy(write, index->spans + token.offset, token.count * sizeof(html_text_span));
+				write += token.count;
+			}
+		}
+
+		// occurrences of different tokens do not overlap, so the last nodes are ordered as well
+		sort(spans, write, text_span_less());
+
+		begin = spans;
+		end = write;
+		return true;
+	}
+
+	// Get the first occurrence that is not before the subtree of root
+	const html_text_span* text_subtree_begin(const html_node_struct* root, const html_text_span* begin, const html_text_span* end)
+	{
+		size_t count = static_cast<size_t>(end - begin);
+
+		while (count > 0)
+		{
+			size_t step = count / 2;
+
+			if (begin[step].last->pre < root->pre)
+			{
+				begin += step + 1;
+				count -= step + 1;
+			}
+			else count = step;
+		}
+
+		return begin;
+	}
+
+	inline bool text_in_subtree(const html_node_struct* node, const html_node_struct* root)
+	{
+		return node->pre >= root->pre && node->post <= root->post;
+	}
+
+	inline bool text_after_subtree(const html_node_struct* node, const html_node_struct* root)
+	{
+		return node->pre > root->pre && node->post > root->post;
+	}
+
+	// Get the next text node in document order
+	html_node_struct* text_next(html_node_struct* cur)
+	{
+		do
+		{
+			if (cur->first_child)
+				cur = cur->first_child;
+			else
+			{
+				while (cur && !cur->next_sibling) cur = cur->parent;
+
+				if (cur) cur = cur->next_sibling;
+			}
+		}
+		while (cur && !text_is_node(cur));
+
+		return cur;
+	}
+
+	// Select descendant text nodes of n that contain the text, using document full-text index if possible
+	void select_by_text(xpath_node_set_raw& ns, const html_node& n, const char_t* text, xpath_allocator* alloc)
+	{
+		html_node_struct* root = n.internal_object();
+		html_document_struct& doc = get_document(root->header);
+
+		html_text_index* index = text_index_get(doc);
+
+		const html_text_span* begin;
+		const html_text_span* end;
+
+		if (index && text_candidates(index, text, alloc, begin, end))
+		{
+			html_node_struct* done = 0;
+
+			for (const html_text_span* it = text_subtree_begin(root, begin, end); it != end && !text_after_subtree(it->first, root); ++it)
+			{
+				// text nodes of a token that continues over several nodes are checked once
+				html_node_struct* cur = it->first;
+
+				if (done && cur->pre <= done->pre)
+				{
+					if (it->last->pre <= done->pre) continue;
+
+					cur = text_next(done);
+				}
+
+				for (;;)
+				{
+					if (cur != root && text_in_subtree(cur, root) && cur->value && find_substring(cur->value, text))
+						ns.push_back(html_node(cur), alloc);
+
+					done = cur;
+
+					if (cur == it->last) break;
+
+					cur = text_next(cur);
+				}
+			}
+		}
+		else
+		{
+			html_node_struct* cur = root->first_child;
+
+			while (cur)
+			{
+				if (text_is_node(cur) && cur->value && find_substring(cur->value, text))
+					ns.push_back(html_node(cur), alloc);
+
+				if (cur->first_child)
+					cur = cur->first_child;
+				else
+				{
+					while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+					cur = (cur == root) ? 0 : cur->next_sibling;
+				}
+			}
+		}
+	}
+}
+
+// State of an XPath extension function call
+namespace pugihtml
+{
+	struct xpath_function_invocation
+	{
+		struct argument
+		{
+			bool boolean;
+			double number;
+			const char_t* string;
+			xpath_node_set_raw set;
+
+			// node set argument as public object, created on first use
+			xpath_node_set* node_set;
+		};
+
+		const xpath_function_entry* function;
+		xpath_node context;
+		argument* arguments;
+
+		// arguments are allocated on the first allocator, string result is copied to the second one
+		xpath_allocator* argument_alloc;
+		xpath_allocator* result_alloc;
+
+		bool boolean;
+		double number;
+		const char_t* string;
+
+		xpath_function_invocation(const xpath_function_entry* function, const xpath_node& context, xpath_allocator* argument_alloc, xpath_allocator* result_alloc):
+			function(function), context(context), arguments(0), argument_alloc(argument_alloc), result_alloc(result_alloc), boolean(false), number(gen_nan()), string(PUGIHTML_TEXT(""))
+		{
+			if (function->argument_count)
+			{
+				arguments = static_cast<argument*>(argument_alloc->allocate(function->argument_count * sizeof(argument)));
+
+				for (size_t i = 0; i < function->argument_count; ++i)
+					new (arguments + i) argument();
+			}
+		}
+
+		~xpath_function_invocation()
+		{
+			for (size_t i = 0; i < function->argument_count; ++i)
+				if (arguments[i].node_set) arguments[i].node_set->~xpath_node_set();
+		}
+
+		void call()
+		{
+			xpath_function_call call(this);
+
+			function->callback(call);
+		}
+	};
+}
+
+namespace
+{
+	// Value of a context-independent subexpression for one document (see ast_invariant)
+	struct xpath_invariant
+	{
+		const void* expr;
+		const void* document;
+		xpath_invariant* next;
+
+		xpath_node_set_raw set;
+		const char_t* string;
+		double number;
+		bool boolean;
+
+		// lookup structures for comparisons against the node set, built on first use
+		xpath_string_set* strings;
+		xpath_number_list* numbers;
+	};
+
+	struct xpath_context
+	{
+		xpath_node n;
+		size_t position, size;
+
+		xpath_context(const xpath_node& n, size_t position, size_t size): n(n), position(position), size(size)
+		{
+		}
+	};
+
+	enum lexeme_t
+	{
+		lex_none = 0,
+		lex_equal,
+		lex_not_equal,
+		lex_less,
+		lex_greater,
+		lex_less_or_equal,
+		lex_greater_or_equal,
+		lex_plus,
+		lex_minus,
+		lex_multiply,
+		lex_union,
+		lex_var_ref,
+		lex_open_brace,
+		lex_close_brace,
+		lex_quoted_string,
+		lex_number,
+		lex_slash,
+		lex_double_slash,
+		lex_open_square_brace,
+		lex_close_square_brace,
+		lex_string,
+		lex_comma,
+		lex_axis_attribute,
+		lex_dot,
+		lex_double_dot,
+		lex_double_colon,
+		lex_eof
+	};
+
+	struct xpath_lexer_string
+	{
+		const char_t* begin;
+		const char_t* end;
+
+		xpath_lexer_string(): begin(0), end(0)
+		{
+		}
+
+		bool operator==(const char_t* other) const
+		{
+			size_t length = static_cast<size_t>(end - begin);
+
+			return strequalrange(other, begin, length);
+		}
+	};
+
+	class xpath_lexer
+	{
+		const char_t* _cur;
+		const char_t* _cur_lexeme_pos;
+		xpath_lexer_string _cur_lexeme_contents;
+
+		lexeme_t _cur_lexeme;
+
+	public:
+		explicit xpath_lexer(const char_t* query): _cur(query)
+		{
+			next();
+		}
+		
+		const char_t* state() const
+		{
+			return _cur;
+		}
+		
+		void next()
+		{
+			const char_t* cur = _cur;
+
+			while (IS_CHARTYPE(*cur, ct_space)) ++cur;
+
+			// save lexeme position for error reporting
+			_cur_lexeme_pos = cur;
+
+			switch (*cur)
+			{
+			case 0:
+				_cur_lexeme = lex_eof;
+				break;
+			
+			case '>':
+				if (*(cur+1) == '=')
+				{
+					cur += 2;
+					_cur_lexeme = lex_greater_or_equal;
+				}
+				else
+				{
+					cur += 1;
+					_cur_lexeme = lex_greater;
+				}
+				break;
+
+			case '<':
+				if (*(cur+1) == '=')
+				{
+					cur += 2;
+					_cur_lexeme = lex_less_or_equal;
+				}
+				else
+				{
+					cur += 1;
+					_cur_lexeme = lex_less;
+				}
+				break;
+
+			case '!':
+				if (*(cur+1) == '=')
+				{
+					cur += 2;
+					_cur_lexeme = lex_not_equal;
+				}
+				else
+				{
+					_cur_lexeme = lex_none;
+				}
+				break;
+
+			case '=':
+				cur += 1;
+				_cur_lexeme = lex_equal;
+
+				break;
+			
+			case '+':
+				cur += 1;
+				_cur_lexeme = lex_plus;
+
+				break;
+
+			case '-':
+				cur += 1;
+				_cur_lexeme = lex_minus;
+
+				break;
+
+			case '*':
+				cur += 1;
+				_cur_lexeme = lex_multiply;
+
+				break;
+
+			case '|':
+				cur += 1;
+				_cur_lexeme = lex_union;
+
+				break;
+			
+			case '$':
+				cur += 1;
+
+				if (IS_CHARTYPEX(*cur, ctx_start_symbol))
+				{
+					_cur_lexeme_contents.begin = cur;
+
+					while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+
+					if (cur[0] == ':' && IS_CHARTYPEX(cur[1], ctx_symbol)) // qname
+					{
+						cur++; // :
+
+						while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+					}
+
+					_cur_lexeme_contents.end = cur;
+				
+					_cur_lexeme = lex_var_ref;
+				}
+				else
+				{
+					_cur_lexeme = lex_none;
+				}
+
+				break;
+
+			case '(':
+				cur += 1;
+				_cur_lexeme = lex_open_brace;
+
+				break;
+
+			case ')':
+				cur += 1;
+				_cur_lexeme = lex_close_brace;
+
+				break;
+			
+			case '[':
+				cur += 1;
+				_cur_lexeme = lex_open_square_brace;
+
+				break;
+
+			case ']':
+				cur += 1;
+				_cur_lexeme = lex_close_square_brace;
+
+				break;
+
+			case ',':
+				cur += 1;
+				_cur_lexeme = lex_comma;
+
+				break;
+
+			case '/':
+				if (*(cur+1) == '/')
+				{
+					cur += 2;
+					_cur_lexeme = lex_double_slash;
+				}
+				else
+				{
+					cur += 1;
+					_cur_lexeme = lex_slash;
+				}
+				break;
+		
+			case '.':
+				if (*(cur+1) == '.')
+				{
+					cur += 2;
+					_cur_lexeme = lex_double_dot;
+				}
+				else if (IS_CHARTYPEX(*(cur+1), ctx_digit))
+				{
+					_cur_lexeme_contents.begin = cur; // .
+
+					++cur;
+
+					while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
+
+					_cur_lexeme_contents.end = cur;
+					
+					_cur_lexeme = lex_number;
+				}
+				else
+				{
+					cur += 1;
+					_cur_lexeme = lex_dot;
+				}
+				break;
+
+			case '@':
+				cur += 1;
+				_cur_lexeme = lex_axis_attribute;
+
+				break;
+
+			case '"':
+			case '\'':
+			{
+				char_t terminator = *cur;
+
+				++cur;
+
+				_cur_lexeme_contents.begin = cur;
+				while (*cur && *cur != terminator) cur++;
+				_cur_lexeme_contents.end = cur;
+				
+				if (!*cur)
+					_cur_lexeme = lex_none;
+				else
+				{
+					cur += 1;
+					_cur_lexeme = lex_quoted_string;
+				}
+
+				break;
+			}
+
+			case ':':
+				if (*(cur+1) == ':')
+				{
+					cur += 2;
+					_cur_lexeme = lex_double_colon;
+				}
+				else
+				{
+					_cur_lexeme = lex_none;
+				}
+				break;
+
+			default:
+				if (IS_CHARTYPEX(*cur, ctx_digit))
+				{
+					_cur_lexeme_contents.begin = cur;
+
+					while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
+				
+					if (*cur == '.')
+					{
+						cur++;
+
+						while (IS_CHARTYPEX(*cur, ctx_digit)) cur++;
+					}
+
+					_cur_lexeme_contents.end = cur;
+
+					_cur_lexeme = lex_number;
+				}
+				else if (IS_CHARTYPEX(*cur, ctx_start_symbol))
+				{
+					_cur_lexeme_contents.begin = cur;
+
+					while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+
+					if (cur[0] == ':')
+					{
+						if (cur[1] == '*') // namespace test ncname:*
+						{
+							cur += 2; // :*
+						}
+						else if (IS_CHARTYPEX(cur[1], ctx_symbol)) // namespace test qname
+						{
+							cur++; // :
+
+							while (IS_CHARTYPEX(*cur, ctx_symbol)) cur++;
+						}
+					}
+
+					_cur_lexeme_contents.end = cur;
+				
+					_cur_lexeme = lex_string;
+				}
+				else
+				{
+					_cur_lexeme = lex_none;
+				}
+			}
+
+			_cur = cur;
+		}
+
+		lexeme_t current() const
+		{
+			return _cur_lexeme;
+		}
+
+		const char_t* current_pos() const
+		{
+			return _cur_lexeme_pos;
+		}
+
+		const xpath_lexer_string& contents() const
+		{
+			assert(_cur_lexeme == lex_var_ref || _cur_lexeme == lex_number || _cur_lexeme == lex_string || _cur_lexeme == lex_quoted_string);
+
+			return _cur_lexeme_contents;
+		}
+	};
+
+	enum ast_type_t
+	{
+		ast_op_or,						// left or right
+		ast_op_and,						// left and right
+		ast_op_equal,					// left = right
+		ast_op_not_equal, 				// left != right
+		ast_op_less,					// left < right
+		ast_op_greater,					// left > right
+		ast_op_less_or_equal,			// left <= right
+		ast_op_greater_or_equal,		// left >= right
+		ast_op_add,						// left + right
+		ast_op_subtract,				// left - right
+		ast_op_multiply,				// left * right
+		ast_op_divide,					// left / right
+		ast_op_mod,						// left % right
+		ast_op_negate,					// left - right
+		ast_op_union,					// left | right
+		ast_predicate,					// apply predicate to set; next points to next predicate
+		ast_filter,						// select * from left where right
+		ast_filter_posinv,				// select * from left where right; proximity position invariant
+		ast_string_constant,			// string constant
+		ast_number_constant,			// number constant
+		ast_variable,					// variable
+		ast_func_last,					// last()
+		ast_func_position,				// position()
+		ast_func_count,					// count(left)
+		ast_func_id,					// id(left)
+		ast_func_local_name_0,			// local-name()
+		ast_func_local_name_1,			// local-name(left)
+		ast_func_namespace_uri_0,		// namespace-uri()
+		ast_func_namespace_uri_1,		// namespace-uri(left)
+		ast_func_name_0,				// name()
+		ast_func_name_1,				// name(left)
+		ast_func_string_0,				// string()
+		ast_func_string_1,				// string(left)
+		ast_func_concat,				// concat(left, right, siblings)
+		ast_func_starts_with,			// starts_with(left, right)
+		ast_func_contains,				// contains(left, right)
+		ast_func_substring_before,		// substring-before(left, right)
+		ast_func_substring_after,		// substring-after(left, right)
+		ast_func_substring_2,			// substring(left, right)
+		ast_func_substring_3,			// substring(left, right, third)
+		ast_func_string_length_0,		// string-length()
+		ast_func_string_length_1,		// string-length(left)
+		ast_func_normalize_space_0,		// normalize-space()
+		ast_func_normalize_space_1,		// normalize-space(left)
+		ast_func_translate,				// translate(left, right, third)
+		ast_func_boolean,				// boolean(left)
+		ast_func_not,					// not(left)
+		ast_func_true,					// true()
+		ast_func_false,					// false()
+		ast_func_lang,					// lang(left)
+		ast_func_number_0,				// number()
+		ast_func_number_1,				// number(left)
+		ast_func_sum,					// sum(left)
+		ast_func_floor,					// floor(left)
+		ast_func_ceiling,				// ceiling(left)
+		ast_func_round,					// round(left)
+		ast_func_has_class,				// has-class(left)
+		ast_func_lower_case,			// lower-case(left)
+		ast_func_ends_with,				// ends-with(left, right)
+		ast_func_matches_token,			// matches-token(left, right)
+		ast_func_extension,				// function from xpath_function_set (left, right, siblings)
+		ast_step,						// process set left with step
+		ast_step_root,					// select root node
+		ast_invariant					// context-independent left, evaluated once per query evaluation and document
+	};
+
+	enum axis_t
+	{
+		axis_ancestor,
+		axis_ancestor_or_self,
+		axis_attribute,
+		axis_child,
+		axis_descendant,
+		axis_descendant_or_self,
+		axis_following,
+		axis_following_sibling,
+		axis_namespace,
+		axis_parent,
+		axis_preceding,
+		axis_preceding_sibling,
+		axis_self
+	};
+	
+	enum nodetest_t
+	{
+		nodetest_none,
+		nodetest_name,
+		nodetest_type_node,
+		nodetest_type_comment,
+		nodetest_type_pi,
+		nodetest_type_text,
+		nodetest_pi,
+		nodetest_all,
+		nodetest_all_in_namespace
+	};
+
+	// Names used by xpath_query::explain, in enumeration order
+	const char_t* const ast_type_names[] =
+	{
+		PUGIHTML_TEXT("or"), PUGIHTML_TEXT("and"), PUGIHTML_TEXT("="), PUGIHTML_TEXT("!="), PUGIHTML_TEXT("<"), PUGIHTML_TEXT(">"), PUGIHTML_TEXT("<="), PUGIHTML_TEXT(">="),
+		PUGIHTML_TEXT("+"), PUGIHTML_TEXT("-"), PUGIHTML_TEXT("*"), PUGIHTML_TEXT("div"), PUGIHTML_TEXT("mod"), PUGIHTML_TEXT("negate"), PUGIHTML_TEXT("|"),
+		PUGIHTML_TEXT("predicate"), PUGIHTML_TEXT("filter"), PUGIHTML_TEXT("filter"), PUGIHTML_TEXT("string"), PUGIHTML_TEXT("number"), PUGIHTML_TEXT("variable"),
+		PUGIHTML_TEXT("last()"), PUGIHTML_TEXT("position()"), PUGIHTML_TEXT("count()"), PUGIHTML_TEXT("id()"), PUGIHTML_TEXT("local-name()"), PUGIHTML_TEXT("local-name()"),
+		PUGIHTML_TEXT("namespace-uri()"), PUGIHTML_TEXT("namespace-uri()"), PUGIHTML_TEXT("name()"), PUGIHTML_TEXT("name()"), PUGIHTML_TEXT("string()"), PUGIHTML_TEXT("string()"),
+		PUGIHTML_TEXT("concat()"), PUGIHTML_TEXT("starts-with()"), PUGIHTML_TEXT("contains()"), PUGIHTML_TEXT("substring-before()"), PUGIHTML_TEXT("substring-after()"),
+		PUGIHTML_TEXT("substring()"), PUGIHTML_TEXT("substring()"), PUGIHTML_TEXT("string-length()"), PUGIHTML_TEXT("string-length()"), PUGIHTML_TEXT("normalize-space()"),
+		PUGIHTML_TEXT("normalize-space()"), PUGIHTML_TEXT("translate()"), PUGIHTML_TEXT("boolean()"), PUGIHTML_TEXT("not()"), PUGIHTML_TEXT("true()"), PUGIHTML_TEXT("false()"),
+		PUGIHTML_TEXT("lang()"), PUGIHTML_TEXT("number()"), PUGIHTML_TEXT("number()"), PUGIHTML_TEXT("sum()"), PUGIHTML_TEXT("floor()"), PUGIHTML_TEXT("ceiling()"),
+		PUGIHTML_TEXT("round()"), PUGIHTML_TEXT("has-class()"), PUGIHTML_TEXT("lower-case()"), PUGIHTML_TEXT("ends-with()"), PUGIHTML_TEXT("matches-token()"),
+		PUGIHTML_TEXT("function"), PUGIHTML_TEXT("step"), PUGIHTML_TEXT("root"), PUGIHTML_TEXT("invariant")
+	};
+
+	const char_t* const axis_names[] =
+	{
+		PUGIHTML_TEXT("ancestor"), PUGIHTML_TEXT("ancestor-or-self"), PUGIHTML_TEXT("attribute"), PUGIHTML_TEXT("child"), PUGIHTML_TEXT("descendant"),
+		PUGIHTML_TEXT("descendant-or-self"), PUGIHTML_TEXT("following"), PUGIHTML_TEXT("following-sibling"), PUGIHTML_TEXT("namespace"), PUGIHTML_TEXT("parent"),
+		PUGIHTML_TEXT("preceding"), PUGIHTML_TEXT("preceding-sibling"), PUGIHTML_TEXT("self")
+	};
+
+	template <axis_t N> struct axis_to_type
+	{
+		static const axis_t axis;
+	};
+
+	template <axis_t N> const axis_t axis_to_type<N>::axis = N;
+
+	// Node set evaluation mode; evaluation of a set that is only tested for emptiness or for its first node stops as soon as the result is known
+	enum nodeset_eval_t
+	{
+		nodeset_eval_all,	// all nodes
+		nodeset_eval_any,	// any node
+		nodeset_eval_first	// first node in document order
+	};
+
+	// Check if only one node of a set with the specified order is needed
+	inline bool eval_once(xpath_node_set::type_t type, nodeset_eval_t eval)
+	{
+		return type == xpath_node_set::type_sorted ? eval != nodeset_eval_all : eval == nodeset_eval_any;
+	}
+
+	// Compiled scalar expression (see xpath_compiler)
+	struct xpath_program;
+
+	bool eval_program_boolean(const xpath_program* program, const xpath_context& c, const xpath_stack& stack);
+	double eval_program_number(const xpath_program* program, const xpath_context& c, const xpath_stack& stack);
+	xpath_string eval_program_string(const xpath_program* program, const xpath_context& c, const xpath_stack& stack);
+
+	// Limit on the nodes a step collects from one context node
+	// Destination of the nodes of a step that are passed to a visitor instead of being collected
+	struct xpath_step_visit
+	{
+		xpath_node_visitor* visitor;
+		bool stopped;
+	};
+
+	struct xpath_step_limit
+	{
+		size_t count;				// maximum number of nodes, 0 if unlimited
+		const xpath_stack* stack;	// if set, step predicates are checked while the nodes are collected
+		xpath_step_visit* visit;	// if set, the nodes are passed to the visitor; only the node that stops the visitor is counted
+	};
+
+	// Text occurrences that narrow a descendant step (see xpath_ast_node::step_text); they are looked up once per document
+	// for all context nodes of the step
+	struct xpath_step_text
+	{
+		xpath_allocator* alloc;		// temporary allocator for merged occurrences, captured by the step
+		const html_document_struct* doc;
+		bool found;
+		const html_text_span* begin;
+		const html_text_span* end;
+	};
+		
+	class xpath_ast_node
+	{
+	private:
+		// node type
+		char _type;
+		char _rettype;
+
+		// for ast_step / ast_predicate
+		char _axis;
+		char _test;
+
+		// tree node structure
+		xpath_ast_node* _left;
+		xpath_ast_node* _right;
+		xpath_ast_node* _next;
+
+		union
+		{
+			// value for ast_string_constant
+			const char_t* string;
+			// value for ast_number_constant
+			double number;
+			// variable for ast_variable
+			xpath_variable* variable;
+			// node test for ast_step (node name/namespace/node type/pi target)
+			const char_t* nodetest;
+			// compiled expression for ast_predicate/ast_filter, if any
+			const xpath_program* program;
+			// function for ast_func_extension
+			const xpath_function_entry* function;
+			// constant pattern for ast_func_contains, if it is searched in place
+			const xpath_pattern* pattern;
+		} _data;
+
+		friend struct xpath_compiler;
+		friend struct xpath_image;
+
+		xpath_ast_node(const xpath_ast_node&);
+		xpath_ast_node& operator=(const xpath_ast_node&);
+
+		static bool is_equality(const equal_to&)
+		{
+			return true;
+		}
+
+		static bool is_equality(const not_equal_to&)
+		{
+			return false;
+		}
+
+		// Lookup structures of a hoisted node set; they are kept with the cached value, so a predicate that compares
+		// against the same set for every node builds them once
+		static const xpath_string_set* invariant_strings(xpath_ast_node* n, const xpath_context& c, const xpath_stack& stack)
+		{
+			if (n->_type != ast_invariant || n->_rettype != xpath_type_node_set) return 0;
+
+			xpath_invariant* i = n->invariant(c, stack);
+
+			if (!i->strings)
+			{
+				xpath_string_set* strings = static_cast<xpath_string_set*>(stack.invariants->alloc->allocate(sizeof(xpath_string_set)));
+				strings->build(i->set.begin(), i->set.end(), stack.invariants->alloc);
+
+				i->strings = strings;
+			}
+
+			return i->strings;
+		}
+
+		static const xpath_number_list* invariant_numbers(xpath_ast_node* n, const xpath_context& c, const xpath_stack& stack)
+		{
+			if (n->_type != ast_invariant || n->_rettype != xpath_type_node_set) return 0;
+
+			xpath_invariant* i = n->invariant(c, stack);
+
+			if (!i->numbers)
+			{
+				xpath_number_list* numbers = static_cast<xpath_number_list*>(stack.invariants->alloc->allocate(sizeof(xpath_number_list)));
+				numbers->build(i->set.begin(), i->set.end(), stack.invariants->alloc);
+
+				i->numbers = numbers;
+			}
+
+			return i->numbers;
+		}
+
+		static bool contains_any(const xpath_node_set_raw& ns, const xpath_string_set& strings, const xpath_stack& stack)
+		{
+			for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				if (strings.contains(string_value(*it, stack).c_str()))
+					return true;
+			}
+
+			return false;
+		}
+
+		static bool contains_other(const xpath_node_set_raw& ns, const xpath_string& value, const xpath_stack& stack)
+		{
+			for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				if (string_value(*it, stack) != value)
+					return true;
+			}
+
+			return false;
+		}
+
+		// Get the smallest or largest numeric value of the node set; fails if no node converts to a number
+		static bool number_bound(xpath_ast_node* n, const xpath_context& c, const xpath_stack& stack, bool largest, double* out_result)
+		{
+			if (const xpath_number_list* numbers = invariant_numbers(n, c, stack))
+			{
+				if (numbers->size == 0) return false;
+
+				*out_result = largest ? numbers->values[numbers->size - 1] : numbers->values[0];
+				return true;
+			}
+
+			xpath_allocator_capture cr(stack.result);
+
+			xpath_node_set_raw ns = n->eval_node_set(c, stack);
+
+			bool found = false;
+
+			for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+			{
+				xpath_allocator_capture cri(stack.result);
+
+				double value = convert_string_to_number(string_value(*it, stack).c_str());
+
+				if (!is_nan(value) && (!found || (largest ? value > *out_result : value < *out_result)))
+				{
+					*out_result = value;
+					found = true;
+				}
+			}
+
+			return found;
+		}
+
+		static bool compare_node_sets_equal(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack)
+		{
+			if (rhs->_type == ast_invariant) swap(lhs, rhs);
+
+			xpath_allocator_capture cr(stack.result);
+
+			if (const xpath_string_set* strings = invariant_strings(lhs, c, stack))
+				return strings->size != 0 && contains_any(rhs->eval_node_set(c, stack), *strings, stack);
+
+			xpath_node_set_raw ls = lhs->eval_node_set(c, stack);
+			xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+
+			if (ls.empty() || rs.empty()) return false;
+
+			// hash the values of the smaller set and probe with the larger one
+			if (ls.size() > rs.size()) swap(ls, rs);
+
+			if (ls.size() == 1)
+			{
+				xpath_string l = string_value(*ls.begin(), stack);
+
+				for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
+				{
+					xpath_allocator_capture cri(stack.result);
+
+					if (string_value(*ri, stack) == l)
+						return true;
+				}
+
+				return false;
+			}
+
+			xpath_string_set strings;
+			strings.build(ls.begin(), ls.end(), stack.result);
+
+			return contains_any(rs, strings, stack);
+		}
+
+		static bool compare_node_sets_not_equal(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack)
+		{
+			xpath_allocator_capture cr(stack.result);
+
+			xpath_node_set_raw ls = lhs->eval_node_set(c, stack);
+			xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+
+			if (ls.empty() || rs.empty()) return false;
+
+			// there is a pair of different values unless all values in both sets are the same
+			xpath_string first = string_value(*ls.begin(), stack);
+
+			return contains_other(ls, first, stack) || contains_other(rs, first, stack);
+		}
+
+		template <class Comp> static bool compare_eq(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack, const Comp& comp)
+		{
+			xpath_value_type lt = lhs->rettype(), rt = rhs->rettype();
+
+			if (lt != xpath_type_node_set && rt != xpath_type_node_set)
+			{
+				if (lt == xpath_type_boolean || rt == xpath_type_boolean)
+					return comp(lhs->eval_boolean(c, stack), rhs->eval_boolean(c, stack));
+				else if (lt == xpath_type_number || rt == xpath_type_number)
+					return comp(lhs->eval_number(c, stack), rhs->eval_number(c, stack));
+				else if (lt == xpath_type_string || rt == xpath_type_string)
+				{
+					xpath_allocator_capture cr(stack.result);
+
+					xpath_string ls = lhs->eval_string(c, stack);
+					xpath_string rs = rhs->eval_string(c, stack);
+
+					return comp(ls, rs);
+				}
+			}
+			else if (lt == xpath_type_node_set && rt == xpath_type_node_set)
+			{
+				return is_equality(comp) ? compare_node_sets_equal(lhs, rhs, c, stack) : compare_node_sets_not_equal(lhs, rhs, c, stack);
+			}
+			else
+			{
+				if (lt == xpath_type_node_set)
+				{
+					swap(lhs, rhs);
+					swap(lt, rt);
+				}
+
+				if (lt == xpath_type_boolean)
+					return comp(lhs->eval_boolean(c, stack), rhs->eval_boolean(c, stack));
+				else if (lt == xpath_type_number)
+				{
+					xpath_allocator_capture cr(stack.result);
+
+					double l = lhs->eval_number(c, stack);
+
+					if (is_equality(comp))
+						if (const xpath_number_list* numbers = invariant_numbers(rhs, c, stack))
+							return numbers->contains(l);
+
+					xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+
+					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
+					{
+						xpath_allocator_capture cri(stack.result);
+
+						if (comp(l, convert_string_to_number(string_value(*ri, stack).c_str())))
+							return true;
+					}
+
+					return false;
+				}
+				else if (lt == xpath_type_string)
+				{
+					xpath_allocator_capture cr(stack.result);
+
+					xpath_string l = lhs->eval_string(c, stack);
+
+					if (is_equality(comp))
+						if (const xpath_string_set* strings = invariant_strings(rhs, c, stack))
+							return strings->contains(l.c_str());
+
+					xpath_node_set_raw rs = rhs->eval_node_set(c, stack);
+
+					for (const xpath_node* ri = rs.begin(); ri != rs.end(); ++ri)
+					{
+						xpath_allocator_capture cri(stack.result);
+
+						if (comp(l, string_value(*ri, stack)))
+							return true;
+					}
+
+					return false;
+				}
+			}
+
+			assert(!"Wrong types");
+			return false;
+		}
+
+		// Relational comparisons with node sets only depend on the smallest value on the left and the largest value on the right
+		template <class Comp> static bool compare_rel(xpath_ast_node* lhs, xpath_ast_node* rhs, const xpath_context& c, const xpath_stack& stack, const Comp& comp)
+		{
+			xpath_value_type lt = lhs->rettype(), rt = rhs->rettype();
+
+			if (lt != xpath_type_node_set && rt != xpath_type_node_set)
+				return comp(lhs->eval_number(c, stack), rhs->eval_number(c, stack));
+
+			double l, r;
+
+			if (lt == xpath_type_node_set)
+			{
+				if (!number_bound(lhs, c, stack, false, &l)) return false;
+			}
+			else
+				l = lhs->eval_number(c, stack);
+
+			if (rt == xpath_type_node_set)
+			{
+				if (!number_bound(rhs, c, stack, true, &r)) return false;
+			}
+			else
+				r = rhs->eval_number(c, stack);
+
+			return comp(l, r);
+		}
+
+		// Filter nodes starting from first with the predicate; if once is set, only the first node that passes is needed
+		void apply_predicate(xpath_node_set_raw& ns, size_t first, xpath_ast_node* expr, const xpath_program* program, const xpath_stack& stack, bool once)
+		{
+			assert(ns.size() >= first);
+
+			size_t i = 1;
+			size_t size = ns.size() - first;
+				
+			xpath_node* last = ns.begin() + first;
+
+			// constant position selects at most one node without evaluating the predicate for every node
+			if (expr->_type == ast_number_constant)
+			{
+				double position = expr->_data.number;
+
+				if (position >= 1 && position <= static_cast<double>(size) && position == floor(position))
+				{
+					*last = last[static_cast<size_t>(position) - 1];
+					++last;
+				}
+
+				ns.truncate(last);
+				return;
+			}
+				
+			// remove_if... or well, sort of
+			for (xpath_node* it = last; it != ns.end(); ++it, ++i)
+			{
+				xpath_context c(*it, i, size);
+			
+				bool match;
+
+				if (expr->rettype() == xpath_type_number)
+					match = (program ? eval_program_number(program, c, stack) : expr->eval_number(c, stack)) == i;
+				else
+					match = program ? eval_program_boolean(program, c, stack) : expr->eval_boolean(c, stack);
+
+				if (match)
+				{
+					*last++ = *it;
+
+					if (once) break;
+				}
+			}
+			
+			ns.truncate(last);
+		}
+
+		void apply_predicates(xpath_node_set_raw& ns, size_t first, const xpath_stack& stack, bool once)
+		{
+			if (ns.size() == first) return;
+			
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+			{
+				apply_predicate(ns, first, pred->_left, pred->_data.program, stack, once && !pred->_next);
+			}
+		}
+
+		// Recognize comparison of count(set) with 0 or 1 that only tests if the set is empty; returns the set expression
+		xpath_ast_node* count_existence(bool& exists)
+		{
+			if (_type < ast_op_equal || _type > ast_op_greater_or_equal) return 0;
+
+			xpath_ast_node* count = _left;
+			xpath_ast_node* number = _right;
+			int type = _type;
+
+			// 0 < count(set) is count(set) > 0
+			if (number->_type == ast_func_count)
+			{
+				count = _right;
+				number = _left;
+
+				if (type == ast_op_less) type = ast_op_greater;
+				else if (type == ast_op_greater) type = ast_op_less;
+				else if (type == ast_op_less_or_equal) type = ast_op_greater_or_equal;
+				else if (type == ast_op_greater_or_equal) type = ast_op_less_or_equal;
+			}
+
+			if (count->_type != ast_func_count || number->_type != ast_number_constant) return 0;
+
+			double value = number->_data.number;
+
+			switch (type)
+			{
+			case ast_op_equal:
+			case ast_op_less_or_equal:
+				exists = false;
+				return value == 0 ? count->_left : 0;
+
+			case ast_op_not_equal:
+			case ast_op_greater:
+				exists = true;
+				return value == 0 ? count->_left : 0;
+
+			case ast_op_less:
+				exists = false;
+				return value == 1 ? count->_left : 0;
+
+			case ast_op_greater_or_equal:
+				exists = true;
+				return value == 1 ? count->_left : 0;
+
+			default:
+				return 0;
+			}
+		}
+
+		// Check if predicates pass for the node; only valid if they do not depend on context position and size
+		bool step_filter(const xpath_node& n, const xpath_stack& stack)
+		{
+			xpath_context c(n, 1, 1);
+
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+			{
+				xpath_allocator_capture cr(stack.result);
+				xpath_allocator_capture ct(stack.temp);
+
+				if (!(pred->_data.program ? eval_program_boolean(pred->_data.program, c, stack) : pred->_left->eval_boolean(c, stack))) return false;
+			}
+
+			return true;
+		}
+
+		// Get the limit on the nodes collected from one context node; once is set if only the first node in axis order is needed
+		xpath_step_limit step_limit(bool once, const xpath_stack& stack)
+		{
+			xpath_step_limit limit = {static_cast<size_t>(once ? 1 : 0), 0, 0};
+
+			if (!_right) return limit;
+
+			// boolean predicates that do not depend on position are checked for each node before it is added
+			if (has_filter_predicates())
+			{
+				limit.stack = &stack;
+				return limit;
+			}
+
+			limit.count = 0;
+
+			// only the nodes up to a constant position are needed for the first predicate
+			if (_right->_left->_type == ast_number_constant)
+			{
+				double position = _right->_left->_data.number;
+
+				if (position >= 1 && position <= 1e9 && position == floor(position)) limit.count = static_cast<size_t>(position);
+			}
+
+			return limit;
+		}
+
+		static bool is_attribute_name_step(xpath_ast_node* n)
+		{
+			return n->_type == ast_step && n->_axis == axis_attribute && n->_test == nodetest_name && !n->_left && !n->_right;
+		}
+
+		static bool is_string_constant(xpath_ast_node* n, const char_t* value)
+		{
+			return n->_type == ast_string_constant && strequal(n->_data.string, value);
+		}
+
+		// Recognize @attr = 'value' and 'value' = @attr
+		static bool attribute_equality(xpath_ast_node* expr, const char_t*& name, const char_t*& value)
+		{
+			if (expr->_type != ast_op_equal) return false;
+
+			xpath_ast_node* attr = expr->_left;
+			xpath_ast_node* constant = expr->_right;
+
+			if (attr->_type == ast_string_constant) 
+			{
+				attr = expr->_right;
+				constant = expr->_left;
+			}
+
+			if (!is_attribute_name_step(attr) || constant->_type != ast_string_constant) return false;
+
+			name = attr->_data.nodetest;
+			value = constant->_data.string;
+
+			return true;
+		}
+
+		// Find posting list of the document index that contains all elements satisfying the predicate expression.
+		// Recognizes has-class('token'), contains(concat(' ', normalize-space(@CLASS), ' '), ' token ') and @attr = 'value' for indexed attributes.
+		static bool index_lookup(xpath_ast_node* expr, const html_attribute_index* index, const html_index_entry*& result)
+		{
+			if (expr->_type == ast_func_has_class && expr->_left->_type == ast_string_constant)
+			{
+				const char_t* token = expr->_left->_data.string;
+				size_t length = strlength(token);
+
+				if (!is_token(token, length)) return false;
+
+				result = index_find(index, 0, token, length);
+				return true;
+			}
+
+			if (expr->_type == ast_func_contains && expr->_right->_type == ast_string_constant)
+			{
+				xpath_ast_node* concat = expr->_left;
+
+				if (concat->_type != ast_func_concat || !is_string_constant(concat->_left, PUGIHTML_TEXT(" "))) return false;
+
+				xpath_ast_node* normalize = concat->_right;
+
+				if (normalize->_type != ast_func_normalize_space_1 || !is_attribute_name_step(normalize->_left) || !is_class_name(normalize->_left->_data.nodetest, index->class_name, index->class_nocase)) return false;
+				if (!normalize->_next || !is_string_constant(normalize->_next, PUGIHTML_TEXT(" ")) || normalize->_next->_next) return false;
+
+				const char_t* token = expr->_right->_data.string;
+				size_t length = strlength(token);
+
+				if (length < 3 || token[0] != ' ' || token[length - 1] != ' ' || !is_token(token + 1, length - 2)) return false;
+
+				result = index_find(index, 0, token + 1, length - 2);
+				return true;
+			}
+
+			const char_t* name;
+			const char_t* key;
+
+			if (attribute_equality(expr, name, key))
+			{
+				size_t attribute = index_attribute_id(index, name);
+				size_t length = strlength(key);
+
+				if (attribute == static_cast<size_t>(-1)) return false;
+
+				// class value equality implies that the value is one of the class tokens
+				if (attribute == 0 && !is_token(key, length)) return false;
+
+				result = index_find(index, attribute, key, length);
+				return true;
+			}
+
+			return false;
+		}
+
+		// Find the string that the first predicate of the step needs the string value of the node to contain: contains(., 'text') or
+		// contains(text(), 'text'), possibly as an operand of 'and'; the text of child text nodes is a part of the string value
+		static const char_t* text_lookup(xpath_ast_node* expr)
+		{
+			if (expr->_type == ast_op_and)
+			{
+				const char_t* result = text_lookup(expr->_left);
+
+				return result ? result : text_lookup(expr->_right);
+			}
+
+			if (expr->_type != ast_func_contains) return 0;
+
+			xpath_ast_node* arg = expr->_left;
+
+			if (arg->_type != ast_step || arg->_left) return 0;
+			if (!(arg->_axis == axis_self && arg->_test == nodetest_type_node) && !(arg->_axis == axis_child && arg->_test == nodetest_type_text)) return 0;
+
+			xpath_ast_node* value = expr->_right;
+
+			if (value->_type == ast_string_constant) return value->_data.string;
+			if (value->_type == ast_variable && value->_rettype == xpath_type_string) return value->_data.variable->get_string();
+
+			return 0;
+		}
+
+		// Collect descendants of n (and n itself for descendant-or-self axis) whose subtrees overlap the text occurrences
+		void step_fill_text(xpath_node_set_raw& ns, const html_node& n, const html_text_span* begin, const html_text_span* end, bool self, xpath_allocator* alloc, const xpath_step_limit& limit)
+		{
+			html_node_struct* root = n.internal_object();
+
+			const html_text_span* it = text_subtree_begin(root, begin, end);
+			if (it == end || text_after_subtree(it->first, root)) return;
+
+			size_t found = 0;
+
+			if (self && step_push(ns, n, alloc, limit) && ++found == limit.count) return;
+
+			html_node_struct* cur = root->first_child;
+
+			while (cur)
+			{
+				while (it != end && it->last->pre < cur->pre) ++it;
+				if (it == end) return;
+
+				// the occurrence either starts before the node or it is the first one that can start in the subtree
+				bool overlaps = !text_after_subtree(it->first, cur);
+
+				if (overlaps && step_push(ns, html_node(cur), alloc, limit) && ++found == limit.count) return;
+
+				if (overlaps && cur->first_child)
+					cur = cur->first_child;
+				else
+				{
+					while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+					cur = (cur == root) ? 0 : cur->next_sibling;
+				}
+			}
+		}
+
+		// Collect descendants of n (and n itself for descendant-or-self axis) from index posting list
+		void step_fill_index(xpath_node_set_raw& ns, const html_node& n, const html_index_entry* entry, const html_attribute_index* index, bool self, xpath_allocator* alloc, const xpath_step_limit& limit)
+		{
+			if (!entry) return;
+
+			html_node_struct** begin;
+			html_node_struct** end;
+
+			index_subtree(index, entry, n.internal_object(), self, begin, end);
+
+			size_t found = 0;
+
+			for (html_node_struct** it = begin; it != end; ++it)
+				if (step_push(ns, html_node(*it), alloc, limit) && ++found == limit.count) return;
+		}
+
+		bool step_test(const html_attribute& a)
+		{
+			const char_t* name = a.name();
+
+			// There are no attribute nodes corresponding to attributes that declare namespaces
+			// That is, "htmlns:..." or "htmlns"
+			if (starts_with(name, PUGIHTML_TEXT("htmlns")) && (name[5] == 0 || name[5] == ':')) return false;
+			
+			switch (_test)
+			{
+			case nodetest_name:
+				return strequal(name, _data.nodetest);
+				
+			case nodetest_type_node:
+			case nodetest_all:
+				return true;
+				
+			case nodetest_all_in_namespace:
+				return starts_with(name, _data.nodetest);
+			
+			default:
+				return false;
+			}
+		}
+
+		bool step_test(const html_node& n)
+		{
+			switch (_test)
+			{
+			case nodetest_name:
+				return n.type() == node_element && strequal(n.name(), _data.nodetest);
+				
+			case nodetest_type_node:
+				return true;
+				
+			case nodetest_type_comment:
+				return n.type() == node_comment;
+				
+			case nodetest_type_text:
+				return n.type() == node_pcdata || n.type() == node_cdata;
+				
+			case nodetest_type_pi:
+				return n.type() == node_pi;
+									
+			case nodetest_pi:
+				return n.type() == node_pi && strequal(n.name(), _data.nodetest);
+				
+			case nodetest_all:
+				return n.type() == node_element;
+				
+			case nodetest_all_in_namespace:
+				return n.type() == node_element && starts_with(n.name(), _data.nodetest);
+
+			default:
+				assert(!"Unknown axis");
+				return false;
+			} 
+		}
+
+		bool step_push(xpath_node_set_raw& ns, const html_attribute& a, const html_node& parent, xpath_allocator* alloc, const xpath_step_limit& limit)
+		{
+			if (!a) return false;
+
+			alloc->visit();
+			if (!step_test(a)) return false;
+
+			xpath_node n(a, parent);
+			if (limit.stack && !step_filter(n, *limit.stack)) return false;
+
+			if (limit.visit) return step_visit_node(n, *limit.visit);
+
+			ns.push_back(n, alloc);
+			return true;
+		}
+		
+		bool step_push(xpath_node_set_raw& ns, const html_node& n, xpath_allocator* alloc, const xpath_step_limit& limit)
+		{
+			if (!n) return false;
+
+			alloc->visit();
+			if (!step_test(n)) return false;
+			if (limit.stack && !step_filter(n, *limit.stack)) return false;
+
+			if (limit.visit) return step_visit_node(n, *limit.visit);
+
+			ns.push_back(n, alloc);
+			return true;
+		}
+
+		static bool step_visit_node(const xpath_node& n, xpath_step_visit& visit)
+		{
+			visit.stopped = !visit.visitor->visit(n);
+
+			return visit.stopped;
+		}
+
+		template <class T> void step_fill(xpath_node_set_raw& ns, const html_node& n, xpath_allocator* alloc, const xpath_step_limit& limit, T)
+		{
+			const axis_t axis = T::axis;
+
+			size_t found = 0;
+
+			switch (axis)
+			{
+			case axis_attribute:
+			{
+				for (html_attribute a = n.first_attribute(); a; a = a.next_attribute())
+					if (step_push(ns, a, n, alloc, limit) && ++found == limit.count) return;
+				
+				break;
+			}
+			
+			case axis_child:
+			{
+				for (html_node c = n.first_child(); c; c = c.next_sibling())
+					if (step_push(ns, c, alloc, limit) && ++found == limit.count) return;
+					
+				break;
+			}
+			
+			case axis_descendant:
+			case axis_descendant_or_self:
+			{
+				if (axis == axis_descendant_or_self && step_push(ns, n, alloc, limit) && ++found == limit.count) return;
+					
+				html_node cur = n.first_child();
+				
+				while (cur && cur != n)
+				{
+					if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+					
+					if (cur.first_child())
+						cur = cur.first_child();
+					else if (cur.next_sibling())
+						cur = cur.next_sibling();
+					else
+					{
+						while (!cur.next_sibling() && cur != n)
+							cur = cur.parent();
+					
+						if (cur != n) cur = cur.next_sibling();
+					}
+				}
+				
+				break;
+			}
+			
+			case axis_following_sibling:
+			{
+				for (html_node c = n.next_sibling(); c; c = c.next_sibling())
+					if (step_push(ns, c, alloc, limit) && ++found == limit.count) return;
+				
+				break;
+			}
+			
+			case axis_preceding_sibling:
+			{
+				for (html_node c = n.previous_sibling(); c; c = c.previous_sibling())
+					if (step_push(ns, c, alloc, limit) && ++found == limit.count) return;
+				
+				break;
+			}
+			
+			case axis_following:
+			{
+				html_node cur = n;
+
+				// exit from this node so that we don't include descendants
+				while (cur && !cur.next_sibling()) cur = cur.parent();
+				cur = cur.next_sibling();
+
+				for (;;)
+				{
+					if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+
+					if (cur.first_child())
+						cur = cur.first_child();
+					else if (cur.next_sibling())
+						cur = cur.next_sibling();
+					else
+					{
+						while (cur && !cur.next_sibling()) cur = cur.parent();
+						cur = cur.next_sibling();
+
+						if (!cur) break;
+					}
+				}
+
+				break;
+			}
+
+			case axis_preceding:
+			{
+				html_node cur = n;
+
+				while (cur && !cur.previous_sibling()) cur = cur.parent();
+				cur = cur.previous_sibling();
+
+				for (;;)
+				{
+					if (cur.last_child())
+						cur = cur.last_child();
+					else
+					{
+						// leaf node, can't be ancestor
+						if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+
+						if (cur.previous_sibling())
+							cur = cur.previous_sibling();
+						else
+						{
+							do 
+							{
+								cur = cur.parent();
+								if (!cur) break;
+
+								if (!node_is_ancestor(cur, n) && step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+							}
+							while (!cur.previous_sibling());
+
+							cur = cur.previous_sibling();
+
+							if (!cur) break;
+						}
+					}
+				}
+
+				break;
+			}
+			
+			case axis_ancestor:
+			case axis_ancestor_or_self:
+			{
+				if (axis == axis_ancestor_or_self && step_push(ns, n, alloc, limit) && ++found == limit.count) return;
+
+				html_node cur = n.parent();
+				
+				while (cur)
+				{
+					if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+					
+					cur = cur.parent();
+				}
+				
+				break;
+			}
+
+			case axis_self:
+			{
+				step_push(ns, n, alloc, limit);
+
+				break;
+			}
+
+			case axis_parent:
+			{
+				if (n.parent()) step_push(ns, n.parent(), alloc, limit);
+
+				break;
+			}
+				
+			default:
+				assert(!"Unimplemented axis");
+			}
+		}
+		
+		template <class T> void step_fill(xpath_node_set_raw& ns, const html_attribute& a, const html_node& p, xpath_allocator* alloc, const xpath_step_limit& limit, T v)
+		{
+			const axis_t axis = T::axis;
+
+			size_t found = 0;
+
+			switch (axis)
+			{
+			case axis_ancestor:
+			case axis_ancestor_or_self:
+			{
+				// reject attributes based on principal node type test
+				if (axis == axis_ancestor_or_self && _test == nodetest_type_node && step_push(ns, a, p, alloc, limit) && ++found == limit.count) return;
+
+				html_node cur = p;
+				
+				while (cur)
+				{
+					if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+					
+					cur = cur.parent();
+				}
+				
+				break;
+			}
+
+			case axis_descendant_or_self:
+			case axis_self:
+			{
+				if (_test == nodetest_type_node) // reject attributes based on principal node type test
+					step_push(ns, a, p, alloc, limit);
+
+				break;
+			}
+
+			case axis_following:
+			{
+				html_node cur = p;
+				
+				for (;;)
+				{
+					if (cur.first_child())
+						cur = cur.first_child();
+					else if (cur.next_sibling())
+						cur = cur.next_sibling();
+					else
+					{
+						while (cur && !cur.next_sibling()) cur = cur.parent();
+						cur = cur.next_sibling();
+						
+						if (!cur) break;
+					}
+
+					if (step_push(ns, cur, alloc, limit) && ++found == limit.count) return;
+				}
+
+				break;
+			}
+
+			case axis_parent:
+			{
+				step_push(ns, p, alloc, limit);
+
+				break;
+			}
+
+			case axis_preceding:
+			{
+				// preceding:: axis does not include attribute nodes and attribute ancestors (they are the same as parent's ancestors), so we can reuse node preceding
+				step_fill(ns, p, alloc, limit, v);
+				break;
+			}
+			
+			default:
+				assert(!"Unimplemented axis");
+			}
+		}
+		
+		// Fill node set with descendant step results, using the document index for the first predicate if possible
+		template <class T> void step_fill_descendant(xpath_node_set_raw& ns, const html_node& n, xpath_allocator* alloc, const xpath_step_limit& limit, xpath_step_text& text, T v)
+		{
+			const axis_t axis = T::axis;
+
+			const html_index_entry* entry = 0;
+
+			if (const html_attribute_index* index = step_index(n, entry))
+				step_fill_index(ns, n, entry, index, axis == axis_descendant_or_self, alloc, limit);
+			else if (step_text(n, text))
+				step_fill_text(ns, n, text.begin, text.end, axis == axis_descendant_or_self, alloc, limit);
+			else
+				step_fill(ns, n, alloc, limit, v);
+		}
+
+		// Get the text occurrences from the document full-text index if it is up to date and the first predicate of the step needs
+		// element or text nodes to contain a string
+		bool step_text(const html_node& n, xpath_step_text& text) const
+		{
+			if (!_right || (_test != nodetest_name && _test != nodetest_all && _test != nodetest_all_in_namespace && _test != nodetest_type_text)) return false;
+
+			const html_document_struct& doc = get_document(n.internal_object()->header);
+
+			if (text.doc != &doc)
+			{
+				const char_t* value = text_index_is_current(doc.text_index, doc) ? text_lookup(_right->_left) : 0;
+
+				text.doc = &doc;
+				text.found = value && text_candidates(doc.text_index, value, text.alloc, text.begin, text.end);
+			}
+
+			return text.found;
+		}
+
+		// Get the document index if it is up to date and can find the nodes matching the first predicate of the step
+		const html_attribute_index* step_index(const html_node& n, const html_index_entry*& entry) const
+		{
+			if (!_right || (_test != nodetest_name && _test != nodetest_all)) return 0;
+
+			const html_document_struct& doc = get_document(n.internal_object()->header);
+
+			return index_is_current(doc.index, doc) && index_lookup(_right->_left, doc.index, entry) ? doc.index : 0;
+		}
+
+		// Fill node set with the union of the axis of several nodes in one pass; following and preceding axes of a node contain the axes of the
+		// nodes after it (before it) that are not its descendants (ancestors), and pre/post numbers tell which ancestors were already added.
+		// Returns false if the axis, the predicates or the nodes are not supported; the result is in document order.
+		template <class T> bool step_fill_merged(xpath_node_set_raw& ns, xpath_node_set_raw& s, xpath_allocator* alloc, const xpath_step_limit& limit, T v)
+		{
+			const axis_t axis = T::axis;
+
+			if (axis != axis_following && axis != axis_preceding && axis != axis_ancestor && axis != axis_ancestor_or_self) return false;
+
+			// predicates that depend on position are evaluated for the axis of each node separately
+			if (!has_filter_predicates()) return false;
+
+			html_node_struct* first = s.begin()->node().internal_object();
+			if (!first || !document_order_current(first, first)) return false;
+
+			const html_document_struct* doc = &get_document(first->header);
+			html_node_struct* min_post = first;
+			html_node_struct* max_pre = first;
+
+			for (const xpath_node* it = s.begin(); it != s.end(); ++it)
+			{
+				html_node_struct* node = it->node().internal_object();
+				if (!node || &get_document(node->header) != doc) return false;
+
+				if (node->post < min_post->post) min_post = node;
+				if (node->pre > max_pre->pre) max_pre = node;
+			}
+
+			switch (axis)
+			{
+			case axis_following:
+				// the node that ends first precedes all other nodes that are not its ancestors
+				step_fill(ns, html_node(min_post), alloc, limit, v);
+				break;
+
+			case axis_preceding:
+				// the node that starts last follows all other nodes that are not its descendants
+				step_fill(ns, html_node(max_pre), alloc, limit, v);
+				reverse(ns.begin(), ns.end());
+				break;
+
+			default:
+			{
+				s.sort_do();
+
+				html_node_struct* prev = 0;
+
+				for (const xpath_node* it = s.begin(); it != s.end(); ++it)
+				{
+					html_node_struct* node = it->node().internal_object();
+					size_t size = ns.size();
+
+					// the ancestors that were added for earlier nodes are exactly the ancestors of the previous node, which are the
+					// ancestors that contain it; the ancestors that were added are before the node in document order
+					for (html_node_struct* cur = axis == axis_ancestor_or_self ? node : node->parent; cur; cur = cur->parent)
+					{
+						if (prev && cur->pre <= prev->pre && prev->post <= cur->post && (axis == axis_ancestor_or_self || cur != prev)) break;
+
+						step_push(ns, html_node(cur), alloc, limit);
+					}
+
+					reverse(ns.begin() + size, ns.end());
+					prev = node;
+				}
+			}
+			}
+
+			// an empty set keeps the order of the axis, as if the nodes were processed one by one
+			if (!ns.empty()) ns.set_type(xpath_node_set::type_sorted);
+
+			return true;
+		}
+
+		template <class T> xpath_node_set_raw step_do(const xpath_context& c, const xpath_stack& stack, nodeset_eval_t eval, T v)
+		{
+			const axis_t axis = T::axis;
+			bool attributes = (axis == axis_ancestor || axis == axis_ancestor_or_self || axis == axis_descendant_or_self || axis == axis_following || axis == axis_parent || axis == axis_preceding || axis == axis_self);
+			bool descendants = (axis == axis_descendant || axis == axis_descendant_or_self);
+			xpath_node_set::type_t axis_type = (axis == axis_ancestor || axis == axis_ancestor_or_self || axis == axis_preceding || axis == axis_preceding_sibling) ? xpath_node_set::type_sorted_reverse : xpath_node_set::type_sorted;
+
+			xpath_node_set_raw ns;
+			ns.set_type(axis_type);
+
+			// the first node of each context node in axis order is enough if the result only needs one node in that order
+			bool once = eval_once(axis_type, eval);
+			xpath_step_limit limit = step_limit(once, stack);
+
+			xpath_allocator_capture ct(stack.temp);
+			xpath_step_text text = {stack.temp, 0, false, 0, 0};
+
+			if (_left)
+			{
+				xpath_node_set_raw s = _left->eval_node_set(c, stack, nodeset_eval_all);
+
+				// self axis preserves the original order
+				if (axis == axis_self) ns.set_type(s.type());
+
+				if (s.size() > 1 && step_fill_merged(ns, s, stack.result, limit, v)) return ns;
+
+				for (const xpath_node* it = s.begin(); it != s.end(); ++it)
+				{
+					size_t size = ns.size();
+
+					// in general, all axes generate elements in a particular order, but there is no order guarantee if axis is applied to two nodes
+					if (axis != axis_self && size != 0) ns.set_type(xpath_node_set::type_unsorted);
+					
+					if (it->node())
+					{
+						if (descendants) step_fill_descendant(ns, it->node(), stack.result, limit, text, v);
+						else step_fill(ns, it->node(), stack.result, limit, v);
+					}
+					else if (attributes)
+						step_fill(ns, it->attribute(), it->parent(), stack.result, limit, v);
+						
+					if (!limit.stack) apply_predicates(ns, size, stack, once);
+
+					if (eval == nodeset_eval_any && !ns.empty()) break;
+				}
+			}
+			else
+			{
+				if (c.n.node())
+				{
+					if (descendants) step_fill_descendant(ns, c.n.node(), stack.result, limit, text, v);
+					else step_fill(ns, c.n.node(), stack.result, limit, v);
+				}
+				else if (attributes)
+					step_fill(ns, c.n.attribute(), c.n.parent(), stack.result, limit, v);
+				
+				if (!limit.stack) apply_predicates(ns, 0, stack, once);
+			}
+
+			// child, attribute and self axes always generate unique set of nodes
+			// for other axis, if the set stayed sorted, it stayed unique because the traversal algorithms do not visit the same node twice
+			if (axis != axis_child && axis != axis_attribute && axis != axis_self && ns.type() == xpath_node_set::type_unsorted)
+				ns.remove_duplicates(stack.temp);
+
+			return ns;
+		}
+
+		// Same traversal as step_do, but the nodes are passed to the visitor as they are found; see is_visitable for the supported steps
+		template <class T> bool step_visit(const xpath_context& c, const xpath_stack& stack, xpath_node_visitor& visitor, T v)
+		{
+			const axis_t axis = T::axis;
+			bool attributes = (axis == axis_descendant_or_self);
+			bool descendants = (axis == axis_descendant || axis == axis_descendant_or_self);
+
+			xpath_step_visit visit = {&visitor, false};
+
+			// the visitor gets the nodes that pass the predicates, and the traversal stops at the node that stops the visitor
+			xpath_step_limit limit = step_limit(false, stack);
+			limit.count = 1;
+			limit.visit = &visit;
+
+			xpath_allocator_capture ct(stack.temp);
+			xpath_step_text text = {stack.temp, 0, false, 0, 0};
 
 			xpath_node_set_raw ns;
-			ns.set_type((axis == axis_ancestor || axis == axis_ancestor_or_self || axis == axis_preceding || axis == axis_preceding_sibling) ? xpath_node_set::type_sorted_reverse : xpath_node_set::type_sorted);
 
-			if (_left)
-			{
-				xpath_node_set_raw s = _left->eval_node_set(c, stack);
+			if (_left)
+			{
+				xpath_node_set_raw s = _left->eval_node_set(c, stack, nodeset_eval_all);
+
+				for (const xpath_node* it = s.begin(); it != s.end() && !visit.stopped; ++it)
+				{
+					if (it->node())
+					{
+						if (descendants) step_fill_descendant(ns, it->node(), stack.result, limit, text, v);
+						else step_fill(ns, it->node(), stack.result, limit, v);
+					}
+					else if (attributes)
+						step_fill(ns, it->attribute(), it->parent(), stack.result, limit, v);
+				}
+			}
+			else
+			{
+				if (c.n.node())
+				{
+					if (descendants) step_fill_descendant(ns, c.n.node(), stack.result, limit, text, v);
+					else step_fill(ns, c.n.node(), stack.result, limit, v);
+				}
+				else if (attributes)
+					step_fill(ns, c.n.attribute(), c.n.parent(), stack.result, limit, v);
+			}
+
+			assert(ns.empty());
+
+			return !visit.stopped;
+		}
+
+		// Check if all predicates of the step are boolean and depend on the context node only, so that each node can be checked separately
+		bool has_filter_predicates() const
+		{
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+				if (pred->_left->rettype() == xpath_type_number || !pred->_left->is_context_node_only()) return false;
+
+			return true;
+		}
+
+		// Check if the path selects at most one node, so that descendants of its result are unique and in document order
+		bool is_single_node_path() const
+		{
+			if (_type == ast_step_root) return true;
+
+			return _type == ast_step && _axis == axis_self && _test == nodetest_type_node && !_right && (!_left || _left->is_single_node_path());
+		}
+
+		// Check if the nodes of the step can be visited during the traversal in the order of eval_node_set: predicates have to be checked
+		// for each node separately, and the result must not need sorting or duplicate removal
+		bool is_visitable() const
+		{
+			if (_type != ast_step || !has_filter_predicates()) return false;
+
+			switch (_axis)
+			{
+			case axis_attribute:
+			case axis_child:
+				return true;
+
+			case axis_descendant:
+			case axis_descendant_or_self:
+				return !_left || _left->is_single_node_path();
+
+			default:
+				return false;
+			}
+		}
+		
+	public:
+		xpath_ast_node(ast_type_t type, xpath_value_type rettype, const char_t* value):
+			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+		{
+			assert(type == ast_string_constant);
+			_data.string = value;
+		}
+
+		xpath_ast_node(ast_type_t type, xpath_value_type rettype, double value):
+			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+		{
+			assert(type == ast_number_constant);
+			_data.number = value;
+		}
+		
+		xpath_ast_node(ast_type_t type, xpath_value_type rettype, xpath_variable* value):
+			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+		{
+			assert(type == ast_variable);
+			_data.variable = value;
+		}
+		
+		xpath_ast_node(ast_type_t type, xpath_value_type rettype, xpath_ast_node* left = 0, xpath_ast_node* right = 0):
+			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(left), _right(right), _next(0)
+		{
+			_data.program = 0;
+		}
+
+		xpath_ast_node(ast_type_t type, xpath_ast_node* left, axis_t axis, nodetest_t test, const char_t* contents):
+			_type((char)type), _rettype(xpath_type_node_set), _axis((char)axis), _test((char)test), _left(left), _right(0), _next(0)
+		{
+			_data.nodetest = contents;
+		}
+
+		xpath_ast_node(const xpath_function_entry* function, xpath_ast_node* left, xpath_ast_node* right):
+			_type(ast_func_extension), _rettype((char)function->result), _axis(0), _test(0), _left(left), _right(right), _next(0)
+		{
+			_data.function = function;
+		}
+
+		xpath_ast_node* next() const
+		{
+			return _next;
+		}
+
+		void set_next(xpath_ast_node* value)
+		{
+			_next = value;
+		}
+
+		void set_right(xpath_ast_node* value)
+		{
+			_right = value;
+		}
+
+		bool eval_boolean(const xpath_context& c, const xpath_stack& stack)
+		{
+			bool exists;
+
+			if (xpath_ast_node* set = count_existence(exists))
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return set->eval_node_set(c, stack, nodeset_eval_any).empty() != exists;
+			}
+
+			switch (_type)
+			{
+			case ast_op_or:
+				return _left->eval_boolean(c, stack) || _right->eval_boolean(c, stack);
+				
+			case ast_op_and:
+				return _left->eval_boolean(c, stack) && _right->eval_boolean(c, stack);
+				
+			case ast_op_equal:
+				return compare_eq(_left, _right, c, stack, equal_to());
+
+			case ast_op_not_equal:
+				return compare_eq(_left, _right, c, stack, not_equal_to());
+	
+			case ast_op_less:
+				return compare_rel(_left, _right, c, stack, less());
+			
+			case ast_op_greater:
+				return compare_rel(_right, _left, c, stack, less());
+
+			case ast_op_less_or_equal:
+				return compare_rel(_left, _right, c, stack, less_equal());
+			
+			case ast_op_greater_or_equal:
+				return compare_rel(_right, _left, c, stack, less_equal());
+
+			case ast_func_starts_with:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_string lr = _left->eval_string(c, stack);
+				xpath_string rr = _right->eval_string(c, stack);
+
+				return starts_with(lr.c_str(), rr.c_str());
+			}
+
+			case ast_func_contains:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				// contains(., 'word') searches the text of the node in place instead of building its string value
+				if (is_inplace_contains())
+				{
+					xpath_node_set_raw ns = _left->eval_node_set(c, stack, nodeset_eval_first);
+
+					return string_value_contains(ns.first(), *_data.pattern);
+				}
+
+				xpath_string lr = _left->eval_string(c, stack);
+				xpath_string rr = _right->eval_string(c, stack);
+
+				return find_substring(lr.c_str(), rr.c_str()) != 0;
+			}
+
+			case ast_func_ends_with:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_string lr = _left->eval_string_argument(c, stack);
+				xpath_string rr = _right->eval_string_argument(c, stack);
+
+				return ends_with(lr.c_str(), lr.length(), rr.c_str(), rr.length());
+			}
+
+			case ast_func_has_class:
+			{
+				if (!c.n.node()) return false;
+
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_string token = _left->eval_string_argument(c, stack);
+				size_t length = token.length();
+
+				return is_token(token.c_str(), length) && node_has_class(c.n.node().internal_object(), token.c_str(), length);
+			}
+
+			case ast_func_matches_token:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_string lr = _left->eval_string_argument(c, stack);
+				xpath_string rr = _right->eval_string_argument(c, stack);
+				size_t length = rr.length();
+
+				return is_token(rr.c_str(), length) && has_token(lr.c_str(), rr.c_str(), length);
+			}
+
+			case ast_func_boolean:
+				return _left->eval_boolean(c, stack);
+				
+			case ast_func_not:
+				return !_left->eval_boolean(c, stack);
+				
+			case ast_func_true:
+				return true;
+				
+			case ast_func_false:
+				return false;
+
+			case ast_func_lang:
+			{
+				if (c.n.attribute()) return false;
+				
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_string lang = _left->eval_string(c, stack);
+				
+				for (html_node n = c.n.node(); n; n = n.parent())
+				{
+					html_attribute a = n.attribute(PUGIHTML_TEXT("html:lang"));
+					
+					if (a)
+					{
+						const char_t* value = a.value();
+						
+						// strnicmp / strncasecmp is not portable
+						for (const char_t* lit = lang.c_str(); *lit; ++lit)
+						{
+							if (tolower_ascii(*lit) != tolower_ascii(*value)) return false;
+							++value;
+						}
+						
+						return *value == 0 || *value == '-';
+					}
+				}
+				
+				return false;
+			}
+
+			case ast_variable:
+			{
+				assert(_rettype == _data.variable->type());
+
+				if (_rettype == xpath_type_boolean)
+					return _data.variable->get_boolean();
+
+				break;
+			}
+
+			case ast_invariant:
+				if (_rettype == xpath_type_boolean)
+					return invariant(c, stack)->boolean;
+
+				break;
+
+			case ast_func_extension:
+				if (_rettype == xpath_type_boolean)
+				{
+					xpath_allocator_capture ct(stack.temp);
+
+					xpath_function_invocation call(_data.function, c.n, stack.temp, stack.result);
+					call_function(call, c, stack);
+
+					return call.boolean;
+				}
+
+				break;
+
+			default:
+				break;
+			}
+
+			// type conversion
+			switch (_rettype)
+			{
+			case xpath_type_number:
+				return convert_number_to_boolean(eval_number(c, stack));
+				
+			case xpath_type_string:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return !eval_string(c, stack).empty();
+			}
+				
+			case xpath_type_node_set:				
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return !eval_node_set(c, stack, nodeset_eval_any).empty();
+			}
+
+			default:
+				assert(!"Wrong expression for return type boolean");
+				return false;
+			}
+		}
+
+		double eval_number(const xpath_context& c, const xpath_stack& stack)
+		{
+			switch (_type)
+			{
+			case ast_op_add:
+				return _left->eval_number(c, stack) + _right->eval_number(c, stack);
+				
+			case ast_op_subtract:
+				return _left->eval_number(c, stack) - _right->eval_number(c, stack);
+
+			case ast_op_multiply:
+				return _left->eval_number(c, stack) * _right->eval_number(c, stack);
+
+			case ast_op_divide:
+				return _left->eval_number(c, stack) / _right->eval_number(c, stack);
+
+			case ast_op_mod:
+				return fmod(_left->eval_number(c, stack), _right->eval_number(c, stack));
+
+			case ast_op_negate:
+				return -_left->eval_number(c, stack);
+
+			case ast_number_constant:
+				return _data.number;
+
+			case ast_func_last:
+				return (double)c.size;
+			
+			case ast_func_position:
+				return (double)c.position;
+
+			case ast_func_count:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return (double)_left->eval_node_set(c, stack).size();
+			}
+			
+			case ast_func_string_length_0:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return (double)string_value(c.n, stack).length();
+			}
+			
+			case ast_func_string_length_1:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return (double)_left->eval_string(c, stack).length();
+			}
+			
+			case ast_func_number_0:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return convert_string_to_number(string_value(c.n, stack).c_str());
+			}
+			
+			case ast_func_number_1:
+				return _left->eval_number(c, stack);
+
+			case ast_func_sum:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				double r = 0;
+				
+				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
+				
+				for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+				{
+					xpath_allocator_capture cri(stack.result);
+
+					r += convert_string_to_number(string_value(*it, stack).c_str());
+				}
+			
+				return r;
+			}
+
+			case ast_func_floor:
+			{
+				double r = _left->eval_number(c, stack);
+				
+				return r == r ? floor(r) : r;
+			}
+
+			case ast_func_ceiling:
+			{
+				double r = _left->eval_number(c, stack);
+				
+				return r == r ? ceil(r) : r;
+			}
+
+			case ast_func_round:
+				return round_nearest_nzero(_left->eval_number(c, stack));
+			
+			case ast_variable:
+			{
+				assert(_rettype == _data.variable->type());
+
+				if (_rettype == xpath_type_number)
+					return _data.variable->get_number();
+
+				break;
+			}
+
+			case ast_invariant:
+				if (_rettype == xpath_type_number)
+					return invariant(c, stack)->number;
+
+				break;
+
+			case ast_func_extension:
+				if (_rettype == xpath_type_number)
+				{
+					xpath_allocator_capture ct(stack.temp);
+
+					xpath_function_invocation call(_data.function, c.n, stack.temp, stack.result);
+					call_function(call, c, stack);
+
+					return call.number;
+				}
+
+				break;
+
+			default:
+				break;
+			}
+
+			// type conversion
+			switch (_rettype)
+			{
+			case xpath_type_boolean:
+				return eval_boolean(c, stack) ? 1 : 0;
+				
+			case xpath_type_string:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return convert_string_to_number(eval_string(c, stack).c_str());
+			}
+				
+			case xpath_type_node_set:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				return convert_string_to_number(eval_string(c, stack).c_str());
+			}
+				
+			default:
+				assert(!"Wrong expression for return type number");
+				return 0;
+			}
+		}
+		
+		xpath_string eval_string_concat(const xpath_context& c, const xpath_stack& stack)
+		{
+			assert(_type == ast_func_concat);
+
+			xpath_allocator_capture ct(stack.temp);
+
+			// count the string number
+			size_t count = 1;
+			for (xpath_ast_node* nc = _right; nc; nc = nc->_next) count++;
+
+			// gather all strings
+			xpath_string static_buffer[4];
+			xpath_string* buffer = static_buffer;
+
+			// allocate on-heap for large concats
+			if (count > sizeof(static_buffer) / sizeof(static_buffer[0]))
+			{
+				buffer = static_cast<xpath_string*>(stack.temp->allocate(count * sizeof(xpath_string)));
+				assert(buffer);
+			}
+
+			// evaluate all strings to temporary stack
+			xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+			buffer[0] = _left->eval_string(c, swapped_stack);
+
+			size_t pos = 1;
+			for (xpath_ast_node* n = _right; n; n = n->_next, ++pos) buffer[pos] = n->eval_string(c, swapped_stack);
+			assert(pos == count);
+
+			// get total length
+			size_t length = 0;
+			for (size_t i = 0; i < count; ++i) length += buffer[i].length();
+
+			// create final string
+			char_t* result = static_cast<char_t*>(stack.result->allocate((length + 1) * sizeof(char_t)));
+			assert(result);
+
+			char_t* ri = result;
+
+			for (size_t j = 0; j < count; ++j)
+				for (const char_t* bi = buffer[j].c_str(); *bi; ++bi)
+					*ri++ = *bi;
+
+			*ri = 0;
+
+			return xpath_string(result, true);
+		}
+
+		bool is_inplace_contains() const
+		{
+			return _type == ast_func_contains && _data.pattern;
+		}
+
+		// Prepare the constant pattern of contains(node-set, 'word') for the in place search
+		void prepare_pattern(xpath_allocator* alloc)
+		{
+			if (_left->rettype() != xpath_type_node_set || _right->_type != ast_string_constant) return;
+
+			size_t length = strlength(_right->_data.string);
+			if (length > xpath_inplace_pattern_limit) return;
+
+			// the pattern is optional, so the search falls back to the string value if there is no memory
+			void* memory = alloc->allocate_nothrow(sizeof(xpath_pattern));
+			if (!memory) return;
+
+			xpath_pattern* pattern = static_cast<xpath_pattern*>(memory);
+			pattern->string = _right->_data.string;
+			pattern->length = length;
+
+			_data.pattern = pattern;
+		}
+
+		// Call extension function; the arguments are evaluated on the temporary stack and converted to the registered types
+		void call_function(xpath_function_invocation& call, const xpath_context& c, const xpath_stack& stack)
+		{
+			const xpath_function_entry* function = _data.function;
+
+			xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+			xpath_ast_node* arg = _left;
+
+			for (size_t i = 0; i < function->argument_count; ++i, arg = (i == 1) ? _right : arg->_next)
+			{
+				xpath_function_invocation::argument& value = call.arguments[i];
+
+				switch (function->arguments[i])
+				{
+				case xpath_type_boolean: value.boolean = arg->eval_boolean(c, swapped_stack); break;
+				case xpath_type_number: value.number = arg->eval_number(c, swapped_stack); break;
+				case xpath_type_string: value.string = arg->eval_string_argument(c, swapped_stack).c_str(); break;
+				case xpath_type_node_set: value.set = arg->eval_node_set(c, swapped_stack); break;
+				default: assert(!"Wrong argument type");
+				}
+			}
+
+			call.call();
+		}
+
+		// Evaluate string argument of a function; @name reads the context node attribute in place instead of building a node set
+		xpath_string eval_string_argument(const xpath_context& c, const xpath_stack& stack)
+		{
+			if (!is_attribute_name_step(this) || starts_with(_data.nodetest, PUGIHTML_TEXT("htmlns"))) return eval_string(c, stack);
+
+			// attributes do not have attributes
+			if (!c.n.node()) return xpath_string();
+
+			for (html_attribute a = c.n.node().first_attribute(); a; a = a.next_attribute())
+				if (strequal(a.name(), _data.nodetest)) return xpath_string_const(a.value());
+
+			return xpath_string();
+		}
+
+		xpath_string eval_string(const xpath_context& c, const xpath_stack& stack)
+		{
+			switch (_type)
+			{
+			case ast_string_constant:
+				return xpath_string_const(_data.string);
+			
+			case ast_func_local_name_0:
+			{
+				xpath_node na = c.n;
+				
+				return xpath_string_const(local_name(na));
+			}
+
+			case ast_func_local_name_1:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
+				xpath_node na = ns.first();
+				
+				return xpath_string_const(local_name(na));
+			}
+
+			case ast_func_name_0:
+			{
+				xpath_node na = c.n;
+				
+				return xpath_string_const(qualified_name(na));
+			}
+
+			case ast_func_name_1:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
+				xpath_node na = ns.first();
+				
+				return xpath_string_const(qualified_name(na));
+			}
+
+			case ast_func_namespace_uri_0:
+			{
+				xpath_node na = c.n;
+				
+				return xpath_string_const(namespace_uri(na));
+			}
+
+			case ast_func_namespace_uri_1:
+			{
+				xpath_allocator_capture cr(stack.result);
+
+				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
+				xpath_node na = ns.first();
+				
+				return xpath_string_const(namespace_uri(na));
+			}
+
+			case ast_func_string_0:
+				return string_value(c.n, stack);
+
+			case ast_func_string_1:
+				return _left->eval_string(c, stack);
+
+			case ast_func_concat:
+				return eval_string_concat(c, stack);
+
+			case ast_func_substring_before:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_string s = _left->eval_string(c, swapped_stack);
+				xpath_string p = _right->eval_string(c, swapped_stack);
+
+				const char_t* pos = find_substring(s.c_str(), p.c_str());
+				
+				return pos ? xpath_string(s.c_str(), pos, stack.result) : xpath_string();
+			}
+			
+			case ast_func_substring_after:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_string s = _left->eval_string(c, swapped_stack);
+				xpath_string p = _right->eval_string(c, swapped_stack);
+				
+				const char_t* pos = find_substring(s.c_str(), p.c_str());
+				if (!pos) return xpath_string();
+
+				const char_t* result = pos + p.length();
+
+				return s.uses_heap() ? xpath_string(result, stack.result) : xpath_string_const(result);
+			}
+
+			case ast_func_substring_2:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_string s = _left->eval_string(c, swapped_stack);
+				size_t s_length = s.length();
+
+				double first = round_nearest(_right->eval_number(c, stack));
+				
+				if (is_nan(first)) return xpath_string(); // NaN
+				else if (first >= s_length + 1) return xpath_string();
+				
+				size_t pos = first < 1 ? 1 : (size_t)first;
+				assert(1 <= pos && pos <= s_length + 1);
+
+				const char_t* rbegin = s.c_str() + (pos - 1);
+				
+				return s.uses_heap() ? xpath_string(rbegin, stack.result) : xpath_string_const(rbegin);
+			}
+			
+			case ast_func_substring_3:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_string s = _left->eval_string(c, swapped_stack);
+				size_t s_length = s.length();
+
+				double first = round_nearest(_right->eval_number(c, stack));
+				double last = first + round_nearest(_right->_next->eval_number(c, stack));
+				
+				if (is_nan(first) || is_nan(last)) return xpath_string();
+				else if (first >= s_length + 1) return xpath_string();
+				else if (first >= last) return xpath_string();
+				else if (last < 1) return xpath_string();
+				
+				size_t pos = first < 1 ? 1 : (size_t)first;
+				size_t end = last >= s_length + 1 ? s_length + 1 : (size_t)last;
+
+				assert(1 <= pos && pos <= end && end <= s_length + 1);
+				const char_t* rbegin = s.c_str() + (pos - 1);
+				const char_t* rend = s.c_str() + (end - 1);
+
+				return (end == s_length + 1 && !s.uses_heap()) ? xpath_string_const(rbegin) : xpath_string(rbegin, rend, stack.result);
+			}
+
+			case ast_func_normalize_space_0:
+			{
+				xpath_string s = string_value(c.n, stack);
+
+				normalize_space(s.data(stack.result));
+
+				return s;
+			}
+
+			case ast_func_normalize_space_1:
+			{
+				xpath_string s = _left->eval_string(c, stack);
+
+				normalize_space(s.data(stack.result));
+			
+				return s;
+			}
+
+			case ast_func_translate:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_string s = _left->eval_string(c, stack);
+				xpath_string from = _right->eval_string(c, swapped_stack);
+				xpath_string to = _right->_next->eval_string(c, swapped_stack);
+
+				translate(s.data(stack.result), from.c_str(), to.c_str());
+
+				return s;
+			}
+
+			case ast_func_lower_case:
+			{
+				xpath_string s = _left->eval_string_argument(c, stack);
+
+				// strings without upper case letters, e.g. most attribute values, are returned without a copy
+				size_t offset;
+
+				if (find_upper_case_ascii(s.c_str(), offset))
+					for (char_t* it = s.data(stack.result) + offset; *it; ++it)
+						*it = tolower_ascii(*it);
+
+				return s;
+			}
+
+			case ast_variable:
+			{
+				assert(_rettype == _data.variable->type());
+
+				if (_rettype == xpath_type_string)
+					return xpath_string_const(_data.variable->get_string());
+
+				break;
+			}
+
+			case ast_invariant:
+				if (_rettype == xpath_type_string)
+					return xpath_string_const(invariant(c, stack)->string);
+
+				break;
+
+			case ast_func_extension:
+				if (_rettype == xpath_type_string)
+				{
+					xpath_allocator_capture ct(stack.temp);
+
+					xpath_function_invocation call(_data.function, c.n, stack.temp, stack.result);
+					call_function(call, c, stack);
+
+					return xpath_string_const(call.string);
+				}
+
+				break;
+
+			default:
+				break;
+			}
+
+			// type conversion
+			switch (_rettype)
+			{
+			case xpath_type_boolean:
+				return xpath_string_const(eval_boolean(c, stack) ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
+				
+			case xpath_type_number:
+				return convert_number_to_string(eval_number(c, stack), stack.result);
+				
+			case xpath_type_node_set:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_node_set_raw ns = eval_node_set(c, swapped_stack);
+				return ns.empty() ? xpath_string() : string_value(ns.first(), stack);
+			}
+			
+			default:
+				assert(!"Wrong expression for return type string");
+				return xpath_string();
+			}
+		}
+
+		// Pass the nodes of the result to the visitor in eval_node_set order; returns false if the visitor stopped
+		bool visit_node_set(const xpath_context& c, const xpath_stack& stack, xpath_node_visitor& visitor)
+		{
+			if (is_visitable())
+			{
+				switch (_axis)
+				{
+				case axis_attribute:
+					return step_visit(c, stack, visitor, axis_to_type<axis_attribute>());
+
+				case axis_child:
+					return step_visit(c, stack, visitor, axis_to_type<axis_child>());
+
+				case axis_descendant:
+					return step_visit(c, stack, visitor, axis_to_type<axis_descendant>());
+
+				case axis_descendant_or_self:
+					return step_visit(c, stack, visitor, axis_to_type<axis_descendant_or_self>());
+
+				default:
+					assert(!"Unexpected axis");
+				}
+			}
+
+			// other expressions are evaluated into the scratch memory first
+			xpath_node_set_raw ns = eval_node_set(c, stack, nodeset_eval_all);
+
+			for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+				if (!visitor.visit(*it)) return false;
+
+			return true;
+		}
+
+		// Check if the step can be evaluated in independent parts over the subtrees of one node (see evaluate_node_set_parallel):
+		// it has to be a descendant step from a single node with predicates that are checked for each node separately
+		bool is_splittable() const
+		{
+			return _type == ast_step && (_axis == axis_descendant || _axis == axis_descendant_or_self) && has_filter_predicates() && (!_left || _left->is_single_node_path());
+		}
+
+		// Get the node whose subtree is split, or an empty node if the step should be evaluated as a whole
+		html_node split_node(const xpath_context& c, const xpath_stack& stack)
+		{
+			assert(is_splittable());
+
+			xpath_node n = c.n;
+
+			if (_left)
+			{
+				xpath_node_set_raw s = _left->eval_node_set(c, stack, nodeset_eval_all);
+				if (s.empty()) return html_node();
+
+				n = *s.begin();
+			}
+
+			// steps that can use the document index are already fast
+			const html_index_entry* entry = 0;
+
+			return n.node() && !step_index(n.node(), entry) ? n.node() : html_node();
+		}
+
+		bool split_includes_self() const
+		{
+			return _axis == axis_descendant_or_self;
+		}
+
+		// Evaluate the step for a part of the split subtree: the nodes in document order from the first node up to the pre-order number end
+		void step_fill_part(xpath_node_set_raw& ns, html_node_struct* first, unsigned int end, const xpath_stack& stack)
+		{
+			assert(is_splittable());
+
+			xpath_step_limit limit = step_limit(false, stack);
+
+			for (html_node_struct* cur = first; cur && cur->pre < end; )
+			{
+				step_push(ns, html_node(cur), stack.result, limit);
+
+				if (cur->first_child)
+					cur = cur->first_child;
+				else
+				{
+					while (cur && !cur->next_sibling) cur = cur->parent;
+					if (cur) cur = cur->next_sibling;
+				}
+			}
+		}
+
+		xpath_node_set_raw eval_node_set(const xpath_context& c, const xpath_stack& stack, nodeset_eval_t eval = nodeset_eval_all)
+		{
+			switch (_type)
+			{
+			case ast_op_union:
+			{
+				xpath_allocator_capture cr(stack.temp);
+
+				xpath_stack swapped_stack = {stack.temp, stack.result, stack.invariants};
+
+				xpath_node_set_raw ls = _left->eval_node_set(c, swapped_stack);
+				xpath_node_set_raw rs = _right->eval_node_set(c, stack);
+				
+				// two ordered sets are merged in linear time; otherwise the sets are joined and sorted
+				if (ls.type() != xpath_node_set::type_unsorted && rs.type() != xpath_node_set::type_unsorted)
+				{
+					ls.sort_do();
+					rs.sort_do();
+					rs.merge(ls.begin(), ls.end(), stack.result);
+				}
+				else
+				{
+					rs.set_type(xpath_node_set::type_unsorted);
+
+					rs.append(ls.begin(), ls.end(), stack.result);
+					rs.remove_duplicates(stack.temp);
+				}
+				
+				return rs;
+			}
+
+			case ast_filter:
+			case ast_filter_posinv:
+			{
+				xpath_node_set_raw set = _left->eval_node_set(c, stack, nodeset_eval_all);
+
+				// either expression is a number or it contains position() call; sort by document order
+				if (_type == ast_filter) set.sort_do();
+
+				apply_predicate(set, 0, _right, _data.program, stack, eval_once(set.type(), eval));
+			
+				return set;
+			}
+			
+			case ast_func_id:
+				return xpath_node_set_raw();
+			
+			case ast_step:
+			{
+				switch (_axis)
+				{
+				case axis_ancestor:
+					return step_do(c, stack, eval, axis_to_type<axis_ancestor>());
+					
+				case axis_ancestor_or_self:
+					return step_do(c, stack, eval, axis_to_type<axis_ancestor_or_self>());
+
+				case axis_attribute:
+					return step_do(c, stack, eval, axis_to_type<axis_attribute>());
+
+				case axis_child:
+					return step_do(c, stack, eval, axis_to_type<axis_child>());
+				
+				case axis_descendant:
+					return step_do(c, stack, eval, axis_to_type<axis_descendant>());
+
+				case axis_descendant_or_self:
+					return step_do(c, stack, eval, axis_to_type<axis_descendant_or_self>());
+
+				case axis_following:
+					return step_do(c, stack, eval, axis_to_type<axis_following>());
+				
+				case axis_following_sibling:
+					return step_do(c, stack, eval, axis_to_type<axis_following_sibling>());
+				
+				case axis_namespace:
+					// namespaced axis is not supported
+					return xpath_node_set_raw();
+				
+				case axis_parent:
+					return step_do(c, stack, eval, axis_to_type<axis_parent>());
+				
+				case axis_preceding:
+					return step_do(c, stack, eval, axis_to_type<axis_preceding>());
+
+				case axis_preceding_sibling:
+					return step_do(c, stack, eval, axis_to_type<axis_preceding_sibling>());
+				
+				case axis_self:
+					return step_do(c, stack, eval, axis_to_type<axis_self>());
+				}
+
+				break;
+			}
+
+			case ast_step_root:
+			{
+				assert(!_right); // root step can't have any predicates
+
+				xpath_node_set_raw ns;
+
+				ns.set_type(xpath_node_set::type_sorted);
+
+				if (c.n.node()) ns.push_back(c.n.node().root(), stack.result);
+				else if (c.n.attribute()) ns.push_back(c.n.parent().root(), stack.result);
+
+				return ns;
+			}
+
+			case ast_variable:
+			{
+				assert(_rettype == _data.variable->type());
+
+				if (_rettype == xpath_type_node_set)
+				{
+					const xpath_node_set& s = _data.variable->get_node_set();
+
+					xpath_node_set_raw ns;
+
+					ns.set_type(s.type());
+					ns.append(s.begin(), s.end(), stack.result);
+
+					return ns;
+				}
+
+				break;
+			}
+
+			case ast_invariant:
+				if (_rettype == xpath_type_node_set)
+				{
+					const xpath_invariant* value = invariant(c, stack);
+
+					xpath_node_set_raw ns;
+
+					ns.set_type(value->set.type());
+					ns.append(value->set.begin(), value->set.end(), stack.result);
+
+					return ns;
+				}
+
+				break;
+
+			default:
+				break;
+			}
+
+			assert(!"Wrong expression for return type node set");
+			return xpath_node_set_raw();
+		}
+		
+		bool is_posinv()
+		{
+			switch (_type)
+			{
+			case ast_func_position:
+				return false;
+
+			case ast_string_constant:
+			case ast_number_constant:
+			case ast_variable:
+				return true;
+
+			case ast_step:
+			case ast_step_root:
+				return true;
+
+			case ast_predicate:
+			case ast_filter:
+			case ast_filter_posinv:
+				return true;
+
+			default:
+				if (_left && !_left->is_posinv()) return false;
+				
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					if (!n->is_posinv()) return false;
+					
+				return true;
+			}
+		}
+
+		// Check if expression does not depend on context position and context size
+		bool is_context_node_only()
+		{
+			switch (_type)
+			{
+			case ast_func_position:
+			case ast_func_last:
+				return false;
+
+			case ast_step:
+			case ast_step_root:
+			case ast_filter:
+			case ast_filter_posinv:
+				// predicates are evaluated in their own context
+				return !_left || _left->is_context_node_only();
+
+			default:
+				if (_left && !_left->is_context_node_only()) return false;
+				
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					if (!n->is_context_node_only()) return false;
+					
+				return true;
+			}
+		}
+
+		// Get steps of a location path that can be matched during a pre-order traversal (see xpath_query_set): forward axes only,
+		// attribute axis only in the last step, predicates that do not depend on context position or size
+		bool forward_path(xpath_ast_node** steps, char* axes, size_t capacity, size_t& count, bool& absolute)
+		{
+			size_t size = 0;
+			xpath_ast_node* cur = this;
+
+			for (; cur && cur->_type == ast_step; cur = cur->_left)
+			{
+				if (size == capacity) return false;
+
+				switch (cur->_axis)
+				{
+				case axis_attribute:
+					if (size != 0) return false;
+					break;
+
+				case axis_child:
+				case axis_descendant:
+				case axis_descendant_or_self:
+				case axis_self:
+					break;
+
+				default:
+					return false;
+				}
+
+				for (xpath_ast_node* pred = cur->_right; pred; pred = pred->_next)
+					if (pred->_left->rettype() == xpath_type_number || !pred->_left->is_context_node_only()) return false;
+
+				steps[size++] = cur;
+			}
+
+			if (cur && cur->_type != ast_step_root) return false;
+
+			// steps were collected from the last one
+			reverse(steps, steps + size);
+
+			// merge descendant-or-self::node() with the following step, i.e. //name is matched as descendant::name
+			size_t result = 0;
+
+			for (size_t i = 0; i < size; ++i)
+			{
+				xpath_ast_node* step = steps[i];
+				char axis = step->_axis;
+
+				if (result > 0 && axes[result - 1] == axis_descendant_or_self && steps[result - 1]->_test == nodetest_type_node && !steps[result - 1]->_right && axis != axis_attribute)
+				{
+					--result;
+
+					if (axis == axis_child) axis = axis_descendant;
+					else if (axis == axis_self) axis = axis_descendant_or_self;
+				}
+
+				steps[result] = step;
+				axes[result] = axis;
+				++result;
+			}
+
+			count = result;
+			absolute = (cur != 0);
+
+			return true;
+		}
+
+		// Get the key that all nodes matching the step have: element name, or attribute name and value if the first predicate is @attr = 'value'
+		bool step_key(const char_t*& name, const char_t*& value)
+		{
+			if (_test != nodetest_name || _axis == axis_attribute) return false;
+
+			if (_right && attribute_equality(_right->_left, name, value)) return true;
+
+			name = _data.nodetest;
+			value = 0;
+
+			return true;
+		}
+
+		// Check if node passes step node test and predicates
+		bool step_match(const xpath_node& n, const xpath_stack& stack)
+		{
+			if (n.attribute() ? !step_test(n.attribute()) : !step_test(n.node())) return false;
+
+			return step_filter(n, stack);
+		}
+
+		// Check if node passes step node test
+		bool step_match_test(const html_node& n)
+		{
+			return step_test(n);
+		}
+
+		// Check if expression only looks at the context node attributes and ancestors, i.e. can be evaluated once the start tag is parsed
+		bool is_attribute_local()
+		{
+			switch (_type)
+			{
+			case ast_step_root:
+			case ast_func_id:
+			case ast_func_string_0:
+			case ast_func_string_length_0:
+			case ast_func_normalize_space_0:
+			case ast_func_number_0:
+			case ast_func_extension:
+				return false;
+
+			case ast_step:
+				if (_axis != axis_attribute || (_left && !_left->is_attribute_local())) return false;
+
+				// attribute predicates can only look at the attribute itself
+				for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+					if (!pred->_left->is_subtree_local()) return false;
+
+				return true;
+
+			default:
+				if (_left && !_left->is_attribute_local()) return false;
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					if (!n->is_attribute_local()) return false;
+
+				return true;
+			}
+		}
+
+		// Check if expression only looks at the context node subtree, i.e. can be evaluated once the element is closed
+		bool is_subtree_local()
+		{
+			switch (_type)
+			{
+			case ast_step_root:
+			case ast_func_id:
+			case ast_func_extension:
+				return false;
+
+			case ast_step:
+				if (_axis != axis_child && _axis != axis_descendant && _axis != axis_descendant_or_self && _axis != axis_self && _axis != axis_attribute)
+					return false;
+
+				if (_left && !_left->is_subtree_local()) return false;
+
+				for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+					if (!pred->_left->is_subtree_local()) return false;
+
+				return true;
+
+			default:
+				if (_left && !_left->is_subtree_local()) return false;
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					if (!n->is_subtree_local()) return false;
+
+				return true;
+			}
+		}
+
+		// Check if step can be matched with the specified axis while the document is parsed: intermediate steps when the start tag is parsed,
+		// the last one when the element is closed
+		bool is_streamable_step(char axis, bool first, bool last)
+		{
+			// intermediate steps have to match elements; the last step can select elements or attributes
+			if (axis != axis_attribute && _test != nodetest_name && _test != nodetest_all && (last || _test != nodetest_type_node))
+				return false;
+
+			// the document node is never matched
+			if (first && (axis == axis_self || axis == axis_descendant_or_self) && _test == nodetest_type_node)
+				return false;
+
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+				if (last ? !pred->_left->is_subtree_local() : !pred->_left->is_attribute_local()) return false;
+
+			return true;
+		}
+
+		// Get cached value of a context-independent subexpression, computing it on first use for the context document
+		xpath_invariant* invariant(const xpath_context& c, const xpath_stack& stack)
+		{
+			assert(_type == ast_invariant);
+
+			html_node n = c.n.attribute() ? c.n.parent() : c.n.node();
+			const void* document = n ? &get_document(n.internal_object()->header) : 0;
+
+			xpath_invariant_cache* cache = stack.invariants;
+
+			for (xpath_invariant* i = cache->first; i; i = i->next)
+				if (i->expr == this && i->document == document) return i;
+
+			xpath_allocator_capture cr(stack.result);
+
+			xpath_node_set_raw set;
+			xpath_string string;
+			double number = 0;
+			bool boolean = false;
+
+			switch (_rettype)
+			{
+			case xpath_type_node_set: set = _left->eval_node_set(c, stack); break;
+			case xpath_type_string: string = _left->eval_string(c, stack); break;
+			case xpath_type_number: number = _left->eval_number(c, stack); break;
+			case xpath_type_boolean: boolean = _left->eval_boolean(c, stack); break;
+			default: assert(!"Wrong invariant type");
+			}
+
+			// the value is computed on the result stack and copied to the cache; the node set has to be copied right after the entry
+			// since only the last allocated object can grow
+			xpath_invariant* result = static_cast<xpath_invariant*>(cache->alloc->allocate(sizeof(xpath_invariant)));
+
+			result->expr = this;
+			result->document = document;
+			result->set = xpath_node_set_raw();
+			result->set.set_type(set.type());
+			if (!set.empty()) result->set.append(set.begin(), set.end(), cache->alloc);
+			result->string = string.empty() ? PUGIHTML_TEXT("") : xpath_string(string.c_str(), cache->alloc).c_str();
+			result->number = number;
+			result->boolean = boolean;
+			result->strings = 0;
+			result->numbers = 0;
+
+			result->next = cache->first;
+			cache->first = result;
+
+			return result;
+		}
+
+		static bool is_constant(xpath_ast_node* n)
+		{
+			return n->_type == ast_string_constant || n->_type == ast_number_constant || n->_type == ast_func_true || n->_type == ast_func_false;
+		}
+
+		// Check if expression does not depend on the context node, position or size (apart from the document the context node is in)
+		bool is_context_free()
+		{
+			switch (_type)
+			{
+			case ast_func_last:
+			case ast_func_position:
+			case ast_func_local_name_0:
+			case ast_func_namespace_uri_0:
+			case ast_func_name_0:
+			case ast_func_string_0:
+			case ast_func_string_length_0:
+			case ast_func_normalize_space_0:
+			case ast_func_number_0:
+			case ast_func_lang:
+			case ast_func_has_class:
+			case ast_func_extension:
+				return false;
+
+			case ast_step:
+				// relative paths start at the context node
+				return _left && _left->is_context_free();
+
+			case ast_filter:
+			case ast_filter_posinv:
+				// predicates are evaluated in their own context
+				return _left->is_context_free();
+
+			default:
+				if (_left && !_left->is_context_free()) return false;
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					if (!n->is_context_free()) return false;
+
+				return true;
+			}
+		}
+
+		// Check if expression selects nodes from the document root, i.e. is expensive enough to be worth caching
+		bool is_rooted()
+		{
+			if (_type == ast_step_root) return true;
+
+			if (_left && _left->is_rooted()) return true;
+
+			for (xpath_ast_node* n = _right; n; n = n->_next)
+				if (n->is_rooted()) return true;
+
+			return false;
+		}
+
+		// Count the places where the expression looks at the string value of its context node: '.', string(), number() and the like
+		size_t context_value_uses()
+		{
+			switch (_type)
+			{
+			case ast_func_string_0:
+			case ast_func_string_length_0:
+			case ast_func_normalize_space_0:
+			case ast_func_number_0:
+				return 1;
+
+			case ast_step:
+				// other steps select nodes, and their predicates have their own context
+				return (_axis == axis_self && _test == nodetest_type_node && !_left && !_right) ? 1 : 0;
+
+			case ast_filter:
+			case ast_filter_posinv:
+				return _left->context_value_uses();
+
+			default:
+			{
+				size_t result = _left ? _left->context_value_uses() : 0;
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					result += n->context_value_uses();
+
+				return result;
+			}
+			}
+		}
+
+		// Check if the query or one of its predicates looks at the string value of the context node more than once
+		bool repeats_context_value()
+		{
+			if (context_value_uses() > 1) return true;
+
+			return repeats_in_predicates();
+		}
+
+		bool repeats_in_predicates()
+		{
+			for (xpath_ast_node* n = this; n; n = n->_next)
+			{
+				if (n->_type == ast_predicate && n->_left->context_value_uses() > 1) return true;
+				if ((n->_type == ast_filter || n->_type == ast_filter_posinv) && n->_right->context_value_uses() > 1) return true;
+
+				if (n->_left && n->_left->repeats_in_predicates()) return true;
+				if (n->_right && n->_right->repeats_in_predicates()) return true;
+			}
+
+			return false;
+		}
+
+		// Turn maximal context-independent subexpressions that select from the document into invariants, evaluated once per evaluation
+		void hoist(xpath_allocator* alloc)
+		{
+			switch (_type)
+			{
+			case ast_invariant:
+			case ast_string_constant:
+			case ast_number_constant:
+			case ast_variable:
+				return;
+
+			default:
+				;
+			}
+
+			if (is_context_free() && is_rooted())
+			{
+				void* memory = alloc->allocate_nothrow(sizeof(xpath_ast_node));
+				if (!memory) return;
+
+				// the node is changed in place so that it keeps its position in the parent argument list
+				xpath_ast_node* copy = new (memory) xpath_ast_node(static_cast<ast_type_t>(_type), rettype(), _left, _right);
+				copy->_axis = _axis;
+				copy->_test = _test;
+				copy->_data = _data;
+
+				_type = static_cast<char>(ast_invariant);
+				_left = copy;
+				_right = 0;
+				return;
+			}
+
+			switch (_type)
+			{
+			case ast_step:
+			case ast_filter:
+			case ast_filter_posinv:
+				// predicates are optimized with their own step or filter
+				if (_left) _left->hoist(alloc);
+				break;
+
+			default:
+				if (_left) _left->hoist(alloc);
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					n->hoist(alloc);
+			}
+		}
+
+		// Estimate relative cost of evaluating expression for one context node
+		unsigned int cost()
+		{
+			unsigned int result;
+
+			switch (_type)
+			{
+			case ast_string_constant:
+			case ast_number_constant:
+			case ast_variable:
+			case ast_func_true:
+			case ast_func_false:
+				return 0;
+
+			case ast_invariant:
+				return 2;
+
+			case ast_step:
+				switch (_axis)
+				{
+				case axis_attribute:
+				case axis_self:
+				case axis_parent:
+					result = 1;
+					break;
+
+				case axis_child:
+				case axis_following_sibling:
+				case axis_preceding_sibling:
+				case axis_ancestor:
+				case axis_ancestor_or_self:
+					result = 4;
+					break;
+
+				default:
+					result = 16;
+				}
+
+				if (_left) result += _left->cost();
+
+				for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+					result += pred->_left->cost();
+
+				return result;
+
+			case ast_step_root:
+				return 1;
+
+			case ast_func_extension:
+				// callbacks are opaque, so they are ordered after predicates that are known to be cheap
+				result = 8;
+
+				if (_left) result += _left->cost();
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					result += n->cost();
+
+				return result;
+
+			default:
+				result = 1;
+
+				if (_left) result += _left->cost();
+
+				for (xpath_ast_node* n = _right; n; n = n->_next)
+					result += n->cost();
+
+				return result;
+			}
+		}
+
+		// Check if predicate can be evaluated independently of the other predicates of the step
+		static bool is_independent_predicate(xpath_ast_node* expr)
+		{
+			return expr->rettype() != xpath_type_number && expr->is_context_node_only();
+		}
+
+		// Evaluate expression that only has constant operands and replace it with the resulting constant
+		void fold(xpath_allocator* alloc, const xpath_stack& stack)
+		{
+			switch (_type)
+			{
+			case ast_predicate:
+			case ast_filter:
+			case ast_filter_posinv:
+			case ast_variable:
+			case ast_func_id:
+			case ast_func_lang:
+			case ast_func_has_class:
+			case ast_func_extension:
+			case ast_step:
+			case ast_step_root:
+			case ast_invariant:
+				return;
+
+			default:
+				;
+			}
+
+			if (_rettype == xpath_type_node_set || !_left || !is_constant(_left)) return;
+
+			for (xpath_ast_node* n = _right; n; n = n->_next)
+				if (!is_constant(n)) return;
+
+			xpath_context c(xpath_node(), 1, 1);
+			xpath_allocator_capture cr(stack.result);
+
+			switch (_rettype)
+			{
+			case xpath_type_number:
+				_data.number = eval_number(c, stack);
+				_type = static_cast<char>(ast_number_constant);
+				break;
+
+			case xpath_type_boolean:
+				_type = static_cast<char>(eval_boolean(c, stack) ? ast_func_true : ast_func_false);
+				break;
+
+			case xpath_type_string:
+			{
+				xpath_string value = eval_string(c, stack);
+
+				size_t length = strlength(value.c_str());
+				char_t* string = static_cast<char_t*>(alloc->allocate_nothrow((length + 1) * sizeof(char_t)));
+				if (!string) return;
+
+				memcpy(string, value.c_str(), (length + 1) * sizeof(char_t));
+
+				_data.string = string;
+				_type = static_cast<char>(ast_string_constant);
+				break;
+			}
+
+			default:
+				assert(!"Wrong expression type");
+				return;
+			}
+
+			_left = _right = 0;
+		}
+
+		// Rewrite descendant-or-self::node()/child::name as descendant::name (and self::name as descendant-or-self::name) if the step
+		// predicates do not depend on position, which turns //name into a single traversal without an intermediate set
+		void merge_descendant_step()
+		{
+			if (_axis != axis_child && _axis != axis_self) return;
+
+			xpath_ast_node* left = _left;
+
+			if (!left || left->_type != ast_step || left->_axis != axis_descendant_or_self || left->_test != nodetest_type_node || left->_right) return;
+
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+				if (!is_independent_predicate(pred->_left)) return;
+
+			_axis = static_cast<char>(_axis == axis_child ? axis_descendant : axis_descendant_or_self);
+			_left = left->_left;
+		}
+
+		// Order step predicates cheapest-first if they do not depend on position or size; the sort is stable to keep equal-cost predicates in query order
+		void sort_predicates()
+		{
+			if (!_right || !_right->_next) return;
+
+			for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+				if (!is_independent_predicate(pred->_left)) return;
+
+			xpath_ast_node* sorted = 0;
+
+			for (xpath_ast_node* pred = _right; pred; )
+			{
+				xpath_ast_node* next = pred->_next;
+				unsigned int cost = pred->_left->cost();
+
+				xpath_ast_node** insert = &sorted;
+				while (*insert && (*insert)->_left->cost() <= cost) insert = &(*insert)->_next;
+
+				pred->_next = *insert;
+				*insert = pred;
+
+				pred = next;
+			}
+
+			_right = sorted;
+		}
+
+		void optimize(xpath_allocator* alloc, const xpath_stack& stack)
+		{
+			if (_left) _left->optimize(alloc, stack);
+			if (_right) _right->optimize(alloc, stack);
+			if (_next) _next->optimize(alloc, stack);
+
+			switch (_type)
+			{
+			case ast_step:
+				merge_descendant_step();
+
+				for (xpath_ast_node* pred = _right; pred; pred = pred->_next)
+					pred->_left->hoist(alloc);
+
+				sort_predicates();
+				break;
+
+			case ast_filter:
+			case ast_filter_posinv:
+				_right->hoist(alloc);
+				break;
+
+			case ast_func_contains:
+				fold(alloc, stack);
+
+				if (_type == ast_func_contains) prepare_pattern(alloc);
+				break;
+
+			default:
+				fold(alloc, stack);
+			}
+		}
+
+		void optimize(xpath_allocator* alloc)
+		{
+			xpath_stack_data sd;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			// folding that runs out of memory leaves the remaining nodes as they are
+			if (setjmp(sd.error_handler)) return;
+		#endif
+
+			optimize(alloc, sd.stack);
+		}
+
+		void explain(html_buffered_writer& writer, unsigned int depth)
+		{
+			for (unsigned int i = 0; i < depth; ++i) writer.write(' ', ' ');
+
+			writer.write(ast_type_names[static_cast<int>(_type)]);
+
+			switch (_type)
+			{
+			case ast_step:
+				writer.write(' ');
+				writer.write(axis_names[static_cast<int>(_axis)]);
+				writer.write(':', ':');
+
+				switch (_test)
+				{
+				case nodetest_name: writer.write(_data.nodetest); break;
+				case nodetest_type_node: writer.write(PUGIHTML_TEXT("node()")); break;
+				case nodetest_type_comment: writer.write(PUGIHTML_TEXT("comment()")); break;
+				case nodetest_type_text: writer.write(PUGIHTML_TEXT("text()")); break;
+				case nodetest_type_pi: writer.write(PUGIHTML_TEXT("processing-instruction()")); break;
+				case nodetest_pi: writer.write(PUGIHTML_TEXT("processing-instruction('")); writer.write(_data.nodetest); writer.write('\'', ')'); break;
+				case nodetest_all: writer.write('*'); break;
+				case nodetest_all_in_namespace: writer.write(_data.nodetest); writer.write(':', '*'); break;
+				default: ;
+				}
+				break;
+
+			case ast_string_constant:
+				writer.write(' ', '\'');
+				writer.write(_data.string);
+				writer.write('\'');
+				break;
+
+			case ast_number_constant:
+			{
+				xpath_memory_block block;
+				block.next = 0;
+
+				xpath_allocator alloc(&block);
+				xpath_string value = convert_number_to_string(_data.number, &alloc);
+
+				writer.write(' ');
+				writer.write(value.c_str());
+
+				alloc.release();
+				break;
+			}
+
+			case ast_variable:
+				writer.write(' ', '$');
+				writer.write(_data.variable->name());
+				break;
+
+			case ast_func_extension:
+				writer.write(' ');
+				writer.write(_data.function->name);
+				writer.write('(', ')');
+				break;
+
+			case ast_predicate:
+			case ast_filter:
+			case ast_filter_posinv:
+				if (_data.program) writer.write(PUGIHTML_TEXT(" (bytecode)"));
+				break;
+
+			default:
+				;
+			}
+
+			writer.write('\n');
+
+			if (_left) _left->explain(writer, depth + 1);
+
+			for (xpath_ast_node* n = _right; n; n = n->_next)
+				n->explain(writer, depth + 1);
+		}
+
+		xpath_value_type rettype() const
+		{
+			return static_cast<xpath_value_type>(_rettype);
+		}
+	};
+
+#ifndef PUGIHTML_NO_XPATH_BYTECODE
+	enum xpath_opcode_t
+	{
+		op_number,					// number dst = number
+		op_string,					// string dst = string
+		op_boolean,					// boolean dst = a
+		op_variable_number,			// number dst = variable
+		op_variable_string,			// string dst = variable
+		op_variable_boolean,		// boolean dst = variable
+		op_eval_number,				// number dst = node (evaluated by the tree interpreter)
+		op_eval_string,				// string dst = node (evaluated by the tree interpreter)
+		op_eval_boolean,			// boolean dst = node (evaluated by the tree interpreter)
+		op_add,						// number dst = a + b
+		op_subtract,				// number dst = a - b
+		op_multiply,				// number dst = a * b
+		op_divide,					// number dst = a / b
+		op_mod,						// number dst = a % b
+		op_negate,					// number dst = -a
+		op_equal_number,			// boolean dst = number a == number b
+		op_not_equal_number,		// boolean dst = number a != number b
+		op_less_number,				// boolean dst = number a < number b
+		op_less_equal_number,		// boolean dst = number a <= number b
+		op_equal_string,			// boolean dst = string a == string b
+		op_not_equal_string,		// boolean dst = string a != string b
+		op_equal_boolean,			// boolean dst = boolean a == boolean b
+		op_not_equal_boolean,		// boolean dst = boolean a != boolean b
+		op_not,						// boolean dst = !a
+		op_move_boolean,			// boolean dst = a
+		op_jump_if_true,			// if boolean a, go to target
+		op_jump_if_false,			// if !boolean a, go to target
+		op_number_to_string,		// string dst = number a
+		op_number_to_boolean,		// boolean dst = number a
+		op_string_to_number,		// number dst = string a
+		op_string_to_boolean,		// boolean dst = string a
+		op_boolean_to_number,		// number dst = boolean a
+		op_boolean_to_string,		// string dst = boolean a
+		op_contains,				// boolean dst = contains(string a, string b)
+		op_starts_with,				// boolean dst = starts-with(string a, string b)
+		op_string_length,			// number dst = string-length(string a)
+		op_ends_with,				// boolean dst = ends-with(string a, string b)
+		op_lower_case,				// string dst = lower-case(string a)
+		op_has_token,				// boolean dst = matches-token(string a, string b)
+		op_has_class,				// boolean dst = has-class(string a)
+		op_attribute_exists,		// boolean dst = context element has attribute string
+		op_attribute_string,		// string dst = value of the first context element attribute string
+		op_attribute_equal			// boolean dst = context element has attribute string with value a
+	};
+
+	// Number of registers of each type available to a program
+	const unsigned int xpath_program_registers = 8;
+
+	// Maximum number of instructions in a program
+	const size_t xpath_program_capacity = 64;
+
+	struct xpath_instruction
+	{
+		char op;
+		unsigned char dst;
+		unsigned char a;
+		unsigned char b;
+
+		union
+		{
+			// value for op_number
+			double number;
+			// value for op_string, attribute name for op_attribute_*
+			const char_t* string;
+			// variable for op_variable_*
+			xpath_variable* variable;
+			// expression for op_eval_*
+			xpath_ast_node* node;
+			// instruction index for op_jump_*
+			size_t target;
+		} data;
+	};
+
+	struct xpath_program
+	{
+		const xpath_instruction* code;
+		size_t size;
+
+		// register with the value of the expression
+		char type;
+		unsigned char result;
+	};
+
+	struct xpath_registers
+	{
+		double numbers[xpath_program_registers];
+		bool booleans[xpath_program_registers];
+		xpath_string strings[xpath_program_registers];
+	};
+
+	inline html_attribute find_context_attribute(const xpath_context& c, const char_t* name)
+	{
+		// attributes do not have attributes
+		if (!c.n.node()) return html_attribute();
+
+		for (html_attribute a = c.n.node().first_attribute(); a; a = a.next_attribute())
+			if (strequal(a.name(), name)) return a;
+
+		return html_attribute();
+	}
+
+	void execute_program(const xpath_program& program, const xpath_context& c, const xpath_stack& stack, xpath_registers& r)
+	{
+		const xpath_instruction* begin = program.code;
+		const xpath_instruction* end = begin + program.size;
+
+		for (const xpath_instruction* ip = begin; ip != end; ++ip)
+		{
+			switch (ip->op)
+			{
+			case op_number:
+				r.numbers[ip->dst] = ip->data.number;
+				break;
+
+			case op_string:
+				r.strings[ip->dst] = xpath_string_const(ip->data.string);
+				break;
+
+			case op_boolean:
+				r.booleans[ip->dst] = ip->a != 0;
+				break;
+
+			case op_variable_number:
+				r.numbers[ip->dst] = ip->data.variable->get_number();
+				break;
+
+			case op_variable_string:
+				r.strings[ip->dst] = xpath_string_const(ip->data.variable->get_string());
+				break;
+
+			case op_variable_boolean:
+				r.booleans[ip->dst] = ip->data.variable->get_boolean();
+				break;
+
+			case op_eval_number:
+				r.numbers[ip->dst] = ip->data.node->eval_number(c, stack);
+				break;
+
+			case op_eval_string:
+				r.strings[ip->dst] = ip->data.node->eval_string(c, stack);
+				break;
+
+			case op_eval_boolean:
+				r.booleans[ip->dst] = ip->data.node->eval_boolean(c, stack);
+				break;
+
+			case op_add:
+				r.numbers[ip->dst] = r.numbers[ip->a] + r.numbers[ip->b];
+				break;
+
+			case op_subtract:
+				r.numbers[ip->dst] = r.numbers[ip->a] - r.numbers[ip->b];
+				break;
+
+			case op_multiply:
+				r.numbers[ip->dst] = r.numbers[ip->a] * r.numbers[ip->b];
+				break;
+
+			case op_divide:
+				r.numbers[ip->dst] = r.numbers[ip->a] / r.numbers[ip->b];
+				break;
+
+			case op_mod:
+				r.numbers[ip->dst] = fmod(r.numbers[ip->a], r.numbers[ip->b]);
+				break;
+
+			case op_negate:
+				r.numbers[ip->dst] = -r.numbers[ip->a];
+				break;
+
+			case op_equal_number:
+				r.booleans[ip->dst] = r.numbers[ip->a] == r.numbers[ip->b];
+				break;
+
+			case op_not_equal_number:
+				r.booleans[ip->dst] = r.numbers[ip->a] != r.numbers[ip->b];
+				break;
+
+			case op_less_number:
+				r.booleans[ip->dst] = r.numbers[ip->a] < r.numbers[ip->b];
+				break;
+
+			case op_less_equal_number:
+				r.booleans[ip->dst] = r.numbers[ip->a] <= r.numbers[ip->b];
+				break;
+
+			case op_equal_string:
+				r.booleans[ip->dst] = r.strings[ip->a] == r.strings[ip->b];
+				break;
+
+			case op_not_equal_string:
+				r.booleans[ip->dst] = r.strings[ip->a] != r.strings[ip->b];
+				break;
+
+			case op_equal_boolean:
+				r.booleans[ip->dst] = r.booleans[ip->a] == r.booleans[ip->b];
+				break;
+
+			case op_not_equal_boolean:
+				r.booleans[ip->dst] = r.booleans[ip->a] != r.booleans[ip->b];
+				break;
+
+			case op_not:
+				r.booleans[ip->dst] = !r.booleans[ip->a];
+				break;
+
+			case op_move_boolean:
+				r.booleans[ip->dst] = r.booleans[ip->a];
+				break;
+
+			case op_jump_if_true:
+				// jumps only go forward, so the target is never the first instruction
+				if (r.booleans[ip->a]) ip = begin + ip->data.target - 1;
+				break;
+
+			case op_jump_if_false:
+				if (!r.booleans[ip->a]) ip = begin + ip->data.target - 1;
+				break;
+
+			case op_number_to_string:
+				r.strings[ip->dst] = convert_number_to_string(r.numbers[ip->a], stack.result);
+				break;
+
+			case op_number_to_boolean:
+				r.booleans[ip->dst] = convert_number_to_boolean(r.numbers[ip->a]);
+				break;
+
+			case op_string_to_number:
+				r.numbers[ip->dst] = convert_string_to_number(r.strings[ip->a].c_str());
+				break;
+
+			case op_string_to_boolean:
+				r.booleans[ip->dst] = !r.strings[ip->a].empty();
+				break;
+
+			case op_boolean_to_number:
+				r.numbers[ip->dst] = r.booleans[ip->a] ? 1 : 0;
+				break;
+
+			case op_boolean_to_string:
+				r.strings[ip->dst] = xpath_string_const(r.booleans[ip->a] ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
+				break;
+
+			case op_contains:
+				r.booleans[ip->dst] = find_substring(r.strings[ip->a].c_str(), r.strings[ip->b].c_str()) != 0;
+				break;
+
+			case op_starts_with:
+				r.booleans[ip->dst] = starts_with(r.strings[ip->a].c_str(), r.strings[ip->b].c_str());
+				break;
+
+			case op_string_length:
+				r.numbers[ip->dst] = static_cast<double>(r.strings[ip->a].length());
+				break;
+
+			case op_ends_with:
+				r.booleans[ip->dst] = ends_with(r.strings[ip->a].c_str(), r.strings[ip->a].length(), r.strings[ip->b].c_str(), r.strings[ip->b].length());
+				break;
+
+			case op_lower_case:
+			{
+				xpath_string s = r.strings[ip->a];
+				size_t offset;
+
+				if (find_upper_case_ascii(s.c_str(), offset))
+					for (char_t* it = s.data(stack.result) + offset; *it; ++it)
+						*it = tolower_ascii(*it);
+
+				r.strings[ip->dst] = s;
+				break;
+			}
+
+			case op_has_token:
+			{
+				const xpath_string& token = r.strings[ip->b];
+				size_t length = token.length();
+
+				r.booleans[ip->dst] = is_token(token.c_str(), length) && has_token(r.strings[ip->a].c_str(), token.c_str(), length);
+				break;
+			}
+
+			case op_has_class:
+			{
+				const xpath_string& token = r.strings[ip->a];
+				size_t length = token.length();
+
+				r.booleans[ip->dst] = c.n.node() && is_token(token.c_str(), length) && node_has_class(c.n.node().internal_object(), token.c_str(), length);
+				break;
+			}
+
+			case op_attribute_exists:
+				r.booleans[ip->dst] = find_context_attribute(c, ip->data.string);
+				break;
+
+			case op_attribute_string:
+			{
+				html_attribute a = find_context_attribute(c, ip->data.string);
+
+				r.strings[ip->dst] = a ? xpath_string_const(a.value()) : xpath_string();
+				break;
+			}
+
+			case op_attribute_equal:
+			{
+				// attribute names are not necessarily unique, so all attributes with the name are compared
+				bool result = false;
+
+				if (c.n.node())
+					for (html_attribute a = c.n.node().first_attribute(); a && !result; a = a.next_attribute())
+						result = strequal(a.name(), ip->data.string) && strequal(a.value(), r.strings[ip->a].c_str());
+
+				r.booleans[ip->dst] = result;
+				break;
+			}
+
+			default:
+				assert(!"Unknown opcode");
+			}
+		}
+	}
+
+	bool eval_program_boolean(const xpath_program* program, const xpath_context& c, const xpath_stack& stack)
+	{
+		xpath_allocator_capture cr(stack.result);
+
+		xpath_registers r;
+		execute_program(*program, c, stack, r);
+
+		switch (program->type)
+		{
+		case xpath_type_number: return convert_number_to_boolean(r.numbers[program->result]);
+		case xpath_type_string: return !r.strings[program->result].empty();
+		default: return r.booleans[program->result];
+		}
+	}
+
+	double eval_program_number(const xpath_program* program, const xpath_context& c, const xpath_stack& stack)
+	{
+		xpath_allocator_capture cr(stack.result);
+
+		xpath_registers r;
+		execute_program(*program, c, stack, r);
+
+		switch (program->type)
+		{
+		case xpath_type_string: return convert_string_to_number(r.strings[program->result].c_str());
+		case xpath_type_boolean: return r.booleans[program->result] ? 1 : 0;
+		default: return r.numbers[program->result];
+		}
+	}
+
+	xpath_string eval_program_string(const xpath_program* program, const xpath_context& c, const xpath_stack& stack)
+	{
+		// the result string stays on the result stack
+		xpath_registers r;
+		execute_program(*program, c, stack, r);
+
+		switch (program->type)
+		{
+		case xpath_type_number: return convert_number_to_string(r.numbers[program->result], stack.result);
+		case xpath_type_boolean: return xpath_string_const(r.booleans[program->result] ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
+		default: return r.strings[program->result];
+		}
+	}
+
+	// Lowers scalar expressions to register programs; node set subexpressions that have no dedicated instruction are left to the tree interpreter
+	struct xpath_compiler
+	{
+		xpath_instruction code[xpath_program_capacity];
+		size_t size;
+
+		unsigned int registers[xpath_type_boolean + 1];
+
+		// number of instructions that do not call the tree interpreter
+		size_t work;
+		bool failed;
+
+		// target for instructions that do not fit
+		xpath_instruction overflow;
+
+		xpath_compiler(): size(0), work(0), failed(false)
+		{
+			for (unsigned int i = 0; i <= xpath_type_boolean; ++i) registers[i] = 0;
+		}
+
+		xpath_instruction* emit(xpath_opcode_t op, unsigned int dst, unsigned int a = 0, unsigned int b = 0)
+		{
+			if (size == xpath_program_capacity)
+			{
+				failed = true;
+				return &overflow;
+			}
+
+			xpath_instruction* result = &code[size++];
+
+			result->op = static_cast<char>(op);
+			result->dst = static_cast<unsigned char>(dst);
+			result->a = static_cast<unsigned char>(a);
+			result->b = static_cast<unsigned char>(b);
+			result->data.target = 0;
+
+			if (op != op_eval_number && op != op_eval_string && op != op_eval_boolean) work++;
+
+			return result;
+		}
+
+		unsigned int allocate(xpath_value_type type)
+		{
+			if (registers[type] == xpath_program_registers)
+			{
+				failed = true;
+				return 0;
+			}
+
+			return registers[type]++;
+		}
+
+		unsigned int fallback(xpath_ast_node* n, xpath_value_type type)
+		{
+			static const xpath_opcode_t ops[] = {op_eval_boolean, op_eval_boolean, op_eval_number, op_eval_string, op_eval_boolean};
+
+			unsigned int dst = allocate(type);
+			emit(ops[type], dst)->data.node = n;
+
+			return dst;
+		}
+
+		unsigned int convert(unsigned int reg, xpath_value_type from, xpath_value_type to)
+		{
+			if (from == to) return reg;
+
+			xpath_opcode_t op;
+
+			switch (from)
+			{
+			case xpath_type_number: op = (to == xpath_type_string) ? op_number_to_string : op_number_to_boolean; break;
+			case xpath_type_string: op = (to == xpath_type_number) ? op_string_to_number : op_string_to_boolean; break;
+			default: op = (to == xpath_type_number) ? op_boolean_to_number : op_boolean_to_string;
+			}
+
+			unsigned int dst = allocate(to);
+			emit(op, dst, reg);
+
+			return dst;
+		}
+
+		// Attribute name test of the attribute axis from the context node, i.e. @name
+		static const char_t* attribute_name(xpath_ast_node* n)
+		{
+			if (!xpath_ast_node::is_attribute_name_step(n)) return 0;
+
+			// namespace declarations are not attribute nodes, the interpreter handles them
+			return starts_with(n->_data.nodetest, PUGIHTML_TEXT("htmlns")) ? 0 : n->_data.nodetest;
+		}
+
+		unsigned int compile(xpath_ast_node* n, xpath_value_type type)
+		{
+			xpath_value_type natural = n->rettype();
+
+			if (natural == xpath_type_node_set)
+			{
+				const char_t* name = attribute_name(n);
+
+				if (name && type != xpath_type_number)
+				{
+					unsigned int dst = allocate(type);
+					emit(type == xpath_type_string ? op_attribute_string : op_attribute_exists, dst)->data.string = name;
+
+					return dst;
+				}
+
+				return fallback(n, type);
+			}
+
+			return convert(compile_value(n), natural, type);
+		}
+
+		unsigned int compile_binary(xpath_opcode_t op, xpath_ast_node* lhs, xpath_ast_node* rhs, xpath_value_type type, xpath_value_type rettype)
+		{
+			unsigned int a = compile(lhs, type);
+			unsigned int b = compile(rhs, type);
+
+			unsigned int dst = allocate(rettype);
+			emit(op, dst, a, b);
+
+			return dst;
+		}
+
+		unsigned int compile_equal(xpath_ast_node* n, bool equal)
+		{
+			xpath_value_type lt = n->_left->rettype(), rt = n->_right->rettype();
+
+			if (lt == xpath_type_node_set || rt == xpath_type_node_set)
+			{
+				// @name = string
+				const char_t* name = attribute_name(lt == xpath_type_node_set ? n->_left : n->_right);
+				xpath_ast_node* value = (lt == xpath_type_node_set) ? n->_right : n->_left;
+
+				if (equal && name && value->rettype() == xpath_type_string)
+				{
+					unsigned int a = compile(value, xpath_type_string);
+
+					unsigned int dst = allocate(xpath_type_boolean);
+					emit(op_attribute_equal, dst, a)->data.string = name;
+
+					return dst;
+				}
+
+				return fallback(n, xpath_type_boolean);
+			}
+
+			if (lt == xpath_type_boolean || rt == xpath_type_boolean)
+				return compile_binary(equal ? op_equal_boolean : op_not_equal_boolean, n->_left, n->_right, xpath_type_boolean, xpath_type_boolean);
+			else if (lt == xpath_type_number || rt == xpath_type_number)
+				return compile_binary(equal ? op_equal_number : op_not_equal_number, n->_left, n->_right, xpath_type_number, xpath_type_boolean);
+			else
+				return compile_binary(equal ? op_equal_string : op_not_equal_string, n->_left, n->_right, xpath_type_string, xpath_type_boolean);
+		}
+
+		unsigned int compile_relational(xpath_ast_node* n, xpath_opcode_t op, bool swap)
+		{
+			if (n->_left->rettype() == xpath_type_node_set || n->_right->rettype() == xpath_type_node_set)
+				return fallback(n, xpath_type_boolean);
+
+			return swap ? compile_binary(op, n->_right, n->_left, xpath_type_number, xpath_type_boolean) : compile_binary(op, n->_left, n->_right, xpath_type_number, xpath_type_boolean);
+		}
+
+		// Compile expression with a scalar type to a register of that type
+		unsigned int compile_value(xpath_ast_node* n)
+		{
+			unsigned int dst;
+
+			switch (n->_type)
+			{
+			case ast_number_constant:
+				dst = allocate(xpath_type_number);
+				emit(op_number, dst)->data.number = n->_data.number;
+				return dst;
+
+			case ast_string_constant:
+				dst = allocate(xpath_type_string);
+				emit(op_string, dst)->data.string = n->_data.string;
+				return dst;
+
+			case ast_func_true:
+			case ast_func_false:
+				dst = allocate(xpath_type_boolean);
+				emit(op_boolean, dst, n->_type == ast_func_true);
+				return dst;
+
+			case ast_variable:
+			{
+				static const xpath_opcode_t ops[] = {op_variable_boolean, op_variable_boolean, op_variable_number, op_variable_string, op_variable_boolean};
+
+				dst = allocate(n->rettype());
+				emit(ops[n->rettype()], dst)->data.variable = n->_data.variable;
+				return dst;
+			}
+
+			case ast_op_or:
+			case ast_op_and:
+			{
+				// the right operand is only evaluated if the left one does not decide the result
+				dst = compile(n->_left, xpath_type_boolean);
+
+				xpath_instruction* jump = emit(n->_type == ast_op_or ? op_jump_if_true : op_jump_if_false, 0, dst);
+
+				unsigned int rhs = compile(n->_right, xpath_type_boolean);
+				emit(op_move_boolean, dst, rhs);
+
+				jump->data.target = size;
+				return dst;
+			}
+
+			case ast_op_equal:
+				return compile_equal(n, true);
+
+			case ast_op_not_equal:
+				return compile_equal(n, false);
+
+			case ast_op_less:
+				return compile_relational(n, op_less_number, false);
+
+			case ast_op_greater:
+				return compile_relational(n, op_less_number, true);
+
+			case ast_op_less_or_equal:
+				return compile_relational(n, op_less_equal_number, false);
+
+			case ast_op_greater_or_equal:
+				return compile_relational(n, op_less_equal_number, true);
+
+			case ast_op_add:
+				return compile_binary(op_add, n->_left, n->_right, xpath_type_number, xpath_type_number);
+
+			case ast_op_subtract:
+				return compile_binary(op_subtract, n->_left, n->_right, xpath_type_number, xpath_type_number);
+
+			case ast_op_multiply:
+				return compile_binary(op_multiply, n->_left, n->_right, xpath_type_number, xpath_type_number);
+
+			case ast_op_divide:
+				return compile_binary(op_divide, n->_left, n->_right, xpath_type_number, xpath_type_number);
+
+			case ast_op_mod:
+				return compile_binary(op_mod, n->_left, n->_right, xpath_type_number, xpath_type_number);
+
+			case ast_op_negate:
+			{
+				unsigned int a = compile(n->_left, xpath_type_number);
+
+				dst = allocate(xpath_type_number);
+				emit(op_negate, dst, a);
+				return dst;
+			}
+
+			case ast_func_not:
+			{
+				unsigned int a = compile(n->_left, xpath_type_boolean);
+
+				dst = allocate(xpath_type_boolean);
+				emit(op_not, dst, a);
+				return dst;
+			}
+
+			case ast_func_boolean:
+				return compile(n->_left, xpath_type_boolean);
+
+			case ast_func_number_1:
+				return compile(n->_left, xpath_type_number);
+
+			case ast_func_string_1:
+				return compile(n->_left, xpath_type_string);
+
+			case ast_func_contains:
+				// the interpreter searches node text in place
+				if (n->is_inplace_contains()) return fallback(n, xpath_type_boolean);
+
+				return compile_binary(op_contains, n->_left, n->_right, xpath_type_string, xpath_type_boolean);
+
+			case ast_func_starts_with:
+				return compile_binary(op_starts_with, n->_left, n->_right, xpath_type_string, xpath_type_boolean);
+
+			case ast_func_string_length_1:
+			{
+				unsigned int a = compile(n->_left, xpath_type_string);
+
+				dst = allocate(xpath_type_number);
+				emit(op_string_length, dst, a);
+				return dst;
+			}
+
+			case ast_func_ends_with:
+				return compile_binary(op_ends_with, n->_left, n->_right, xpath_type_string, xpath_type_boolean);
+
+			case ast_func_matches_token:
+				return compile_binary(op_has_token, n->_left, n->_right, xpath_type_string, xpath_type_boolean);
+
+			case ast_func_lower_case:
+			{
+				unsigned int a = compile(n->_left, xpath_type_string);
+
+				dst = allocate(xpath_type_string);
+				emit(op_lower_case, dst, a);
+				return dst;
+			}
+
+			case ast_func_has_class:
+			{
+				unsigned int a = compile(n->_left, xpath_type_string);
+
+				dst = allocate(xpath_type_boolean);
+				emit(op_has_class, dst, a);
+				return dst;
+			}
+
+			default:
+				return fallback(n, n->rettype());
+			}
+		}
+
+		// Compile scalar expression; returns 0 if the tree interpreter is as fast or the expression does not fit
+		static xpath_program* compile(xpath_ast_node* n, xpath_allocator* alloc)
+		{
+			switch (n->_type)
+			{
+			case ast_string_constant:
+			case ast_number_constant:
+			case ast_variable:
+			case ast_func_true:
+			case ast_func_false:
+				return 0;
+
+			default:
+				if (n->rettype() == xpath_type_node_set) return 0;
+			}
+
+			xpath_compiler compiler;
+			unsigned int result = compiler.compile_value(n);
+
+			if (compiler.failed || compiler.work == 0) return 0;
+
+			xpath_program* program = static_cast<xpath_program*>(alloc->allocate_nothrow(sizeof(xpath_program)));
+			xpath_instruction* code = static_cast<xpath_instruction*>(alloc->allocate_nothrow(compiler.size * sizeof(xpath_instruction)));
+			if (!program || !code) return 0;
+
+			memcpy(code, compiler.code, compiler.size * sizeof(xpath_instruction));
+
+			program->code = code;
+			program->size = compiler.size;
+			program->type = static_cast<char>(n->rettype());
+			program->result = static_cast<unsigned char>(result);
+
+			return program;
+		}
+
+		// Compile all predicate and filter expressions in the tree
+		static void compile_predicates(xpath_ast_node* n, xpath_allocator* alloc)
+		{
+			for (; n; n = n->_next)
+			{
+				if (n->_left) compile_predicates(n->_left, alloc);
+				if (n->_right) compile_predicates(n->_right, alloc);
+
+				if (n->_type == ast_predicate)
+					n->_data.program = compile(n->_left, alloc);
+				else if (n->_type == ast_filter || n->_type == ast_filter_posinv)
+					n->_data.program = compile(n->_right, alloc);
+			}
+		}
+	};
+#else
+	struct xpath_compiler
+	{
+		static xpath_program* compile(xpath_ast_node*, xpath_allocator*)
+		{
+			return 0;
+		}
+
+		static void compile_predicates(xpath_ast_node*, xpath_allocator*)
+		{
+		}
+	};
+
+	bool eval_program_boolean(const xpath_program*, const xpath_context&, const xpath_stack&)
+	{
+		assert(!"Bytecode is disabled");
+		return false;
+	}
+
+	double eval_program_number(const xpath_program*, const xpath_context&, const xpath_stack&)
+	{
+		assert(!"Bytecode is disabled");
+		return 0;
+	}
+
+	xpath_string eval_program_string(const xpath_program*, const xpath_context&, const xpath_stack&)
+	{
+		assert(!"Bytecode is disabled");
+		return xpath_string();
+	}
+#endif
+
+	struct xpath_parser
+	{
+	    xpath_allocator* _alloc;
+	    xpath_lexer _lexer;
+
+		const char_t* _query;
+		xpath_variable_set* _variables;
+		const xpath_function_set* _functions;
+		unsigned int _options;
+
+		xpath_parse_result* _result;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		jmp_buf _error_handler;
+	#endif
+
+		void throw_error(const char* message)
+		{
+			_result->error = message;
+			_result->offset = _lexer.current_pos() - _query;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			longjmp(_error_handler, 1);
+		#else
+			throw xpath_exception(*_result);
+		#endif
+		}
+
+		void throw_error_oom()
+        {
+        #ifdef PUGIHTML_NO_EXCEPTIONS
+            throw_error("Out of memory");
+        #else
+            throw std::bad_alloc();
+        #endif
+        }
+
+		void* alloc_node()
+		{
+			void* result = _alloc->allocate_nothrow(sizeof(xpath_ast_node));
+
+			if (!result) throw_error_oom();
+
+			return result;
+		}
+
+		const char_t* alloc_string(const xpath_lexer_string& value)
+		{
+			if (value.begin)
+			{
+				size_t length = static_cast<size_t>(value.end - value.begin);
+
+				char_t* c = static_cast<char_t*>(_alloc->allocate_nothrow((length + 1) * sizeof(char_t)));
+				if (!c) throw_error_oom();
+
+				memcpy(c, value.begin, length * sizeof(char_t));
+				c[length] = 0;
+
+				return c;
+			}
+			else return 0;
+		}
+
+		// Name of a name test, converted to the case selected by the compilation options
+		const char_t* alloc_name(const xpath_lexer_string& value)
+		{
+			char_t* c = const_cast<char_t*>(alloc_string(value));
+
+			if (c && (_options & xpath_names_upper)) to_upper(c);
+			else if (c && (_options & xpath_names_lower)) to_lower(c);
+
+			return c;
+		}
+
+		xpath_ast_node* parse_function_helper(ast_type_t type0, ast_type_t type1, size_t argc, xpath_ast_node* args[2])
+		{
+			assert(argc <= 1);
+
+			if (argc == 1 && args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
+
+			return new (alloc_node()) xpath_ast_node(argc == 0 ? type0 : type1, xpath_type_string, args[0]);
+		}
+
+		// Arguments are stored like concat() arguments: the first one in left, the rest in right and its siblings
+		xpath_ast_node* parse_extension_function(const xpath_function_entry* function, xpath_ast_node* args[2])
+		{
+			xpath_ast_node* arg = args[0];
+
+			for (size_t i = 0; i < function->argument_count; ++i, arg = (i == 1) ? args[1] : arg->next())
+				if (function->arguments[i] == xpath_type_node_set && arg->rettype() != xpath_type_node_set)
+					throw_error("Function has to be applied to node set");
+
+			return new (alloc_node()) xpath_ast_node(function, args[0], args[1]);
+		}
+
+		xpath_ast_node* parse_function(const xpath_lexer_string& name, size_t argc, xpath_ast_node* args[2])
+		{
+			switch (name.begin[0])
+			{
+			case 'b':
+				if (name == PUGIHTML_TEXT("boolean") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_boolean, xpath_type_boolean, args[0]);
+					
+				break;
+			
+			case 'c':
+				if (name == PUGIHTML_TEXT("count") && argc == 1)
+				{
+					if (args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
+					return new (alloc_node()) xpath_ast_node(ast_func_count, xpath_type_number, args[0]);
+				}
+				else if (name == PUGIHTML_TEXT("contains") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_contains, xpath_type_boolean, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("concat") && argc >= 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_concat, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("ceiling") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_ceiling, xpath_type_number, args[0]);
+					
+				break;
+			
+			case 'e':
+				if (name == PUGIHTML_TEXT("ends-with") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_ends_with, xpath_type_boolean, args[0], args[1]);
+
+				break;
+
+			case 'f':
+				if (name == PUGIHTML_TEXT("false") && argc == 0)
+					return new (alloc_node()) xpath_ast_node(ast_func_false, xpath_type_boolean);
+				else if (name == PUGIHTML_TEXT("floor") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_floor, xpath_type_number, args[0]);
+					
+				break;
+			
+			case 'h':
+				if (name == PUGIHTML_TEXT("has-class") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_has_class, xpath_type_boolean, args[0]);
+
+				break;
+
+			case 'i':
+				if (name == PUGIHTML_TEXT("id") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_id, xpath_type_node_set, args[0]);
+					
+				break;
+			
+			case 'l':
+				if (name == PUGIHTML_TEXT("last") && argc == 0)
+					return new (alloc_node()) xpath_ast_node(ast_func_last, xpath_type_number);
+				else if (name == PUGIHTML_TEXT("lang") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_lang, xpath_type_boolean, args[0]);
+				else if (name == PUGIHTML_TEXT("local-name") && argc <= 1)
+					return parse_function_helper(ast_func_local_name_0, ast_func_local_name_1, argc, args);
+				else if (name == PUGIHTML_TEXT("lower-case") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_lower_case, xpath_type_string, args[0]);
+			
+				break;
+			
+			case 'm':
+				if (name == PUGIHTML_TEXT("matches-token") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_matches_token, xpath_type_boolean, args[0], args[1]);
+
+				break;
+
+			case 'n':
+				if (name == PUGIHTML_TEXT("name") && argc <= 1)
+					return parse_function_helper(ast_func_name_0, ast_func_name_1, argc, args);
+				else if (name == PUGIHTML_TEXT("namespace-uri") && argc <= 1)
+					return parse_function_helper(ast_func_namespace_uri_0, ast_func_namespace_uri_1, argc, args);
+				else if (name == PUGIHTML_TEXT("normalize-space") && argc <= 1)
+					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_normalize_space_0 : ast_func_normalize_space_1, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("not") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_not, xpath_type_boolean, args[0]);
+				else if (name == PUGIHTML_TEXT("number") && argc <= 1)
+					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_number_0 : ast_func_number_1, xpath_type_number, args[0]);
+			
+				break;
+			
+			case 'p':
+				if (name == PUGIHTML_TEXT("position") && argc == 0)
+					return new (alloc_node()) xpath_ast_node(ast_func_position, xpath_type_number);
+				
+				break;
+			
+			case 'r':
+				if (name == PUGIHTML_TEXT("round") && argc == 1)
+					return new (alloc_node()) xpath_ast_node(ast_func_round, xpath_type_number, args[0]);
+
+				break;
+			
+			case 's':
+				if (name == PUGIHTML_TEXT("string") && argc <= 1)
+					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_string_0 : ast_func_string_1, xpath_type_string, args[0]);
+				else if (name == PUGIHTML_TEXT("string-length") && argc <= 1)
+					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_string_length_0 : ast_func_string_length_1, xpath_type_number, args[0]);
+				else if (name == PUGIHTML_TEXT("starts-with") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_starts_with, xpath_type_boolean, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("substring-before") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_substring_before, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("substring-after") && argc == 2)
+					return new (alloc_node()) xpath_ast_node(ast_func_substring_after, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("substring") && (argc == 2 || argc == 3))
+					return new (alloc_node()) xpath_ast_node(argc == 2 ? ast_func_substring_2 : ast_func_substring_3, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("sum") && argc == 1)
+				{
+					if (args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
+					return new (alloc_node()) xpath_ast_node(ast_func_sum, xpath_type_number, args[0]);
+				}
+
+				break;
+			
+			case 't':
+				if (name == PUGIHTML_TEXT("translate") && argc == 3)
+					return new (alloc_node()) xpath_ast_node(ast_func_translate, xpath_type_string, args[0], args[1]);
+				else if (name == PUGIHTML_TEXT("true") && argc == 0)
+					return new (alloc_node()) xpath_ast_node(ast_func_true, xpath_type_boolean);
+					
+				break;
+			}
+
+			if (_functions)
+				if (const xpath_function_entry* function = xpath_function_entry::find(_functions, name.begin, name.end, argc))
+					return parse_extension_function(function, args);
+
+			throw_error("Unrecognized function or wrong parameter count");
+
+			return 0;
+		}
+
+		axis_t parse_axis_name(const xpath_lexer_string& name, bool& specified)
+		{
+			specified = true;
+
+			switch (name.begin[0])
+			{
+			case 'a':
+				if (name == PUGIHTML_TEXT("ancestor"))
+					return axis_ancestor;
+				else if (name == PUGIHTML_TEXT("ancestor-or-self"))
+					return axis_ancestor_or_self;
+				else if (name == PUGIHTML_TEXT("attribute"))
+					return axis_attribute;
+				
+				break;
+			
+			case 'c':
+				if (name == PUGIHTML_TEXT("child"))
+					return axis_child;
+				
+				break;
+			
+			case 'd':
+				if (name == PUGIHTML_TEXT("descendant"))
+					return axis_descendant;
+				else if (name == PUGIHTML_TEXT("descendant-or-self"))
+					return axis_descendant_or_self;
+				
+				break;
+			
+			case 'f':
+				if (name == PUGIHTML_TEXT("following"))
+					return axis_following;
+				else if (name == PUGIHTML_TEXT("following-sibling"))
+					return axis_following_sibling;
+				
+				break;
+			
+			case 'n':
+				if (name == PUGIHTML_TEXT("namespace"))
+					return axis_namespace;
+				
+				break;
+			
+			case 'p':
+				if (name == PUGIHTML_TEXT("parent"))
+					return axis_parent;
+				else if (name == PUGIHTML_TEXT("preceding"))
+					return axis_preceding;
+				else if (name == PUGIHTML_TEXT("preceding-sibling"))
+					return axis_preceding_sibling;
+				
+				break;
+			
+			case 's':
+				if (name == PUGIHTML_TEXT("self"))
+					return axis_self;
+				
+				break;
+			}
+
+			specified = false;
+			return axis_child;
+		}
+
+		nodetest_t parse_node_test_type(const xpath_lexer_string& name)
+		{
+			switch (name.begin[0])
+			{
+			case 'c':
+				if (name == PUGIHTML_TEXT("comment"))
+					return nodetest_type_comment;
+
+				break;
+
+			case 'n':
+				if (name == PUGIHTML_TEXT("node"))
+					return nodetest_type_node;
+
+				break;
+
+			case 'p':
+				if (name == PUGIHTML_TEXT("processing-instruction"))
+					return nodetest_type_pi;
+
+				break;
+
+			case 't':
+				if (name == PUGIHTML_TEXT("text"))
+					return nodetest_type_text;
+
+				break;
+			}
+
+			return nodetest_none;
+		}
+
+	    // PrimaryExpr ::= VariableReference | '(' Expr ')' | Literal | Number | FunctionCall
+	    xpath_ast_node* parse_primary_expression()
+	    {
+	    	switch (_lexer.current())
+	    	{
+	    	case lex_var_ref:
+	    	{
+				xpath_lexer_string name = _lexer.contents();
+
+				if (!_variables)
+					throw_error("Unknown variable: variable set is not provided");
+
+				xpath_variable* var = get_variable(_variables, name.begin, name.end);
+
+				if (!var)
+					throw_error("Unknown variable: variable set does not contain the given name");
+
+				_lexer.next();
+
+	    		return new (alloc_node()) xpath_ast_node(ast_variable, var->type(), var);
+			}
+
+			case lex_open_brace:
+			{
+				_lexer.next();
+
+				xpath_ast_node* n = parse_expression();
+
+				if (_lexer.current() != lex_close_brace)
+					throw_error("Unmatched braces");
+
+				_lexer.next();
+
+				return n;
+			}
+
+			case lex_quoted_string:
+			{
+				const char_t* value = alloc_string(_lexer.contents());
+
+				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_string_constant, xpath_type_string, value);
+				_lexer.next();
+
+				return n;
+			}
+
+			case lex_number:
+			{
+				double value = 0;
+
+				if (!convert_string_to_number(_lexer.contents().begin, _lexer.contents().end, &value))
+					throw_error_oom();
+
+				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_number_constant, xpath_type_number, value);
+				_lexer.next();
+
+				return n;
+			}
+
+			case lex_string:
+			{
+				xpath_ast_node* args[2] = {0};
+				size_t argc = 0;
+				
+				xpath_lexer_string function = _lexer.contents();
+				_lexer.next();
+				
+				xpath_ast_node* last_arg = 0;
+				
+				if (_lexer.current() != lex_open_brace)
+					throw_error("Unrecognized function call");
+				_lexer.next();
+
+				if (_lexer.current() != lex_close_brace)
+					args[argc++] = parse_expression();
+
+				while (_lexer.current() != lex_close_brace)
+				{
+					if (_lexer.current() != lex_comma)
+						throw_error("No comma between function arguments");
+					_lexer.next();
+					
+					xpath_ast_node* n = parse_expression();
+					
+					if (argc < 2) args[argc] = n;
+					else last_arg->set_next(n);
+
+					argc++;
+					last_arg = n;
+				}
+				
+				_lexer.next();
+
+				return parse_function(function, argc, args);
+			}
+
+	    	default:
+	    		throw_error("Unrecognizable primary expression");
+
+	    		return 0;
+	    	}
+	    }
+	    
+	    // FilterExpr ::= PrimaryExpr | FilterExpr Predicate
+	    // Predicate ::= '[' PredicateExpr ']'
+	    // PredicateExpr ::= Expr
+	    xpath_ast_node* parse_filter_expression()
+	    {
+	    	xpath_ast_node* n = parse_primary_expression();
+
+	    	while (_lexer.current() == lex_open_square_brace)
+	    	{
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_expression();
+
+				if (n->rettype() != xpath_type_node_set) throw_error("Predicate has to be applied to node set");
+
+				bool posinv = expr->rettype() != xpath_type_number && expr->is_posinv();
+
+	    		n = new (alloc_node()) xpath_ast_node(posinv ? ast_filter_posinv : ast_filter, xpath_type_node_set, n, expr);
+
+	    		if (_lexer.current() != lex_close_square_brace)
+	    			throw_error("Unmatched square brace");
+	    	
+	    		_lexer.next();
+	    	}
+	    	
+	    	return n;
+	    }
+	    
+	    // Step ::= AxisSpecifier NodeTest Predicate* | AbbreviatedStep
+	    // AxisSpecifier ::= AxisName '::' | '@'?
+	    // NodeTest ::= NameTest | NodeType '(' ')' | 'processing-instruction' '(' Literal ')'
+	    // NameTest ::= '*' | NCName ':' '*' | QName
+	    // AbbreviatedStep ::= '.' | '..'
+	    xpath_ast_node* parse_step(xpath_ast_node* set)
+	    {
+			if (set && set->rettype() != xpath_type_node_set)
+				throw_error("Step has to be applied to node set");
+
+			bool axis_specified = false;
+			axis_t axis = axis_child; // implied child axis
+
+			if (_lexer.current() == lex_axis_attribute)
+			{
+				axis = axis_attribute;
+				axis_specified = true;
+				
+				_lexer.next();
+			}
+			else if (_lexer.current() == lex_dot)
+			{
+				_lexer.next();
+				
+				return new (alloc_node()) xpath_ast_node(ast_step, set, axis_self, nodetest_type_node, 0);
+			}
+			else if (_lexer.current() == lex_double_dot)
+			{
+				_lexer.next();
+				
+				return new (alloc_node()) xpath_ast_node(ast_step, set, axis_parent, nodetest_type_node, 0);
+			}
+	    
+			nodetest_t nt_type = nodetest_none;
+			xpath_lexer_string nt_name;
+			
+			if (_lexer.current() == lex_string)
+			{
+				// node name test
+				nt_name = _lexer.contents();
+				_lexer.next();
+
+				// was it an axis name?
+				if (_lexer.current() == lex_double_colon)
+				{
+					// parse axis name
+					if (axis_specified) throw_error("Two axis specifiers in one step");
+
+					axis = parse_axis_name(nt_name, axis_specified);
+
+					if (!axis_specified) throw_error("Unknown axis");
+
+					// read actual node test
+					_lexer.next();
+
+					if (_lexer.current() == lex_multiply)
+					{
+						nt_type = nodetest_all;
+						nt_name = xpath_lexer_string();
+						_lexer.next();
+					}
+					else if (_lexer.current() == lex_string)
+					{
+						nt_name = _lexer.contents();
+						_lexer.next();
+					}
+					else throw_error("Unrecognized node test");
+				}
+				
+				if (nt_type == nodetest_none)
+				{
+					// node type test or processing-instruction
+					if (_lexer.current() == lex_open_brace)
+					{
+						_lexer.next();
+						
+						if (_lexer.current() == lex_close_brace)
+						{
+							_lexer.next();
+
+							nt_type = parse_node_test_type(nt_name);
+
+							if (nt_type == nodetest_none) throw_error("Unrecognized node type");
+							
+							nt_name = xpath_lexer_string();
+						}
+						else if (nt_name == PUGIHTML_TEXT("processing-instruction"))
+						{
+							if (_lexer.current() != lex_quoted_string)
+								throw_error("Only literals are allowed as arguments to processing-instruction()");
+						
+							nt_type = nodetest_pi;
+							nt_name = _lexer.contents();
+							_lexer.next();
+							
+							if (_lexer.current() != lex_close_brace)
+								throw_error("Unmatched brace near processing-instruction()");
+							_lexer.next();
+						}
+						else
+							throw_error("Unmatched brace near node type test");
+
+					}
+					// QName or NCName:*
+					else
+					{
+						if (nt_name.end - nt_name.begin > 2 && nt_name.end[-2] == ':' && nt_name.end[-1] == '*') // NCName:*
+						{
+							nt_name.end--; // erase *
+							
+							nt_type = nodetest_all_in_namespace;
+						}
+						else nt_type = nodetest_name;
+					}
+				}
+			}
+			else if (_lexer.current() == lex_multiply)
+			{
+				nt_type = nodetest_all;
+				_lexer.next();
+			}
+			else throw_error("Unrecognized node test");
+			
+			const char_t* nt_data = (nt_type == nodetest_name || nt_type == nodetest_all_in_namespace) ? alloc_name(nt_name) : alloc_string(nt_name);
+
+			xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step, set, axis, nt_type, nt_data);
+			
+			xpath_ast_node* last = 0;
+			
+			while (_lexer.current() == lex_open_square_brace)
+			{
+				_lexer.next();
+				
+				xpath_ast_node* expr = parse_expression();
+
+				xpath_ast_node* pred = new (alloc_node()) xpath_ast_node(ast_predicate, xpath_type_node_set, expr);
+				
+				if (_lexer.current() != lex_close_square_brace)
+	    			throw_error("Unmatched square brace");
+				_lexer.next();
+				
+				if (last) last->set_next(pred);
+				else n->set_right(pred);
+				
+				last = pred;
+			}
+			
+			return n;
+	    }
+	    
+	    // RelativeLocationPath ::= Step | RelativeLocationPath '/' Step | RelativeLocationPath '//' Step
+	    xpath_ast_node* parse_relative_location_path(xpath_ast_node* set)
+	    {
+			xpath_ast_node* n = parse_step(set);
+			
+			while (_lexer.current() == lex_slash || _lexer.current() == lex_double_slash)
+			{
+				lexeme_t l = _lexer.current();
+				_lexer.next();
+
+				if (l == lex_double_slash)
+					n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
+				
+				n = parse_step(n);
+			}
+			
+			return n;
+	    }
+	    
+	    // LocationPath ::= RelativeLocationPath | AbsoluteLocationPath
+	    // AbsoluteLocationPath ::= '/' RelativeLocationPath? | '//' RelativeLocationPath
+	    xpath_ast_node* parse_location_path()
+	    {
+			if (_lexer.current() == lex_slash)
+			{
+				_lexer.next();
+				
+				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step_root, xpath_type_node_set);
+
+				// relative location path can start from axis_attribute, dot, double_dot, multiply and string lexemes; any other lexeme means standalone root path
+				lexeme_t l = _lexer.current();
+
+				if (l == lex_string || l == lex_axis_attribute || l == lex_dot || l == lex_double_dot || l == lex_multiply)
+					return parse_relative_location_path(n);
+				else
+					return n;
+			}
+			else if (_lexer.current() == lex_double_slash)
+			{
+				_lexer.next();
+				
+				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step_root, xpath_type_node_set);
+				n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
+				
+				return parse_relative_location_path(n);
+			}
+
+			// else clause moved outside of if because of bogus warning 'control may reach end of non-void function being inlined' in gcc 4.0.1
+			return parse_relative_location_path(0);
+	    }
+	    
+	    // PathExpr ::= LocationPath
+	    //				| FilterExpr
+	    //				| FilterExpr '/' RelativeLocationPath
+	    //				| FilterExpr '//' RelativeLocationPath
+	    xpath_ast_node* parse_path_expression()
+	    {
+			// Clarification.
+			// PathExpr begins with either LocationPath or FilterExpr.
+			// FilterExpr begins with PrimaryExpr
+			// PrimaryExpr begins with '$' in case of it being a variable reference,
+			// '(' in case of it being an expression, string literal, number constant or
+			// function call.
+
+			if (_lexer.current() == lex_var_ref || _lexer.current() == lex_open_brace || 
+				_lexer.current() == lex_quoted_string || _lexer.current() == lex_number ||
+				_lexer.current() == lex_string)
+	    	{
+	    		if (_lexer.current() == lex_string)
+	    		{
+	    			// This is either a function call, or not - if not, we shall proceed with location path
+	    			const char_t* state = _lexer.state();
+	    			
+					while (IS_CHARTYPE(*state, ct_space)) ++state;
+	    			
+	    			if (*state != '(') return parse_location_path();
+
+					// This looks like a function call; however this still can be a node-test. Check it.
+					if (parse_node_test_type(_lexer.contents()) != nodetest_none) return parse_location_path();
+	    		}
+	    		
+	    		xpath_ast_node* n = parse_filter_expression();
+
+	    		if (_lexer.current() == lex_slash || _lexer.current() == lex_double_slash)
+	    		{
+					lexeme_t l = _lexer.current();
+	    			_lexer.next();
+	    			
+					if (l == lex_double_slash)
+					{
+						if (n->rettype() != xpath_type_node_set) throw_error("Step has to be applied to node set");
+
+						n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
+					}
+	
+	    			// select from location path
+	    			return parse_relative_location_path(n);
+	    		}
+
+	    		return n;
+	    	}
+	    	else return parse_location_path();
+	    }
+
+	    // UnionExpr ::= PathExpr | UnionExpr '|' PathExpr
+	    xpath_ast_node* parse_union_expression()
+	    {
+	    	xpath_ast_node* n = parse_path_expression();
+
+	    	while (_lexer.current() == lex_union)
+	    	{
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_union_expression();
+
+				if (n->rettype() != xpath_type_node_set || expr->rettype() != xpath_type_node_set)
+					throw_error("Union operator has to be applied to node sets");
+
+	    		n = new (alloc_node()) xpath_ast_node(ast_op_union, xpath_type_node_set, n, expr);
+	    	}
+
+	    	return n;
+	    }
+
+	    // UnaryExpr ::= UnionExpr | '-' UnaryExpr
+	    xpath_ast_node* parse_unary_expression()
+	    {
+	    	if (_lexer.current() == lex_minus)
+	    	{
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_unary_expression();
+
+	    		return new (alloc_node()) xpath_ast_node(ast_op_negate, xpath_type_number, expr);
+	    	}
+	    	else return parse_union_expression();
+	    }
+	    
+	    // MultiplicativeExpr ::= UnaryExpr
+	    //						  | MultiplicativeExpr '*' UnaryExpr
+	    //						  | MultiplicativeExpr 'div' UnaryExpr
+	    //						  | MultiplicativeExpr 'mod' UnaryExpr
+	    xpath_ast_node* parse_multiplicative_expression()
+	    {
+	    	xpath_ast_node* n = parse_unary_expression();
+
+	    	while (_lexer.current() == lex_multiply || (_lexer.current() == lex_string &&
+	    		   (_lexer.contents() == PUGIHTML_TEXT("mod") || _lexer.contents() == PUGIHTML_TEXT("div"))))
+	    	{
+	    		ast_type_t op = _lexer.current() == lex_multiply ? ast_op_multiply :
+	    			_lexer.contents().begin[0] == 'd' ? ast_op_divide : ast_op_mod;
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_unary_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(op, xpath_type_number, n, expr);
+	    	}
+
+	    	return n;
+	    }
+
+	    // AdditiveExpr ::= MultiplicativeExpr
+	    //					| AdditiveExpr '+' MultiplicativeExpr
+	    //					| AdditiveExpr '-' MultiplicativeExpr
+	    xpath_ast_node* parse_additive_expression()
+	    {
+	    	xpath_ast_node* n = parse_multiplicative_expression();
+
+	    	while (_lexer.current() == lex_plus || _lexer.current() == lex_minus)
+	    	{
+	    		lexeme_t l = _lexer.current();
+
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_multiplicative_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(l == lex_plus ? ast_op_add : ast_op_subtract, xpath_type_number, n, expr);
+	    	}
+
+	    	return n;
+	    }
+
+	    // RelationalExpr ::= AdditiveExpr
+	    //					  | RelationalExpr '<' AdditiveExpr
+	    //					  | RelationalExpr '>' AdditiveExpr
+	    //					  | RelationalExpr '<=' AdditiveExpr
+	    //					  | RelationalExpr '>=' AdditiveExpr
+	    xpath_ast_node* parse_relational_expression()
+	    {
+	    	xpath_ast_node* n = parse_additive_expression();
+
+	    	while (_lexer.current() == lex_less || _lexer.current() == lex_less_or_equal || 
+	    		   _lexer.current() == lex_greater || _lexer.current() == lex_greater_or_equal)
+	    	{
+	    		lexeme_t l = _lexer.current();
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_additive_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(l == lex_less ? ast_op_less : l == lex_greater ? ast_op_greater :
+	    						l == lex_less_or_equal ? ast_op_less_or_equal : ast_op_greater_or_equal, xpath_type_boolean, n, expr);
+	    	}
+
+	    	return n;
+	    }
+	    
+	    // EqualityExpr ::= RelationalExpr
+	    //					| EqualityExpr '=' RelationalExpr
+	    //					| EqualityExpr '!=' RelationalExpr
+	    xpath_ast_node* parse_equality_expression()
+	    {
+	    	xpath_ast_node* n = parse_relational_expression();
+
+	    	while (_lexer.current() == lex_equal || _lexer.current() == lex_not_equal)
+	    	{
+	    		lexeme_t l = _lexer.current();
+
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_relational_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(l == lex_equal ? ast_op_equal : ast_op_not_equal, xpath_type_boolean, n, expr);
+	    	}
+
+	    	return n;
+	    }
+	    
+	    // AndExpr ::= EqualityExpr | AndExpr 'and' EqualityExpr
+	    xpath_ast_node* parse_and_expression()
+	    {
+	    	xpath_ast_node* n = parse_equality_expression();
+
+	    	while (_lexer.current() == lex_string && _lexer.contents() == PUGIHTML_TEXT("and"))
+	    	{
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_equality_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(ast_op_and, xpath_type_boolean, n, expr);
+	    	}
+
+	    	return n;
+	    }
+
+	    // OrExpr ::= AndExpr | OrExpr 'or' AndExpr
+	    xpath_ast_node* parse_or_expression()
+	    {
+	    	xpath_ast_node* n = parse_and_expression();
+
+	    	while (_lexer.current() == lex_string && _lexer.contents() == PUGIHTML_TEXT("or"))
+	    	{
+	    		_lexer.next();
+
+				xpath_ast_node* expr = parse_and_expression();
+
+	    		n = new (alloc_node()) xpath_ast_node(ast_op_or, xpath_type_boolean, n, expr);
+	    	}
+
+	    	return n;
+	    }
+		
+		// Expr ::= OrExpr
+		xpath_ast_node* parse_expression()
+		{
+			return parse_or_expression();
+		}
+
+		xpath_parser(const char_t* query, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options, xpath_allocator* alloc, xpath_parse_result* result):
+			_alloc(alloc), _lexer(query), _query(query), _variables(variables), _functions(functions), _options(options), _result(result)
+		{
+		}
+
+		xpath_ast_node* parse()
+		{
+			xpath_ast_node* result = parse_expression();
+			
+			if (_lexer.current() != lex_eof)
+			{
+				// there are still unparsed tokens left, error
+				throw_error("Incorrect query");
+			}
+			
+			return result;
+		}
+
+		static xpath_ast_node* parse(const char_t* query, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options, xpath_allocator* alloc, xpath_parse_result* result)
+		{
+			xpath_parser parser(query, variables, functions, options, alloc, result);
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			int error = setjmp(parser._error_handler);
+
+			xpath_ast_node* root = (error == 0) ? parser.parse() : 0;
+		#else
+			xpath_ast_node* root = parser.parse();
+		#endif
+
+			if (root)
+			{
+				root->optimize(alloc);
+
+				xpath_compiler::compile_predicates(root, alloc);
+			}
+
+			return root;
+		}
+	};
+
+    struct xpath_query_impl
+    {
+		static xpath_query_impl* create()
+		{
+			void* memory = global_allocate(sizeof(xpath_query_impl));
+
+            return new (memory) xpath_query_impl();
+		}
+
+		static void destroy(void* ptr)
+		{
+			if (!ptr) return;
+			
+			// free all allocated pages
+			static_cast<xpath_query_impl*>(ptr)->alloc.release();
+
+			// free allocator memory (with the first page)
+			global_deallocate(ptr);
+		}
+
+        xpath_query_impl(): root(0), program(0), alloc(&block), memo(false)
+        {
+            block.next = 0;
+        }
+
+		// Prepare stack data for an evaluation of the query
+		void start(xpath_stack_data& sd) const
+		{
+			sd.invariants.values.enabled = memo;
+		}
+
+        xpath_ast_node* root;
+        const xpath_program* program;
+        xpath_allocator alloc;
+        xpath_memory_block block;
+
+		// keep string values during evaluation (see xpath_string_memo)
+		bool memo;
+    };
+
+	// Binary image of a compiled query (see xpath_query::save). Nodes are stored in post-order, so that every reference points to an earlier
+	// record; references are record indices and string offsets, so the image does not depend on the address it is loaded from.
+	const char xpath_image_magic[4] = {'P', 'H', 'X', 'Q'};
+
+	// has to be changed whenever the tree or the bytecode changes
+	const unsigned int xpath_image_version = 1;
+
+	struct xpath_image_header
+	{
+		char magic[4];
+		unsigned int version;
+		unsigned int char_size;
+		unsigned int size;			// size of the image in bytes
+		unsigned int checksum;
+
+		unsigned int nodes;
+		unsigned int programs;
+		unsigned int instructions;
+		unsigned int strings;		// size of the string table in char_t units
+
+		unsigned int root;			// root node index
+		unsigned int program;		// root program index + 1, or 0
+	};
+
+	struct xpath_image_node
+	{
+		double number;				// value for ast_number_constant
+
+		char type;
+		char rettype;
+		char axis;
+		char test;
+
+		unsigned int left;			// node index + 1, or 0
+		unsigned int right;
+		unsigned int next;
+
+		// string offset + 1 for constants, node tests, variable and function names, program index + 1 for predicates and filters; 0 otherwise
+		unsigned int data;
+	};
+
+	struct xpath_image_program
+	{
+		unsigned int code;			// first instruction index
+		unsigned int size;
+		unsigned int type;
+		unsigned int result;
+	};
+
+	struct xpath_image_instruction
+	{
+		double number;				// value for op_number
+
+		char op;
+		unsigned char dst;
+		unsigned char a;
+		unsigned char b;
+
+		// string offset + 1 for strings and variable names, node index for op_eval_*, target for op_jump_*; 0 otherwise
+		unsigned int data;
+	};
+
+	const char* const xpath_image_invalid = "Invalid query image";
+	const char* const xpath_image_oom = "Out of memory";
+
+	// FNV-1a over words; the image size is only a multiple of the character size
+	unsigned int xpath_image_hash(unsigned int result, const char* data, size_t size)
+	{
+		size_t i = 0;
+
+		for (; i + sizeof(unsigned int) <= size; i += sizeof(unsigned int))
+		{
+			unsigned int word;
+			memcpy(&word, data + i, sizeof(word));
+
+			result = (result ^ word) * 16777619u;
+		}
+
+		for (; i < size; ++i)
+			result = (result ^ static_cast<unsigned char>(data[i])) * 16777619u;
+
+		return result;
+	}
+
+	// The header is hashed with a zero checksum field
+	unsigned int xpath_image_checksum(const xpath_image_header& header, const char* data, size_t size)
+	{
+		xpath_image_header copy = header;
+		copy.checksum = 0;
+
+		return xpath_image_hash(xpath_image_hash(2166136261u, reinterpret_cast<const char*>(&copy), sizeof(copy)), data, size);
+	}
+
+	struct xpath_image
+	{
+		struct entry
+		{
+			const xpath_ast_node* node;
+			unsigned int index;
+		};
+
+		// nodes in post-order
+		const xpath_ast_node** nodes;
+		size_t count;
+		size_t capacity;
+
+		// node to index map (open addressing, at most half full)
+		entry* table;
+		size_t table_size;
+
+		bool failed;
+
+		xpath_image(): nodes(0), count(0), capacity(0), table(0), table_size(0), failed(false)
+		{
+		}
+
+		~xpath_image()
+		{
+			if (nodes) global_deallocate(nodes);
+			if (table) global_deallocate(table);
+		}
+
+		static size_t hash(const xpath_ast_node* n)
+		{
+			return static_cast<size_t>(reinterpret_cast<uintptr_t>(n) / sizeof(void*));
+		}
+
+		const entry* find(const xpath_ast_node* n) const
+		{
+			if (!table) return 0;
+
+			for (size_t i = hash(n) & (table_size - 1); table[i].node; i = (i + 1) & (table_size - 1))
+				if (table[i].node == n) return &table[i];
+
+			return 0;
+		}
+
+		bool grow()
+		{
+			size_t new_capacity = capacity ? capacity * 2 : 64;
+
+			const xpath_ast_node** new_nodes = static_cast<const xpath_ast_node**>(global_allocate(new_capacity * sizeof(const xpath_ast_node*)));
+			entry* new_table = static_cast<entry*>(global_allocate(new_capacity * 2 * sizeof(entry)));
+
+			if (!new_nodes || !new_table)
+			{
+				if (new_nodes) global_deallocate(new_nodes);
+				if (new_table) global_deallocate(new_table);
+				return false;
+			}
+
+			if (count) memcpy(new_nodes, nodes, count * sizeof(const xpath_ast_node*));
+			memset(new_table, 0, new_capacity * 2 * sizeof(entry));
+
+			if (nodes) global_deallocate(nodes);
+			if (table) global_deallocate(table);
+
+			nodes = new_nodes;
+			capacity = new_capacity;
+			table = new_table;
+			table_size = new_capacity * 2;
+
+			// rehash
+			for (size_t i = 0; i < count; ++i) insert(nodes[i], static_cast<unsigned int>(i));
+
+			return true;
+		}
+
+		void insert(const xpath_ast_node* n, unsigned int index)
+		{
+			size_t i = hash(n) & (table_size - 1);
+
+			while (table[i].node) i = (i + 1) & (table_size - 1);
+
+			table[i].node = n;
+			table[i].index = index;
+		}
+
+		// Add the node chain in post-order; the chain is walked from the end, so that each node follows its next sibling
+		void add(const xpath_ast_node* n)
+		{
+			if (!n || failed || find(n)) return;
+
+			add(n->_left);
+			add(n->_right);
+			add(n->_next);
+
+			if (failed || find(n)) return;
+
+			if (count == capacity && !grow())
+			{
+				failed = true;
+				return;
+			}
+
+			nodes[count] = n;
+			insert(n, static_cast<unsigned int>(count));
+			count++;
+		}
+
+		unsigned int index(const xpath_ast_node* n) const
+		{
+			if (!n) return 0;
+
+			// bytecode only refers to nodes of the expression it was compiled from
+			const entry* e = find(n);
+			assert(e);
+
+			return e->index + 1;
+		}
+
+		static bool has_program(const xpath_ast_node* n)
+		{
+			return (n->_type == ast_predicate || n->_type == ast_filter || n->_type == ast_filter_posinv) && n->_data.program;
+		}
+
+		static const char_t* node_string(const xpath_ast_node* n)
+		{
+			switch (n->_type)
+			{
+			case ast_string_constant: return n->_data.string;
+			case ast_variable: return n->_data.variable->name();
+			case ast_step: return n->_data.nodetest;
+			case ast_func_extension: return n->_data.function->name;
+			default: return 0;
+			}
+		}
+
+		static size_t string_size(const char_t* s)
+		{
+			return s ? strlength(s) + 1 : 0;
+		}
+
+		static unsigned int write_string(char_t* strings, size_t& offset, const char_t* s)
+		{
+			if (!s) return 0;
+
+			size_t length = strlength(s);
+			memcpy(strings + offset, s, (length + 1) * sizeof(char_t));
+
+			unsigned int result = static_cast<unsigned int>(offset + 1);
+			offset += length + 1;
+
+			return result;
+		}
+
+	#ifndef PUGIHTML_NO_XPATH_BYTECODE
+		static const char_t* instruction_string(const xpath_instruction& i)
+		{
+			switch (i.op)
+			{
+			case op_string:
+			case op_attribute_exists:
+			case op_attribute_string:
+			case op_attribute_equal:
+				return i.data.string;
+
+			case op_variable_number:
+			case op_variable_string:
+			case op_variable_boolean:
+				return i.data.variable->name();
+
+			default:
+				return 0;
+			}
+		}
+	#endif
+
+		static size_t save(const xpath_query_impl* impl, void* buffer, size_t capacity)
+		{
+			xpath_image image;
+			image.add(impl->root);
+
+			if (image.failed)
+			{
+			#ifdef PUGIHTML_NO_EXCEPTIONS
+				return 0;
+			#else
+				throw std::bad_alloc();
+			#endif
+			}
+
+			// count records and strings
+			size_t programs = 0, instructions = 0, strings = 0;
+
+			for (size_t i = 0; i < image.count; ++i)
+			{
+				const xpath_ast_node* n = image.nodes[i];
+
+				strings += string_size(node_string(n));
+
+			#ifndef PUGIHTML_NO_XPATH_BYTECODE
+				if (has_program(n))
+				{
+					const xpath_program* p = n->_data.program;
+
+					programs++;
+					instructions += p->size;
+
+					for (size_t j = 0; j < p->size; ++j) strings += string_size(instruction_string(p->code[j]));
+				}
+			#endif
+			}
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			if (impl->program)
+			{
+				programs++;
+				instructions += impl->program->size;
+
+				for (size_t j = 0; j < impl->program->size; ++j) strings += string_size(instruction_string(impl->program->code[j]));
+			}
+		#endif
+
+			size_t size = sizeof(xpath_image_header) + image.count * sizeof(xpath_image_node) + programs * sizeof(xpath_image_program) +
+				instructions * sizeof(xpath_image_instruction) + strings * sizeof(char_t);
+
+			if (size > capacity) return size;
+
+			// records are copied to the buffer, which does not have to be aligned
+			char* nodes_data = static_cast<char*>(buffer) + sizeof(xpath_image_header);
+			char* programs_data = nodes_data + image.count * sizeof(xpath_image_node);
+			char* instructions_data = programs_data + programs * sizeof(xpath_image_program);
+			char_t* string_data = reinterpret_cast<char_t*>(instructions_data + instructions * sizeof(xpath_image_instruction));
+
+			size_t string_offset = 0;
+			size_t program_index = 0;
+			size_t instruction_index = 0;
+
+			for (size_t i = 0; i < image.count; ++i)
+			{
+				const xpath_ast_node* n = image.nodes[i];
+
+				xpath_image_node r;
+				memset(&r, 0, sizeof(r));
+
+				r.type = n->_type;
+				r.rettype = n->_rettype;
+				r.axis = n->_axis;
+				r.test = n->_test;
+				r.left = image.index(n->_left);
+				r.right = image.index(n->_right);
+				r.next = image.index(n->_next);
+				r.data = write_string(string_data, string_offset, node_string(n));
+
+				if (n->_type == ast_number_constant) r.number = n->_data.number;
+
+			#ifndef PUGIHTML_NO_XPATH_BYTECODE
+				if (has_program(n))
+				{
+					write_program(image, *n->_data.program, programs_data, program_index, instructions_data, instruction_index, string_data, string_offset);
+					r.data = static_cast<unsigned int>(program_index);
+				}
+			#endif
+
+				memcpy(nodes_data + i * sizeof(r), &r, sizeof(r));
+			}
+
+			xpath_image_header header;
+			memset(&header, 0, sizeof(header));
+
+			memcpy(header.magic, xpath_image_magic, sizeof(header.magic));
+			header.version = xpath_image_version;
+			header.char_size = sizeof(char_t);
+			header.size = static_cast<unsigned int>(size);
+			header.nodes = static_cast<unsigned int>(image.count);
+			header.programs = static_cast<unsigned int>(programs);
+			header.instructions = static_cast<unsigned int>(instructions);
+			header.strings = static_cast<unsigned int>(strings);
+			header.root = image.index(impl->root) - 1;
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			if (impl->program)
+			{
+				write_program(image, *impl->program, programs_data, program_index, instructions_data, instruction_index, string_data, string_offset);
+				header.program = static_cast<unsigned int>(program_index);
+			}
+		#endif
+
+			assert(program_index == programs && instruction_index == instructions && string_offset == strings);
+
+			header.checksum = xpath_image_checksum(header, nodes_data, size - sizeof(header));
+
+			memcpy(buffer, &header, sizeof(header));
+
+			return size;
+		}
+
+	#ifndef PUGIHTML_NO_XPATH_BYTECODE
+		static void write_program(const xpath_image& image, const xpath_program& p, char* programs_data, size_t& program_index,
+			char* instructions_data, size_t& instruction_index, char_t* string_data, size_t& string_offset)
+		{
+			xpath_image_program r;
+
+			r.code = static_cast<unsigned int>(instruction_index);
+			r.size = static_cast<unsigned int>(p.size);
+			r.type = static_cast<unsigned char>(p.type);
+			r.result = p.result;
+
+			memcpy(programs_data + program_index * sizeof(r), &r, sizeof(r));
+			program_index++;
+
+			for (size_t i = 0; i < p.size; ++i)
+			{
+				const xpath_instruction& ins = p.code[i];
+
+				xpath_image_instruction ri;
+				memset(&ri, 0, sizeof(ri));
+
+				ri.op = ins.op;
+				ri.dst = ins.dst;
+				ri.a = ins.a;
+				ri.b = ins.b;
+
+				switch (ins.op)
+				{
+				case op_number:
+					ri.number = ins.data.number;
+					break;
+
+				case op_eval_number:
+				case op_eval_string:
+				case op_eval_boolean:
+					ri.data = image.index(ins.data.node) - 1;
+					break;
+
+				case op_jump_if_true:
+				case op_jump_if_false:
+					ri.data = static_cast<unsigned int>(ins.data.target);
+					break;
+
+				default:
+					ri.data = write_string(string_data, string_offset, instruction_string(ins));
+				}
+
+				memcpy(instructions_data + instruction_index * sizeof(ri), &ri, sizeof(ri));
+				instruction_index++;
+			}
+		}
+	#endif
+
+
+
+		struct reader
+		{
+			const char* nodes_data;
+			const char* programs_data;
+			const char* instructions_data;
+
+			const char_t* strings;
+			size_t string_count;
+
+			xpath_ast_node* nodes;
+			size_t node_count;
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			xpath_program* programs;
+			size_t program_count;
+
+			xpath_instruction* code;
+			size_t instruction_count;
+		#endif
+
+			xpath_variable_set* variables;
+			const xpath_function_set* functions;
+
+			xpath_allocator* alloc;
+
+			const char* error;
+
+			// Get string for a reference (offset + 1); 0 references are only allowed if optional is set
+			const char_t* string(unsigned int reference, bool optional)
+			{
+				if (reference == 0)
+				{
+					if (!optional) error = xpath_image_invalid;
+					return 0;
+				}
+
+				if (reference > string_count)
+				{
+					error = xpath_image_invalid;
+					return 0;
+				}
+
+				return strings + (reference - 1);
+			}
+
+			xpath_variable* variable(unsigned int reference, xpath_value_type type)
+			{
+				const char_t* name = string(reference, false);
+				if (!name) return 0;
+
+				xpath_variable* result = variables ? variables->get(name) : 0;
+
+				if (!result || result->type() != type)
+				{
+					error = "Unknown variable: variable set does not contain the given name";
+					return 0;
+				}
+
+				return result;
+			}
+
+			const xpath_function_entry* function(const xpath_ast_node* n, unsigned int reference)
+			{
+				const char_t* name = string(reference, false);
+				if (!name) return 0;
+
+				// arguments are stored like concat() arguments
+				size_t argc = 0;
+
+				if (n->_left)
+				{
+					argc = 1;
+
+					for (xpath_ast_node* arg = n->_right; arg; arg = arg->_next) argc++;
+				}
+
+				const xpath_function_entry* result = functions ? xpath_function_entry::find(functions, name, name + strlength(name), argc) : 0;
+
+				if (!result || result->result != n->rettype())
+				{
+					error = "Unrecognized function or wrong parameter count";
+					return 0;
+				}
+
+				xpath_ast_node* arg = n->_left;
+
+				for (size_t i = 0; i < argc; ++i, arg = (i == 1) ? n->_right : arg->_next)
+					if (result->arguments[i] == xpath_type_node_set && arg->rettype() != xpath_type_node_set)
+					{
+						error = "Function has to be applied to node set";
+						return 0;
+					}
+
+				return result;
+			}
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			// Load program; bytecode can only evaluate nodes that precede the limit
+			const xpath_program* program(unsigned int index, size_t limit)
+			{
+				xpath_image_program r;
+
+				if (index >= program_count)
+				{
+					error = xpath_image_invalid;
+					return 0;
+				}
+
+				memcpy(&r, programs_data + index * sizeof(r), sizeof(r));
+
+				if (r.size == 0 || r.code > instruction_count || r.size > instruction_count - r.code || r.result >= xpath_program_registers ||
+					(r.type != xpath_type_number && r.type != xpath_type_string && r.type != xpath_type_boolean))
+				{
+					error = xpath_image_invalid;
+					return 0;
+				}
+
+				xpath_program* result = programs + index;
+
+				result->code = code + r.code;
+				result->size = r.size;
+				result->type = static_cast<char>(r.type);
+				result->result = static_cast<unsigned char>(r.result);
+
+				for (size_t i = 0; i < r.size; ++i)
+				{
+					xpath_image_instruction ri;
+					memcpy(&ri, instructions_data + (r.code + i) * sizeof(ri), sizeof(ri));
+
+					if (ri.op < 0 || ri.op > op_attribute_equal || ri.dst >= xpath_program_registers || ri.a >= xpath_program_registers || ri.b >= xpath_program_registers)
+					{
+						error = xpath_image_invalid;
+						return 0;
+					}
+
+					xpath_instruction& ins = code[r.code + i];
+
+					ins.op = ri.op;
+					ins.dst = ri.dst;
+					ins.a = ri.a;
+					ins.b = ri.b;
+					ins.data.target = 0;
+
+					switch (ri.op)
+					{
+					case op_number:
+						ins.data.number = ri.number;
+						break;
+
+					case op_string:
+					case op_attribute_exists:
+					case op_attribute_string:
+					case op_attribute_equal:
+						ins.data.string = string(ri.data, false);
+						break;
+
+					case op_variable_number:
+						ins.data.variable = variable(ri.data, xpath_type_number);
+						break;
+
+					case op_variable_string:
+						ins.data.variable = variable(ri.data, xpath_type_string);
+						break;
+
+					case op_variable_boolean:
+						ins.data.variable = variable(ri.data, xpath_type_boolean);
+						break;
+
+					case op_eval_number:
+					case op_eval_string:
+					case op_eval_boolean:
+						if (ri.data >= limit) error = xpath_image_invalid;
+						else ins.data.node = nodes + ri.data;
+						break;
+
+					case op_jump_if_true:
+					case op_jump_if_false:
+						// jumps only go forward, at most to the end of the program
+						if (ri.data <= i || ri.data > r.size) error = xpath_image_invalid;
+						else ins.data.target = ri.data;
+						break;
+
+					default:
+						;
+					}
+
+					if (error) return 0;
+				}
+
+				return result;
+			}
+		#endif
+
+			void node(size_t index)
+			{
+				xpath_image_node r;
+				memcpy(&r, nodes_data + index * sizeof(r), sizeof(r));
+
+				// references only point to preceding nodes, so the loaded tree has no cycles
+				if (r.type < 0 || r.type > ast_invariant || r.rettype <= xpath_type_none || r.rettype > xpath_type_boolean ||
+					r.axis < 0 || r.axis > axis_self || r.test < 0 || r.test > nodetest_all_in_namespace ||
+					r.left > index || r.right > index || r.next > index)
+				{
+					error = xpath_image_invalid;
+					return;
+				}
+
+				xpath_ast_node* n = new (nodes + index) xpath_ast_node(static_cast<ast_type_t>(r.type), static_cast<xpath_value_type>(r.rettype),
+					r.left ? nodes + (r.left - 1) : 0, r.right ? nodes + (r.right - 1) : 0);
+
+				n->_axis = r.axis;
+				n->_test = r.test;
+				n->_next = r.next ? nodes + (r.next - 1) : 0;
+
+				switch (r.type)
+				{
+				case ast_string_constant:
+					n->_data.string = string(r.data, false);
+					break;
+
+				case ast_number_constant:
+					n->_data.number = r.number;
+					break;
+
+				case ast_variable:
+					n->_data.variable = variable(r.data, n->rettype());
+					break;
+
+				case ast_step:
+					n->_data.nodetest = string(r.data, true);
+					break;
+
+				case ast_func_extension:
+					n->_data.function = function(n, r.data);
+					break;
+
+				case ast_func_contains:
+					// patterns are not saved; they are prepared again like after parsing
+					n->prepare_pattern(alloc);
+					break;
+
+				case ast_predicate:
+				case ast_filter:
+				case ast_filter_posinv:
+				#ifndef PUGIHTML_NO_XPATH_BYTECODE
+					if (r.data) n->_data.program = program(r.data - 1, index);
+				#endif
+					break;
+
+				default:
+					;
+				}
+			}
+		};
+
+		static const char* load(xpath_query_impl* impl, const void* data, size_t size, xpath_variable_set* variables, const xpath_function_set* functions)
+		{
+			xpath_image_header header;
+
+			if (!data || size < sizeof(header)) return xpath_image_invalid;
+
+			memcpy(&header, data, sizeof(header));
+
+			if (memcmp(header.magic, xpath_image_magic, sizeof(header.magic)) != 0) return xpath_image_invalid;
+			if (header.version != xpath_image_version || header.char_size != sizeof(char_t)) return "Query image was saved by a different version or configuration";
+
+			// check table sizes one by one, so that the total does not overflow
+			size_t rest = size - sizeof(header);
+
+			if (header.size != size || header.nodes == 0 || header.root >= header.nodes || header.nodes > rest / sizeof(xpath_image_node)) return xpath_image_invalid;
+			rest -= header.nodes * sizeof(xpath_image_node);
+
+			if (header.programs > rest / sizeof(xpath_image_program)) return xpath_image_invalid;
+			rest -= header.programs * sizeof(xpath_image_program);
+
+			if (header.instructions > rest / sizeof(xpath_image_instruction)) return xpath_image_invalid;
+			rest -= header.instructions * sizeof(xpath_image_instruction);
+
+			if (rest != header.strings * sizeof(char_t) || header.program > header.programs) return xpath_image_invalid;
+
+			const char* nodes_data = static_cast<const char*>(data) + sizeof(header);
+
+			if (xpath_image_checksum(header, nodes_data, size - sizeof(header)) != header.checksum) return xpath_image_invalid;
+
+			reader r;
+
+			r.nodes_data = nodes_data;
+			r.programs_data = r.nodes_data + header.nodes * sizeof(xpath_image_node);
+			r.instructions_data = r.programs_data + header.programs * sizeof(xpath_image_program);
+			r.variables = variables;
+			r.functions = functions;
+			r.alloc = &impl->alloc;
+			r.error = 0;
+
+			// string table is copied, so the image does not have to outlive the query
+			r.string_count = header.strings;
+
+			char_t* strings = static_cast<char_t*>(impl->alloc.allocate_nothrow((header.strings + 1) * sizeof(char_t)));
+			if (!strings) return xpath_image_oom;
+
+			if (header.strings) memcpy(strings, r.instructions_data + header.instructions * sizeof(xpath_image_instruction), header.strings * sizeof(char_t));
+			if (header.strings && strings[header.strings - 1] != 0) return xpath_image_invalid;
+
+			r.strings = strings;
+
+			r.node_count = header.nodes;
+			r.nodes = static_cast<xpath_ast_node*>(impl->alloc.allocate_nothrow(header.nodes * sizeof(xpath_ast_node)));
+			if (!r.nodes) return xpath_image_oom;
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			r.program_count = header.programs;
+			r.instruction_count = header.instructions;
+
+			r.programs = static_cast<xpath_program*>(impl->alloc.allocate_nothrow((header.programs + 1) * sizeof(xpath_program)));
+			r.code = static_cast<xpath_instruction*>(impl->alloc.allocate_nothrow((header.instructions + 1) * sizeof(xpath_instruction)));
+			if (!r.programs || !r.code) return xpath_image_oom;
+		#endif
+
+			for (size_t i = 0; i < header.nodes && !r.error; ++i) r.node(i);
+
+		#ifndef PUGIHTML_NO_XPATH_BYTECODE
+			if (header.program && !r.error) impl->program = r.program(header.program - 1, header.nodes);
+		#endif
+
+			if (r.error) return r.error;
+
+			impl->root = r.nodes + header.root;
+			impl->memo = impl->root->repeats_context_value();
+
+			return 0;
+		}
+
+	};
+
+	xpath_string evaluate_string_impl(xpath_query_impl* impl, const xpath_node& n, xpath_stack_data& sd)
+	{
+		if (!impl) return xpath_string();
+
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_string();
+	#endif
+
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+
+		return impl->program ? eval_program_string(impl->program, c, sd.stack) : impl->root->eval_string(c, sd.stack);
+	}
+
+	bool evaluate_boolean_impl(xpath_query_impl* impl, const xpath_node& n, xpath_eval_context* scratch)
+	{
+		if (!impl) return false;
+		
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return false;
+	#endif
+		
+		return impl->program ? eval_program_boolean(impl->program, c, sd.stack) : impl->root->eval_boolean(c, sd.stack);
+	}
+
+	double evaluate_number_impl(xpath_query_impl* impl, const xpath_node& n, xpath_eval_context* scratch)
+	{
+		if (!impl) return gen_nan();
+		
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return gen_nan();
+	#endif
+
+		return impl->program ? eval_program_number(impl->program, c, sd.stack) : impl->root->eval_number(c, sd.stack);
+	}
+
+	size_t copy_string(const xpath_string& r, char_t* buffer, size_t capacity)
+	{
+		size_t full_size = r.length() + 1;
+		
+		if (capacity > 0)
+        {
+            size_t size = (full_size < capacity) ? full_size : capacity;
+            assert(size > 0);
+
+            memcpy(buffer, r.c_str(), (size - 1) * sizeof(char_t));
+            buffer[size - 1] = 0;
+        }
+		
+		return full_size;
+	}
+
+	// Check that the query evaluates to a node set; throws xpath_exception if it does not
+	bool is_node_set_query(xpath_query_impl* impl)
+	{
+		if (!impl) return false;
+
+		if (impl->root->rettype() == xpath_type_node_set) return true;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		return false;
+	#else
+		xpath_parse_result result;
+		result.error = "Expression does not evaluate to node set";
+
+		throw xpath_exception(result);
+	#endif
+	}
+
+	xpath_node_set evaluate_node_set_impl(xpath_query_impl* impl, const xpath_node& n, xpath_eval_context* scratch = 0)
+	{
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node_set();
+	#endif
+
+		xpath_node_set_raw r = impl->root->eval_node_set(c, sd.stack);
+
+		return xpath_node_set(r.begin(), r.end(), r.type());
+	}
+
+	xpath_node evaluate_node_impl(xpath_query_impl* impl, const xpath_node& n, xpath_eval_context* scratch = 0)
+	{
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node();
+	#endif
+
+		xpath_node_set_raw r = impl->root->eval_node_set(c, sd.stack, nodeset_eval_first);
+
+		return xpath_first(r.begin(), r.end(), r.type());
+	}
+
+	bool for_each_node_impl(xpath_query_impl* impl, const xpath_node& n, xpath_node_visitor& visitor, xpath_eval_context* scratch = 0)
+	{
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return false;
+	#endif
+
+		return impl->root->visit_node_set(c, sd.stack, visitor);
+	}
+
+#ifdef PUGIHTML_XPATH_THREADS
+	// Part of the split subtree, evaluated by one of the threads
+	struct xpath_parallel_part
+	{
+		html_node_struct* first;	// first node of the part in document order
+		unsigned int end;			// pre-order number of the first node after the part
+		xpath_node_set_raw result;
+	};
+
+	struct xpath_parallel_job
+	{
+		void (*run)(const xpath_parallel_job& job, size_t part, xpath_stack_data& sd);	// evaluates one part
+		const void* data;
+		size_t part_count;
+		volatile long next;			// next part to evaluate, shared by all threads
+	};
+
+	struct xpath_parallel_worker
+	{
+		xpath_parallel_job* job;
+		xpath_stack_data data;		// keeps the part results until they are merged
+		bool failed;
+	};
+
+	// Descendant step evaluated over the parts of a split subtree
+	struct xpath_parallel_step
+	{
+		xpath_ast_node* step;
+		xpath_parallel_part* parts;
+	};
+
+	void parallel_fill_step(const xpath_parallel_job& job, size_t part, xpath_stack_data& sd)
+	{
+		const xpath_parallel_step& split = *static_cast<const xpath_parallel_step*>(job.data);
+		xpath_parallel_part& p = split.parts[part];
+
+		split.step->step_fill_part(p.result, p.first, p.end, sd.stack);
+	}
+
+	// Frees the workers when evaluation finishes or fails
+	struct xpath_parallel_workers
+	{
+		xpath_parallel_worker* workers;
+		size_t count;
+
+		xpath_parallel_workers(): workers(0), count(0)
+		{
+		}
+
+		~xpath_parallel_workers()
+		{
+			for (size_t i = 0; i < count; ++i) workers[i].~xpath_parallel_worker();
+
+			if (workers) global_deallocate(workers);
+		}
+	};
+
+	inline size_t parallel_next_part(volatile long* next)
+	{
+	#ifdef _WIN32
+		return static_cast<size_t>(InterlockedExchangeAdd(next, 1));
+	#else
+		return static_cast<size_t>(__sync_fetch_and_add(next, 1));
+	#endif
+	}
+
+	void parallel_run(xpath_parallel_worker* worker)
+	{
+		xpath_parallel_job& job = *worker->job;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(worker->data.error_handler))
+		{
+			worker->failed = true;
+			return;
+		}
+	#else
+		try
+	#endif
+		{
+			for (size_t i = parallel_next_part(&job.next); i < job.part_count; i = parallel_next_part(&job.next))
+				job.run(job, i, worker->data);
+		}
+	#ifndef PUGIHTML_NO_EXCEPTIONS
+		catch (...)
+		{
+			worker->failed = true;
+		}
+	#endif
+	}
+
+#ifdef _WIN32
+	typedef HANDLE xpath_thread;
+
+	unsigned int __stdcall parallel_thread(void* worker)
+	{
+		parallel_run(static_cast<xpath_parallel_worker*>(worker));
+		return 0;
+	}
+
+	bool parallel_start(xpath_thread& thread, xpath_parallel_worker* worker)
+	{
+		thread = reinterpret_cast<HANDLE>(_beginthreadex(0, 0, parallel_thread, worker, 0, 0));
+		return thread != 0;
+	}
+
+	void parallel_join(xpath_thread thread)
+	{
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+	}
+#else
+	typedef pthread_t xpath_thread;
+
+	void* parallel_thread(void* worker)
+	{
+		parallel_run(static_cast<xpath_parallel_worker*>(worker));
+		return 0;
+	}
+
+	bool parallel_start(xpath_thread& thread, xpath_parallel_worker* worker)
+	{
+		return pthread_create(&thread, 0, parallel_thread, worker) == 0;
+	}
+
+	void parallel_join(xpath_thread thread)
+	{
+		pthread_join(thread, 0);
+	}
+#endif
+
+	// Split the descendants of the node into parts of consecutive nodes in document order, starting at the checkpoints of the document order
+	xpath_parallel_part* parallel_split(html_node_struct* node, size_t& count, unsigned int thread_count, xpath_allocator* alloc)
+	{
+		const html_document_struct& doc = get_document(node->header);
+
+		// the post-order number of the node counts the nodes that were left before, which are the preceding nodes and the descendants
+		size_t depth = 0;
+		for (html_node_struct* p = node->parent; p; p = p->parent) depth++;
+
+		size_t begin = node->pre + 1;
+		size_t end = begin + node->post + depth - node->pre;
+
+		// several parts per thread balance the work; parts start at checkpoints, except for the first one
+		size_t grain = (end - begin) / (thread_count * 16);
+		grain = (grain / order_checkpoint_step + 1) * order_checkpoint_step;
+
+		count = 0;
+
+		xpath_parallel_part* parts = static_cast<xpath_parallel_part*>(alloc->allocate(((end - begin) / grain + 2) * sizeof(xpath_parallel_part)));
+
+		for (size_t pre = begin; pre < end; )
+		{
+			size_t next = (pre / grain + 1) * grain;
+			if (next > end) next = end;
+
+			xpath_parallel_part part = {pre == begin ? node->first_child : doc.order_checkpoints->nodes[pre / order_checkpoint_step], static_cast<unsigned int>(next), xpath_node_set_raw()};
+			assert(part.first->pre == pre);
+
+			parts[count++] = part;
+			pre = next;
+		}
+
+		return parts;
+	}
+
+	// Evaluate the parts of the job on thread_count threads, the calling thread being one of them; returns false if the workers could not be
+	// allocated or evaluation of a part failed. The workers keep the memory of the part results.
+	bool parallel_execute(xpath_parallel_job& job, xpath_parallel_workers& workers, unsigned int thread_count, xpath_allocator* temp)
+	{
+		workers.workers = static_cast<xpath_parallel_worker*>(global_allocate(thread_count * sizeof(xpath_parallel_worker)));
+		if (!workers.workers) return false;
+
+		for (; workers.count < thread_count; ++workers.count)
+		{
+			xpath_parallel_worker* worker = new (workers.workers + workers.count) xpath_parallel_worker;
+
+			worker->job = &job;
+			worker->failed = false;
+		}
+
+		xpath_thread* threads = static_cast<xpath_thread*>(temp->allocate((thread_count - 1) * sizeof(xpath_thread)));
+		size_t started = 0;
+
+		// if a thread can not be started, the parts are evaluated by the others
+		while (started < thread_count - 1 && parallel_start(threads[started], workers.workers + started + 1)) started++;
+
+		parallel_run(workers.workers);
+
+		for (size_t i = 0; i < started; ++i) parallel_join(threads[i]);
+
+		for (size_t i = 0; i < workers.count; ++i)
+			if (workers.workers[i].failed) return false;
+
+		return true;
+	}
+
+	xpath_node_set evaluate_node_set_parallel_impl(xpath_query_impl* impl, const xpath_node& n, unsigned int thread_count)
+	{
+		xpath_ast_node* step = impl->root;
+
+		if (thread_count <= 1 || !step->is_splittable()) return evaluate_node_set_impl(impl, n);
+
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd;
+		xpath_parallel_workers workers;
+
+		impl->start(sd);
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node_set();
+	#endif
+
+		html_node root = step->split_node(c, sd.stack);
+		// the document order can not be split if the checkpoints could not be recorded
+		const html_order_checkpoints* checkpoints = root ? get_document(root.internal_object()->header).order_checkpoints : 0;
+		if (!checkpoints || checkpoints->count == 0) return evaluate_node_set_impl(impl, n);
+
+		size_t part_count = 0;
+		xpath_parallel_part* parts = parallel_split(root.internal_object(), part_count, thread_count, &sd.temp);
+
+		xpath_parallel_step split = {step, parts};
+		xpath_parallel_job job = {parallel_fill_step, &split, part_count, 0};
+
+		// each thread evaluates the parts with its own allocators; the error is reported by evaluating the query again on this thread
+		if (!parallel_execute(job, workers, thread_count, &sd.temp)) return evaluate_node_set_impl(impl, n);
+
+		// descendant-or-self::node() starts with the node itself, followed by the parts in document order
+		xpath_node_set_raw self;
+		if (step->split_includes_self()) step->step_fill_part(self, root.internal_object(), root.internal_object()->pre + 1, sd.stack);
+
+		size_t size = self.size();
+		for (size_t i = 0; i < part_count; ++i) size += parts[i].result.size();
+
+		xpath_node* result = static_cast<xpath_node*>(sd.result.allocate((size > 0 ? size : 1) * sizeof(xpath_node)));
+		xpath_node* end = result;
+
+		if (!self.empty())
+		{
+			memcpy(end, self.begin(), self.size() * sizeof(xpath_node));
+			end += self.size();
+		}
+
+		for (size_t i = 0; i < part_count; ++i)
+			if (!parts[i].result.empty())
+			{
+				memcpy(end, parts[i].result.begin(), parts[i].result.size() * sizeof(xpath_node));
+				end += parts[i].result.size();
+			}
+
+		return xpath_node_set(result, end, xpath_node_set::type_sorted);
+	}
+#endif
+}
+
+// CSS selectors
+namespace
+{
+	enum css_condition_type_t
+	{
+		css_condition_id,				// #value
+		css_condition_class,			// .value
+		css_condition_attribute,		// [name op value]
+		css_condition_nth,				// :nth-child(an+b) and friends
+		css_condition_empty,			// :empty
+		css_condition_root,				// :root
+		css_condition_not				// :not(argument)
+	};
+
+	enum css_attribute_op_t
+	{
+		css_attribute_exists,			// [name]
+		css_attribute_equal,			// [name=value]
+		css_attribute_includes,			// [name~=value]
+		css_attribute_dash,				// [name|=value]
+		css_attribute_prefix,			// [name^=value]
+		css_attribute_suffix,			// [name$=value]
+		css_attribute_substring			// [name*=value]
+	};
+
+	enum css_combinator_t
+	{
+		css_combinator_none,			// leftmost compound selector
+		css_combinator_descendant,		// left right
+		css_combinator_child,			// left > right
+		css_combinator_adjacent,		// left + right
+		css_combinator_sibling			// left ~ right
+	};
+
+	struct css_compound;
+
+	struct css_condition
+	{
+		css_condition* next;
+
+		char type;
+		char op;					// attribute operator
+
+		bool from_end;				// nth: count siblings from the end
+		bool of_type;				// nth: count only siblings with the same name
+
+		const char_t* name;			// upper-case attribute name
+		const char_t* value;		// id, class or attribute value
+		size_t length;
+
+		int a, b;					// nth: an+b
+
+		css_compound* argument;		// not: negated selector
+	};
+
+	// Compound selector (type selector and conditions), linked to the compound selector on the left
+	struct css_compound
+	{
+		const char_t* tag;			// upper-case element name, 0 for any element
+		css_condition* conditions;
+
+		char combinator;
+		css_compound* left;
+	};
+
+	struct css_selector_list
+	{
+		css_compound* rightmost;
+		css_selector_list* next;
+	};
+
+	static const char_t css_id_name[] = {'I', 'D', 0};
+
+	inline char_t css_toupper(char_t ch)
+	{
+		return (static_cast<unsigned int>(ch - 'a') < 26) ? static_cast<char_t>(ch - 'a' + 'A') : ch;
+	}
+
+	// Compare document name with upper-case selector name
+	bool css_name_equal(const char_t* name, const char_t* upper)
+	{
+		for (; *upper; ++name, ++upper)
+			if (css_toupper(*name) != *upper) return false;
+
+		return *name == 0;
+	}
+
+	inline bool css_is_element(const html_node_struct* n)
+	{
+		return n && static_cast<html_node_type>((n->header & html_memory_page_type_mask) + 1) == node_element;
+	}
+
+	html_node_struct* css_previous_element(html_node_struct* n)
+	{
+		for (html_node_struct* s = n->prev_sibling_c; s->next_sibling; s = s->prev_sibling_c)
+			if (css_is_element(s)) return s;
+
+		return 0;
+	}
+
+	const char_t* css_attribute_value(const html_node_struct* n, const char_t* name)
+	{
+		for (html_attribute_struct* a = n->first_attribute; a; a = a->next_attribute)
+			if (a->name && css_name_equal(a->name, name))
+				return a->value ? a->value : PUGIHTML_TEXT("");
+
+		return 0;
+	}
+
+	bool css_match_attribute(const css_condition* c, const char_t* value)
+	{
+		if (!value) return false;
+
+		switch (c->op)
+		{
+		case css_attribute_exists:
+			return true;
+
+		case css_attribute_equal:
+			return strequal(value, c->value);
+
+		case css_attribute_includes:
+			return has_token(value, c->value, c->length) && is_token(c->value, c->length);
+
+		case css_attribute_dash:
+			return starts_with(value, c->value) && (value[c->length] == 0 || value[c->length] == '-');
+
+		case css_attribute_prefix:
+			return c->length > 0 && starts_with(value, c->value);
+
+		case css_attribute_suffix:
+		{
+			size_t length = strlength(value);
+
+			return c->length > 0 && length >= c->length && memcmp(value + length - c->length, c->value, c->length * sizeof(char_t)) == 0;
+		}
+
+		case css_attribute_substring:
+			return c->length > 0 && find_substring(value, c->value) != 0;
+
+		default:
+			assert(!"Unknown attribute operator");
+			return false;
+		}
+	}
+
+	bool css_match_nth(const css_condition* c, const html_node_struct* n)
+	{
+		int index = 1;
+
+		if (c->from_end)
+		{
+			for (html_node_struct* s = n->next_sibling; s; s = s->next_sibling)
+				if (css_is_element(s) && (!c->of_type || (s->name && n->name && strequal(s->name, n->name)))) ++index;
+		}
+		else
+		{
+			for (html_node_struct* s = n->prev_sibling_c; s->next_sibling; s = s->prev_sibling_c)
+				if (css_is_element(s) && (!c->of_type || (s->name && n->name && strequal(s->name, n->name)))) ++index;
+		}
+
+		// index = a * k + b for some k >= 0
+		if (c->a == 0) return index == c->b;
+
+		int offset = index - c->b;
+
+		return offset % c->a == 0 && offset / c->a >= 0;
+	}
+
+	bool css_match_compound(const css_compound* c, html_node_struct* n);
+
+	bool css_match_condition(const css_condition* c, html_node_struct* n)
+	{
+		switch (c->type)
+		{
+		case css_condition_id:
+		{
+			const char_t* value = css_attribute_value(n, css_id_name);
+
+			return value && strequal(value, c->value);
+		}
+
+		case css_condition_class:
+		{
+			const char_t* value = css_attribute_value(n, index_class_name);
+
+			return value && has_token(value, c->value, c->length);
+		}
+
+		case css_condition_attribute:
+			return css_match_attribute(c, css_attribute_value(n, c->name));
+
+		case css_condition_nth:
+			return css_match_nth(c, n);
+
+		case css_condition_empty:
+			for (html_node_struct* child = n->first_child; child; child = child->next_sibling)
+			{
+				html_node_type type = static_cast<html_node_type>((child->header & html_memory_page_type_mask) + 1);
+
+				if (type == node_element || ((type == node_pcdata || type == node_cdata) && child->value && *child->value)) return false;
+			}
+
+			return true;
+
+		case css_condition_root:
+			return n->parent && !css_is_element(n->parent);
+
+		case css_condition_not:
+			return !css_match_compound(c->argument, n);
+
+		default:
+			assert(!"Unknown condition");
+			return false;
+		}
+	}
+
+	bool css_match_compound(const css_compound* c, html_node_struct* n)
+	{
+		if (c->tag && !(n->name && css_name_equal(n->name, c->tag))) return false;
+
+		for (const css_condition* cond = c->conditions; cond; cond = cond->next)
+			if (!css_match_condition(cond, n)) return false;
+
+		return true;
+	}
+
+	// Match element against the complex selector ending with compound selector c, right to left
+	bool css_match(const css_compound* c, html_node_struct* n)
+	{
+		if (!css_match_compound(c, n)) return false;
+
+		switch (c->combinator)
+		{
+		case css_combinator_none:
+			return true;
+
+		case css_combinator_child:
+			return css_is_element(n->parent) && css_match(c->left, n->parent);
+
+		case css_combinator_descendant:
+			for (html_node_struct* p = n->parent; css_is_element(p); p = p->parent)
+				if (css_match(c->left, p)) return true;
+
+			return false;
+
+		case css_combinator_adjacent:
+		{
+			html_node_struct* s = css_previous_element(n);
+
+			return s && css_match(c->left, s);
+		}
+
+		case css_combinator_sibling:
+			for (html_node_struct* s = css_previous_element(n); s; s = css_previous_element(s))
+				if (css_match(c->left, s)) return true;
+
+			return false;
+
+		default:
+			assert(!"Unknown combinator");
+			return false;
+		}
+	}
+
+	bool css_match_list(const css_selector_list* list, html_node_struct* n)
+	{
+		if (!css_is_element(n)) return false;
+
+		for (; list; list = list->next)
+			if (css_match(list->rightmost, n)) return true;
+
+		return false;
+	}
+
+	// Find posting list of the document index that contains all elements matching compound selector c
+	bool css_index_lookup(const css_compound* c, const html_attribute_index* index, const html_index_entry*& result)
+	{
+		for (const css_condition* cond = c->conditions; cond; cond = cond->next)
+		{
+			size_t attribute;
+
+			switch (cond->type)
+			{
+			case css_condition_class:
+				if (!is_token(cond->value, cond->length)) continue;
+
+				result = index_find(index, 0, cond->value, cond->length);
+				return true;
+
+			case css_condition_id:
+				attribute = index_attribute_id(index, css_id_name);
+				break;
+
+			case css_condition_attribute:
+				if (cond->op != css_attribute_equal) continue;
+
+				attribute = index_attribute_id(index, cond->name);
+				break;
+
+			default:
+				continue;
+			}
+
+			// class attribute values are indexed by tokens
+			if (attribute != static_cast<size_t>(-1) && attribute != 0)
+			{
+				result = index_find(index, attribute, cond->value, cond->length);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Select descendants of root matching the selector list in document order; stops after the first one if ns is null
+	html_node_struct* css_select(const css_selector_list* list, html_node_struct* root, xpath_node_set_raw* ns, xpath_allocator* alloc)
+	{
+		const html_document_struct& doc = get_document(root->header);
+		const html_index_entry* entry = 0;
+
+		if (!list->next && index_is_current(doc.index, doc) && css_index_lookup(list->rightmost, doc.index, entry))
+		{
+			if (!entry) return 0;
+
+			html_node_struct** begin;
+			html_node_struct** end;
+
+			index_subtree(doc.index, entry, root, false, begin, end);
+
+			for (html_node_struct** it = begin; it != end; ++it)
+				if (css_match(list->rightmost, *it))
+				{
+					if (!ns) return *it;
+
+					ns->push_back(html_node(*it), alloc);
+				}
+
+			return 0;
+		}
+
+		html_node_struct* cur = root->first_child;
+
+		while (cur)
+		{
+			if (css_match_list(list, cur))
+			{
+				if (!ns) return cur;
+
+				ns->push_back(html_node(cur), alloc);
+			}
+
+			if (cur->first_child)
+				cur = cur->first_child;
+			else
+			{
+				while (!cur->next_sibling && cur != root) cur = cur->parent;
+
+				cur = (cur == root) ? 0 : cur->next_sibling;
+			}
+		}
+
+		return 0;
+	}
+
+	struct css_parser
+	{
+		xpath_allocator* _alloc;
+
+		const char_t* _query;
+		const char_t* _cur;
+
+		xpath_parse_result* _result;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		jmp_buf _error_handler;
+	#endif
+
+		void throw_error(const char* message)
+		{
+			_result->error = message;
+			_result->offset = _cur - _query;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			longjmp(_error_handler, 1);
+		#else
+			throw xpath_exception(*_result);
+		#endif
+		}
+
+		void throw_error_oom()
+        {
+        #ifdef PUGIHTML_NO_EXCEPTIONS
+            throw_error("Out of memory");
+        #else
+            throw std::bad_alloc();
+        #endif
+        }
+
+		void* alloc(size_t size)
+		{
+			void* result = _alloc->allocate_nothrow(size);
+
+			if (!result) throw_error_oom();
+
+			return memset(result, 0, size);
+		}
+
+		const char_t* alloc_string(const char_t* begin, const char_t* end, bool upper)
+		{
+			size_t length = static_cast<size_t>(end - begin);
+
+			char_t* c = static_cast<char_t*>(alloc((length + 1) * sizeof(char_t)));
+
+			for (size_t i = 0; i < length; ++i) c[i] = upper ? css_toupper(begin[i]) : begin[i];
+
+			return c;
+		}
+
+		static bool is_ident(char_t ch)
+		{
+			return (static_cast<unsigned int>(ch) >= 0x80) || (static_cast<unsigned int>(ch - 'a') < 26) || (static_cast<unsigned int>(ch - 'A') < 26) ||
+				(static_cast<unsigned int>(ch - '0') < 10) || ch == '-' || ch == '_';
+		}
+
+		static bool is_digit(char_t ch)
+		{
+			return static_cast<unsigned int>(ch - '0') < 10;
+		}
+
+		void skip_space()
+		{
+			while (IS_CHARTYPE(*_cur, ct_space)) ++_cur;
+		}
+
+		void expect(char_t ch, const char* message)
+		{
+			skip_space();
+
+			if (*_cur != ch) throw_error(message);
+
+			++_cur;
+		}
+
+		const char_t* parse_ident(bool upper, size_t* length = 0)
+		{
+			const char_t* begin = _cur;
+
+			while (is_ident(*_cur)) ++_cur;
+
+			if (begin == _cur) throw_error("Expected identifier");
+
+			if (length) *length = static_cast<size_t>(_cur - begin);
+
+			return alloc_string(begin, _cur, upper);
+		}
+
+		// Parse identifier or quoted string
+		const char_t* parse_value(size_t& length)
+		{
+			if (*_cur != '"' && *_cur != '\'') return parse_ident(false, &length);
+
+			char_t quote = *_cur++;
+			const char_t* begin = _cur;
+
+			while (*_cur && *_cur != quote) ++_cur;
+
+			if (!*_cur) throw_error("Unterminated string");
+
+			length = static_cast<size_t>(_cur - begin);
+
+			return alloc_string(begin, _cur++, false);
+		}
+
+		bool keyword(const char_t* name, size_t length, const char* keyword)
+		{
+			for (size_t i = 0; i < length; ++i)
+				if (!keyword[i] || (name[i] | ' ') != keyword[i]) return false;
+
+			return keyword[length] == 0;
+		}
+
+		int parse_number()
+		{
+			if (!is_digit(*_cur)) throw_error("Expected number");
+
+			int result = 0;
+
+			while (is_digit(*_cur)) result = result * 10 + (*_cur++ - '0');
+
+			return result;
+		}
+
+		// an+b, odd, even
+		void parse_nth(css_condition* c)
+		{
+			skip_space();
+
+			if (is_ident(*_cur) && (*_cur | ' ') != 'n' && !is_digit(*_cur) && *_cur != '-')
+			{
+				const char_t* begin = _cur;
+
+				while (is_ident(*_cur)) ++_cur;
+
+				if (keyword(begin, static_cast<size_t>(_cur - begin), "odd")) c->a = 2, c->b = 1;
+				else if (keyword(begin, static_cast<size_t>(_cur - begin), "even")) c->a = 2, c->b = 0;
+				else throw_error("Expected an+b expression");
+			}
+			else
+			{
+				int sign = 1;
+
+				if (*_cur == '+' || *_cur == '-') sign = (*_cur++ == '-') ? -1 : 1;
+
+				bool digits = is_digit(*_cur);
+				int value = digits ? parse_number() : 1;
+
+				if ((*_cur | ' ') == 'n')
+				{
+					++_cur;
+
+					c->a = sign * value;
+
+					skip_space();
+
+					if (*_cur == '+' || *_cur == '-')
+					{
+						int bsign = (*_cur++ == '-') ? -1 : 1;
+
+						skip_space();
+
+						c->b = bsign * parse_number();
+					}
+				}
+				else
+				{
+					if (!digits) throw_error("Expected an+b expression");
+
+					c->b = sign * value;
+				}
+			}
+
+			expect(')', "Expected ')'");
+		}
+
+		css_condition* parse_attribute()
+		{
+			css_condition* c = static_cast<css_condition*>(alloc(sizeof(css_condition)));
+			c->type = css_condition_attribute;
+
+			skip_space();
+			c->name = parse_ident(true);
+			skip_space();
+
+			char_t ch = *_cur;
+
+			if (ch == ']')
+			{
+				c->op = css_attribute_exists;
+				++_cur;
+
+				return c;
+			}
+
+			if (ch == 0) throw_error("Expected ']'");
+			else if (ch == '=') c->op = css_attribute_equal;
+			else if (ch == '~') c->op = css_attribute_includes;
+			else if (ch == '|') c->op = css_attribute_dash;
+			else if (ch == '^') c->op = css_attribute_prefix;
+			else if (ch == '$') c->op = css_attribute_suffix;
+			else if (ch == '*') c->op = css_attribute_substring;
+			else throw_error("Unknown attribute operator");
+
+			++_cur;
+
+			if (ch != '=')
+			{
+				if (*_cur != '=') throw_error("Unknown attribute operator");
+				++_cur;
+			}
+
+			skip_space();
+			c->value = parse_value(c->length);
+
+			expect(']', "Expected ']'");
+
+			return c;
+		}
+
+		// Parses pseudo-class, appending conditions to the list
+		css_condition** parse_pseudo(css_condition** tail)
+		{
+			const char_t* name = _cur;
+			while (is_ident(*_cur)) ++_cur;
+
+			size_t length = static_cast<size_t>(_cur - name);
+
+			css_condition* c = static_cast<css_condition*>(alloc(sizeof(css_condition)));
+			c->type = css_condition_nth;
+
+			if (keyword(name, length, "first-child")) c->b = 1;
+			else if (keyword(name, length, "last-child")) c->b = 1, c->from_end = true;
+			else if (keyword(name, length, "first-of-type")) c->b = 1, c->of_type = true;
+			else if (keyword(name, length, "last-of-type")) c->b = 1, c->of_type = c->from_end = true;
+			else if (keyword(name, length, "only-child") || keyword(name, length, "only-of-type"))
+			{
+				c->b = 1;
+				c->of_type = (name[5] | ' ') == 'o';
+
+				css_condition* last = static_cast<css_condition*>(alloc(sizeof(css_condition)));
+				*last = *c;
+				last->from_end = true;
+
+				*tail = c;
+				c->next = last;
+
+				return &last->next;
+			}
+			else if (keyword(name, length, "empty")) c->type = css_condition_empty;
+			else if (keyword(name, length, "root")) c->type = css_condition_root;
+			else if (*_cur == '(' && keyword(name, length, "not"))
+			{
+				++_cur;
+				skip_space();
+
+				c->type = css_condition_not;
+				c->argument = parse_compound();
+
+				expect(')', "Expected ')'");
+			}
+			else if (*_cur == '(' && (keyword(name, length, "nth-child") || keyword(name, length, "nth-last-child") ||
+				keyword(name, length, "nth-of-type") || keyword(name, length, "nth-last-of-type")))
+			{
+				++_cur;
+
+				c->from_end = (name[4] | ' ') == 'l';
+				c->of_type = (name[length - 1] | ' ') == 'e';
+
+				parse_nth(c);
+			}
+			else
+			{
+				_cur = name;
+				throw_error("Unknown pseudo-class");
+			}
+
+			*tail = c;
+
+			return &c->next;
+		}
+
+		css_compound* parse_compound()
+		{
+			css_compound* c = static_cast<css_compound*>(alloc(sizeof(css_compound)));
+			css_condition** tail = &c->conditions;
+
+			bool empty = true;
+
+			if (*_cur == '*')
+			{
+				++_cur;
+				empty = false;
+			}
+			else if (is_ident(*_cur))
+			{
+				c->tag = parse_ident(true);
+				empty = false;
+			}
+
+			for (;; empty = false)
+			{
+				char_t ch = *_cur;
+
+				if (ch == '#' || ch == '.')
+				{
+					++_cur;
+
+					css_condition* cond = static_cast<css_condition*>(alloc(sizeof(css_condition)));
+					cond->type = (ch == '#') ? css_condition_id : css_condition_class;
+					cond->value = parse_ident(false, &cond->length);
+
+					*tail = cond;
+					tail = &cond->next;
+				}
+				else if (ch == '[')
+				{
+					++_cur;
+
+					css_condition* cond = parse_attribute();
+
+					*tail = cond;
+					tail = &cond->next;
+				}
+				else if (ch == ':')
+				{
+					++_cur;
+
+					tail = parse_pseudo(tail);
+				}
+				else break;
+			}
+
+			if (empty) throw_error("Expected selector");
+
+			return c;
+		}
+
+		css_compound* parse_complex()
+		{
+			skip_space();
+
+			css_compound* c = parse_compound();
+
+			for (;;)
+			{
+				const char_t* start = _cur;
+
+				skip_space();
+
+				char combinator;
+
+				if (*_cur == '>') combinator = css_combinator_child;
+				else if (*_cur == '+') combinator = css_combinator_adjacent;
+				else if (*_cur == '~') combinator = css_combinator_sibling;
+				else if (_cur != start && *_cur && *_cur != ',') combinator = css_combinator_descendant;
+				else break;
+
+				if (combinator != css_combinator_descendant) 
+				{
+					++_cur;
+					skip_space();
+				}
+
+				css_compound* right = parse_compound();
+
+				right->combinator = combinator;
+				right->left = c;
+
+				c = right;
+			}
+
+			return c;
+		}
+
+		css_selector_list* parse()
+		{
+			css_selector_list* result = 0;
+			css_selector_list** tail = &result;
+
+			for (;;)
+			{
+				css_selector_list* list = static_cast<css_selector_list*>(alloc(sizeof(css_selector_list)));
+				list->rightmost = parse_complex();
+
+				*tail = list;
+				tail = &list->next;
+
+				skip_space();
+
+				if (*_cur != ',') break;
+
+				++_cur;
+			}
+
+			if (*_cur) throw_error("Unexpected character in selector");
+
+			return result;
+		}
+
+		css_parser(const char_t* query, xpath_allocator* alloc, xpath_parse_result* result): _alloc(alloc), _query(query), _cur(query), _result(result)
+		{
+		}
+
+		static css_selector_list* parse(const char_t* query, xpath_allocator* alloc, xpath_parse_result* result)
+		{
+			css_parser parser(query, alloc, result);
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			int error = setjmp(parser._error_handler);
+
+			return (error == 0) ? parser.parse() : 0;
+		#else
+			return parser.parse();
+		#endif
+		}
+	};
+
+    struct css_selector_impl
+    {
+		static css_selector_impl* create()
+		{
+			void* memory = global_allocate(sizeof(css_selector_impl));
+
+            return new (memory) css_selector_impl();
+		}
+
+		static void destroy(void* ptr)
+		{
+			if (!ptr) return;
+			
+			// free all allocated pages
+			static_cast<css_selector_impl*>(ptr)->alloc.release();
+
+			// free allocator memory (with the first page)
+			global_deallocate(ptr);
+		}
+
+        css_selector_impl(): list(0), alloc(&block)
+        {
+            block.next = 0;
+        }
+
+        css_selector_list* list;
+        xpath_allocator alloc;
+        xpath_memory_block block;
+    };
+}
+
+// Compiled query cache
+namespace
+{
+#if defined(__GNUC__) || (defined(_MSC_VER) && _MSC_VER >= 1400)
+#	define PUGIHTML_HAS_SPIN_LOCK
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+	extern "C" long __cdecl _InterlockedExchange(long volatile* target, long value);
+#	pragma intrinsic(_InterlockedExchange)
+#endif
+
+	// Busy-waiting lock for short critical sections; does nothing on compilers without atomic intrinsics
+	class spin_lock_guard
+	{
+		volatile long* _lock;
+
+		spin_lock_guard(const spin_lock_guard&);
+		spin_lock_guard& operator=(const spin_lock_guard&);
+
+	public:
+		explicit spin_lock_guard(volatile long* lock): _lock(lock)
+		{
+		#if defined(_MSC_VER) && _MSC_VER >= 1400
+			while (_InterlockedExchange(_lock, 1)) {}
+		#elif defined(__GNUC__)
+			while (__sync_lock_test_and_set(_lock, 1)) {}
+		#endif
+		}
+
+		~spin_lock_guard()
+		{
+		#if defined(_MSC_VER) && _MSC_VER >= 1400
+			_InterlockedExchange(_lock, 0);
+		#elif defined(__GNUC__)
+			__sync_lock_release(_lock);
+		#endif
+		}
+	};
+
+	struct xpath_query_cache_entry
+	{
+		xpath_query_cache_entry* prev;		// LRU list, most recently used first
+		xpath_query_cache_entry* next;
+		xpath_query_cache_entry* chain;		// hash bucket chain
+
+		unsigned int hash;
+		const char_t* key;
+		const xpath_variable_set* variables;
+
+		xpath_query* query;
+
+		size_t references;					// number of evaluations in progress
+		bool cached;						// false if the entry was removed from the cache while in use
+	};
+
+	struct xpath_query_cache
+	{
+		xpath_query_cache_entry* buckets[256];
+
+		xpath_query_cache_entry* head;
+		xpath_query_cache_entry* tail;
+
+		size_t size;
+		size_t capacity;
+
+		size_t hits;
+		size_t misses;
+
+		volatile long lock;
+	};
+
+	// POD with constant initializer, so it's ready before any dynamic initialization
+	static xpath_query_cache query_cache =
+	{
+		{0}, 0, 0, 0,
+	#ifdef PUGIHTML_HAS_SPIN_LOCK
+		64,
+	#else
+		0,
+	#endif
+		0, 0, 0
+	};
+
+	unsigned int query_cache_hash(const char_t* query, const xpath_variable_set* variables)
+	{
+		return hash_string(query) ^ static_cast<unsigned int>(reinterpret_cast<uintptr_t>(variables) >> 4);
+	}
+
+	xpath_query_cache_entry* query_cache_create(const char_t* query, xpath_variable_set* variables, unsigned int hash)
+	{
+		size_t size = (strlength(query) + 1) * sizeof(char_t);
+
+		xpath_query_cache_entry* entry = static_cast<xpath_query_cache_entry*>(global_allocate(sizeof(xpath_query_cache_entry) + size));
+		if (!entry) return 0;
+
+		buffer_holder entry_holder(entry, global_deallocate);
+
+		void* memory = global_allocate(sizeof(xpath_query));
+		if (!memory) return 0;
+
+		buffer_holder memory_holder(memory, global_deallocate);
+
+		// may throw xpath_exception
+		xpath_query* q = new (memory) xpath_query(query, variables);
+
+		if (!*q)
+		{
+			q->~xpath_query();
+			return 0;
+		}
+
+		memory_holder.release();
+
+		char_t* key = reinterpret_cast<char_t*>(entry + 1);
+		memcpy(key, query, size);
+
+		entry->prev = entry->next = entry->chain = 0;
+		entry->hash = hash;
+		entry->key = key;
+		entry->variables = variables;
+		entry->query = q;
+		entry->references = 1;
+		entry->cached = true;
+
+		return static_cast<xpath_query_cache_entry*>(entry_holder.release());
+	}
+
+	void query_cache_destroy(xpath_query_cache_entry* entry)
+	{
+		entry->query->~xpath_query();
+		global_deallocate(entry->query);
+
+		global_deallocate(entry);
+	}
+
+	xpath_query_cache_entry* query_cache_find(const char_t* query, const xpath_variable_set* variables, unsigned int hash)
+	{
+		for (xpath_query_cache_entry* entry = query_cache.buckets[hash % 256]; entry; entry = entry->chain)
+			if (entry->hash == hash && entry->variables == variables && strequal(entry->key, query))
+				return entry;
+
+		return 0;
+	}
+
+	void query_cache_unlink(xpath_query_cache_entry* entry)
+	{
+		if (entry->prev) entry->prev->next = entry->next;
+		else query_cache.head = entry->next;
+
+		if (entry->next) entry->next->prev = entry->prev;
+		else query_cache.tail = entry->prev;
+
+		entry->prev = entry->next = 0;
+	}
+
+	void query_cache_link_front(xpath_query_cache_entry* entry)
+	{
+		entry->next = query_cache.head;
+
+		if (query_cache.head) query_cache.head->prev = entry;
+		else query_cache.tail = entry;
+
+		query_cache.head = entry;
+	}
+
+	// Remove the entry from the cache; returns true if it is not used and can be destroyed
+	bool query_cache_remove(xpath_query_cache_entry* entry)
+	{
+		query_cache_unlink(entry);
+
+		xpath_query_cache_entry** link = &query_cache.buckets[entry->hash % 256];
+
+		while (*link != entry) link = &(*link)->chain;
+
+		*link = entry->chain;
+
+		query_cache.size--;
+		entry->cached = false;
+
+		return entry->references == 0;
+	}
+
+	// Remove unused entries over capacity (or matching variable set if trim is false), collecting removed entries in a list for deletion outside of the lock
+	xpath_query_cache_entry* query_cache_evict(const xpath_variable_set* variables, bool trim)
+	{
+		xpath_query_cache_entry* result = 0;
+
+		for (xpath_query_cache_entry* entry = query_cache.tail; entry && (!trim || query_cache.size > query_cache.capacity); )
+		{
+			xpath_query_cache_entry* prev = entry->prev;
+
+			if ((trim ? entry->references == 0 : (!variables || entry->variables == variables)) && query_cache_remove(entry))
+			{
+				entry->chain = result;
+				result = entry;
+			}
+
+			entry = prev;
+		}
+
+		return result;
+	}
+
+	void query_cache_destroy_list(xpath_query_cache_entry* list)
+	{
+		while (list)
+		{
+			xpath_query_cache_entry* next = list->chain;
+
+			query_cache_destroy(list);
+
+			list = next;
+		}
+	}
+
+	// Get compiled query from the cache, compiling it if necessary; returns 0 if the cache is disabled or the query failed to compile
+	xpath_query_cache_entry* query_cache_acquire(const char_t* query, xpath_variable_set* variables)
+	{
+		unsigned int hash = query_cache_hash(query, variables);
+
+		{
+			spin_lock_guard guard(&query_cache.lock);
+
+			if (query_cache.capacity == 0) return 0;
+
+			xpath_query_cache_entry* entry = query_cache_find(query, variables, hash);
+
+			if (entry)
+			{
+				query_cache.hits++;
+				entry->references++;
+
+				query_cache_unlink(entry);
+				query_cache_link_front(entry);
+
+				return entry;
+			}
+
+			query_cache.misses++;
+		}
+
+		// compile outside of the lock
+		xpath_query_cache_entry* entry = query_cache_create(query, variables, hash);
+		if (!entry) return 0;
+
+		xpath_query_cache_entry* evicted = 0;
+
+		{
+			spin_lock_guard guard(&query_cache.lock);
+
+			xpath_query_cache_entry* existing = query_cache_find(query, variables, hash);
+
+			if (existing)
+			{
+				// another thread compiled the same query, so use it instead
+				existing->references++;
+
+				evicted = entry;
+				entry->chain = 0;
+				entry = existing;
+			}
+			else if (query_cache.capacity == 0)
+			{
+				// the cache was disabled while compiling
+				entry->cached = false;
+			}
+			else
+			{
+				query_cache_link_front(entry);
+
+				entry->chain = query_cache.buckets[hash % 256];
+				query_cache.buckets[hash % 256] = entry;
+
+				query_cache.size++;
+
+				evicted = query_cache_evict(0, true);
+			}
+		}
+
+		query_cache_destroy_list(evicted);
+
+		return entry;
+	}
+
+	void query_cache_release(xpath_query_cache_entry* entry)
+	{
+		xpath_query_cache_entry* evicted = 0;
+
+		{
+			spin_lock_guard guard(&query_cache.lock);
+
+			if (--entry->references == 0)
+			{
+				if (!entry->cached)
+				{
+					entry->chain = 0;
+					evicted = entry;
+				}
+				// entries that were in use could not be evicted before
+				else if (query_cache.size > query_cache.capacity) evicted = query_cache_evict(0, true);
+			}
+		}
+
+		query_cache_destroy_list(evicted);
+	}
+
+	// Remove queries bound to the variable set (or all queries if variables is null)
+	void query_cache_purge(const xpath_variable_set* variables)
+	{
+		xpath_query_cache_entry* evicted;
+
+		{
+			spin_lock_guard guard(&query_cache.lock);
+
+			if (query_cache.size == 0) return;
+
+			evicted = query_cache_evict(variables, false);
+		}
+
+		query_cache_destroy_list(evicted);
+	}
+
+	// Frees cached queries at exit
+	struct query_cache_cleanup
+	{
+		~query_cache_cleanup()
+		{
+			query_cache_purge(0);
+		}
+	};
+
+	static query_cache_cleanup query_cache_cleanup_instance;
+
+	// Scoped reference to a cached compiled query
+	class xpath_query_cache_lease
+	{
+		xpath_query_cache_entry* _entry;
+
+		xpath_query_cache_lease(const xpath_query_cache_lease&);
+		xpath_query_cache_lease& operator=(const xpath_query_cache_lease&);
+
+	public:
+		xpath_query_cache_lease(const char_t* query, xpath_variable_set* variables): _entry(query_cache_acquire(query, variables))
+		{
+		}
+
+		~xpath_query_cache_lease()
+		{
+			if (_entry) query_cache_release(_entry);
+		}
+
+		const xpath_query* query() const
+		{
+			return _entry ? _entry->query : 0;
+		}
+	};
+}
 
-				// self axis preserves the original order
-				if (axis == axis_self) ns.set_type(s.type());
+// Query sets
+namespace
+{
+	// Maximum number of steps in a path matched during the shared traversal (step masks use one bit per step and one for the origin)
+	const size_t xpath_query_set_max_steps = 31;
 
-				for (const xpath_node* it = s.begin(); it != s.end(); ++it)
-				{
-					size_t size = ns.size();
+	struct xpath_query_set_entry
+	{
+		xpath_query_impl* query;
 
-					// in general, all axes generate elements in a particular order, but there is no order guarantee if axis is applied to two nodes
-					if (axis != axis_self && size != 0) ns.set_type(xpath_node_set::type_unsorted);
-					
-					if (it->node())
-						step_fill(ns, it->node(), stack.result, v);
-					else if (attributes)
-						step_fill(ns, it->attribute(), it->parent(), stack.result, v);
-						
-					apply_predicates(ns, size, stack);
-				}
-			}
-			else
+		// Steps of a shared path from the first one, and the axes they are matched with
+		xpath_ast_node* steps[xpath_query_set_max_steps];
+		char axes[xpath_query_set_max_steps];
+		size_t step_count;
+
+		bool shared;
+		bool absolute;
+		bool streamable;
+	};
+
+	struct xpath_query_set_impl
+	{
+		static xpath_query_set_impl* create()
+		{
+			void* memory = global_allocate(sizeof(xpath_query_set_impl));
+			if (!memory) return 0;
+
+			return new (memory) xpath_query_set_impl();
+		}
+
+		static void destroy(void* ptr)
+		{
+			if (!ptr) return;
+
+			xpath_query_set_impl* impl = static_cast<xpath_query_set_impl*>(ptr);
+
+			for (size_t i = 0; i < impl->size; ++i)
+				xpath_query_impl::destroy(impl->entries[i].query);
+
+			if (impl->entries) global_deallocate(impl->entries);
+
+			global_deallocate(impl);
+		}
+
+		xpath_query_set_impl(): entries(0), size(0), capacity(0), shared(0), absolute(false), streamable(0)
+		{
+		}
+
+		bool reserve()
+		{
+			if (size < capacity) return true;
+
+			size_t new_capacity = capacity ? capacity * 2 : 8;
+
+			xpath_query_set_entry* data = static_cast<xpath_query_set_entry*>(global_allocate(new_capacity * sizeof(xpath_query_set_entry)));
+			if (!data) return false;
+
+			if (entries)
 			{
-				if (c.n.node())
-					step_fill(ns, c.n.node(), stack.result, v);
-				else if (attributes)
-					step_fill(ns, c.n.attribute(), c.n.parent(), stack.result, v);
-				
-				apply_predicates(ns, 0, stack);
+				memcpy(data, entries, size * sizeof(xpath_query_set_entry));
+				global_deallocate(entries);
 			}
 
-			// child, attribute and self axes always generate unique set of nodes
-			// for other axis, if the set stayed sorted, it stayed unique because the traversal algorithms do not visit the same node twice
-			if (axis != axis_child && axis != axis_attribute && axis != axis_self && ns.type() == xpath_node_set::type_unsorted)
-				ns.remove_duplicates();
+			entries = data;
+			capacity = new_capacity;
 
-			return ns;
+			return true;
 		}
-		
-	public:
-		xpath_ast_node(ast_type_t type, xpath_value_type rettype, const char_t* value):
-			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+
+		xpath_query_set_entry* entries;
+		size_t size;
+		size_t capacity;
+
+		// Number of shared entries, and whether any of them is an absolute path
+		size_t shared;
+		bool absolute;
+
+		// Number of entries that can be evaluated during parsing
+		size_t streamable;
+	};
+
+	// Dispatch key of a step; only nodes that have the key can match the step
+	struct xpath_query_set_key
+	{
+		unsigned int hash;
+		const char_t* name;		// element name or attribute name
+		const char_t* value;	// attribute value (0 for element name keys)
+		size_t query;
+
+		bool operator==(const xpath_query_set_key& other) const
 		{
-			assert(type == ast_string_constant);
-			_data.string = value;
+			return hash == other.hash && name == other.name && value == other.value && query == other.query;
 		}
+	};
 
-		xpath_ast_node(ast_type_t type, xpath_value_type rettype, double value):
-			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+	struct xpath_query_set_key_comparator
+	{
+		bool operator()(const xpath_query_set_key& lhs, const xpath_query_set_key& rhs) const
 		{
-			assert(type == ast_number_constant);
-			_data.number = value;
+			return lhs.hash < rhs.hash;
 		}
-		
-		xpath_ast_node(ast_type_t type, xpath_value_type rettype, xpath_variable* value):
-			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(0), _right(0), _next(0)
+	};
+
+	unsigned int query_set_key_hash(const char_t* name, const char_t* value)
+	{
+		unsigned int hash = index_hash(0, name, strlength(name));
+
+		return value ? index_hash(hash, value, strlength(value)) : hash;
+	}
+
+	struct xpath_query_set_match
+	{
+		xpath_node node;
+		size_t query;
+	};
+
+	// Change of the query state made by a node; frame markers (query == query_set_frame) separate the changes of each node on the current path
+	struct xpath_query_set_change
+	{
+		size_t query;
+		size_t parent;			// marker index of the parent node (frame markers only)
+		uint32_t matched;
+		uint32_t reached;
+	};
+
+	const size_t query_set_frame = static_cast<size_t>(-1);
+
+	// Check if the node can match the step that follows the previous step bit, given the masks of its parent and the steps it matched so far
+	inline bool query_set_reached(char axis, uint32_t previous, uint32_t parent_matched, uint32_t parent_reached, uint32_t matched)
+	{
+		switch (axis)
 		{
-			assert(type == ast_variable);
-			_data.variable = value;
+		case axis_child:
+			return (parent_matched & previous) != 0;
+
+		case axis_descendant:
+			return (parent_reached & previous) != 0;
+
+		case axis_descendant_or_self:
+			return ((parent_reached | matched) & previous) != 0;
+
+		case axis_self:
+			return (matched & previous) != 0;
+
+		default:
+			return false;
 		}
-		
-		xpath_ast_node(ast_type_t type, xpath_value_type rettype, xpath_ast_node* left = 0, xpath_ast_node* right = 0):
-			_type((char)type), _rettype((char)rettype), _axis(0), _test(0), _left(left), _right(right), _next(0)
+	}
+
+	// Growing array allocated from xpath_allocator; must be the last object allocated so that it can be reallocated in place
+	template <typename T> class xpath_query_set_array
+	{
+		T* _begin;
+		T* _end;
+		T* _eos;
+
+	public:
+		xpath_query_set_array(): _begin(0), _end(0), _eos(0)
 		{
 		}
 
-		xpath_ast_node(ast_type_t type, xpath_ast_node* left, axis_t axis, nodetest_t test, const char_t* contents):
-			_type((char)type), _rettype(xpath_type_node_set), _axis((char)axis), _test((char)test), _left(left), _right(0), _next(0)
+		T* begin() const
 		{
-			_data.nodetest = contents;
+			return _begin;
 		}
 
-		void set_next(xpath_ast_node* value)
+		T* end() const
 		{
-			_next = value;
+			return _end;
 		}
 
-		void set_right(xpath_ast_node* value)
+		size_t size() const
 		{
-			_right = value;
+			return static_cast<size_t>(_end - _begin);
 		}
 
-		bool eval_boolean(const xpath_context& c, const xpath_stack& stack)
+		void truncate(size_t size)
 		{
-			switch (_type)
+			_end = _begin + size;
+		}
+
+		void push_back(const T& value, xpath_allocator* alloc)
+		{
+			if (_end == _eos)
 			{
-			case ast_op_or:
-				return _left->eval_boolean(c, stack) || _right->eval_boolean(c, stack);
-				
-			case ast_op_and:
-				return _left->eval_boolean(c, stack) && _right->eval_boolean(c, stack);
-				
-			case ast_op_equal:
-				return compare_eq(_left, _right, c, stack, equal_to());
+				size_t capacity = static_cast<size_t>(_eos - _begin);
 
-			case ast_op_not_equal:
-				return compare_eq(_left, _right, c, stack, not_equal_to());
-	
-			case ast_op_less:
-				return compare_rel(_left, _right, c, stack, less());
-			
-			case ast_op_greater:
-				return compare_rel(_right, _left, c, stack, less());
+				// get new capacity (1.5x rule)
+				size_t new_capacity = capacity + capacity / 2 + 1;
 
-			case ast_op_less_or_equal:
-				return compare_rel(_left, _right, c, stack, less_equal());
-			
-			case ast_op_greater_or_equal:
-				return compare_rel(_right, _left, c, stack, less_equal());
+				T* data = static_cast<T*>(alloc->reallocate(_begin, capacity * sizeof(T), new_capacity * sizeof(T)));
+				assert(data);
 
-			case ast_func_starts_with:
-			{
-				xpath_allocator_capture cr(stack.result);
+				_begin = data;
+				_end = data + capacity;
+				_eos = data + new_capacity;
+			}
 
-				xpath_string lr = _left->eval_string(c, stack);
-				xpath_string rr = _right->eval_string(c, stack);
+			*_end++ = value;
+		}
+	};
 
-				return starts_with(lr.c_str(), rr.c_str());
-			}
+	// Shared traversal state. For every query there are two step masks for the current node: steps matched by the node, and steps matched
+	// by the node or its ancestors; bit 0 stands for the path origin (context node or document root), bit i for step i
+	class xpath_query_set_matcher
+	{
+		const xpath_query_set_impl* _impl;
+		html_node_struct* _context;
+		html_node_struct* _root;
+		const xpath_stack& _stack;
 
-			case ast_func_contains:
+		uint32_t* _matched;
+		uint32_t* _reached;
+		size_t* _visited;
+		size_t _stamp;
+		size_t _live;
+
+		xpath_query_set_key* _keys;
+		size_t _key_count;
+		bool _attribute_keys;
+
+		// queries with steps that have no key, and masks of the steps preceding them
+		size_t* _generic;
+		uint32_t* _generic_masks;
+		size_t _generic_count;
+
+		xpath_query_set_array<xpath_query_set_change> _changes;
+		xpath_query_set_array<xpath_query_set_match>& _matches;
+
+		xpath_query_set_matcher(const xpath_query_set_matcher&);
+		xpath_query_set_matcher& operator=(const xpath_query_set_matcher&);
+
+		template <typename T> T* allocate(size_t count)
+		{
+			return static_cast<T*>(_stack.temp->allocate((count ? count : 1) * sizeof(T)));
+		}
+
+		void prepare()
+		{
+			size_t count = _impl->size;
+
+			_matched = allocate<uint32_t>(count);
+			_reached = allocate<uint32_t>(count);
+			_visited = allocate<size_t>(count);
+			_generic = allocate<size_t>(count);
+			_generic_masks = allocate<uint32_t>(count);
+
+			size_t key_count = 0;
+
+			for (size_t i = 0; i < count; ++i)
 			{
-				xpath_allocator_capture cr(stack.result);
+				_matched[i] = _reached[i] = 0;
+				_visited[i] = 0;
 
-				xpath_string lr = _left->eval_string(c, stack);
-				xpath_string rr = _right->eval_string(c, stack);
+				const xpath_query_set_entry& entry = _impl->entries[i];
 
-				return find_substring(lr.c_str(), rr.c_str()) != 0;
+				if (entry.shared)
+					for (size_t j = 0; j < entry.step_count; ++j) key_count++;
 			}
 
-			case ast_func_boolean:
-				return _left->eval_boolean(c, stack);
-				
-			case ast_func_not:
-				return !_left->eval_boolean(c, stack);
-				
-			case ast_func_true:
-				return true;
-				
-			case ast_func_false:
-				return false;
+			_keys = allocate<xpath_query_set_key>(key_count);
 
-			case ast_func_lang:
+			for (size_t i = 0; i < count; ++i)
 			{
-				if (c.n.attribute()) return false;
-				
-				xpath_allocator_capture cr(stack.result);
+				const xpath_query_set_entry& entry = _impl->entries[i];
+				if (!entry.shared) continue;
 
-				xpath_string lang = _left->eval_string(c, stack);
-				
-				for (html_node n = c.n.node(); n; n = n.parent())
+				uint32_t generic = 0;
+
+				for (size_t j = 0; j < entry.step_count; ++j)
 				{
-					html_attribute a = n.attribute(PUGIHTML_TEXT("html:lang"));
-					
-					if (a)
+					if (entry.axes[j] == axis_attribute) continue;
+
+					xpath_query_set_key key;
+
+					if (entry.steps[j]->step_key(key.name, key.value))
 					{
-						const char_t* value = a.value();
-						
-						// strnicmp / strncasecmp is not portable
-						for (const char_t* lit = lang.c_str(); *lit; ++lit)
-						{
-							if (tolower_ascii(*lit) != tolower_ascii(*value)) return false;
-							++value;
-						}
-						
-						return *value == 0 || *value == '-';
+						key.hash = query_set_key_hash(key.name, key.value);
+						key.query = i;
+
+						_keys[_key_count++] = key;
+
+						if (key.value) _attribute_keys = true;
 					}
+					else generic |= 1u << j;
+				}
+
+				if (generic)
+				{
+					_generic[_generic_count] = i;
+					_generic_masks[_generic_count] = generic;
+					_generic_count++;
 				}
-				
-				return false;
 			}
 
-			case ast_variable:
-			{
-				assert(_rettype == _data.variable->type());
+			sort(_keys, _keys + _key_count, xpath_query_set_key_comparator());
+		}
 
-				if (_rettype == xpath_type_boolean)
-					return _data.variable->get_boolean();
+		const xpath_query_set_key* find_key(unsigned int hash) const
+		{
+			const xpath_query_set_key* begin = _keys;
+			size_t count = _key_count;
+
+			// lower bound
+			while (count > 0)
+			{
+				size_t step = count / 2;
 
-				// fallthrough to type conversion
+				if (begin[step].hash < hash)
+				{
+					begin += step + 1;
+					count -= step + 1;
+				}
+				else count = step;
 			}
 
-			default:
+			return begin;
+		}
+
+		uint32_t match_node(const xpath_query_set_entry& entry, html_node_struct* node, bool origin, uint32_t parent_matched, uint32_t parent_reached)
+		{
+			uint32_t matched = origin ? 1 : 0;
+
+			html_node n(node);
+
+			for (size_t i = 0; i < entry.step_count; ++i)
 			{
-				switch (_rettype)
-				{
-				case xpath_type_number:
-					return convert_number_to_boolean(eval_number(c, stack));
-					
-				case xpath_type_string:
-				{
-					xpath_allocator_capture cr(stack.result);
+				uint32_t previous = 1u << i;
 
-					return !eval_string(c, stack).empty();
-				}
-					
-				case xpath_type_node_set:				
-				{
-					xpath_allocator_capture cr(stack.result);
+				// attribute step is matched by match_attributes
+				if (query_set_reached(entry.axes[i], previous, parent_matched, parent_reached, matched) && entry.steps[i]->step_match(n, _stack))
+					matched |= previous << 1;
+			}
 
-					return !eval_node_set(c, stack).empty();
-				}
+			return matched;
+		}
+
+		void match_attributes(const xpath_query_set_entry& entry, size_t query, html_node_struct* node)
+		{
+			xpath_ast_node* step = entry.steps[entry.step_count - 1];
+
+			html_node parent(node);
+
+			for (html_attribute a = parent.first_attribute(); a; a = a.next_attribute())
+			{
+				xpath_node xn(a, parent);
 
-				default:
-					assert(!"Wrong expression for return type boolean");
-					return false;
+				if (step->step_match(xn, _stack))
+				{
+					xpath_query_set_match m = {xn, query};
+					_matches.push_back(m, _stack.result);
 				}
 			}
-			}
 		}
 
-		double eval_number(const xpath_context& c, const xpath_stack& stack)
+		// Update the state of the query for the node; the query masks hold the parent state before the first visit
+		void visit(size_t query, html_node_struct* node)
 		{
-			switch (_type)
-			{
-			case ast_op_add:
-				return _left->eval_number(c, stack) + _right->eval_number(c, stack);
-				
-			case ast_op_subtract:
-				return _left->eval_number(c, stack) - _right->eval_number(c, stack);
+			if (_visited[query] == _stamp) return;
 
-			case ast_op_multiply:
-				return _left->eval_number(c, stack) * _right->eval_number(c, stack);
+			_visited[query] = _stamp;
 
-			case ast_op_divide:
-				return _left->eval_number(c, stack) / _right->eval_number(c, stack);
+			const xpath_query_set_entry& entry = _impl->entries[query];
 
-			case ast_op_mod:
-				return fmod(_left->eval_number(c, stack), _right->eval_number(c, stack));
+			bool origin = entry.absolute ? node == _root : node == _context;
 
-			case ast_op_negate:
-				return -_left->eval_number(c, stack);
+			uint32_t matched = match_node(entry, node, origin, _matched[query], _reached[query]);
 
-			case ast_number_constant:
-				return _data.number;
+			if (matched == 0 && _matched[query] == 0) return;
 
-			case ast_func_last:
-				return (double)c.size;
-			
-			case ast_func_position:
-				return (double)c.position;
+			xpath_query_set_change change = {query, 0, _matched[query], _reached[query]};
+			_changes.push_back(change, _stack.temp);
 
-			case ast_func_count:
-			{
-				xpath_allocator_capture cr(stack.result);
+			if (_reached[query] == 0) _live++;
 
-				return (double)_left->eval_node_set(c, stack).size();
-			}
-			
-			case ast_func_string_length_0:
-			{
-				xpath_allocator_capture cr(stack.result);
+			_matched[query] = matched;
+			_reached[query] |= matched;
 
-				return (double)string_value(c.n, stack.result).length();
-			}
-			
-			case ast_func_string_length_1:
+			if (entry.step_count > 0 && entry.axes[entry.step_count - 1] == axis_attribute)
 			{
-				xpath_allocator_capture cr(stack.result);
-
-				return (double)_left->eval_string(c, stack).length();
+				if (matched & (1u << (entry.step_count - 1))) match_attributes(entry, query, node);
 			}
-			
-			case ast_func_number_0:
+			else if (matched & (1u << entry.step_count))
 			{
-				xpath_allocator_capture cr(stack.result);
-
-				return convert_string_to_number(string_value(c.n, stack.result).c_str());
+				xpath_query_set_match m = {xpath_node(html_node(node)), query};
+				_matches.push_back(m, _stack.result);
 			}
-			
-			case ast_func_number_1:
-				return _left->eval_number(c, stack);
+		}
 
-			case ast_func_sum:
-			{
-				xpath_allocator_capture cr(stack.result);
+		void visit_key(unsigned int hash, const char_t* name, const char_t* value, html_node_struct* node)
+		{
+			for (const xpath_query_set_key* key = find_key(hash); key != _keys + _key_count && key->hash == hash; ++key)
+				if (!key->value == !value && strequal(key->name, name) && (!value || strequal(key->value, value)))
+					visit(key->query, node);
+		}
 
-				double r = 0;
-				
-				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
-				
-				for (const xpath_node* it = ns.begin(); it != ns.end(); ++it)
+		void enter(html_node_struct* node, size_t parent)
+		{
+			++_stamp;
+
+			size_t frame = _changes.size();
+
+			xpath_query_set_change marker = {query_set_frame, parent, 0, 0};
+			_changes.push_back(marker, _stack.temp);
+
+			// queries matched by the parent have to be updated even if the node does not match them
+			if (parent != query_set_frame)
+			{
+				for (size_t i = parent + 1; i < frame; ++i)
 				{
-					xpath_allocator_capture cri(stack.result);
+					size_t query = _changes.begin()[i].query;
 
-					r += convert_string_to_number(string_value(*it, stack.result).c_str());
+					if (_matched[query]) visit(query, node);
 				}
-			
-				return r;
 			}
 
-			case ast_func_floor:
+			if (node == _root || node == _context)
 			{
-				double r = _left->eval_number(c, stack);
-				
-				return r == r ? floor(r) : r;
+				for (size_t i = 0; i < _impl->size; ++i)
+					if (_impl->entries[i].shared) visit(i, node);
 			}
 
-			case ast_func_ceiling:
+			if (static_cast<html_node_type>((node->header & html_memory_page_type_mask) + 1) == node_element)
 			{
-				double r = _left->eval_number(c, stack);
-				
-				return r == r ? ceil(r) : r;
+				if (node->name) visit_key(query_set_key_hash(node->name, 0), node->name, 0, node);
+
+				if (_attribute_keys)
+				{
+					for (html_attribute_struct* a = node->first_attribute; a; a = a->next_attribute)
+						if (a->name)
+						{
+							const char_t* value = a->value ? a->value : PUGIHTML_TEXT("");
+
+							visit_key(query_set_key_hash(a->name, value), a->name, value, node);
+						}
+				}
 			}
 
-			case ast_func_round:
-				return round_nearest_nzero(_left->eval_number(c, stack));
-			
-			case ast_variable:
+			// the node can only match a step without key if the preceding step was matched by the parent or its ancestors
+			for (size_t i = 0; i < _generic_count; ++i)
+				if (_reached[_generic[i]] & _generic_masks[i]) visit(_generic[i], node);
+		}
+
+		// Undo the changes of the node; returns the parent marker index
+		size_t leave(size_t frame)
+		{
+			xpath_query_set_change* changes = _changes.begin();
+
+			for (size_t i = _changes.size(); i > frame + 1; --i)
 			{
-				assert(_rettype == _data.variable->type());
+				const xpath_query_set_change& change = changes[i - 1];
 
-				if (_rettype == xpath_type_number)
-					return _data.variable->get_number();
+				_matched[change.query] = change.matched;
+				_reached[change.query] = change.reached;
 
-				// fallthrough to type conversion
+				if (change.reached == 0) _live--;
 			}
 
-			default:
+			size_t parent = changes[frame].parent;
+
+			_changes.truncate(frame);
+
+			return parent;
+		}
+
+	public:
+		xpath_query_set_matcher(const xpath_query_set_impl* impl, html_node_struct* context, xpath_query_set_array<xpath_query_set_match>& matches, const xpath_stack& stack):
+			_impl(impl), _context(context), _root(context), _stack(stack), _matched(0), _reached(0), _visited(0), _stamp(0), _live(0),
+			_keys(0), _key_count(0), _attribute_keys(false), _generic(0), _generic_masks(0), _generic_count(0), _matches(matches)
+		{
+			if (impl->absolute)
+				while (_root->parent) _root = _root->parent;
+		}
+
+		// Match all shared paths during one pre-order traversal; matches are produced in document order
+		void run()
+		{
+			prepare();
+
+			html_node_struct* cur = _root;
+			size_t parent = query_set_frame;
+
+			for (;;)
 			{
-				switch (_rettype)
-				{
-				case xpath_type_boolean:
-					return eval_boolean(c, stack) ? 1 : 0;
-					
-				case xpath_type_string:
-				{
-					xpath_allocator_capture cr(stack.result);
+				size_t frame = _changes.size();
+
+				enter(cur, parent);
 
-					return convert_string_to_number(eval_string(c, stack).c_str());
+				// skip subtrees that no path can reach unless they contain the origin of relative paths
+				if (cur->first_child && (_live || node_is_descendant(_context, cur)))
+				{
+					parent = frame;
+					cur = cur->first_child;
+					continue;
 				}
-					
-				case xpath_type_node_set:
+
+				for (;;)
 				{
-					xpath_allocator_capture cr(stack.result);
+					parent = leave(frame);
 
-					return convert_string_to_number(eval_string(c, stack).c_str());
-				}
-					
-				default:
-					assert(!"Wrong expression for return type number");
-					return 0;
+					if (cur == _root) return;
+
+					if (cur->next_sibling)
+					{
+						cur = cur->next_sibling;
+						break;
+					}
+
+					cur = cur->parent;
+					frame = parent;
 				}
-				
-			}
 			}
 		}
-		
-		xpath_string eval_string_concat(const xpath_context& c, const xpath_stack& stack)
+	};
+
+	// Matches streamable paths while the document is parsed. For every open element there is a frame with a flag that tells if the element
+	// may be selected by the last step of a path, followed by two step masks per query (see xpath_query_set_matcher); frame 0 is the document
+	class xpath_stream_matcher: public html_parse_listener
+	{
+		const xpath_query_set_impl* _impl;
+		xpath_stream_handler* _handler;
+		bool _drop;
+		bool _failed;
+
+		uint32_t* _frames;
+		size_t _stride;
+		size_t _depth;
+		size_t _capacity;
+
+		// number of open elements that may be selected; their subtrees are kept
+		size_t _retained;
+
+		xpath_stack_data _sd;
+
+		xpath_stream_matcher(const xpath_stream_matcher&);
+		xpath_stream_matcher& operator=(const xpath_stream_matcher&);
+
+		static bool is_element(const html_node_struct* node)
 		{
-			assert(_type == ast_func_concat);
+			return static_cast<html_node_type>((node->header & html_memory_page_type_mask) + 1) == node_element;
+		}
 
-			xpath_allocator_capture ct(stack.temp);
+		bool reserve()
+		{
+			if (_depth < _capacity) return true;
 
-			// count the string number
-			size_t count = 1;
-			for (xpath_ast_node* nc = _right; nc; nc = nc->_next) count++;
+			size_t new_capacity = _capacity ? _capacity * 2 : 32;
 
-			// gather all strings
-			xpath_string static_buffer[4];
-			xpath_string* buffer = static_buffer;
+			uint32_t* frames = static_cast<uint32_t*>(global_allocate(new_capacity * _stride * sizeof(uint32_t)));
+			if (!frames) return false;
 
-			// allocate on-heap for large concats
-			if (count > sizeof(static_buffer) / sizeof(static_buffer[0]))
+			if (_frames)
 			{
-				buffer = static_cast<xpath_string*>(stack.temp->allocate(count * sizeof(xpath_string)));
-				assert(buffer);
+				memcpy(frames, _frames, _depth * _stride * sizeof(uint32_t));
+				global_deallocate(_frames);
 			}
 
-			// evaluate all strings to temporary stack
-			xpath_stack swapped_stack = {stack.temp, stack.result};
+			_frames = frames;
+			_capacity = new_capacity;
 
-			buffer[0] = _left->eval_string(c, swapped_stack);
+			return true;
+		}
 
-			size_t pos = 1;
-			for (xpath_ast_node* n = _right; n; n = n->_next, ++pos) buffer[pos] = n->eval_string(c, swapped_stack);
-			assert(pos == count);
+		void open_element(html_node_struct* node)
+		{
+			if (!reserve())
+			{
+				_failed = true;
+				return;
+			}
 
-			// get total length
-			size_t length = 0;
-			for (size_t i = 0; i < count; ++i) length += buffer[i].length();
+			const uint32_t* parent = _frames + (_depth - 1) * _stride;
+			uint32_t* frame = _frames + _depth * _stride;
 
-			// create final string
-			char_t* result = static_cast<char_t*>(stack.result->allocate((length + 1) * sizeof(char_t)));
-			assert(result);
+			html_node n(node);
+			bool retained = false;
 
-			char_t* ri = result;
+			for (size_t i = 0; i < _impl->size; ++i)
+			{
+				const xpath_query_set_entry& entry = _impl->entries[i];
 
-			for (size_t j = 0; j < count; ++j)
-				for (const char_t* bi = buffer[j].c_str(); *bi; ++bi)
-					*ri++ = *bi;
+				uint32_t parent_matched = parent[1 + 2 * i];
+				uint32_t parent_reached = parent[2 + 2 * i];
+				uint32_t matched = 0;
 
-			*ri = 0;
+				if (parent_reached)
+				{
+					size_t last = entry.step_count - 1;
 
-			return xpath_string(result, true);
+					for (size_t j = 0; j < last; ++j)
+					{
+						uint32_t previous = 1u << j;
+
+						if (query_set_reached(entry.axes[j], previous, parent_matched, parent_reached, matched) && entry.steps[j]->step_match(n, _sd.stack))
+							matched |= previous << 1;
+					}
+
+					// predicates of the last step are checked once the element subtree is parsed
+					if (query_set_reached(entry.axes[last], 1u << last, parent_matched, parent_reached, matched) && entry.steps[last]->step_match_test(n))
+						retained = true;
+				}
+
+				frame[1 + 2 * i] = matched;
+				frame[2 + 2 * i] = parent_reached | matched;
+			}
+
+			frame[0] = retained;
+
+			_depth++;
+			if (retained) _retained++;
 		}
 
-		xpath_string eval_string(const xpath_context& c, const xpath_stack& stack)
+		void close_element(html_node_struct* node)
 		{
-			switch (_type)
-			{
-			case ast_string_constant:
-				return xpath_string_const(_data.string);
-			
-			case ast_func_local_name_0:
-			{
-				xpath_node na = c.n;
-				
-				return xpath_string_const(local_name(na));
-			}
+			assert(_depth > 1);
 
-			case ast_func_local_name_1:
+			const uint32_t* parent = _frames + (_depth - 2) * _stride;
+			const uint32_t* frame = _frames + (_depth - 1) * _stride;
+
+			html_node n(node);
+
+			for (size_t i = 0; i < _impl->size; ++i)
 			{
-				xpath_allocator_capture cr(stack.result);
+				const xpath_query_set_entry& entry = _impl->entries[i];
+				if (!entry.streamable) continue;
 
-				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
-				xpath_node na = ns.first();
-				
-				return xpath_string_const(local_name(na));
+				size_t last = entry.step_count - 1;
+
+				if (entry.axes[last] == axis_attribute)
+				{
+					if ((frame[1 + 2 * i] & (1u << last)) == 0) continue;
+
+					for (html_attribute a = n.first_attribute(); a; a = a.next_attribute())
+					{
+						xpath_node xn(a, n);
+
+						if (entry.steps[last]->step_match(xn, _sd.stack)) _handler->match(i, xn);
+					}
+				}
+				else if (frame[0] && query_set_reached(entry.axes[last], 1u << last, parent[1 + 2 * i], parent[2 + 2 * i], frame[1 + 2 * i]) &&
+					entry.steps[last]->step_match(n, _sd.stack))
+				{
+					_handler->match(i, xpath_node(n));
+				}
 			}
 
-			case ast_func_name_0:
+			if (frame[0]) _retained--;
+
+			_depth--;
+		}
+
+	public:
+		xpath_stream_matcher(const xpath_query_set_impl* impl, xpath_stream_handler* handler, bool drop):
+			_impl(impl), _handler(handler), _drop(drop), _failed(false), _frames(0), _stride(1 + 2 * impl->size), _depth(0), _capacity(0), _retained(0)
+		{
+			if (!reserve())
 			{
-				xpath_node na = c.n;
-				
-				return xpath_string_const(qualified_name(na));
+				_failed = true;
+				return;
 			}
 
-			case ast_func_name_1:
-			{
-				xpath_allocator_capture cr(stack.result);
+			// the document matches the origin of all streamable paths
+			_frames[0] = 0;
 
-				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
-				xpath_node na = ns.first();
-				
-				return xpath_string_const(qualified_name(na));
+			for (size_t i = 0; i < impl->size; ++i)
+				_frames[1 + 2 * i] = _frames[2 + 2 * i] = impl->entries[i].streamable ? 1 : 0;
+
+			_depth = 1;
+		}
+
+		~xpath_stream_matcher()
+		{
+			if (_frames) global_deallocate(_frames);
+		}
+
+		bool failed() const
+		{
+			return _failed;
+		}
+
+		virtual void open(html_node_struct* node)
+		{
+			if (_failed || !is_element(node)) return;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			if (setjmp(_sd.error_handler))
+			{
+				_failed = true;
+				return;
 			}
 
-			case ast_func_namespace_uri_0:
+			open_element(node);
+		#else
+			try
 			{
-				xpath_node na = c.n;
-				
-				return xpath_string_const(namespace_uri(na));
+				open_element(node);
 			}
+			catch (const std::bad_alloc&)
+			{
+				_failed = true;
+			}
+		#endif
+		}
 
-			case ast_func_namespace_uri_1:
+		virtual bool close(html_node_struct* node)
+		{
+			if (_failed) return false;
+
+			if (is_element(node))
 			{
-				xpath_allocator_capture cr(stack.result);
+			#ifdef PUGIHTML_NO_EXCEPTIONS
+				if (setjmp(_sd.error_handler))
+				{
+					_failed = true;
+					return false;
+				}
 
-				xpath_node_set_raw ns = _left->eval_node_set(c, stack);
-				xpath_node na = ns.first();
-				
-				return xpath_string_const(namespace_uri(na));
+				close_element(node);
+			#else
+				try
+				{
+					close_element(node);
+				}
+				catch (const std::bad_alloc&)
+				{
+					_failed = true;
+					return false;
+				}
+			#endif
 			}
 
-			case ast_func_string_0:
-				return string_value(c.n, stack.result);
-
-			case ast_func_string_1:
-				return _left->eval_string(c, stack);
+			return _drop && _retained == 0;
+		}
+	};
+}
 
-			case ast_func_concat:
-				return eval_string_concat(c, stack);
+// Tables
+namespace
+{
+	struct xpath_table_column
+	{
+		xpath_query_impl* query;
+		xpath_value_type type;
+		size_t slot;		// index among the string columns, or among the number and boolean columns
+	};
 
-			case ast_func_substring_before:
-			{
-				xpath_allocator_capture cr(stack.temp);
+	struct xpath_table_impl
+	{
+		static xpath_table_impl* create()
+		{
+			void* memory = global_allocate(sizeof(xpath_table_impl));
+			if (!memory) return 0;
 
-				xpath_stack swapped_stack = {stack.temp, stack.result};
+			return new (memory) xpath_table_impl();
+		}
 
-				xpath_string s = _left->eval_string(c, swapped_stack);
-				xpath_string p = _right->eval_string(c, swapped_stack);
+		static void destroy(void* ptr)
+		{
+			if (!ptr) return;
 
-				const char_t* pos = find_substring(s.c_str(), p.c_str());
-				
-				return pos ? xpath_string(s.c_str(), pos, stack.result) : xpath_string();
-			}
-			
-			case ast_func_substring_after:
-			{
-				xpath_allocator_capture cr(stack.temp);
+			xpath_table_impl* impl = static_cast<xpath_table_impl*>(ptr);
 
-				xpath_stack swapped_stack = {stack.temp, stack.result};
+			xpath_query_impl::destroy(impl->rows);
 
-				xpath_string s = _left->eval_string(c, swapped_stack);
-				xpath_string p = _right->eval_string(c, swapped_stack);
-				
-				const char_t* pos = find_substring(s.c_str(), p.c_str());
-				if (!pos) return xpath_string();
+			for (size_t i = 0; i < impl->size; ++i)
+				xpath_query_impl::destroy(impl->columns[i].query);
 
-				const char_t* result = pos + p.length();
+			if (impl->columns) global_deallocate(impl->columns);
 
-				return s.uses_heap() ? xpath_string(result, stack.result) : xpath_string_const(result);
-			}
+			global_deallocate(impl);
+		}
 
-			case ast_func_substring_2:
-			{
-				xpath_allocator_capture cr(stack.temp);
+		xpath_table_impl(): rows(0), columns(0), size(0), capacity(0), strings(0), numbers(0)
+		{
+		}
 
-				xpath_stack swapped_stack = {stack.temp, stack.result};
+		bool reserve()
+		{
+			if (size < capacity) return true;
 
-				xpath_string s = _left->eval_string(c, swapped_stack);
-				size_t s_length = s.length();
+			size_t new_capacity = capacity ? capacity * 2 : 8;
 
-				double first = round_nearest(_right->eval_number(c, stack));
-				
-				if (is_nan(first)) return xpath_string(); // NaN
-				else if (first >= s_length + 1) return xpath_string();
-				
-				size_t pos = first < 1 ? 1 : (size_t)first;
-				assert(1 <= pos && pos <= s_length + 1);
+			xpath_table_column* data = static_cast<xpath_table_column*>(global_allocate(new_capacity * sizeof(xpath_table_column)));
+			if (!data) return false;
 
-				const char_t* rbegin = s.c_str() + (pos - 1);
-				
-				return s.uses_heap() ? xpath_string(rbegin, stack.result) : xpath_string_const(rbegin);
-			}
-			
-			case ast_func_substring_3:
+			if (columns)
 			{
-				xpath_allocator_capture cr(stack.temp);
-
-				xpath_stack swapped_stack = {stack.temp, stack.result};
+				memcpy(data, columns, size * sizeof(xpath_table_column));
+				global_deallocate(columns);
+			}
 
-				xpath_string s = _left->eval_string(c, swapped_stack);
-				size_t s_length = s.length();
+			columns = data;
+			capacity = new_capacity;
 
-				double first = round_nearest(_right->eval_number(c, stack));
-				double last = first + round_nearest(_right->_next->eval_number(c, stack));
-				
-				if (is_nan(first) || is_nan(last)) return xpath_string();
-				else if (first >= s_length + 1) return xpath_string();
-				else if (first >= last) return xpath_string();
-				else if (last < 1) return xpath_string();
-				
-				size_t pos = first < 1 ? 1 : (size_t)first;
-				size_t end = last >= s_length + 1 ? s_length + 1 : (size_t)last;
+			return true;
+		}
 
-				assert(1 <= pos && pos <= end && end <= s_length + 1);
-				const char_t* rbegin = s.c_str() + (pos - 1);
-				const char_t* rend = s.c_str() + (end - 1);
+		xpath_query_impl* rows;
 
-				return (end == s_length + 1 && !s.uses_heap()) ? xpath_string_const(rbegin) : xpath_string(rbegin, rend, stack.result);
-			}
+		xpath_table_column* columns;
+		size_t size;
+		size_t capacity;
 
-			case ast_func_normalize_space_0:
-			{
-				xpath_string s = string_value(c.n, stack.result);
+		// Number of string columns and of number and boolean columns
+		size_t strings;
+		size_t numbers;
+	};
 
-				normalize_space(s.data(stack.result));
+	// Evaluated table. Values are stored by column: numbers[slot * rows + row] for number and boolean columns, and for string columns
+	// offsets[slot * (rows + 1) + row] into the string buffer, where the strings of a column follow each other with terminating zeros.
+	struct xpath_table_result_impl
+	{
+		static xpath_table_result_impl* create()
+		{
+			void* memory = global_allocate(sizeof(xpath_table_result_impl));
+			if (!memory) return 0;
 
-				return s;
-			}
+			return new (memory) xpath_table_result_impl();
+		}
 
-			case ast_func_normalize_space_1:
-			{
-				xpath_string s = _left->eval_string(c, stack);
+		static void destroy(void* ptr)
+		{
+			if (!ptr) return;
 
-				normalize_space(s.data(stack.result));
-			
-				return s;
-			}
+			xpath_table_result_impl* impl = static_cast<xpath_table_result_impl*>(ptr);
 
-			case ast_func_translate:
-			{
-				xpath_allocator_capture cr(stack.temp);
+			if (impl->data) global_deallocate(impl->data);
+			if (impl->strings) global_deallocate(impl->strings);
 
-				xpath_stack swapped_stack = {stack.temp, stack.result};
+			global_deallocate(impl);
+		}
 
-				xpath_string s = _left->eval_string(c, stack);
-				xpath_string from = _right->eval_string(c, swapped_stack);
-				xpath_string to = _right->_next->eval_string(c, swapped_stack);
+		xpath_table_result_impl(): rows(0), columns(0), numbers(0), nodes(0), offsets(0), types(0), slots(0), data(0), data_capacity(0), strings(0), strings_capacity(0)
+		{
+		}
 
-				translate(s.data(stack.result), from.c_str(), to.c_str());
+		// Lay out the arrays for the table shape; the string buffer is allocated once the size of the strings is known.
+		// The result stays empty until evaluation sets the number of rows and columns.
+		bool reset(const xpath_table_impl* table, size_t row_count)
+		{
+			size_t number_count = table->numbers * row_count;
+			size_t offset_count = table->strings * (row_count + 1) + table->size;
 
-				return s;
-			}
+			// numbers go first, so that they are aligned
+			size_t size = number_count * sizeof(double) + row_count * sizeof(xpath_node) + offset_count * sizeof(size_t) + table->size * sizeof(xpath_value_type);
 
-			case ast_variable:
+			if (size > data_capacity)
 			{
-				assert(_rettype == _data.variable->type());
+				void* memory = global_allocate(size);
+				if (!memory) return false;
 
-				if (_rettype == xpath_type_string)
-					return xpath_string_const(_data.variable->get_string());
+				if (data) global_deallocate(data);
 
-				// fallthrough to type conversion
+				data = memory;
+				data_capacity = size;
 			}
 
-			default:
-			{
-				switch (_rettype)
-				{
-				case xpath_type_boolean:
-					return xpath_string_const(eval_boolean(c, stack) ? PUGIHTML_TEXT("true") : PUGIHTML_TEXT("false"));
-					
-				case xpath_type_number:
-					return convert_number_to_string(eval_number(c, stack), stack.result);
-					
-				case xpath_type_node_set:
-				{
-					xpath_allocator_capture cr(stack.temp);
+			char* ptr = static_cast<char*>(data);
 
-					xpath_stack swapped_stack = {stack.temp, stack.result};
+			numbers = reinterpret_cast<double*>(ptr);
+			nodes = reinterpret_cast<xpath_node*>(ptr + number_count * sizeof(double));
+			offsets = reinterpret_cast<size_t*>(nodes + row_count);
+			slots = offsets + table->strings * (row_count + 1);
+			types = reinterpret_cast<xpath_value_type*>(slots + table->size);
 
-					xpath_node_set_raw ns = eval_node_set(c, swapped_stack);
-					return ns.empty() ? xpath_string() : string_value(ns.first(), stack.result);
-				}
-				
-				default:
-					assert(!"Wrong expression for return type string");
-					return xpath_string();
-				}
-			}
+			for (size_t i = 0; i < table->size; ++i)
+			{
+				types[i] = table->columns[i].type;
+				slots[i] = table->columns[i].slot;
 			}
+
+			return true;
 		}
 
-		xpath_node_set_raw eval_node_set(const xpath_context& c, const xpath_stack& stack)
+		bool reserve_strings(size_t size)
 		{
-			switch (_type)
-			{
-			case ast_op_union:
-			{
-				xpath_allocator_capture cr(stack.temp);
-
-				xpath_stack swapped_stack = {stack.temp, stack.result};
-
-				xpath_node_set_raw ls = _left->eval_node_set(c, swapped_stack);
-				xpath_node_set_raw rs = _right->eval_node_set(c, stack);
-				
-				// we can optimize merging two sorted sets, but this is a very rare operation, so don't bother
-  		        rs.set_type(xpath_node_set::type_unsorted);
+			if (size <= strings_capacity) return true;
 
-				rs.append(ls.begin(), ls.end(), stack.result);
-				rs.remove_duplicates();
-				
-				return rs;
-			}
-
-			case ast_filter:
-			case ast_filter_posinv:
-			{
-				xpath_node_set_raw set = _left->eval_node_set(c, stack);
+			void* memory = global_allocate(size * sizeof(char_t));
+			if (!memory) return false;
 
-				// either expression is a number or it contains position() call; sort by document order
-				if (_type == ast_filter) set.sort_do();
+			if (strings) global_deallocate(strings);
 
-				apply_predicate(set, 0, _right, stack);
-			
-				return set;
-			}
-			
-			case ast_func_id:
-				return xpath_node_set_raw();
-			
-			case ast_step:
-			{
-				switch (_axis)
-				{
-				case axis_ancestor:
-					return step_do(c, stack, axis_to_type<axis_ancestor>());
-					
-				case axis_ancestor_or_self:
-					return step_do(c, stack, axis_to_type<axis_ancestor_or_self>());
+			strings = static_cast<char_t*>(memory);
+			strings_capacity = size;
 
-				case axis_attribute:
-					return step_do(c, stack, axis_to_type<axis_attribute>());
+			return true;
+		}
 
-				case axis_child:
-					return step_do(c, stack, axis_to_type<axis_child>());
-				
-				case axis_descendant:
-					return step_do(c, stack, axis_to_type<axis_descendant>());
+		size_t rows;
+		size_t columns;
 
-				case axis_descendant_or_self:
-					return step_do(c, stack, axis_to_type<axis_descendant_or_self>());
+		double* numbers;
+		xpath_node* nodes;
+		size_t* offsets;
+		xpath_value_type* types;
+		size_t* slots;
 
-				case axis_following:
-					return step_do(c, stack, axis_to_type<axis_following>());
-				
-				case axis_following_sibling:
-					return step_do(c, stack, axis_to_type<axis_following_sibling>());
-				
-				case axis_namespace:
-					// namespaced axis is not supported
-					return xpath_node_set_raw();
-				
-				case axis_parent:
-					return step_do(c, stack, axis_to_type<axis_parent>());
-				
-				case axis_preceding:
-					return step_do(c, stack, axis_to_type<axis_preceding>());
+		void* data;
+		size_t data_capacity;
 
-				case axis_preceding_sibling:
-					return step_do(c, stack, axis_to_type<axis_preceding_sibling>());
-				
-				case axis_self:
-					return step_do(c, stack, axis_to_type<axis_self>());
-				}
-			}
+		char_t* strings;
+		size_t strings_capacity;
+	};
 
-			case ast_step_root:
-			{
-				assert(!_right); // root step can't have any predicates
+	// String value of a cell until it is copied to the string buffer; points to the document, to the query or to the memory of the evaluation
+	struct xpath_table_cell
+	{
+		const char_t* data;
+		size_t length;
+	};
 
-				xpath_node_set_raw ns;
+	struct xpath_table_fill
+	{
+		const xpath_table_impl* table;
+		const xpath_node* rows;
+		size_t row_count;
+		size_t grain;				// number of rows in a part
 
-				ns.set_type(xpath_node_set::type_sorted);
+		xpath_table_cell* cells;	// cells[slot * row_count + row] for string columns
+		double* numbers;
+	};
 
-				if (c.n.node()) ns.push_back(c.n.node().root(), stack.result);
-				else if (c.n.attribute()) ns.push_back(c.n.parent().root(), stack.result);
+	// Evaluate the columns for a range of rows, column by column; the stack data is shared by all cells, so context-independent
+	// subexpressions of the column queries are evaluated once
+	void table_fill_rows(const xpath_table_fill& fill, size_t begin, size_t end, xpath_stack_data& sd)
+	{
+		for (size_t i = 0; i < fill.table->size; ++i)
+		{
+			const xpath_table_column& column = fill.table->columns[i];
+			const xpath_query_impl* impl = column.query;
 
-				return ns;
-			}
+			impl->start(sd);
 
-			case ast_variable:
+			for (size_t row = begin; row < end; ++row)
 			{
-				assert(_rettype == _data.variable->type());
-
-				if (_rettype == xpath_type_node_set)
-				{
-					const xpath_node_set& s = _data.variable->get_node_set();
+				xpath_allocator_capture ct(&sd.temp);
 
-					xpath_node_set_raw ns;
+				xpath_context c(fill.rows[row], 1, 1);
 
-					ns.set_type(s.type());
-					ns.append(s.begin(), s.end(), stack.result);
+				if (column.type == xpath_type_string)
+				{
+					// the result allocator is not reverted, so that the string stays valid until it is copied
+					xpath_string value = impl->program ? eval_program_string(impl->program, c, sd.stack) : impl->root->eval_string(c, sd.stack);
+					xpath_table_cell& cell = fill.cells[column.slot * fill.row_count + row];
 
-					return ns;
+					cell.data = value.c_str();
+					cell.length = value.length();
 				}
+				else
+				{
+					xpath_allocator_capture cr(&sd.result);
 
-				// fallthrough to type conversion
-			}
+					double& value = fill.numbers[column.slot * fill.row_count + row];
 
-			default:
-				assert(!"Wrong expression for return type node set");
-				return xpath_node_set_raw();
+					if (column.type == xpath_type_number)
+						value = impl->program ? eval_program_number(impl->program, c, sd.stack) : impl->root->eval_number(c, sd.stack);
+					else
+						value = (impl->program ? eval_program_boolean(impl->program, c, sd.stack) : impl->root->eval_boolean(c, sd.stack)) ? 1 : 0;
+				}
 			}
 		}
-		
-		bool is_posinv()
-		{
-			switch (_type)
-			{
-			case ast_func_position:
-				return false;
+	}
+
+#ifdef PUGIHTML_XPATH_THREADS
+	void parallel_fill_rows(const xpath_parallel_job& job, size_t part, xpath_stack_data& sd)
+	{
+		const xpath_table_fill& fill = *static_cast<const xpath_table_fill*>(job.data);
+
+		size_t begin = part * fill.grain;
+		size_t end = begin + fill.grain < fill.row_count ? begin + fill.grain : fill.row_count;
+
+		table_fill_rows(fill, begin, end, sd);
+	}
+#endif
+
+	// Copy the cell strings to the string buffer of the result
+	bool table_pack_strings(xpath_table_result_impl* result, const xpath_table_fill& fill)
+	{
+		size_t count = fill.table->strings * fill.row_count;
+		size_t size = count;
 
-			case ast_string_constant:
-			case ast_number_constant:
-			case ast_variable:
-				return true;
+		for (size_t i = 0; i < count; ++i) size += fill.cells[i].length;
 
-			case ast_step:
-			case ast_step_root:
-				return true;
+		if (!result->reserve_strings(size)) return false;
 
-			case ast_predicate:
-			case ast_filter:
-			case ast_filter_posinv:
-				return true;
+		char_t* ptr = result->strings;
 
-			default:
-				if (_left && !_left->is_posinv()) return false;
-				
-				for (xpath_ast_node* n = _right; n; n = n->_next)
-					if (!n->is_posinv()) return false;
-					
-				return true;
+		for (size_t slot = 0; slot < fill.table->strings; ++slot)
+		{
+			const xpath_table_cell* cells = fill.cells + slot * fill.row_count;
+			size_t* offsets = result->offsets + slot * (fill.row_count + 1);
+
+			for (size_t row = 0; row < fill.row_count; ++row)
+			{
+				offsets[row] = static_cast<size_t>(ptr - result->strings);
+
+				memcpy(ptr, cells[row].data, cells[row].length * sizeof(char_t));
+				ptr += cells[row].length;
+				*ptr++ = 0;
 			}
-		}
 
-		xpath_value_type rettype() const
-		{
-			return static_cast<xpath_value_type>(_rettype);
+			offsets[fill.row_count] = static_cast<size_t>(ptr - result->strings);
 		}
-	};
 
-	struct xpath_parser
+		return true;
+	}
+
+	// Evaluate the table into the result; returns false on out of memory errors if PUGIHTML_NO_EXCEPTIONS is defined, or if the parts
+	// could not be evaluated on several threads, in which case the caller evaluates the table again on the calling thread
+	bool evaluate_table_impl(const xpath_table_impl* table, xpath_table_result_impl* result, const xpath_node& n, xpath_eval_context* scratch, unsigned int thread_count)
 	{
-	    xpath_allocator* _alloc;
-	    xpath_lexer _lexer;
+		result->rows = result->columns = 0;
 
-		const char_t* _query;
-		xpath_variable_set* _variables;
+		if (!table || !table->rows) return true;
 
-		xpath_parse_result* _result;
+		update_document_order(n);
+
+		xpath_context c(n, 1, 1);
+		xpath_stack_data sd(scratch);
+
+	#ifdef PUGIHTML_XPATH_THREADS
+		xpath_parallel_workers workers;
+	#endif
+
+		table->rows->start(sd);
 
 	#ifdef PUGIHTML_NO_EXCEPTIONS
-		jmp_buf _error_handler;
+		if (setjmp(sd.error_handler)) return false;
 	#endif
 
-		void throw_error(const char* message)
-		{
-			_result->error = message;
-			_result->offset = _lexer.current_pos() - _query;
+		xpath_node_set_raw rows = table->rows->root->eval_node_set(c, sd.stack);
 
-		#ifdef PUGIHTML_NO_EXCEPTIONS
-			longjmp(_error_handler, 1);
-		#else
-			throw xpath_exception(*_result);
-		#endif
-		}
+		if (!result->reset(table, rows.size())) sd.result.fail();
 
-		void throw_error_oom()
-        {
-        #ifdef PUGIHTML_NO_EXCEPTIONS
-            throw_error("Out of memory");
-        #else
-            throw std::bad_alloc();
-        #endif
-        }
+		if (!rows.empty()) memcpy(result->nodes, rows.begin(), rows.size() * sizeof(xpath_node));
 
-		void* alloc_node()
+		xpath_table_fill fill = {table, result->nodes, rows.size(), rows.size(), 0, result->numbers};
+
+		fill.cells = static_cast<xpath_table_cell*>(sd.result.allocate((table->strings * rows.size() + 1) * sizeof(xpath_table_cell)));
+
+	#ifdef PUGIHTML_XPATH_THREADS
+		if (thread_count > 1 && rows.size() > 1)
 		{
-			void* result = _alloc->allocate_nothrow(sizeof(xpath_ast_node));
+			// several parts per thread balance the work
+			fill.grain = rows.size() / (thread_count * 8) + 1;
 
-			if (!result) throw_error_oom();
+			xpath_parallel_job job = {parallel_fill_rows, &fill, (rows.size() + fill.grain - 1) / fill.grain, 0};
 
-			return result;
+			if (!parallel_execute(job, workers, thread_count, &sd.temp)) return false;
 		}
+		else
+	#else
+		(void)thread_count;
+	#endif
+			table_fill_rows(fill, 0, rows.size(), sd);
 
-		const char_t* alloc_string(const xpath_lexer_string& value)
-		{
-			if (value.begin)
-			{
-				size_t length = static_cast<size_t>(value.end - value.begin);
+		if (!table_pack_strings(result, fill)) sd.result.fail();
 
-				char_t* c = static_cast<char_t*>(_alloc->allocate_nothrow((length + 1) * sizeof(char_t)));
-				if (!c) throw_error_oom();
+		result->rows = rows.size();
+		result->columns = table->size;
 
-				memcpy(c, value.begin, length * sizeof(char_t));
-				c[length] = 0;
+		return true;
+	}
+}
 
-				return c;
-			}
-			else return 0;
-		}
+namespace pugihtml
+{
+#ifndef PUGIHTML_NO_EXCEPTIONS
+	xpath_exception::xpath_exception(const xpath_parse_result& result): _result(result)
+	{
+		assert(result.error);
+	}
+	
+	const char* xpath_exception::what() const throw()
+	{
+		return _result.error;
+	}
 
-		xpath_ast_node* parse_function_helper(ast_type_t type0, ast_type_t type1, size_t argc, xpath_ast_node* args[2])
-		{
-			assert(argc <= 1);
+	const xpath_parse_result& xpath_exception::result() const
+	{
+		return _result;
+	}
+#endif
+	
+	xpath_node::xpath_node()
+	{
+	}
+		
+	xpath_node::xpath_node(const html_node& node): _node(node)
+	{
+	}
+		
+	xpath_node::xpath_node(const html_attribute& attribute, const html_node& parent): _node(attribute ? parent : html_node()), _attribute(attribute)
+	{
+	}
 
-			if (argc == 1 && args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
+	html_node xpath_node::node() const
+	{
+		return _attribute ? html_node() : _node;
+	}
+		
+	html_attribute xpath_node::attribute() const
+	{
+		return _attribute;
+	}
+	
+	html_node xpath_node::parent() const
+	{
+		return _attribute ? _node : _node.parent();
+	}
 
-			return new (alloc_node()) xpath_ast_node(argc == 0 ? type0 : type1, xpath_type_string, args[0]);
-		}
+	xpath_node::operator xpath_node::unspecified_bool_type() const
+	{
+		return (_node || _attribute) ? &xpath_node::_node : 0;
+	}
+	
+	bool xpath_node::operator!() const
+	{
+		return !(_node || _attribute);
+	}
 
-		xpath_ast_node* parse_function(const xpath_lexer_string& name, size_t argc, xpath_ast_node* args[2])
-		{
-			switch (name.begin[0])
-			{
-			case 'b':
-				if (name == PUGIHTML_TEXT("boolean") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_boolean, xpath_type_boolean, args[0]);
-					
-				break;
-			
-			case 'c':
-				if (name == PUGIHTML_TEXT("count") && argc == 1)
-				{
-					if (args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
-					return new (alloc_node()) xpath_ast_node(ast_func_count, xpath_type_number, args[0]);
-				}
-				else if (name == PUGIHTML_TEXT("contains") && argc == 2)
-					return new (alloc_node()) xpath_ast_node(ast_func_contains, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("concat") && argc >= 2)
-					return new (alloc_node()) xpath_ast_node(ast_func_concat, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("ceiling") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_ceiling, xpath_type_number, args[0]);
-					
-				break;
-			
-			case 'f':
-				if (name == PUGIHTML_TEXT("false") && argc == 0)
-					return new (alloc_node()) xpath_ast_node(ast_func_false, xpath_type_boolean);
-				else if (name == PUGIHTML_TEXT("floor") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_floor, xpath_type_number, args[0]);
-					
-				break;
-			
-			case 'i':
-				if (name == PUGIHTML_TEXT("id") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_id, xpath_type_node_set, args[0]);
-					
-				break;
-			
-			case 'l':
-				if (name == PUGIHTML_TEXT("last") && argc == 0)
-					return new (alloc_node()) xpath_ast_node(ast_func_last, xpath_type_number);
-				else if (name == PUGIHTML_TEXT("lang") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_lang, xpath_type_boolean, args[0]);
-				else if (name == PUGIHTML_TEXT("local-name") && argc <= 1)
-					return parse_function_helper(ast_func_local_name_0, ast_func_local_name_1, argc, args);
-			
-				break;
-			
-			case 'n':
-				if (name == PUGIHTML_TEXT("name") && argc <= 1)
-					return parse_function_helper(ast_func_name_0, ast_func_name_1, argc, args);
-				else if (name == PUGIHTML_TEXT("namespace-uri") && argc <= 1)
-					return parse_function_helper(ast_func_namespace_uri_0, ast_func_namespace_uri_1, argc, args);
-				else if (name == PUGIHTML_TEXT("normalize-space") && argc <= 1)
-					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_normalize_space_0 : ast_func_normalize_space_1, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("not") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_not, xpath_type_boolean, args[0]);
-				else if (name == PUGIHTML_TEXT("number") && argc <= 1)
-					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_number_0 : ast_func_number_1, xpath_type_number, args[0]);
-			
-				break;
-			
-			case 'p':
-				if (name == PUGIHTML_TEXT("position") && argc == 0)
-					return new (alloc_node()) xpath_ast_node(ast_func_position, xpath_type_number);
-				
-				break;
-			
-			case 'r':
-				if (name == PUGIHTML_TEXT("round") && argc == 1)
-					return new (alloc_node()) xpath_ast_node(ast_func_round, xpath_type_number, args[0]);
+	bool xpath_node::operator==(const xpath_node& n) const
+	{
+		return _node == n._node && _attribute == n._attribute;
+	}
+	
+	bool xpath_node::operator!=(const xpath_node& n) const
+	{
+		return _node != n._node || _attribute != n._attribute;
+	}
 
-				break;
-			
-			case 's':
-				if (name == PUGIHTML_TEXT("string") && argc <= 1)
-					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_string_0 : ast_func_string_1, xpath_type_string, args[0]);
-				else if (name == PUGIHTML_TEXT("string-length") && argc <= 1)
-					return new (alloc_node()) xpath_ast_node(argc == 0 ? ast_func_string_length_0 : ast_func_string_length_1, xpath_type_string, args[0]);
-				else if (name == PUGIHTML_TEXT("starts-with") && argc == 2)
-					return new (alloc_node()) xpath_ast_node(ast_func_starts_with, xpath_type_boolean, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("substring-before") && argc == 2)
-					return new (alloc_node()) xpath_ast_node(ast_func_substring_before, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("substring-after") && argc == 2)
-					return new (alloc_node()) xpath_ast_node(ast_func_substring_after, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("substring") && (argc == 2 || argc == 3))
-					return new (alloc_node()) xpath_ast_node(argc == 2 ? ast_func_substring_2 : ast_func_substring_3, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("sum") && argc == 1)
-				{
-					if (args[0]->rettype() != xpath_type_node_set) throw_error("Function has to be applied to node set");
-					return new (alloc_node()) xpath_ast_node(ast_func_sum, xpath_type_number, args[0]);
-				}
+#ifdef __BORLANDC__
+	bool operator&&(const xpath_node& lhs, bool rhs)
+	{
+		return (bool)lhs && rhs;
+	}
+
+	bool operator||(const xpath_node& lhs, bool rhs)
+	{
+		return (bool)lhs || rhs;
+	}
+#endif
+
+	void xpath_node_set::_assign(const_iterator begin, const_iterator end)
+	{
+		assert(begin <= end);
 
-				break;
-			
-			case 't':
-				if (name == PUGIHTML_TEXT("translate") && argc == 3)
-					return new (alloc_node()) xpath_ast_node(ast_func_translate, xpath_type_string, args[0], args[1]);
-				else if (name == PUGIHTML_TEXT("true") && argc == 0)
-					return new (alloc_node()) xpath_ast_node(ast_func_true, xpath_type_boolean);
-					
-				break;
-			}
+		size_t size = static_cast<size_t>(end - begin);
 
-			throw_error("Unrecognized function or wrong parameter count");
+		if (size <= 1)
+		{
+			// deallocate old buffer
+			if (_begin != &_storage) global_deallocate(_begin);
 
-			return 0;
-		}
+			// use internal buffer
+			if (begin != end) _storage = *begin;
 
-		axis_t parse_axis_name(const xpath_lexer_string& name, bool& specified)
+			_begin = &_storage;
+			_end = &_storage + size;
+		}
+		else
 		{
-			specified = true;
+			// make heap copy
+			xpath_node* storage = static_cast<xpath_node*>(global_allocate(size * sizeof(xpath_node)));
 
-			switch (name.begin[0])
+			if (!storage)
 			{
-			case 'a':
-				if (name == PUGIHTML_TEXT("ancestor"))
-					return axis_ancestor;
-				else if (name == PUGIHTML_TEXT("ancestor-or-self"))
-					return axis_ancestor_or_self;
-				else if (name == PUGIHTML_TEXT("attribute"))
-					return axis_attribute;
-				
-				break;
-			
-			case 'c':
-				if (name == PUGIHTML_TEXT("child"))
-					return axis_child;
-				
-				break;
-			
-			case 'd':
-				if (name == PUGIHTML_TEXT("descendant"))
-					return axis_descendant;
-				else if (name == PUGIHTML_TEXT("descendant-or-self"))
-					return axis_descendant_or_self;
-				
-				break;
-			
-			case 'f':
-				if (name == PUGIHTML_TEXT("following"))
-					return axis_following;
-				else if (name == PUGIHTML_TEXT("following-sibling"))
-					return axis_following_sibling;
-				
-				break;
-			
-			case 'n':
-				if (name == PUGIHTML_TEXT("namespace"))
-					return axis_namespace;
-				
-				break;
-			
-			case 'p':
-				if (name == PUGIHTML_TEXT("parent"))
-					return axis_parent;
-				else if (name == PUGIHTML_TEXT("preceding"))
-					return axis_preceding;
-				else if (name == PUGIHTML_TEXT("preceding-sibling"))
-					return axis_preceding_sibling;
-				
-				break;
-			
-			case 's':
-				if (name == PUGIHTML_TEXT("self"))
-					return axis_self;
-				
-				break;
+			#ifdef PUGIHTML_NO_EXCEPTIONS
+				return;
+			#else
+				throw std::bad_alloc();
+			#endif
 			}
 
-			specified = false;
-			return axis_child;
+			memcpy(storage, begin, size * sizeof(xpath_node));
+			
+			// deallocate old buffer
+			if (_begin != &_storage) global_deallocate(_begin);
+
+			// finalize
+			_begin = storage;
+			_end = storage + size;
 		}
+	}
 
-		nodetest_t parse_node_test_type(const xpath_lexer_string& name)
-		{
-			switch (name.begin[0])
-			{
-			case 'c':
-				if (name == PUGIHTML_TEXT("comment"))
-					return nodetest_type_comment;
+	xpath_node_set::xpath_node_set(): _type(type_unsorted), _begin(&_storage), _end(&_storage)
+	{
+	}
 
-				break;
+	xpath_node_set::xpath_node_set(const_iterator begin, const_iterator end, type_t type): _type(type), _begin(&_storage), _end(&_storage)
+	{
+		_assign(begin, end);
+	}
 
-			case 'n':
-				if (name == PUGIHTML_TEXT("node"))
-					return nodetest_type_node;
+	xpath_node_set::~xpath_node_set()
+	{
+		if (_begin != &_storage) global_deallocate(_begin);
+	}
+		
+	xpath_node_set::xpath_node_set(const xpath_node_set& ns): _type(ns._type), _begin(&_storage), _end(&_storage)
+	{
+		_assign(ns._begin, ns._end);
+	}
+	
+	xpath_node_set& xpath_node_set::operator=(const xpath_node_set& ns)
+	{
+		if (this == &ns) return *this;
+		
+		_type = ns._type;
+		_assign(ns._begin, ns._end);
 
-				break;
+		return *this;
+	}
 
-			case 'p':
-				if (name == PUGIHTML_TEXT("processing-instruction"))
-					return nodetest_type_pi;
+	xpath_node_set::type_t xpath_node_set::type() const
+	{
+		return _type;
+	}
+		
+	size_t xpath_node_set::size() const
+	{
+		return _end - _begin;
+	}
+		
+	bool xpath_node_set::empty() const
+	{
+		return _begin == _end;
+	}
+		
+	const xpath_node& xpath_node_set::operator[](size_t index) const
+	{
+		assert(index < size());
+		return _begin[index];
+	}
 
-				break;
+	xpath_node_set::const_iterator xpath_node_set::begin() const
+	{
+		return _begin;
+	}
+		
+	xpath_node_set::const_iterator xpath_node_set::end() const
+	{
+		return _end;
+	}
+	
+	void xpath_node_set::sort(bool reverse)
+	{
+		if (_begin != _end) update_document_order(*_begin);
 
-			case 't':
-				if (name == PUGIHTML_TEXT("text"))
-					return nodetest_type_text;
+		_type = xpath_sort(_begin, _end, _type, reverse);
+	}
 
-				break;
-			}
+	xpath_node xpath_node_set::first() const
+	{
+		return xpath_first(_begin, _end, _type);
+	}
 
-			return nodetest_none;
-		}
+    xpath_parse_result::xpath_parse_result(): error("Internal error"), offset(0)
+    {
+    }
 
-	    // PrimaryExpr ::= VariableReference | '(' Expr ')' | Literal | Number | FunctionCall
-	    xpath_ast_node* parse_primary_expression()
-	    {
-	    	switch (_lexer.current())
-	    	{
-	    	case lex_var_ref:
-	    	{
-				xpath_lexer_string name = _lexer.contents();
+    xpath_parse_result::operator bool() const
+    {
+        return error == 0;
+    }
+	const char* xpath_parse_result::description() const
+	{
+		return error ? error : "No error";
+	}
 
-				if (!_variables)
-					throw_error("Unknown variable: variable set is not provided");
+	xpath_variable::xpath_variable()
+    {
+    }
 
-				xpath_variable* var = get_variable(_variables, name.begin, name.end);
+	const char_t* xpath_variable::name() const
+	{
+		switch (_type)
+		{
+		case xpath_type_node_set:
+			return static_cast<const xpath_variable_node_set*>(this)->name;
 
-				if (!var)
-					throw_error("Unknown variable: variable set does not contain the given name");
+		case xpath_type_number:
+			return static_cast<const xpath_variable_number*>(this)->name;
 
-				_lexer.next();
+		case xpath_type_string:
+			return static_cast<const xpath_variable_string*>(this)->name;
 
-	    		return new (alloc_node()) xpath_ast_node(ast_variable, var->type(), var);
-			}
+		case xpath_type_boolean:
+			return static_cast<const xpath_variable_boolean*>(this)->name;
+
+		default:
+			assert(!"Invalid variable type");
+			return 0;
+		}
+	}
+
+	xpath_value_type xpath_variable::type() const
+	{
+		return _type;
+	}
+
+	bool xpath_variable::get_boolean() const
+	{
+		return (_type == xpath_type_boolean) ? static_cast<const xpath_variable_boolean*>(this)->value : false;
+	}
+
+	double xpath_variable::get_number() const
+	{
+		return (_type == xpath_type_number) ? static_cast<const xpath_variable_number*>(this)->value : gen_nan();
+	}
+
+	const char_t* xpath_variable::get_string() const
+	{
+		const char_t* value = (_type == xpath_type_string) ? static_cast<const xpath_variable_string*>(this)->value : 0;
+		return value ? value : PUGIHTML_TEXT("");
+	}
 
-			case lex_open_brace:
-			{
-				_lexer.next();
+	const xpath_node_set& xpath_variable::get_node_set() const
+	{
+		return (_type == xpath_type_node_set) ? static_cast<const xpath_variable_node_set*>(this)->value : dummy_node_set;
+	}
 
-				xpath_ast_node* n = parse_expression();
+	bool xpath_variable::set(bool value)
+	{
+		if (_type != xpath_type_boolean) return false;
 
-				if (_lexer.current() != lex_close_brace)
-					throw_error("Unmatched braces");
+		static_cast<xpath_variable_boolean*>(this)->value = value;
+		return true;
+	}
 
-				_lexer.next();
+	bool xpath_variable::set(double value)
+	{
+		if (_type != xpath_type_number) return false;
 
-				return n;
-			}
+		static_cast<xpath_variable_number*>(this)->value = value;
+		return true;
+	}
 
-			case lex_quoted_string:
-			{
-				const char_t* value = alloc_string(_lexer.contents());
+	bool xpath_variable::set(const char_t* value)
+	{
+		if (_type != xpath_type_string) return false;
 
-				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_string_constant, xpath_type_string, value);
-				_lexer.next();
+		xpath_variable_string* var = static_cast<xpath_variable_string*>(this);
 
-				return n;
-			}
+		// duplicate string
+		size_t size = (strlength(value) + 1) * sizeof(char_t);
 
-			case lex_number:
-			{
-				double value = 0;
+		char_t* copy = static_cast<char_t*>(global_allocate(size));
+		if (!copy) return false;
 
-				if (!convert_string_to_number(_lexer.contents().begin, _lexer.contents().end, &value))
-					throw_error_oom();
+		memcpy(copy, value, size);
 
-				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_number_constant, xpath_type_number, value);
-				_lexer.next();
+		// replace old string
+		if (var->value) global_deallocate(var->value);
+		var->value = copy;
 
-				return n;
-			}
+		return true;
+	}
 
-			case lex_string:
-			{
-				xpath_ast_node* args[2] = {0};
-				size_t argc = 0;
-				
-				xpath_lexer_string function = _lexer.contents();
-				_lexer.next();
-				
-				xpath_ast_node* last_arg = 0;
-				
-				if (_lexer.current() != lex_open_brace)
-					throw_error("Unrecognized function call");
-				_lexer.next();
+	bool xpath_variable::set(const xpath_node_set& value)
+	{
+		if (_type != xpath_type_node_set) return false;
 
-				if (_lexer.current() != lex_close_brace)
-					args[argc++] = parse_expression();
+		static_cast<xpath_variable_node_set*>(this)->value = value;
+		return true;
+	}
 
-				while (_lexer.current() != lex_close_brace)
-				{
-					if (_lexer.current() != lex_comma)
-						throw_error("No comma between function arguments");
-					_lexer.next();
-					
-					xpath_ast_node* n = parse_expression();
-					
-					if (argc < 2) args[argc] = n;
-					else last_arg->set_next(n);
+	xpath_variable_set::xpath_variable_set()
+	{
+		for (size_t i = 0; i < sizeof(_data) / sizeof(_data[0]); ++i) _data[i] = 0;
+	}
 
-					argc++;
-					last_arg = n;
-				}
-				
-				_lexer.next();
+	xpath_variable_set::~xpath_variable_set()
+	{
+		// cached queries refer to the variables
+		query_cache_purge(this);
 
-				return parse_function(function, argc, args);
-			}
+		for (size_t i = 0; i < sizeof(_data) / sizeof(_data[0]); ++i)
+		{
+			xpath_variable* var = _data[i];
 
-	    	default:
-	    		throw_error("Unrecognizable primary expression");
+			while (var)
+			{
+				xpath_variable* next = var->_next;
 
-	    		return 0;
-	    	}
-	    }
-	    
-	    // FilterExpr ::= PrimaryExpr | FilterExpr Predicate
-	    // Predicate ::= '[' PredicateExpr ']'
-	    // PredicateExpr ::= Expr
-	    xpath_ast_node* parse_filter_expression()
-	    {
-	    	xpath_ast_node* n = parse_primary_expression();
+				delete_xpath_variable(var->_type, var);
 
-	    	while (_lexer.current() == lex_open_square_brace)
-	    	{
-	    		_lexer.next();
+				var = next;
+			}
+		}
+	}
 
-				xpath_ast_node* expr = parse_expression();
+	xpath_variable* xpath_variable_set::find(const char_t* name) const
+	{
+		const size_t hash_size = sizeof(_data) / sizeof(_data[0]);
+		size_t hash = hash_string(name) % hash_size;
 
-				if (n->rettype() != xpath_type_node_set) throw_error("Predicate has to be applied to node set");
+		// look for existing variable
+		for (xpath_variable* var = _data[hash]; var; var = var->_next)
+			if (strequal(var->name(), name))
+				return var;
 
-				bool posinv = expr->rettype() != xpath_type_number && expr->is_posinv();
+		return 0;
+	}
 
-	    		n = new (alloc_node()) xpath_ast_node(posinv ? ast_filter_posinv : ast_filter, xpath_type_node_set, n, expr);
+	xpath_variable* xpath_variable_set::add(const char_t* name, xpath_value_type type)
+	{
+		const size_t hash_size = sizeof(_data) / sizeof(_data[0]);
+		size_t hash = hash_string(name) % hash_size;
 
-	    		if (_lexer.current() != lex_close_square_brace)
-	    			throw_error("Unmatched square brace");
-	    	
-	    		_lexer.next();
-	    	}
-	    	
-	    	return n;
-	    }
-	    
-	    // Step ::= AxisSpecifier NodeTest Predicate* | AbbreviatedStep
-	    // AxisSpecifier ::= AxisName '::' | '@'?
-	    // NodeTest ::= NameTest | NodeType '(' ')' | 'processing-instruction' '(' Literal ')'
-	    // NameTest ::= '*' | NCName ':' '*' | QName
-	    // AbbreviatedStep ::= '.' | '..'
-	    xpath_ast_node* parse_step(xpath_ast_node* set)
-	    {
-			if (set && set->rettype() != xpath_type_node_set)
-				throw_error("Step has to be applied to node set");
+		// look for existing variable
+		for (xpath_variable* var = _data[hash]; var; var = var->_next)
+			if (strequal(var->name(), name))
+				return var->type() == type ? var : 0;
 
-			bool axis_specified = false;
-			axis_t axis = axis_child; // implied child axis
+		// add new variable
+		xpath_variable* result = new_xpath_variable(type, name);
 
-			if (_lexer.current() == lex_axis_attribute)
-			{
-				axis = axis_attribute;
-				axis_specified = true;
-				
-				_lexer.next();
-			}
-			else if (_lexer.current() == lex_dot)
-			{
-				_lexer.next();
-				
-				return new (alloc_node()) xpath_ast_node(ast_step, set, axis_self, nodetest_type_node, 0);
-			}
-			else if (_lexer.current() == lex_double_dot)
-			{
-				_lexer.next();
-				
-				return new (alloc_node()) xpath_ast_node(ast_step, set, axis_parent, nodetest_type_node, 0);
-			}
-	    
-			nodetest_t nt_type = nodetest_none;
-			xpath_lexer_string nt_name;
-			
-			if (_lexer.current() == lex_string)
-			{
-				// node name test
-				nt_name = _lexer.contents();
-				_lexer.next();
+		if (result)
+		{
+			result->_type = type;
+			result->_next = _data[hash];
 
-				// was it an axis name?
-				if (_lexer.current() == lex_double_colon)
-				{
-					// parse axis name
-					if (axis_specified) throw_error("Two axis specifiers in one step");
+			_data[hash] = result;
+		}
 
-					axis = parse_axis_name(nt_name, axis_specified);
+		return result;
+	}
 
-					if (!axis_specified) throw_error("Unknown axis");
+	bool xpath_variable_set::set(const char_t* name, bool value)
+	{
+		xpath_variable* var = add(name, xpath_type_boolean);
+		return var ? var->set(value) : false;
+	}
 
-					// read actual node test
-					_lexer.next();
+	bool xpath_variable_set::set(const char_t* name, double value)
+	{
+		xpath_variable* var = add(name, xpath_type_number);
+		return var ? var->set(value) : false;
+	}
 
-					if (_lexer.current() == lex_multiply)
-					{
-						nt_type = nodetest_all;
-						nt_name = xpath_lexer_string();
-						_lexer.next();
-					}
-					else if (_lexer.current() == lex_string)
-					{
-						nt_name = _lexer.contents();
-						_lexer.next();
-					}
-					else throw_error("Unrecognized node test");
-				}
-				
-				if (nt_type == nodetest_none)
-				{
-					// node type test or processing-instruction
-					if (_lexer.current() == lex_open_brace)
-					{
-						_lexer.next();
-						
-						if (_lexer.current() == lex_close_brace)
-						{
-							_lexer.next();
+	bool xpath_variable_set::set(const char_t* name, const char_t* value)
+	{
+		xpath_variable* var = add(name, xpath_type_string);
+		return var ? var->set(value) : false;
+	}
 
-							nt_type = parse_node_test_type(nt_name);
+	bool xpath_variable_set::set(const char_t* name, const xpath_node_set& value)
+	{
+		xpath_variable* var = add(name, xpath_type_node_set);
+		return var ? var->set(value) : false;
+	}
 
-							if (nt_type == nodetest_none) throw_error("Unrecognized node type");
-							
-							nt_name = xpath_lexer_string();
-						}
-						else if (nt_name == PUGIHTML_TEXT("processing-instruction"))
-						{
-							if (_lexer.current() != lex_quoted_string)
-								throw_error("Only literals are allowed as arguments to processing-instruction()");
-						
-							nt_type = nodetest_pi;
-							nt_name = _lexer.contents();
-							_lexer.next();
-							
-							if (_lexer.current() != lex_close_brace)
-								throw_error("Unmatched brace near processing-instruction()");
-							_lexer.next();
-						}
-						else
-							throw_error("Unmatched brace near node type test");
+	xpath_variable* xpath_variable_set::get(const char_t* name)
+	{
+		return find(name);
+	}
 
-					}
-					// QName or NCName:*
-					else
-					{
-						if (nt_name.end - nt_name.begin > 2 && nt_name.end[-2] == ':' && nt_name.end[-1] == '*') // NCName:*
-						{
-							nt_name.end--; // erase *
-							
-							nt_type = nodetest_all_in_namespace;
-						}
-						else nt_type = nodetest_name;
-					}
-				}
-			}
-			else if (_lexer.current() == lex_multiply)
-			{
-				nt_type = nodetest_all;
-				_lexer.next();
-			}
-			else throw_error("Unrecognized node test");
-			
-			xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step, set, axis, nt_type, alloc_string(nt_name));
-			
-			xpath_ast_node* last = 0;
-			
-			while (_lexer.current() == lex_open_square_brace)
-			{
-				_lexer.next();
-				
-				xpath_ast_node* expr = parse_expression();
+	const xpath_variable* xpath_variable_set::get(const char_t* name) const
+	{
+		return find(name);
+	}
 
-				xpath_ast_node* pred = new (alloc_node()) xpath_ast_node(ast_predicate, xpath_type_node_set, expr);
-				
-				if (_lexer.current() != lex_close_square_brace)
-	    			throw_error("Unmatched square brace");
-				_lexer.next();
-				
-				if (last) last->set_next(pred);
-				else n->set_right(pred);
-				
-				last = pred;
-			}
-			
-			return n;
-	    }
-	    
-	    // RelativeLocationPath ::= Step | RelativeLocationPath '/' Step | RelativeLocationPath '//' Step
-	    xpath_ast_node* parse_relative_location_path(xpath_ast_node* set)
-	    {
-			xpath_ast_node* n = parse_step(set);
-			
-			while (_lexer.current() == lex_slash || _lexer.current() == lex_double_slash)
-			{
-				lexeme_t l = _lexer.current();
-				_lexer.next();
+	xpath_function_call::xpath_function_call(xpath_function_invocation* impl): _impl(impl)
+	{
+	}
 
-				if (l == lex_double_slash)
-					n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
-				
-				n = parse_step(n);
-			}
-			
-			return n;
-	    }
-	    
-	    // LocationPath ::= RelativeLocationPath | AbsoluteLocationPath
-	    // AbsoluteLocationPath ::= '/' RelativeLocationPath? | '//' RelativeLocationPath
-	    xpath_ast_node* parse_location_path()
-	    {
-			if (_lexer.current() == lex_slash)
-			{
-				_lexer.next();
-				
-				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step_root, xpath_type_node_set);
+	const xpath_node& xpath_function_call::context() const
+	{
+		return _impl->context;
+	}
 
-				// relative location path can start from axis_attribute, dot, double_dot, multiply and string lexemes; any other lexeme means standalone root path
-				lexeme_t l = _lexer.current();
+	void* xpath_function_call::data() const
+	{
+		return _impl->function->data;
+	}
 
-				if (l == lex_string || l == lex_axis_attribute || l == lex_dot || l == lex_double_dot || l == lex_multiply)
-					return parse_relative_location_path(n);
-				else
-					return n;
-			}
-			else if (_lexer.current() == lex_double_slash)
-			{
-				_lexer.next();
-				
-				xpath_ast_node* n = new (alloc_node()) xpath_ast_node(ast_step_root, xpath_type_node_set);
-				n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
-				
-				return parse_relative_location_path(n);
-			}
+	size_t xpath_function_call::argument_count() const
+	{
+		return _impl->function->argument_count;
+	}
 
-			// else clause moved outside of if because of bogus warning 'control may reach end of non-void function being inlined' in gcc 4.0.1
-			return parse_relative_location_path(0);
-	    }
-	    
-	    // PathExpr ::= LocationPath
-	    //				| FilterExpr
-	    //				| FilterExpr '/' RelativeLocationPath
-	    //				| FilterExpr '//' RelativeLocationPath
-	    xpath_ast_node* parse_path_expression()
-	    {
-			// Clarification.
-			// PathExpr begins with either LocationPath or FilterExpr.
-			// FilterExpr begins with PrimaryExpr
-			// PrimaryExpr begins with '$' in case of it being a variable reference,
-			// '(' in case of it being an expression, string literal, number constant or
-			// function call.
+	bool xpath_function_call::get_boolean(size_t index) const
+	{
+		if (index >= _impl->function->argument_count || _impl->function->arguments[index] != xpath_type_boolean) return false;
 
-			if (_lexer.current() == lex_var_ref || _lexer.current() == lex_open_brace || 
-				_lexer.current() == lex_quoted_string || _lexer.current() == lex_number ||
-				_lexer.current() == lex_string)
-	    	{
-	    		if (_lexer.current() == lex_string)
-	    		{
-	    			// This is either a function call, or not - if not, we shall proceed with location path
-	    			const char_t* state = _lexer.state();
-	    			
-					while (IS_CHARTYPE(*state, ct_space)) ++state;
-	    			
-	    			if (*state != '(') return parse_location_path();
+		return _impl->arguments[index].boolean;
+	}
 
-					// This looks like a function call; however this still can be a node-test. Check it.
-					if (parse_node_test_type(_lexer.contents()) != nodetest_none) return parse_location_path();
-	    		}
-	    		
-	    		xpath_ast_node* n = parse_filter_expression();
+	double xpath_function_call::get_number(size_t index) const
+	{
+		if (index >= _impl->function->argument_count || _impl->function->arguments[index] != xpath_type_number) return gen_nan();
 
-	    		if (_lexer.current() == lex_slash || _lexer.current() == lex_double_slash)
-	    		{
-					lexeme_t l = _lexer.current();
-	    			_lexer.next();
-	    			
-					if (l == lex_double_slash)
-					{
-						if (n->rettype() != xpath_type_node_set) throw_error("Step has to be applied to node set");
+		return _impl->arguments[index].number;
+	}
 
-						n = new (alloc_node()) xpath_ast_node(ast_step, n, axis_descendant_or_self, nodetest_type_node, 0);
-					}
-	
-	    			// select from location path
-	    			return parse_relative_location_path(n);
-	    		}
+	const char_t* xpath_function_call::get_string(size_t index) const
+	{
+		if (index >= _impl->function->argument_count || _impl->function->arguments[index] != xpath_type_string) return PUGIHTML_TEXT("");
 
-	    		return n;
-	    	}
-	    	else return parse_location_path();
-	    }
+		return _impl->arguments[index].string;
+	}
 
-	    // UnionExpr ::= PathExpr | UnionExpr '|' PathExpr
-	    xpath_ast_node* parse_union_expression()
-	    {
-	    	xpath_ast_node* n = parse_path_expression();
+	const xpath_node_set& xpath_function_call::get_node_set(size_t index) const
+	{
+		if (index >= _impl->function->argument_count || _impl->function->arguments[index] != xpath_type_node_set) return dummy_node_set;
 
-	    	while (_lexer.current() == lex_union)
-	    	{
-	    		_lexer.next();
+		xpath_function_invocation::argument& value = _impl->arguments[index];
 
-				xpath_ast_node* expr = parse_union_expression();
+		// most callbacks never look at node set arguments, so the public copy is only made on request
+		if (!value.node_set)
+		{
+			void* memory = _impl->argument_alloc->allocate_nothrow(sizeof(xpath_node_set));
+			if (!memory) return dummy_node_set;
 
-				if (n->rettype() != xpath_type_node_set || expr->rettype() != xpath_type_node_set)
-					throw_error("Union operator has to be applied to node sets");
+			value.node_set = new (memory) xpath_node_set(value.set.begin(), value.set.end(), value.set.type());
+		}
 
-	    		n = new (alloc_node()) xpath_ast_node(ast_op_union, xpath_type_node_set, n, expr);
-	    	}
+		return *value.node_set;
+	}
 
-	    	return n;
-	    }
+	bool xpath_function_call::set(bool value)
+	{
+		if (_impl->function->result != xpath_type_boolean) return false;
 
-	    // UnaryExpr ::= UnionExpr | '-' UnaryExpr
-	    xpath_ast_node* parse_unary_expression()
-	    {
-	    	if (_lexer.current() == lex_minus)
-	    	{
-	    		_lexer.next();
+		_impl->boolean = value;
+		return true;
+	}
 
-				xpath_ast_node* expr = parse_unary_expression();
+	bool xpath_function_call::set(double value)
+	{
+		if (_impl->function->result != xpath_type_number) return false;
 
-	    		return new (alloc_node()) xpath_ast_node(ast_op_negate, xpath_type_number, expr);
-	    	}
-	    	else return parse_union_expression();
-	    }
-	    
-	    // MultiplicativeExpr ::= UnaryExpr
-	    //						  | MultiplicativeExpr '*' UnaryExpr
-	    //						  | MultiplicativeExpr 'div' UnaryExpr
-	    //						  | MultiplicativeExpr 'mod' UnaryExpr
-	    xpath_ast_node* parse_multiplicative_expression()
-	    {
-	    	xpath_ast_node* n = parse_unary_expression();
+		_impl->number = value;
+		return true;
+	}
 
-	    	while (_lexer.current() == lex_multiply || (_lexer.current() == lex_string &&
-	    		   (_lexer.contents() == PUGIHTML_TEXT("mod") || _lexer.contents() == PUGIHTML_TEXT("div"))))
-	    	{
-	    		ast_type_t op = _lexer.current() == lex_multiply ? ast_op_multiply :
-	    			_lexer.contents().begin[0] == 'd' ? ast_op_divide : ast_op_mod;
-	    		_lexer.next();
+	bool xpath_function_call::set(const char_t* value)
+	{
+		if (_impl->function->result != xpath_type_string) return false;
 
-				xpath_ast_node* expr = parse_unary_expression();
+		size_t length = strlength(value);
 
-	    		n = new (alloc_node()) xpath_ast_node(op, xpath_type_number, n, expr);
-	    	}
+		char_t* copy = static_cast<char_t*>(_impl->result_alloc->allocate_nothrow((length + 1) * sizeof(char_t)));
+		if (!copy) return false;
 
-	    	return n;
-	    }
+		memcpy(copy, value, (length + 1) * sizeof(char_t));
 
-	    // AdditiveExpr ::= MultiplicativeExpr
-	    //					| AdditiveExpr '+' MultiplicativeExpr
-	    //					| AdditiveExpr '-' MultiplicativeExpr
-	    xpath_ast_node* parse_additive_expression()
-	    {
-	    	xpath_ast_node* n = parse_multiplicative_expression();
+		_impl->string = copy;
+		return true;
+	}
 
-	    	while (_lexer.current() == lex_plus || _lexer.current() == lex_minus)
-	    	{
-	    		lexeme_t l = _lexer.current();
+	xpath_function_set::xpath_function_set()
+	{
+		for (size_t i = 0; i < sizeof(_data) / sizeof(_data[0]); ++i) _data[i] = 0;
+	}
 
-	    		_lexer.next();
+	xpath_function_set::~xpath_function_set()
+	{
+		xpath_function_entry::destroy(this);
+	}
 
-				xpath_ast_node* expr = parse_multiplicative_expression();
+	bool xpath_function_set::add(const char_t* name, xpath_value_type result, const xpath_value_type* arguments, size_t argument_count, xpath_function_callback callback, void* data)
+	{
+		if (!*name || !callback) return false;
 
-	    		n = new (alloc_node()) xpath_ast_node(l == lex_plus ? ast_op_add : ast_op_subtract, xpath_type_number, n, expr);
-	    	}
+		if (result != xpath_type_boolean && result != xpath_type_number && result != xpath_type_string) return false;
 
-	    	return n;
-	    }
+		for (size_t i = 0; i < argument_count; ++i)
+			if (arguments[i] == xpath_type_none || arguments[i] > xpath_type_boolean) return false;
 
-	    // RelationalExpr ::= AdditiveExpr
-	    //					  | RelationalExpr '<' AdditiveExpr
-	    //					  | RelationalExpr '>' AdditiveExpr
-	    //					  | RelationalExpr '<=' AdditiveExpr
-	    //					  | RelationalExpr '>=' AdditiveExpr
-	    xpath_ast_node* parse_relational_expression()
-	    {
-	    	xpath_ast_node* n = parse_additive_expression();
+		xpath_function_entry* entry = xpath_function_entry::find(this, name, name + strlength(name), argument_count);
 
-	    	while (_lexer.current() == lex_less || _lexer.current() == lex_less_or_equal || 
-	    		   _lexer.current() == lex_greater || _lexer.current() == lex_greater_or_equal)
-	    	{
-	    		lexeme_t l = _lexer.current();
-	    		_lexer.next();
+		if (entry)
+		{
+			// compiled queries refer to the entry, so only the callback can change
+			if (entry->result != result || (argument_count && memcmp(entry->arguments, arguments, argument_count * sizeof(xpath_value_type)) != 0)) return false;
+		}
+		else
+		{
+			entry = xpath_function_entry::create(name, result, arguments, argument_count);
+			if (!entry) return false;
 
-				xpath_ast_node* expr = parse_additive_expression();
+			xpath_function_entry::insert(this, entry);
+		}
 
-	    		n = new (alloc_node()) xpath_ast_node(l == lex_less ? ast_op_less : l == lex_greater ? ast_op_greater :
-	    						l == lex_less_or_equal ? ast_op_less_or_equal : ast_op_greater_or_equal, xpath_type_boolean, n, expr);
-	    	}
+		entry->callback = callback;
+		entry->data = data;
 
-	    	return n;
-	    }
-	    
-	    // EqualityExpr ::= RelationalExpr
-	    //					| EqualityExpr '=' RelationalExpr
-	    //					| EqualityExpr '!=' RelationalExpr
-	    xpath_ast_node* parse_equality_expression()
-	    {
-	    	xpath_ast_node* n = parse_relational_expression();
+		return true;
+	}
 
-	    	while (_lexer.current() == lex_equal || _lexer.current() == lex_not_equal)
-	    	{
-	    		lexeme_t l = _lexer.current();
+	bool xpath_function_set::contains(const char_t* name, size_t argument_count) const
+	{
+		return xpath_function_entry::find(this, name, name + strlength(name), argument_count) != 0;
+	}
 
-	    		_lexer.next();
+	xpath_limits::xpath_limits(): memory(0), visits(0), cancel(0)
+	{
+	}
 
-				xpath_ast_node* expr = parse_relational_expression();
+	xpath_eval_context::xpath_eval_context(size_t limit): _blocks(0), _retained(0), _limit(limit), _memory(0), _visits(0), _status(xpath_eval_ok)
+	{
+	}
 
-	    		n = new (alloc_node()) xpath_ast_node(l == lex_equal ? ast_op_equal : ast_op_not_equal, xpath_type_boolean, n, expr);
-	    	}
+	xpath_eval_context::~xpath_eval_context()
+	{
+		release();
+	}
 
-	    	return n;
-	    }
-	    
-	    // AndExpr ::= EqualityExpr | AndExpr 'and' EqualityExpr
-	    xpath_ast_node* parse_and_expression()
-	    {
-	    	xpath_ast_node* n = parse_equality_expression();
+	size_t xpath_eval_context::retained() const
+	{
+		return _retained;
+	}
 
-	    	while (_lexer.current() == lex_string && _lexer.contents() == PUGIHTML_TEXT("and"))
-	    	{
-	    		_lexer.next();
+	size_t xpath_eval_context::limit() const
+	{
+		return _limit;
+	}
 
-				xpath_ast_node* expr = parse_equality_expression();
+	void xpath_eval_context::set_limit(size_t limit)
+	{
+		_limit = limit;
 
-	    		n = new (alloc_node()) xpath_ast_node(ast_op_and, xpath_type_boolean, n, expr);
-	    	}
+		xpath_block_cache::trim(this, limit);
+	}
 
-	    	return n;
-	    }
+	void xpath_eval_context::release()
+	{
+		xpath_block_cache::trim(this, 0);
+	}
 
-	    // OrExpr ::= AndExpr | OrExpr 'or' AndExpr
-	    xpath_ast_node* parse_or_expression()
-	    {
-	    	xpath_ast_node* n = parse_and_expression();
+	const xpath_limits& xpath_eval_context::limits() const
+	{
+		return _limits;
+	}
 
-	    	while (_lexer.current() == lex_string && _lexer.contents() == PUGIHTML_TEXT("or"))
-	    	{
-	    		_lexer.next();
+	void xpath_eval_context::set_limits(const xpath_limits& limits)
+	{
+		_limits = limits;
+	}
 
-				xpath_ast_node* expr = parse_and_expression();
+	xpath_eval_status xpath_eval_context::status() const
+	{
+		return _status;
+	}
 
-	    		n = new (alloc_node()) xpath_ast_node(ast_op_or, xpath_type_boolean, n, expr);
-	    	}
+	xpath_query::xpath_query(const char_t* query, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options): _impl(0)
+	{
+		xpath_query_impl* impl = xpath_query_impl::create();
 
-	    	return n;
-	    }
-		
-		// Expr ::= OrExpr
-		xpath_ast_node* parse_expression()
+		if (!impl)
 		{
-			return parse_or_expression();
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			_result.error = "Out of memory";
+        #else
+			throw std::bad_alloc();
+		#endif
 		}
-
-		xpath_parser(const char_t* query, xpath_variable_set* variables, xpath_allocator* alloc, xpath_parse_result* result): _alloc(alloc), _lexer(query), _query(query), _variables(variables), _result(result)
+		else
 		{
-		}
+			buffer_holder impl_holder(impl, xpath_query_impl::destroy);
 
-		xpath_ast_node* parse()
-		{
-			xpath_ast_node* result = parse_expression();
-			
-			if (_lexer.current() != lex_eof)
+			impl->root = xpath_parser::parse(query, variables, functions, options, &impl->alloc, &_result);
+
+			if (impl->root)
 			{
-				// there are still unparsed tokens left, error
-				throw_error("Incorrect query");
+				impl->program = xpath_compiler::compile(impl->root, &impl->alloc);
+				impl->memo = impl->root->repeats_context_value();
+
+                _impl = static_cast<xpath_query_impl*>(impl_holder.release());
+				_result.error = 0;
 			}
-			
-			return result;
 		}
+	}
 
-		static xpath_ast_node* parse(const char_t* query, xpath_variable_set* variables, xpath_allocator* alloc, xpath_parse_result* result)
-		{
-			xpath_parser parser(query, variables, alloc, result);
+	xpath_query::xpath_query(): _impl(0)
+	{
+	}
 
-		#ifdef PUGIHTML_NO_EXCEPTIONS
-			int error = setjmp(parser._error_handler);
+	xpath_query::~xpath_query()
+	{
+		xpath_query_impl::destroy(_impl);
+	}
 
-			return (error == 0) ? parser.parse() : 0;
+	size_t xpath_query::save(void* buffer, size_t capacity) const
+	{
+		if (!_impl) return 0;
+
+		return xpath_image::save(static_cast<xpath_query_impl*>(_impl), buffer, capacity);
+	}
+
+	bool xpath_query::load(const void* data, size_t size, xpath_variable_set* variables, const xpath_function_set* functions)
+	{
+		xpath_query_impl::destroy(_impl);
+
+		_impl = 0;
+		_result = xpath_parse_result();
+
+		xpath_query_impl* impl = xpath_query_impl::create();
+
+		if (!impl)
+		{
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			_result.error = "Out of memory";
+			return false;
 		#else
-			return parser.parse();
+			throw std::bad_alloc();
 		#endif
 		}
-	};
 
-    struct xpath_query_impl
-    {
-		static xpath_query_impl* create()
-		{
-			void* memory = global_allocate(sizeof(xpath_query_impl));
+		buffer_holder impl_holder(impl, xpath_query_impl::destroy);
 
-            return new (memory) xpath_query_impl();
-		}
+		const char* error = xpath_image::load(impl, data, size, variables, functions);
 
-		static void destroy(void* ptr)
+		if (error)
 		{
-			if (!ptr) return;
-			
-			// free all allocated pages
-			static_cast<xpath_query_impl*>(ptr)->alloc.release();
+		#ifndef PUGIHTML_NO_EXCEPTIONS
+			if (error == xpath_image_oom) throw std::bad_alloc();
+		#endif
 
-			// free allocator memory (with the first page)
-			global_deallocate(ptr);
+			_result.error = error;
+			return false;
 		}
 
-        xpath_query_impl(): root(0), alloc(&block)
-        {
-            block.next = 0;
-        }
+		_impl = static_cast<xpath_query_impl*>(impl_holder.release());
+		_result.error = 0;
 
-        xpath_ast_node* root;
-        xpath_allocator alloc;
-        xpath_memory_block block;
-    };
+		return true;
+	}
 
-	xpath_string evaluate_string_impl(xpath_query_impl* impl, const xpath_node& n, xpath_stack_data& sd)
+	xpath_value_type xpath_query::return_type() const
 	{
-		if (!impl) return xpath_string();
+		if (!_impl) return xpath_type_none;
 
-	#ifdef PUGIHTML_NO_EXCEPTIONS
-		if (setjmp(sd.error_handler)) return xpath_string();
-	#endif
+		return static_cast<xpath_query_impl*>(_impl)->root->rettype();
+	}
 
-		xpath_context c(n, 1, 1);
+	bool xpath_query::evaluate_boolean(const xpath_node& n) const
+	{
+		return evaluate_boolean_impl(static_cast<xpath_query_impl*>(_impl), n, 0);
+	}
+	
+	double xpath_query::evaluate_number(const xpath_node& n) const
+	{
+		return evaluate_number_impl(static_cast<xpath_query_impl*>(_impl), n, 0);
+	}
+
+#ifndef PUGIHTML_NO_STL
+	string_t xpath_query::evaluate_string(const xpath_node& n) const
+	{
+		xpath_stack_data sd;
 
-		return impl->root->eval_string(c, sd.stack);
+		return evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd).c_str();
 	}
-}
+#endif
 
-namespace pugihtml
-{
-#ifndef PUGIHTML_NO_EXCEPTIONS
-	xpath_exception::xpath_exception(const xpath_parse_result& result): _result(result)
+	size_t xpath_query::evaluate_string(char_t* buffer, size_t capacity, const xpath_node& n) const
 	{
-		assert(result.error);
+		xpath_stack_data sd;
+
+		return copy_string(evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd), buffer, capacity);
 	}
-	
-	const char* xpath_exception::what() const throw()
+
+	xpath_node_set xpath_query::evaluate_node_set(const xpath_node& n) const
 	{
-		return _result.error;
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return xpath_node_set();
+		
+		return evaluate_node_set_impl(static_cast<xpath_query_impl*>(_impl), n);
 	}
 
-	const xpath_parse_result& xpath_exception::result() const
+	xpath_node xpath_query::evaluate_node(const xpath_node& n) const
 	{
-		return _result;
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return xpath_node();
+		
+		return evaluate_node_impl(static_cast<xpath_query_impl*>(_impl), n);
+	}
+
+	bool xpath_query::evaluate_boolean(const xpath_node& n, xpath_eval_context& context) const
+	{
+		return evaluate_boolean_impl(static_cast<xpath_query_impl*>(_impl), n, &context);
+	}
+
+	double xpath_query::evaluate_number(const xpath_node& n, xpath_eval_context& context) const
+	{
+		return evaluate_number_impl(static_cast<xpath_query_impl*>(_impl), n, &context);
+	}
+
+#ifndef PUGIHTML_NO_STL
+	string_t xpath_query::evaluate_string(const xpath_node& n, xpath_eval_context& context) const
+	{
+		xpath_stack_data sd(&context);
+
+		return evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd).c_str();
 	}
 #endif
-	
-	xpath_node::xpath_node()
+
+	size_t xpath_query::evaluate_string(char_t* buffer, size_t capacity, const xpath_node& n, xpath_eval_context& context) const
+	{
+		xpath_stack_data sd(&context);
+
+		return copy_string(evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd), buffer, capacity);
+	}
+
+	xpath_node_set xpath_query::evaluate_node_set(const xpath_node& n, xpath_eval_context& context) const
+	{
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return xpath_node_set();
+		
+		return evaluate_node_set_impl(static_cast<xpath_query_impl*>(_impl), n, &context);
+	}
+
+	xpath_node xpath_query::evaluate_node(const xpath_node& n, xpath_eval_context& context) const
+	{
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return xpath_node();
+		
+		return evaluate_node_impl(static_cast<xpath_query_impl*>(_impl), n, &context);
+	}
+
+	xpath_node_set xpath_query::evaluate_node_set_parallel(const xpath_node& n, unsigned int thread_count) const
+	{
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return xpath_node_set();
+
+	#ifdef PUGIHTML_XPATH_THREADS
+		return evaluate_node_set_parallel_impl(static_cast<xpath_query_impl*>(_impl), n, thread_count);
+	#else
+		(void)thread_count;
+
+		return evaluate_node_set_impl(static_cast<xpath_query_impl*>(_impl), n);
+	#endif
+	}
+
+	bool xpath_query::for_each_node(const xpath_node& n, xpath_node_visitor& visitor) const
+	{
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return false;
+
+		return for_each_node_impl(static_cast<xpath_query_impl*>(_impl), n, visitor);
+	}
+
+	bool xpath_query::for_each_node(const xpath_node& n, xpath_node_visitor& visitor, xpath_eval_context& context) const
 	{
+		if (!is_node_set_query(static_cast<xpath_query_impl*>(_impl))) return false;
+
+		return for_each_node_impl(static_cast<xpath_query_impl*>(_impl), n, visitor, &context);
 	}
-		
-	xpath_node::xpath_node(const html_node& node): _node(node)
+
+	void xpath_query::explain(html_writer& writer, html_encoding encoding) const
 	{
+		if (!_impl) return;
+
+		html_buffered_writer buffered_writer(writer, encoding);
+
+		static_cast<xpath_query_impl*>(_impl)->root->explain(buffered_writer, 0);
 	}
-		
-	xpath_node::xpath_node(const html_attribute& attribute, const html_node& parent): _node(attribute ? parent : html_node()), _attribute(attribute)
+
+#ifndef PUGIHTML_NO_STL
+	void xpath_query::explain(std::basic_ostream<char, std::char_traits<char> >& stream, html_encoding encoding) const
 	{
+		html_writer_stream writer(stream);
+
+		explain(writer, encoding);
 	}
 
-	html_node xpath_node::node() const
+	void xpath_query::explain(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& stream) const
 	{
-		return _attribute ? html_node() : _node;
+		html_writer_stream writer(stream);
+
+		explain(writer, encoding_wchar);
 	}
-		
-	html_attribute xpath_node::attribute() const
+#endif
+
+	const xpath_parse_result& xpath_query::result() const
 	{
-		return _attribute;
+		return _result;
 	}
-	
-	html_node xpath_node::parent() const
+
+	xpath_query::operator xpath_query::unspecified_bool_type() const
 	{
-		return _attribute ? _node : _node.parent();
+		return _impl ? &xpath_query::_impl : 0;
 	}
 
-	xpath_node::operator xpath_node::unspecified_bool_type() const
+	bool xpath_query::operator!() const
 	{
-		return (_node || _attribute) ? &xpath_node::_node : 0;
+		return !_impl;
 	}
-	
-	bool xpath_node::operator!() const
+
+	void PUGIHTML_FUNCTION set_xpath_query_cache_capacity(size_t capacity)
 	{
-		return !(_node || _attribute);
+		xpath_query_cache_entry* evicted;
+
+		{
+			spin_lock_guard guard(&query_cache.lock);
+
+			query_cache.capacity = capacity;
+
+			evicted = query_cache_evict(0, true);
+		}
+
+		query_cache_destroy_list(evicted);
 	}
 
-	bool xpath_node::operator==(const xpath_node& n) const
+	xpath_query_cache_statistics PUGIHTML_FUNCTION get_xpath_query_cache_statistics()
 	{
-		return _node == n._node && _attribute == n._attribute;
+		spin_lock_guard guard(&query_cache.lock);
+
+		xpath_query_cache_statistics result;
+
+		result.hits = query_cache.hits;
+		result.misses = query_cache.misses;
+		result.size = query_cache.size;
+		result.capacity = query_cache.capacity;
+
+		return result;
 	}
-	
-	bool xpath_node::operator!=(const xpath_node& n) const
+
+	void PUGIHTML_FUNCTION clear_xpath_query_cache()
 	{
-		return _node != n._node || _attribute != n._attribute;
+		query_cache_purge(0);
+
+		spin_lock_guard guard(&query_cache.lock);
+
+		query_cache.hits = query_cache.misses = 0;
 	}
 
-#ifdef __BORLANDC__
-	bool operator&&(const xpath_node& lhs, bool rhs)
+	xpath_query_set::xpath_query_set(): _impl(0)
 	{
-		return (bool)lhs && rhs;
 	}
 
-	bool operator||(const xpath_node& lhs, bool rhs)
+	xpath_query_set::~xpath_query_set()
 	{
-		return (bool)lhs || rhs;
+		xpath_query_set_impl::destroy(_impl);
 	}
-#endif
 
-	void xpath_node_set::_assign(const_iterator begin, const_iterator end)
+	bool xpath_query_set::add(const char_t* query, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options)
 	{
-		assert(begin <= end);
+		if (!_impl) _impl = xpath_query_set_impl::create();
 
-		size_t size = static_cast<size_t>(end - begin);
+		xpath_query_set_impl* set = static_cast<xpath_query_set_impl*>(_impl);
+		xpath_query_impl* impl = set && set->reserve() ? xpath_query_impl::create() : 0;
 
-		if (size <= 1)
+		if (!impl)
 		{
-			// deallocate old buffer
-			if (_begin != &_storage) global_deallocate(_begin);
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			_result = xpath_parse_result();
+			_result.error = "Out of memory";
+			return false;
+        #else
+			throw std::bad_alloc();
+		#endif
+		}
 
-			// use internal buffer
-			if (begin != end) _storage = *begin;
+		buffer_holder impl_holder(impl, xpath_query_impl::destroy);
 
-			_begin = &_storage;
-			_end = &_storage + size;
-		}
-		else
+		impl->root = xpath_parser::parse(query, variables, functions, options, &impl->alloc, &_result);
+
+		if (!impl->root) return false;
+
+		if (impl->root->rettype() != xpath_type_node_set)
 		{
-			// make heap copy
-			xpath_node* storage = static_cast<xpath_node*>(global_allocate(size * sizeof(xpath_node)));
+			_result.error = "Expression does not evaluate to node set";
+			_result.offset = 0;
 
-			if (!storage)
-			{
-			#ifdef PUGIHTML_NO_EXCEPTIONS
-				return;
-			#else
-				throw std::bad_alloc();
-			#endif
-			}
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			return false;
+		#else
+			throw xpath_exception(_result);
+		#endif
+		}
 
-			memcpy(storage, begin, size * sizeof(xpath_node));
-			
-			// deallocate old buffer
-			if (_begin != &_storage) global_deallocate(_begin);
+		_result.error = 0;
 
-			// finalize
-			_begin = storage;
-			_end = storage + size;
+		xpath_query_set_entry& entry = set->entries[set->size];
+
+		entry.query = static_cast<xpath_query_impl*>(impl_holder.release());
+		entry.shared = entry.query->root->forward_path(entry.steps, entry.axes, xpath_query_set_max_steps, entry.step_count, entry.absolute);
+
+		if (entry.shared)
+		{
+			set->shared++;
+			if (entry.absolute) set->absolute = true;
 		}
-	}
 
-	xpath_node_set::xpath_node_set(): _type(type_unsorted), _begin(&_storage), _end(&_storage)
-	{
+		entry.streamable = entry.shared && entry.step_count > 0;
+
+		for (size_t i = 0; entry.streamable && i < entry.step_count; ++i)
+			entry.streamable = entry.steps[i]->is_streamable_step(entry.axes[i], i == 0, i + 1 == entry.step_count);
+
+		if (entry.streamable) set->streamable++;
+
+		set->size++;
+
+		return true;
 	}
 
-	xpath_node_set::xpath_node_set(const_iterator begin, const_iterator end, type_t type): _type(type), _begin(&_storage), _end(&_storage)
+	size_t xpath_query_set::size() const
 	{
-		_assign(begin, end);
+		return _impl ? static_cast<xpath_query_set_impl*>(_impl)->size : 0;
 	}
 
-	xpath_node_set::~xpath_node_set()
+	bool xpath_query_set::shared(size_t index) const
 	{
-		if (_begin != &_storage) global_deallocate(_begin);
+		return index < size() && static_cast<xpath_query_set_impl*>(_impl)->entries[index].shared;
 	}
-		
-	xpath_node_set::xpath_node_set(const xpath_node_set& ns): _type(ns._type), _begin(&_storage), _end(&_storage)
+
+	bool xpath_query_set::streamable(size_t index) const
 	{
-		_assign(ns._begin, ns._end);
+		return index < size() && static_cast<xpath_query_set_impl*>(_impl)->entries[index].streamable;
 	}
-	
-	xpath_node_set& xpath_node_set::operator=(const xpath_node_set& ns)
+
+	void xpath_query_set::evaluate_node_sets(const xpath_node& n, xpath_node_set* results) const
 	{
-		if (this == &ns) return *this;
-		
-		_type = ns._type;
-		_assign(ns._begin, ns._end);
+		xpath_query_set_impl* set = static_cast<xpath_query_set_impl*>(_impl);
+		if (!set) return;
 
-		return *this;
+		// paths are matched from an element (or document) context only
+		html_node_struct* context = n.node().internal_object();
+
+		for (size_t i = 0; i < set->size; ++i)
+			if (!context || !set->entries[i].shared)
+				results[i] = evaluate_node_set_impl(set->entries[i].query, n);
+
+		if (!context || set->shared == 0) return;
+
+		update_document_order(context);
+
+		xpath_stack_data sd;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler))
+		{
+			for (size_t i = 0; i < set->size; ++i)
+				if (set->entries[i].shared) results[i] = xpath_node_set();
+
+			return;
+		}
+	#endif
+
+		xpath_query_set_array<xpath_query_set_match> matches;
+
+		xpath_query_set_matcher matcher(set, context, matches, sd.stack);
+		matcher.run();
+
+		// group matches by query, preserving document order
+		size_t* offsets = static_cast<size_t*>(sd.temp.allocate((set->size + 1) * sizeof(size_t)));
+
+		for (size_t i = 0; i <= set->size; ++i) offsets[i] = 0;
+
+		for (const xpath_query_set_match* it = matches.begin(); it != matches.end(); ++it) offsets[it->query + 1]++;
+
+		for (size_t i = 0; i < set->size; ++i) offsets[i + 1] += offsets[i];
+
+		xpath_node* nodes = static_cast<xpath_node*>(sd.temp.allocate((offsets[set->size] + 1) * sizeof(xpath_node)));
+
+		for (const xpath_query_set_match* it = matches.begin(); it != matches.end(); ++it) nodes[offsets[it->query]++] = it->node;
+
+		// offsets now point to the end of each group
+		for (size_t i = 0; i < set->size; ++i)
+			if (set->entries[i].shared)
+			{
+				xpath_node* begin = nodes + (i == 0 ? 0 : offsets[i - 1]);
+
+				results[i] = xpath_node_set(begin, nodes + offsets[i], xpath_node_set::type_sorted);
+			}
 	}
 
-	xpath_node_set::type_t xpath_node_set::type() const
+	const xpath_parse_result& xpath_query_set::result() const
 	{
-		return _type;
+		return _result;
 	}
-		
-	size_t xpath_node_set::size() const
+
+	xpath_table_result::xpath_table_result(): _impl(0)
 	{
-		return _end - _begin;
 	}
-		
-	bool xpath_node_set::empty() const
+
+	xpath_table_result::~xpath_table_result()
 	{
-		return _begin == _end;
+		xpath_table_result_impl::destroy(_impl);
 	}
-		
-	const xpath_node& xpath_node_set::operator[](size_t index) const
+
+	size_t xpath_table_result::rows() const
 	{
-		assert(index < size());
-		return _begin[index];
+		return _impl ? static_cast<xpath_table_result_impl*>(_impl)->rows : 0;
 	}
 
-	xpath_node_set::const_iterator xpath_node_set::begin() const
+	size_t xpath_table_result::columns() const
 	{
-		return _begin;
+		return _impl ? static_cast<xpath_table_result_impl*>(_impl)->columns : 0;
 	}
-		
-	xpath_node_set::const_iterator xpath_node_set::end() const
+
+	xpath_node xpath_table_result::row(size_t index) const
 	{
-		return _end;
+		return index < rows() ? static_cast<xpath_table_result_impl*>(_impl)->nodes[index] : xpath_node();
 	}
-	
-	void xpath_node_set::sort(bool reverse)
+
+	xpath_value_type xpath_table_result::type(size_t column) const
 	{
-		_type = xpath_sort(_begin, _end, _type, reverse);
+		return column < columns() ? static_cast<xpath_table_result_impl*>(_impl)->types[column] : xpath_type_none;
 	}
 
-	xpath_node xpath_node_set::first() const
+	const char_t* xpath_table_result::string(size_t row, size_t column) const
 	{
-		return xpath_first(_begin, _end, _type);
-	}
+		if (row >= rows() || type(column) != xpath_type_string) return PUGIHTML_TEXT("");
 
-    xpath_parse_result::xpath_parse_result(): error("Internal error"), offset(0)
-    {
-    }
+		xpath_table_result_impl* impl = static_cast<xpath_table_result_impl*>(_impl);
 
-    xpath_parse_result::operator bool() const
-    {
-        return error == 0;
-    }
-	const char* xpath_parse_result::description() const
+		return impl->strings + impl->offsets[impl->slots[column] * (impl->rows + 1) + row];
+	}
+
+	size_t xpath_table_result::length(size_t row, size_t column) const
 	{
-		return error ? error : "No error";
+		if (row >= rows() || type(column) != xpath_type_string) return 0;
+
+		xpath_table_result_impl* impl = static_cast<xpath_table_result_impl*>(_impl);
+		const size_t* offsets = impl->offsets + impl->slots[column] * (impl->rows + 1);
+
+		// strings are followed by terminating zeros
+		return offsets[row + 1] - offsets[row] - 1;
 	}
 
-	xpath_variable::xpath_variable()
-    {
-    }
+	double xpath_table_result::number(size_t row, size_t column) const
+	{
+		const double* values = numbers(column);
 
-	const char_t* xpath_variable::name() const
+		if (row >= rows()) return gen_nan();
+
+		return values ? values[row] : (type(column) == xpath_type_string ? convert_string_to_number(string(row, column)) : gen_nan());
+	}
+
+	bool xpath_table_result::boolean(size_t row, size_t column) const
 	{
-		switch (_type)
-		{
-		case xpath_type_node_set:
-			return static_cast<const xpath_variable_node_set*>(this)->name;
+		const double* values = numbers(column);
 
-		case xpath_type_number:
-			return static_cast<const xpath_variable_number*>(this)->name;
+		if (row >= rows()) return false;
 
-		case xpath_type_string:
-			return static_cast<const xpath_variable_string*>(this)->name;
+		// booleans are stored as 1 and 0
+		return values ? convert_number_to_boolean(values[row]) : *string(row, column) != 0;
+	}
 
-		case xpath_type_boolean:
-			return static_cast<const xpath_variable_boolean*>(this)->name;
+	const double* xpath_table_result::numbers(size_t column) const
+	{
+		xpath_value_type t = type(column);
+		if (t != xpath_type_number && t != xpath_type_boolean) return 0;
 
-		default:
-			assert(!"Invalid variable type");
-			return 0;
-		}
+		xpath_table_result_impl* impl = static_cast<xpath_table_result_impl*>(_impl);
+
+		return impl->numbers + impl->slots[column] * impl->rows;
 	}
 
-	xpath_value_type xpath_variable::type() const
+	void xpath_table_result::clear()
 	{
-		return _type;
+		if (_impl) static_cast<xpath_table_result_impl*>(_impl)->rows = static_cast<xpath_table_result_impl*>(_impl)->columns = 0;
 	}
 
-	bool xpath_variable::get_boolean() const
+	xpath_table::xpath_table(): _impl(0)
 	{
-		return (_type == xpath_type_boolean) ? static_cast<const xpath_variable_boolean*>(this)->value : false;
 	}
 
-	double xpath_variable::get_number() const
+	xpath_table::~xpath_table()
 	{
-		return (_type == xpath_type_number) ? static_cast<const xpath_variable_number*>(this)->value : gen_nan();
+		xpath_table_impl::destroy(_impl);
 	}
 
-	const char_t* xpath_variable::get_string() const
-	{
-		const char_t* value = (_type == xpath_type_string) ? static_cast<const xpath_variable_string*>(this)->value : 0;
-		return value ? value : PUGIHTML_TEXT("");
-	}
+	bool xpath_table::set_rows(const char_t* query, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options)
+	{
+		if (!_impl) _impl = xpath_table_impl::create();
+
+		xpath_table_impl* table = static_cast<xpath_table_impl*>(_impl);
+		xpath_query_impl* impl = table ? xpath_query_impl::create() : 0;
+
+		if (!impl)
+		{
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			_result = xpath_parse_result();
+			_result.error = "Out of memory";
+			return false;
+        #else
+			throw std::bad_alloc();
+		#endif
+		}
+
+		buffer_holder impl_holder(impl, xpath_query_impl::destroy);
+
+		impl->root = xpath_parser::parse(query, variables, functions, options, &impl->alloc, &_result);
+
+		if (!impl->root) return false;
+
+		if (impl->root->rettype() != xpath_type_node_set)
+		{
+			_result.error = "Expression does not evaluate to node set";
+			_result.offset = 0;
+
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			return false;
+		#else
+			throw xpath_exception(_result);
+		#endif
+		}
+
+		impl->program = xpath_compiler::compile(impl->root, &impl->alloc);
+		impl->memo = impl->root->repeats_context_value();
 
-	const xpath_node_set& xpath_variable::get_node_set() const
-	{
-		return (_type == xpath_type_node_set) ? static_cast<const xpath_variable_node_set*>(this)->value : dummy_node_set;
-	}
+		_result.error = 0;
 
-	bool xpath_variable::set(bool value)
-	{
-		if (_type != xpath_type_boolean) return false;
+		xpath_query_impl::destroy(table->rows);
+		table->rows = static_cast<xpath_query_impl*>(impl_holder.release());
 
-		static_cast<xpath_variable_boolean*>(this)->value = value;
 		return true;
 	}
 
-	bool xpath_variable::set(double value)
+	bool xpath_table::add_column(const char_t* query, xpath_value_type type, xpath_variable_set* variables, const xpath_function_set* functions, unsigned int options)
 	{
-		if (_type != xpath_type_number) return false;
+		if (type != xpath_type_string && type != xpath_type_number && type != xpath_type_boolean)
+		{
+			_result = xpath_parse_result();
+			_result.error = "Column type has to be string, number or boolean";
 
-		static_cast<xpath_variable_number*>(this)->value = value;
-		return true;
-	}
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			return false;
+		#else
+			throw xpath_exception(_result);
+		#endif
+		}
 
-	bool xpath_variable::set(const char_t* value)
-	{
-		if (_type != xpath_type_string) return false;
+		if (!_impl) _impl = xpath_table_impl::create();
 
-		xpath_variable_string* var = static_cast<xpath_variable_string*>(this);
+		xpath_table_impl* table = static_cast<xpath_table_impl*>(_impl);
+		xpath_query_impl* impl = table && table->reserve() ? xpath_query_impl::create() : 0;
 
-		// duplicate string
-		size_t size = (strlength(value) + 1) * sizeof(char_t);
+		if (!impl)
+		{
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			_result = xpath_parse_result();
+			_result.error = "Out of memory";
+			return false;
+        #else
+			throw std::bad_alloc();
+		#endif
+		}
 
-		char_t* copy = static_cast<char_t*>(global_allocate(size));
-		if (!copy) return false;
+		buffer_holder impl_holder(impl, xpath_query_impl::destroy);
 
-		memcpy(copy, value, size);
+		impl->root = xpath_parser::parse(query, variables, functions, options, &impl->alloc, &_result);
 
-		// replace old string
-		if (var->value) global_deallocate(var->value);
-		var->value = copy;
+		if (!impl->root) return false;
 
-		return true;
-	}
+		// the query is evaluated for every row, so context-independent subexpressions are evaluated once per table, like those of predicates
+		impl->root->hoist(&impl->alloc);
 
-	bool xpath_variable::set(const xpath_node_set& value)
-	{
-		if (_type != xpath_type_node_set) return false;
+		impl->program = xpath_compiler::compile(impl->root, &impl->alloc);
+		impl->memo = impl->root->repeats_context_value();
+
+		_result.error = 0;
+
+		xpath_table_column& column = table->columns[table->size++];
+
+		column.query = static_cast<xpath_query_impl*>(impl_holder.release());
+		column.type = type;
+		column.slot = type == xpath_type_string ? table->strings++ : table->numbers++;
 
-		static_cast<xpath_variable_node_set*>(this)->value = value;
 		return true;
 	}
 
-	xpath_variable_set::xpath_variable_set()
+	size_t xpath_table::columns() const
 	{
-		for (size_t i = 0; i < sizeof(_data) / sizeof(_data[0]); ++i) _data[i] = 0;
+		return _impl ? static_cast<xpath_table_impl*>(_impl)->size : 0;
 	}
 
-	xpath_variable_set::~xpath_variable_set()
+	bool xpath_table::evaluate(const xpath_node& n, xpath_table_result& result) const
 	{
-		for (size_t i = 0; i < sizeof(_data) / sizeof(_data[0]); ++i)
-		{
-			xpath_variable* var = _data[i];
-
-			while (var)
-			{
-				xpath_variable* next = var->_next;
-
-				delete_xpath_variable(var->_type, var);
-
-				var = next;
-			}
-		}
+		return evaluate_parallel(n, result, 1);
 	}
 
-	xpath_variable* xpath_variable_set::find(const char_t* name) const
+	bool xpath_table::evaluate(const xpath_node& n, xpath_table_result& result, xpath_eval_context& context) const
 	{
-		const size_t hash_size = sizeof(_data) / sizeof(_data[0]);
-		size_t hash = hash_string(name) % hash_size;
+		result.clear();
 
-		// look for existing variable
-		for (xpath_variable* var = _data[hash]; var; var = var->_next)
-			if (strequal(var->name(), name))
-				return var;
+		if (!result._impl) result._impl = xpath_table_result_impl::create();
 
-		return 0;
+		if (!result._impl)
+		{
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			return false;
+		#else
+			throw std::bad_alloc();
+		#endif
+		}
+
+		return evaluate_table_impl(static_cast<xpath_table_impl*>(_impl), static_cast<xpath_table_result_impl*>(result._impl), n, &context, 1);
 	}
 
-	xpath_variable* xpath_variable_set::add(const char_t* name, xpath_value_type type)
+	bool xpath_table::evaluate_parallel(const xpath_node& n, xpath_table_result& result, unsigned int thread_count) const
 	{
-		const size_t hash_size = sizeof(_data) / sizeof(_data[0]);
-		size_t hash = hash_string(name) % hash_size;
-
-		// look for existing variable
-		for (xpath_variable* var = _data[hash]; var; var = var->_next)
-			if (strequal(var->name(), name))
-				return var->type() == type ? var : 0;
+		result.clear();
 
-		// add new variable
-		xpath_variable* result = new_xpath_variable(type, name);
+		if (!result._impl) result._impl = xpath_table_result_impl::create();
 
-		if (result)
+		if (!result._impl)
 		{
-			result->_type = type;
-			result->_next = _data[hash];
-
-			_data[hash] = result;
+		#ifdef PUGIHTML_NO_EXCEPTIONS
+			return false;
+		#else
+			throw std::bad_alloc();
+		#endif
 		}
 
-		return result;
-	}
+		xpath_table_impl* table = static_cast<xpath_table_impl*>(_impl);
+		xpath_table_result_impl* impl = static_cast<xpath_table_result_impl*>(result._impl);
 
-	bool xpath_variable_set::set(const char_t* name, bool value)
-	{
-		xpath_variable* var = add(name, xpath_type_boolean);
-		return var ? var->set(value) : false;
+		// the error is reported by evaluating the table again on this thread
+		return evaluate_table_impl(table, impl, n, 0, thread_count) || (thread_count > 1 && evaluate_table_impl(table, impl, n, 0, 1));
 	}
 
-	bool xpath_variable_set::set(const char_t* name, double value)
+	const xpath_parse_result& xpath_table::result() const
 	{
-		xpath_variable* var = add(name, xpath_type_number);
-		return var ? var->set(value) : false;
+		return _result;
 	}
 
-	bool xpath_variable_set::set(const char_t* name, const char_t* value)
+	xpath_stream_handler::~xpath_stream_handler()
 	{
-		xpath_variable* var = add(name, xpath_type_string);
-		return var ? var->set(value) : false;
 	}
 
-	bool xpath_variable_set::set(const char_t* name, const xpath_node_set& value)
+	xpath_node_visitor::~xpath_node_visitor()
 	{
-		xpath_variable* var = add(name, xpath_type_node_set);
-		return var ? var->set(value) : false;
 	}
 
-	xpath_variable* xpath_variable_set::get(const char_t* name)
+	html_parse_result html_document::load_buffer_stream(const void* contents, size_t size, const xpath_query_set& queries, xpath_stream_handler& handler, unsigned int options, html_encoding encoding)
 	{
-		return find(name);
-	}
+		const xpath_query_set_impl* set = static_cast<const xpath_query_set_impl*>(queries._impl);
 
-	const xpath_variable* xpath_variable_set::get(const char_t* name) const
-	{
-		return find(name);
+		if (!set) return load_buffer(contents, size, options, encoding);
+
+		bool drop = (options & parse_stream_drop) != 0;
+
+		// dropped nodes are not available to queries evaluated after parsing
+		if (drop && set->streamable < set->size)
+		{
+			reset();
+
+			return make_parse_result(status_unsupported_query);
+		}
+
+		xpath_stream_matcher matcher(set, &handler, drop);
+
+		html_parse_result result = load_buffer_impl(const_cast<void*>(contents), size, options, encoding, false, false, &matcher);
+
+		if (result && matcher.failed()) result.status = status_out_of_memory;
+		if (!result) return result;
+
+		// other queries see the complete document
+		for (size_t i = 0; i < set->size; ++i)
+			if (!set->entries[i].streamable)
+			{
+				xpath_node_set nodes = evaluate_node_set_impl(set->entries[i].query, xpath_node(*this));
+
+				for (xpath_node_set::const_iterator it = nodes.begin(); it != nodes.end(); ++it) handler.match(i, *it);
+			}
+
+		return result;
 	}
 
-	xpath_query::xpath_query(const char_t* query, xpath_variable_set* variables): _impl(0)
+	css_selector::css_selector(const char_t* selector): _impl(0)
 	{
-		xpath_query_impl* impl = xpath_query_impl::create();
+		css_selector_impl* impl = css_selector_impl::create();
 
 		if (!impl)
 		{
@@ -9335,146 +18931,91 @@ namespace pugihtml
 		}
 		else
 		{
-			buffer_holder impl_holder(impl, xpath_query_impl::destroy);
+			buffer_holder impl_holder(impl, css_selector_impl::destroy);
 
-			impl->root = xpath_parser::parse(query, variables, &impl->alloc, &_result);
+			impl->list = css_parser::parse(selector, &impl->alloc, &_result);
 
-			if (impl->root)
+			if (impl->list)
 			{
-                _impl = static_cast<xpath_query_impl*>(impl_holder.release());
+                _impl = static_cast<css_selector_impl*>(impl_holder.release());
 				_result.error = 0;
 			}
 		}
 	}
 
-	xpath_query::~xpath_query()
-	{
-		xpath_query_impl::destroy(_impl);
-	}
-
-	xpath_value_type xpath_query::return_type() const
-	{
-		if (!_impl) return xpath_type_none;
-
-		return static_cast<xpath_query_impl*>(_impl)->root->rettype();
-	}
-
-	bool xpath_query::evaluate_boolean(const xpath_node& n) const
-	{
-		if (!_impl) return false;
-		
-		xpath_context c(n, 1, 1);
-		xpath_stack_data sd;
-
-	#ifdef PUGIHTML_NO_EXCEPTIONS
-		if (setjmp(sd.error_handler)) return false;
-	#endif
-		
-		return static_cast<xpath_query_impl*>(_impl)->root->eval_boolean(c, sd.stack);
-	}
-	
-	double xpath_query::evaluate_number(const xpath_node& n) const
+	css_selector::~css_selector()
 	{
-		if (!_impl) return gen_nan();
-		
-		xpath_context c(n, 1, 1);
-		xpath_stack_data sd;
-
-	#ifdef PUGIHTML_NO_EXCEPTIONS
-		if (setjmp(sd.error_handler)) return gen_nan();
-	#endif
-
-		return static_cast<xpath_query_impl*>(_impl)->root->eval_number(c, sd.stack);
+		css_selector_impl::destroy(_impl);
 	}
 
-#ifndef PUGIHTML_NO_STL
-	string_t xpath_query::evaluate_string(const xpath_node& n) const
+	bool css_selector::match(const html_node& n) const
 	{
-		xpath_stack_data sd;
+		if (!_impl || !n) return false;
 
-		return evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd).c_str();
+		return css_match_list(static_cast<css_selector_impl*>(_impl)->list, n.internal_object());
 	}
-#endif
 
-	size_t xpath_query::evaluate_string(char_t* buffer, size_t capacity, const xpath_node& n) const
+	html_node css_selector::select_first(const html_node& n) const
 	{
-		xpath_stack_data sd;
-
-		xpath_string r = evaluate_string_impl(static_cast<xpath_query_impl*>(_impl), n, sd);
-
-		size_t full_size = r.length() + 1;
-		
-		if (capacity > 0)
-        {
-            size_t size = (full_size < capacity) ? full_size : capacity;
-            assert(size > 0);
+		if (!_impl || !n) return html_node();
 
-            memcpy(buffer, r.c_str(), (size - 1) * sizeof(char_t));
-            buffer[size - 1] = 0;
-        }
-		
-		return full_size;
+		return html_node(css_select(static_cast<css_selector_impl*>(_impl)->list, n.internal_object(), 0, 0));
 	}
 
-	xpath_node_set xpath_query::evaluate_node_set(const xpath_node& n) const
+	xpath_node_set css_selector::select_all(const html_node& n) const
 	{
-		if (!_impl) return xpath_node_set();
+		if (!_impl || !n) return xpath_node_set();
 
-        xpath_ast_node* root = static_cast<xpath_query_impl*>(_impl)->root;
-
-		if (root->rettype() != xpath_type_node_set)
-		{
-		#ifdef PUGIHTML_NO_EXCEPTIONS
-			return xpath_node_set();
-		#else
-			xpath_parse_result result;
-			result.error = "Expression does not evaluate to node set";
-
-			throw xpath_exception(result);
-		#endif
-		}
-		
-		xpath_context c(n, 1, 1);
 		xpath_stack_data sd;
 
 	#ifdef PUGIHTML_NO_EXCEPTIONS
 		if (setjmp(sd.error_handler)) return xpath_node_set();
 	#endif
 
-		xpath_node_set_raw r = root->eval_node_set(c, sd.stack);
+		update_document_order(n.internal_object());
+
+		xpath_node_set_raw r;
+		r.set_type(xpath_node_set::type_sorted);
+
+		css_select(static_cast<css_selector_impl*>(_impl)->list, n.internal_object(), &r, sd.stack.result);
 
 		return xpath_node_set(r.begin(), r.end(), r.type());
 	}
 
-	const xpath_parse_result& xpath_query::result() const
+	const xpath_parse_result& css_selector::result() const
 	{
 		return _result;
 	}
 
-	xpath_query::operator xpath_query::unspecified_bool_type() const
+	css_selector::operator css_selector::unspecified_bool_type() const
 	{
-		return _impl ? &xpath_query::_impl : 0;
+		return _impl ? &css_selector::_impl : 0;
 	}
 
-	bool xpath_query::operator!() const
+	bool css_selector::operator!() const
 	{
 		return !_impl;
 	}
 
 	xpath_node html_node::select_single_node(const char_t* query, xpath_variable_set* variables) const
 	{
+		xpath_query_cache_lease lease(query, variables);
+		if (lease.query()) return select_single_node(*lease.query());
+
 		xpath_query q(query, variables);
 		return select_single_node(q);
 	}
 
 	xpath_node html_node::select_single_node(const xpath_query& query) const
 	{
-		xpath_node_set s = query.evaluate_node_set(*this);
-		return s.empty() ? xpath_node() : s.first();
+		return query.evaluate_node(*this);
 	}
 
 	xpath_node_set html_node::select_nodes(const char_t* query, xpath_variable_set* variables) const
 	{
+		xpath_query_cache_lease lease(query, variables);
+		if (lease.query()) return select_nodes(*lease.query());
+
 		xpath_query q(query, variables);
 		return select_nodes(q);
 	}
@@ -9483,6 +19024,60 @@ namespace pugihtml
 	{
 		return query.evaluate_node_set(*this);
 	}
+
+	xpath_node_set html_node::elements_with_class(const char_t* name) const
+	{
+		if (!_root) return xpath_node_set();
+
+		xpath_stack_data sd;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node_set();
+	#endif
+
+		xpath_node_set_raw r;
+		r.set_type(xpath_node_set::type_sorted);
+
+		select_by_attribute(r, *this, document_class_name(get_document(_root->header)), name, true, sd.stack.result);
+
+		return xpath_node_set(r.begin(), r.end(), r.type());
+	}
+
+	xpath_node_set html_node::elements_with_attribute(const char_t* name, const char_t* value) const
+	{
+		if (!_root) return xpath_node_set();
+
+		xpath_stack_data sd;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node_set();
+	#endif
+
+		xpath_node_set_raw r;
+		r.set_type(xpath_node_set::type_sorted);
+
+		select_by_attribute(r, *this, name, value, false, sd.stack.result);
+
+		return xpath_node_set(r.begin(), r.end(), r.type());
+	}
+
+	xpath_node_set html_node::find_text_nodes(const char_t* text) const
+	{
+		if (!_root) return xpath_node_set();
+
+		xpath_stack_data sd;
+
+	#ifdef PUGIHTML_NO_EXCEPTIONS
+		if (setjmp(sd.error_handler)) return xpath_node_set();
+	#endif
+
+		xpath_node_set_raw r;
+		r.set_type(xpath_node_set::type_sorted);
+
+		select_by_text(r, *this, text, sd.stack.result);
+
+		return xpath_node_set(r.begin(), r.end(), r.type());
+	}
 }
 
 #endif
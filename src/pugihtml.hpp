@@ -70,6 +70,17 @@ namespace pugihtml
     // This flag determines if document type declaration (node_doctype) is added to the DOM tree. This flag is off by default.
 	const unsigned int parse_doctype = 0x0200;
 
+	// This flag determines if nodes are removed from the DOM tree once they are closed and no streamed query can select them or their
+	// descendants anymore (see html_document::load_buffer_stream). This flag is off by default; it keeps memory bounded by the matched subtrees.
+	const unsigned int parse_stream_drop = 0x0400;
+
+	// This flag determines if element and attribute names are converted to lower case instead of upper case during parsing. This flag is off by default.
+	const unsigned int parse_names_lower = 0x0800;
+
+	// This flag determines if element and attribute names are kept as written instead of being converted to upper case during parsing; it takes
+	// precedence over parse_names_lower. This flag is off by default. Closing tags match opening tags regardless of case in all modes.
+	const unsigned int parse_names_preserve = 0x1000;
+
 	// The default parsing mode.
     // Elements, PCDATA and CDATA sections are added to the DOM tree, character/reference entities are expanded,
     // End-of-Line characters are normalized, attribute values are normalized using CDATA normalization rules.
@@ -115,6 +126,7 @@ namespace pugihtml
 	// Forward declarations
 	struct html_attribute_struct;
 	struct html_node_struct;
+	struct html_parse_listener;
 
 	class html_node_iterator;
 	class html_attribute_iterator;
@@ -126,7 +138,10 @@ namespace pugihtml
 	#ifndef PUGIHTML_NO_XPATH
 	class xpath_node;
 	class xpath_node_set;
+	class xpath_node_visitor;
 	class xpath_query;
+	class xpath_query_set;
+	class xpath_stream_handler;
 	class xpath_variable_set;
 	#endif
 
@@ -223,6 +238,7 @@ namespace pugihtml
 		bool set_value(const char_t* rhs);
 
         // Set attribute value with type conversion (numbers are converted to strings, boolean is converted to "true"/"false")
+        // Doubles are written in XPath number format with the shortest digits that convert back to the same value
 		bool set_value(int rhs);
 		bool set_value(unsigned int rhs);
 		bool set_value(double rhs);
@@ -437,6 +453,17 @@ namespace pugihtml
 		// Select node set by evaluating XPath query
 		xpath_node_set select_nodes(const char_t* query, xpath_variable_set* variables = 0) const;
 		xpath_node_set select_nodes(const xpath_query& query) const;
+
+		// Get descendant elements with the specified CLASS token, in document order (uses document index).
+		// The lookups below build the index if it is not up to date, which writes to the document; build it first (see html_document::build_index
+		// and html_document::build_text_index) if several threads use them at once.
+		xpath_node_set elements_with_class(const char_t* name) const;
+
+		// Get descendant elements with the specified attribute value, in document order (uses document index if the attribute is indexed)
+		xpath_node_set elements_with_attribute(const char_t* name, const char_t* value) const;
+
+		// Get descendant text nodes (PCDATA and CDATA) whose value contains the string, in document order (uses document full-text index)
+		xpath_node_set find_text_nodes(const char_t* text) const;
 	#endif
 		
 		// Print subtree using a writer object
@@ -606,7 +633,9 @@ namespace pugihtml
 		status_bad_start_element,   // Parsing error occurred while parsing start element tag
 		status_bad_attribute,       // Parsing error occurred while parsing element attribute
 		status_bad_end_element,     // Parsing error occurred while parsing end element tag
-		status_end_element_mismatch // There was a mismatch of start-end tags (closing tag had incorrect name, some tag was not closed or there was an excessive closing tag)
+		status_end_element_mismatch,// There was a mismatch of start-end tags (closing tag had incorrect name, some tag was not closed or there was an excessive closing tag)
+
+		status_unsupported_query    // Streamed query can not be evaluated during parsing (see html_document::load_buffer_stream)
 	};
 
 	// Parsing result
@@ -637,7 +666,7 @@ namespace pugihtml
 	private:
 		char_t* _buffer;
 
-		char _memory[192];
+		char _memory[224];
 		
 		// Non-copyable semantics
 		html_document(const html_document&);
@@ -646,7 +675,7 @@ namespace pugihtml
 		void create();
 		void destroy();
 
-		html_parse_result load_buffer_impl(void* contents, size_t size, unsigned int options, html_encoding encoding, bool is_mutable, bool own);
+		html_parse_result load_buffer_impl(void* contents, size_t size, unsigned int options, html_encoding encoding, bool is_mutable, bool own, html_parse_listener* listener = 0);
 
 	public:
 		// Default constructor, makes empty document
@@ -685,6 +714,14 @@ namespace pugihtml
         // You should allocate the buffer with pugihtml allocation function; document will free the buffer when it is no longer needed (you can't use it anymore).
 		html_parse_result load_buffer_inplace_own(void* contents, size_t size, unsigned int options = parse_default, html_encoding encoding = encoding_auto);
 
+	#ifndef PUGIHTML_NO_XPATH
+		// Load document from buffer, evaluating the queries while the document is parsed; each selected node is passed to the handler as soon as
+		// its element is closed (see xpath_query_set::streamable). Paths are evaluated from the document node. With parse_stream_drop, closed nodes
+		// that can not be selected anymore are removed from the tree, and status_unsupported_query is returned if a query is not streamable;
+		// without it, queries that are not streamable are evaluated once the document is parsed.
+		html_parse_result load_buffer_stream(const void* contents, size_t size, const xpath_query_set& queries, xpath_stream_handler& handler, unsigned int options = parse_default, html_encoding encoding = encoding_auto);
+	#endif
+
 		// Save HTML document to writer (semantics is slightly different from html_node::print, see documentation for details).
 		void save(html_writer& writer, const char_t* indent = PUGIHTML_TEXT("\t"), unsigned int flags = format_default, html_encoding encoding = encoding_auto) const;
 
@@ -700,6 +737,22 @@ namespace pugihtml
 
         // Get document element
         html_node document_element() const;
+
+		// Add attribute to the document index; its values are indexed as a whole (CLASS attribute tokens are always indexed).
+		// Indexed attributes are reset when the document is reset or loaded.
+		bool index_attribute(const char_t* name);
+
+		// Build the document index. The index is also built on demand by html_node::elements_with_class/elements_with_attribute,
+		// and is used by XPath queries while it is up to date; any document modification makes it stale until it is rebuilt.
+		bool build_index();
+
+		// Build the document full-text index of words in text nodes. The index is also built on demand by html_node::find_text_nodes,
+		// and narrows contains(., 'text') and contains(text(), 'text') predicates of XPath descendant steps while it is up to date.
+		bool build_text_index();
+
+		// Number the nodes in document order. Loading does this; after the document is modified, node set sorting and XPath queries number
+		// the nodes on first use, which writes to the document. Call this before const queries run on the modified document from several threads.
+		void update_order();
 	};
 
 #ifndef PUGIHTML_NO_XPATH
@@ -713,6 +766,17 @@ namespace pugihtml
 		xpath_type_boolean    // Boolean
 	};
 
+	// XPath query compilation options
+
+	// Name tests are compared with element and attribute names as written in the query. This is the default.
+	const unsigned int xpath_names_exact = 0x0000;
+
+	// Names in name tests are converted to upper case when the query is compiled, so that //div/@class selects from documents parsed with default options.
+	const unsigned int xpath_names_upper = 0x0001;
+
+	// Names in name tests are converted to lower case when the query is compiled, to select from documents parsed with parse_names_lower.
+	const unsigned int xpath_names_lower = 0x0002;
+
     // XPath parsing result
 	struct PUGIHTML_CLASS xpath_parse_result
 	{
@@ -798,7 +862,158 @@ namespace pugihtml
 		const xpath_variable* get(const char_t* name) const;
 	};
 
-	// A compiled XPath query object
+	struct xpath_function_entry;
+	struct xpath_function_invocation;
+
+	// Arguments and result of an XPath extension function call (see xpath_function_set)
+	class PUGIHTML_CLASS xpath_function_call
+	{
+		friend struct xpath_function_invocation;
+
+	private:
+		xpath_function_invocation* _impl;
+
+		explicit xpath_function_call(xpath_function_invocation* impl);
+
+		// Non-copyable semantics
+		xpath_function_call(const xpath_function_call&);
+		xpath_function_call& operator=(const xpath_function_call&);
+
+	public:
+		// Get the context node of the call
+		const xpath_node& context() const;
+
+		// Get the user data pointer the function was registered with
+		void* data() const;
+
+		// Get the number of arguments
+		size_t argument_count() const;
+
+		// Get argument value; arguments are converted to the registered types before the call, so no conversion is performed here.
+		// Default value (false, NaN, empty string, empty node set) is returned on type mismatch or if the index is out of range.
+		bool get_boolean(size_t index) const;
+		double get_number(size_t index) const;
+		const char_t* get_string(size_t index) const;
+		const xpath_node_set& get_node_set(size_t index) const;
+
+		// Set the result; no type conversion is performed, false is returned if the type does not match the registered result type.
+		// The string is copied. If no result is set, the default value of the result type is used.
+		bool set(bool value);
+		bool set(double value);
+		bool set(const char_t* value);
+	};
+
+	// XPath extension function callback
+	typedef void (*xpath_function_callback)(xpath_function_call& call);
+
+	// A set of XPath extension functions. Functions are bound by name and argument count when a query is compiled, if the name is not
+	// an XPath 1.0 function; the set has to outlive the queries compiled with it. Calls are not evaluated ahead of time or cached, so the
+	// callback may look at any part of the document.
+	class PUGIHTML_CLASS xpath_function_set
+	{
+		friend struct xpath_function_entry;
+
+	private:
+		xpath_function_entry* _data[64];
+
+		// Non-copyable semantics
+		xpath_function_set(const xpath_function_set&);
+		xpath_function_set& operator=(const xpath_function_set&);
+
+	public:
+		// Default constructor/destructor
+		xpath_function_set();
+		~xpath_function_set();
+
+		// Add a new function with the specified result and argument types (node set results are not supported). Adding a function with the
+		// name and argument count of an existing one replaces its callback and data if the types match; otherwise false is returned.
+		bool add(const char_t* name, xpath_value_type result, const xpath_value_type* arguments, size_t argument_count, xpath_function_callback callback, void* data = 0);
+
+		// Check if there is a function with the specified name and argument count
+		bool contains(const char_t* name, size_t argument_count) const;
+	};
+
+	struct xpath_block_cache;
+
+	// Outcome of the last evaluation that used an evaluation context
+	enum xpath_eval_status
+	{
+		xpath_eval_ok,             // Evaluation completed
+		xpath_eval_out_of_memory,  // Memory allocation failed
+		xpath_eval_memory_limit,   // Evaluation needed more memory than xpath_limits::memory
+		xpath_eval_visit_limit,    // Location steps visited more nodes than xpath_limits::visits
+		xpath_eval_cancelled       // Cancellation flag was set
+	};
+
+	// Resource limits of evaluations that use an evaluation context (see xpath_eval_context::set_limits); zero means no limit
+	struct PUGIHTML_CLASS xpath_limits
+	{
+		// Maximum number of bytes of evaluation memory in use at a time, not counting the fixed stack buffers
+		size_t memory;
+
+		// Maximum number of nodes visited by location steps
+		size_t visits;
+
+		// Evaluation stops when the flag becomes nonzero; it is checked every few hundred node visits and on every memory page allocation,
+		// so it can be set from another thread or a timer to implement a deadline. The flag has to outlive the evaluations.
+		const volatile int* cancel;
+
+		// Default constructor, sets no limits
+		xpath_limits();
+	};
+
+	// Scratch memory for XPath evaluation that is kept between evaluations; memory pages that evaluation needs beyond the fixed
+	// stack buffers are retained up to the limit instead of being freed after every call. A context can be used by one thread at a time.
+	class PUGIHTML_CLASS xpath_eval_context
+	{
+		friend struct xpath_block_cache;
+
+	private:
+		void* _blocks;
+		size_t _retained;
+		size_t _limit;
+
+		xpath_limits _limits;
+		size_t _memory;
+		size_t _visits;
+		xpath_eval_status _status;
+
+		// Non-copyable semantics
+		xpath_eval_context(const xpath_eval_context&);
+		xpath_eval_context& operator=(const xpath_eval_context&);
+
+	public:
+		// Construct a context that retains at most limit bytes between evaluations
+		explicit xpath_eval_context(size_t limit = 1024 * 1024);
+
+		// Destructor; frees all retained memory
+		~xpath_eval_context();
+
+		// Get the number of bytes currently retained
+		size_t retained() const;
+
+		// Get/set the number of bytes that can be retained; lowering the limit frees memory above it
+		size_t limit() const;
+		void set_limit(size_t limit);
+
+		// Free all retained memory
+		void release();
+
+		// Get/set resource limits of the evaluations that use the context
+		const xpath_limits& limits() const;
+		void set_limits(const xpath_limits& limits);
+
+		// Get the status of the last evaluation that used the context; use it to tell why evaluation failed in PUGIHTML_NO_EXCEPTIONS mode
+		xpath_eval_status status() const;
+	};
+
+	// A compiled XPath query object. In addition to the XPath 1.0 function library, queries can use has-class(token) (context
+	// element has the CLASS token), lower-case(string) (ASCII letters only), ends-with(string, suffix) and matches-token(list, token)
+	// (whitespace-separated list contains the token).
+	//
+	// Evaluation does not modify the document, except that the document order numbers of nodes are refreshed on first use after the document
+	// was modified (see html_document::update_order). To run queries from several threads on a document that was modified after it was
+	// loaded, call html_document::update_order first.
 	class PUGIHTML_CLASS xpath_query
 	{
 	private:
@@ -812,9 +1027,12 @@ namespace pugihtml
 		xpath_query& operator=(const xpath_query&);
 
 	public:
-        // Construct a compiled object from XPath expression.
+        // Construct a compiled object from XPath expression; options are the xpath_names_* flags.
         // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on compilation errors.
-		explicit xpath_query(const char_t* query, xpath_variable_set* variables = 0);
+		explicit xpath_query(const char_t* query, xpath_variable_set* variables = 0, const xpath_function_set* functions = 0, unsigned int options = xpath_names_exact);
+
+		// Construct an empty query; use load() to fill it
+		xpath_query();
 
 		// Destructor
 		~xpath_query();
@@ -847,6 +1065,66 @@ namespace pugihtml
         // If PUGIHTML_NO_EXCEPTIONS is defined, returns empty node set instead.
 		xpath_node_set evaluate_node_set(const xpath_node& n) const;
 
+		// Evaluate expression as node set in the specified context and return the first node in document order; evaluation stops early when possible.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on type mismatch and std::bad_alloc on out of memory errors.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns empty node instead.
+		xpath_node evaluate_node(const xpath_node& n) const;
+
+		// Evaluate expression using the scratch memory and the limits of the evaluation context; otherwise the same as the functions above.
+		// If a limit is exceeded, evaluation stops and context.status() tells which one.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception if a limit is exceeded.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns the same values as on out of memory errors instead.
+		bool evaluate_boolean(const xpath_node& n, xpath_eval_context& context) const;
+		double evaluate_number(const xpath_node& n, xpath_eval_context& context) const;
+
+	#ifndef PUGIHTML_NO_STL
+		string_t evaluate_string(const xpath_node& n, xpath_eval_context& context) const;
+	#endif
+
+		size_t evaluate_string(char_t* buffer, size_t capacity, const xpath_node& n, xpath_eval_context& context) const;
+		xpath_node_set evaluate_node_set(const xpath_node& n, xpath_eval_context& context) const;
+		xpath_node evaluate_node(const xpath_node& n, xpath_eval_context& context) const;
+
+		// Evaluate expression as node set in the specified context on several threads; the result is the same as for evaluate_node_set.
+		// A descendant step from the root or from the context node, such as //TR[TD[3] > 100], is split into subtrees that are evaluated in parallel
+		// if all of its predicates are boolean and do not depend on position; other expressions are evaluated on the calling thread, as are all
+		// expressions if PUGIHTML_XPATH_THREADS is not defined. The document must not be modified during evaluation, and extension functions
+		// may be called from several threads at once.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on type mismatch and std::bad_alloc on out of memory errors.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns empty node set instead.
+		xpath_node_set evaluate_node_set_parallel(const xpath_node& n, unsigned int thread_count) const;
+
+		// Evaluate expression as node set in the specified context and pass the nodes to the visitor in the order of evaluate_node_set, without
+		// copying the result. Paths that end with a child or attribute step, or with a descendant step from a single node, are not collected at all:
+		// the nodes are passed to the visitor during the traversal, which stops as soon as the visitor returns false. The document must not be
+		// modified by the visitor. Returns false if the visitor stopped the iteration.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on type mismatch and std::bad_alloc on out of memory errors.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false on errors instead.
+		bool for_each_node(const xpath_node& n, xpath_node_visitor& visitor) const;
+		bool for_each_node(const xpath_node& n, xpath_node_visitor& visitor, xpath_eval_context& context) const;
+
+		// Print the optimized expression tree (one node per line, children indented) to the writer; useful to check how the query is evaluated
+		void explain(html_writer& writer, html_encoding encoding = encoding_auto) const;
+
+	#ifndef PUGIHTML_NO_STL
+		// Print the optimized expression tree to stream
+		void explain(std::basic_ostream<char, std::char_traits<char> >& os, html_encoding encoding = encoding_auto) const;
+		void explain(std::basic_ostream<wchar_t, std::char_traits<wchar_t> >& os) const;
+	#endif
+
+		// Save the compiled query as a binary image that load() turns back into a query without parsing or optimizing the expression.
+		// References inside the image are offsets, so it can be stored in a file and loaded from any address; it can only be loaded by
+		// the same version and configuration of the library. Variables and extension functions are stored by name.
+		// Returns the image size; the image is only written if it fits into capacity bytes. Returns 0 if the query is empty.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors.
+		size_t save(void* buffer, size_t capacity) const;
+
+		// Replace the query with the one saved in the image; variables and extension functions are bound by name in the specified sets, which
+		// have to provide the same names and types as the ones the query was compiled with. The image is not referenced after the call.
+		// Returns false and leaves the query empty if the image is damaged or a binding fails (see result()).
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors.
+		bool load(const void* data, size_t size, xpath_variable_set* variables = 0, const xpath_function_set* functions = 0);
+
 		// Get parsing result (used to get compilation errors in PUGIHTML_NO_EXCEPTIONS mode)
 		const xpath_parse_result& result() const;
 
@@ -856,6 +1134,189 @@ namespace pugihtml
     	// Borland C++ workaround
 		bool operator!() const;
 	};
+
+	// A set of compiled queries that are evaluated together.
+	// Location paths that only use child, descendant, descendant-or-self and self axes (and optionally end with an attribute step), with
+	// predicates that do not use position() or last(), are matched during a single traversal of the document; other queries are evaluated one by one.
+	class PUGIHTML_CLASS xpath_query_set
+	{
+		friend class html_document;
+
+	private:
+		void* _impl;
+		xpath_parse_result _result;
+
+		// Non-copyable semantics
+		xpath_query_set(const xpath_query_set&);
+		xpath_query_set& operator=(const xpath_query_set&);
+
+	public:
+		// Construct an empty set
+		xpath_query_set();
+
+		// Destructor
+		~xpath_query_set();
+
+		// Compile XPath expression with the options of xpath_query and add it to the set; the query index is the number of queries added before it.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on compilation errors or if expression does not evaluate to node set.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false instead (see result()).
+		bool add(const char_t* query, xpath_variable_set* variables = 0, const xpath_function_set* functions = 0, unsigned int options = xpath_names_exact);
+
+		// Get number of queries in the set
+		size_t size() const;
+
+		// Check if query is evaluated during the shared traversal
+		bool shared(size_t index) const;
+
+		// Check if query can be evaluated while the document is parsed: a shared path that selects elements or attributes, where the predicates
+		// of the last step only look at the selected node subtree, and the predicates of other steps only look at attributes and ancestors
+		bool streamable(size_t index) const;
+
+		// Evaluate all queries as node sets in the specified context; results should point to an array of size() node sets.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, affected results are empty node sets instead.
+		void evaluate_node_sets(const xpath_node& n, xpath_node_set* results) const;
+
+		// Get the result of the last add call (used to get compilation errors in PUGIHTML_NO_EXCEPTIONS mode)
+		const xpath_parse_result& result() const;
+	};
+
+	// Values extracted by xpath_table: the row nodes and one value for each row and column. Values are stored by column; the strings of all
+	// cells are copied to one buffer, so they do not depend on the document. The memory is reused by later evaluations into the same result.
+	class PUGIHTML_CLASS xpath_table_result
+	{
+		friend class xpath_table;
+
+	private:
+		void* _impl;
+
+		// Non-copyable semantics
+		xpath_table_result(const xpath_table_result&);
+		xpath_table_result& operator=(const xpath_table_result&);
+
+	public:
+		// Construct an empty result
+		xpath_table_result();
+
+		// Destructor
+		~xpath_table_result();
+
+		// Get number of rows/columns
+		size_t rows() const;
+		size_t columns() const;
+
+		// Get the node of the row
+		xpath_node row(size_t index) const;
+
+		// Get column value type (xpath_type_none if there is no such column)
+		xpath_value_type type(size_t column) const;
+
+		// Get value of a string column cell and its length; returns "" and 0 for other columns or if the index is out of range
+		const char_t* string(size_t row, size_t column) const;
+		size_t length(size_t row, size_t column) const;
+
+		// Get value of a cell converted to number/boolean the same way as number() and boolean() do; returns NaN/false if the index is out of range
+		double number(size_t row, size_t column) const;
+		bool boolean(size_t row, size_t column) const;
+
+		// Get values of a number or boolean column (1 for true and 0 for false) as an array of rows() numbers; returns 0 for other columns
+		const double* numbers(size_t column) const;
+
+		// Remove all rows and columns; keeps the memory for later evaluations
+		void clear();
+	};
+
+	// A row query and a set of column queries that extract a table: the column queries are evaluated with each node selected by the row query
+	// as the context node (with position and size 1), as with xpath_query::evaluate_string(row) and friends, but the evaluation memory and
+	// context-independent subexpressions are shared by all cells, and the results are packed into xpath_table_result.
+	class PUGIHTML_CLASS xpath_table
+	{
+	private:
+		void* _impl;
+		xpath_parse_result _result;
+
+		// Non-copyable semantics
+		xpath_table(const xpath_table&);
+		xpath_table& operator=(const xpath_table&);
+
+	public:
+		// Construct an empty table
+		xpath_table();
+
+		// Destructor
+		~xpath_table();
+
+		// Compile XPath expression that selects the rows (see xpath_query for options), replacing the previous one.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on compilation errors or if expression does not evaluate to node set.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false instead (see result()).
+		bool set_rows(const char_t* query, xpath_variable_set* variables = 0, const xpath_function_set* functions = 0, unsigned int options = xpath_names_exact);
+
+		// Compile XPath expression with the options of xpath_query and add it as the next column; the value is converted to the specified type, which has to be
+		// xpath_type_string, xpath_type_number or xpath_type_boolean.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on compilation errors or invalid type.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false instead (see result()).
+		bool add_column(const char_t* query, xpath_value_type type = xpath_type_string, xpath_variable_set* variables = 0, const xpath_function_set* functions = 0, unsigned int options = xpath_names_exact);
+
+		// Get number of columns
+		size_t columns() const;
+
+		// Evaluate the table in the specified context; the rows are in the order of xpath_query::evaluate_node_set. The result is empty if
+		// there is no row query. The context overload uses the scratch memory and the limits of the evaluation context (see xpath_query).
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors and xpath_exception if a limit is exceeded.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false and leaves the result empty instead.
+		bool evaluate(const xpath_node& n, xpath_table_result& result) const;
+		bool evaluate(const xpath_node& n, xpath_table_result& result, xpath_eval_context& context) const;
+
+		// Evaluate the table with the rows split into ranges that are evaluated on several threads; the result is the same as for evaluate.
+		// Rows are selected on the calling thread, as are all cells if PUGIHTML_XPATH_THREADS is not defined. The document must not be
+		// modified during evaluation, and extension functions may be called from several threads at once.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors.
+        // If PUGIHTML_NO_EXCEPTIONS is defined, returns false and leaves the result empty instead.
+		bool evaluate_parallel(const xpath_node& n, xpath_table_result& result, unsigned int thread_count) const;
+
+		// Get the result of the last set_rows or add_column call (used to get compilation errors in PUGIHTML_NO_EXCEPTIONS mode)
+		const xpath_parse_result& result() const;
+	};
+
+	// Visitor of query results (see xpath_query::for_each_node)
+	class PUGIHTML_CLASS xpath_node_visitor
+	{
+	public:
+		virtual ~xpath_node_visitor();
+
+		// Callback that is called for each node of the result; return false to stop the iteration
+		virtual bool visit(const xpath_node& node) = 0;
+	};
+
+	// Handler of streamed query matches (see html_document::load_buffer_stream)
+	class PUGIHTML_CLASS xpath_stream_handler
+	{
+	public:
+		virtual ~xpath_stream_handler();
+
+		// Callback that is called for each node selected by the query with the specified index; the node subtree is complete.
+		// With parse_stream_drop the node may be removed from the tree after the callback returns.
+		virtual void match(size_t query, const xpath_node& node) = 0;
+	};
+
+	// Compiled query cache statistics (see set_xpath_query_cache_capacity)
+	struct PUGIHTML_CLASS xpath_query_cache_statistics
+	{
+		size_t hits;		// Number of lookups that found a compiled query
+		size_t misses;		// Number of lookups that had to compile the query
+		size_t size;		// Number of cached queries
+		size_t capacity;	// Maximum number of cached queries
+	};
+
+	// Set the maximum number of compiled queries that html_node::select_single_node/select_nodes string overloads keep for reuse (0 disables caching).
+	// Queries are keyed by query string and variable set object; least recently used queries are evicted first. The cache is thread-safe.
+	void PUGIHTML_FUNCTION set_xpath_query_cache_capacity(size_t capacity);
+
+	// Get compiled query cache statistics
+	xpath_query_cache_statistics PUGIHTML_FUNCTION get_xpath_query_cache_statistics();
+
+	// Remove all compiled queries from the cache and reset hit/miss counters
+	void PUGIHTML_FUNCTION clear_xpath_query_cache();
 	
 	#ifndef PUGIHTML_NO_EXCEPTIONS
 	// XPath exception class
@@ -958,7 +1419,8 @@ namespace pugihtml
 		const_iterator begin() const;
 		const_iterator end() const;
 
-		// Sort the collection in ascending/descending order by document order
+		// Sort the collection in ascending/descending order by document order; numbers the nodes if their document was modified
+		// (see html_document::update_order)
 		void sort(bool reverse = false);
 		
 		// Get first node in the collection by document order
@@ -977,6 +1439,50 @@ namespace pugihtml
 
 		void _assign(const_iterator begin, const_iterator end);
 	};
+
+	// A compiled CSS selector list. Supports type, universal, #id, .class and attribute ([a], [a=v], [a~=v], [a|=v], [a^=v], [a$=v], [a*=v]) selectors,
+	// descendant, child (>), adjacent sibling (+) and general sibling (~) combinators, and :first-child, :last-child, :only-child, :nth-child(an+b),
+	// :nth-last-child(an+b), :first-of-type, :last-of-type, :nth-of-type(an+b), :nth-last-of-type(an+b), :empty, :root and :not(compound selector) pseudo-classes.
+	// Element and attribute names are matched case-insensitively.
+	class PUGIHTML_CLASS css_selector
+	{
+	private:
+		void* _impl;
+		xpath_parse_result _result;
+
+    	typedef void* css_selector::*unspecified_bool_type;
+
+		// Non-copyable semantics
+		css_selector(const css_selector&);
+		css_selector& operator=(const css_selector&);
+
+	public:
+        // Construct a compiled object from CSS selector list.
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws xpath_exception on compilation errors.
+		explicit css_selector(const char_t* selector);
+
+		// Destructor
+		~css_selector();
+
+		// Check if the element matches the selector list
+		bool match(const html_node& n) const;
+
+		// Get the first descendant element that matches the selector list (in document order)
+		html_node select_first(const html_node& n) const;
+
+		// Get all descendant elements that match the selector list, in document order. Uses document index if it is up to date (see html_document::build_index).
+        // If PUGIHTML_NO_EXCEPTIONS is not defined, throws std::bad_alloc on out of memory errors.
+		xpath_node_set select_all(const html_node& n) const;
+
+		// Get parsing result (used to get compilation errors in PUGIHTML_NO_EXCEPTIONS mode)
+		const xpath_parse_result& result() const;
+
+		// Safe bool conversion operator
+		operator unspecified_bool_type() const;
+
+    	// Borland C++ workaround
+		bool operator!() const;
+	};
 #endif
 
 #ifndef PUGIHTML_NO_STL
@@ -18,6 +18,7 @@ namespace pugihtml
 {
     //#define ARRAYSIZE(ar)  (sizeof(ar) / sizeof(ar[0]))
     #define TOUPPER(X){ if((X) >= 'a' && (X) <= 'z') {(X) -= ('a' - 'A');} }
+    #define TOLOWER(X){ if((X) >= 'A' && (X) <= 'Z') {(X) += ('a' - 'A');} }
     
     static inline void to_upper(char_t* str)
     {
@@ -28,6 +29,15 @@ namespace pugihtml
         }
     }
 
+    static inline void to_lower(char_t* str)
+    {
+        while(*str!=0)
+        { 
+            TOLOWER(*str);
+            str++;
+        }
+    }
+
     //static char_t* attributes[] = {"ABBR", "ACCEPT", "ACCEPT-CHARSET", 
     //    "ACCESSKEY", "ACTION", "ALIGN", "ALINK", "ALT", "ARCHIVE", 
     //    "AXIS", "BACKGROUND", "BGCOLOR", "BORDER", "CELLPADDING", 